@@ -268,6 +268,12 @@ struct chip_cfg_s {
     unsigned char dmp_loaded;
     /* Sampling rate used when DMP is enabled. */
     unsigned short dmp_sample_rate;
+    /* Incremented on every FIFO reset, lets FIFO readers drop stale data. */
+    uint32_t fifo_resets;
+    /* Overflows seen by mpu_read_fifo_bytes. */
+    uint32_t fifo_overflows;
+    /* Time setup_compass took in the last mpu_init. */
+    unsigned long compass_setup_ms;
 #if defined AK89xx_SECONDARY
     /* Compass sample rate. */
     unsigned short compass_sample_rate;
@@ -278,6 +284,10 @@ struct chip_cfg_s {
     unsigned short compass_sample_rate;
     unsigned char compass_addr;
     float mag_sens_adj[3];
+    /* mag_sens_adj came from mpu_set_compass_sens_adj, skip the self test. */
+    unsigned char mag_sens_given;
+    /* The last self test passed. */
+    unsigned char mag_sens_tested;
 #endif
 };
 
@@ -470,7 +480,20 @@ enum lp_accel_rate_e {
 #define SELF_TEST_LOW_LIMIT  (243.0/390.0)   //!< Low limit when gain is 5.
 #define SELF_TEST_HIGH_LIMIT (575.0/390.0)   //!< High limit when gain is 5.
 
+/* Self test runs in continuous mode at 75 Hz, 1 sample averaged. The
+ * conversions in flight when the bias changes are thrown away.
+ */
+#define HMC_CAL_CONFA       (0x18)
+#define HMC_CAL_SETTLE      (2)
+/* A 75 Hz conversion comes every 13.3 ms. Reading the data does not clear
+ * RDY, it stays set until the next conversion is written, so reads are
+ * spaced a whole period apart to get a new one each time.
+ */
+#define HMC_CONVERSION_MS   (14)
+#define HMC_READY_TIMEOUT_MS (50)
+
 #define HMC58X3_R_STATUS (9)
+#define HMC58X3_STATUS_RDY (0x01)
 #define HMC58X3_R_IDA (10)
 #define HMC58X3_R_IDB (11)
 #define HMC58X3_R_IDC (12)
@@ -561,10 +584,12 @@ const struct test_s test = {
     .max_accel_var  = 0.14f
 };
 
-static struct gyro_state_s st = {
-    .reg = &reg,
-    .hw = &hw,
-    .test = &test
+static struct gyro_state_s gyro_state[MPU_MAX_DEVICES] = {
+    [0 ... MPU_MAX_DEVICES - 1] = {
+        .reg = &reg,
+        .hw = &hw,
+        .test = &test
+    }
 };
 #elif defined MPU6500
 const struct gyro_reg_s reg = {
@@ -641,15 +666,30 @@ const struct test_s test = {
     .max_accel_var  = 0.14f
 };
 
-static struct gyro_state_s st = {
-    .reg = &reg,
-    .hw = &hw,
-    .test = &test
+static struct gyro_state_s gyro_state[MPU_MAX_DEVICES] = {
+    [0 ... MPU_MAX_DEVICES - 1] = {
+        .reg = &reg,
+        .hw = &hw,
+        .test = &test
+    }
 };
 #endif
 
+/* Index of the device all driver calls currently operate on. Every device
+ * gets its own copy of the driver state, see mpu_select_device. The index is
+ * per thread so devices on different buses can be driven in parallel.
+ */
+static __thread unsigned char active_dev;
+#define st (gyro_state[active_dev])
+
 #define MAX_PACKET_LENGTH (12)
 
+/* Largest single I2C transfer out of the FIFO. */
+#define MAX_FIFO_READ (252)
+
+/* FIFO size of every supported part. */
+#define MAX_FIFO_SIZE (1024)
+
 #if defined AK89xx_SECONDARY || defined HMC5883L_SECONDARY
 static int setup_compass(void);
 #define MAX_COMPASS_SAMPLE_RATE (100)
@@ -690,6 +730,22 @@ static int set_int_enable(unsigned char enable)
     return 0;
 }
 
+/**
+ *  @brief      Select the device used by subsequent driver calls.
+ *  Each device keeps its own cached chip configuration, so several MPUs can
+ *  be driven from one process. The caller is responsible for pointing the
+ *  I2C layer at the bus the device lives on.
+ *  @param[in]  device  Device index, 0 to MPU_MAX_DEVICES - 1.
+ *  @return     0 if successful.
+ */
+int mpu_select_device(unsigned char device)
+{
+    if (device >= MPU_MAX_DEVICES)
+        return -1;
+    active_dev = device;
+    return 0;
+}
+
 /**
  *  @brief      Register dump for testing.
  *  @return     0 if successful.
@@ -741,6 +797,9 @@ int mpu_read_reg(unsigned char reg, unsigned char *data)
 int mpu_init(struct int_param_s *int_param)
 {
     unsigned char data[6], rev;
+#if defined AK89xx_SECONDARY || defined HMC5883L_SECONDARY
+    unsigned long start_ms, end_ms;
+#endif
 
     /* Reset device. */
     data[0] = BIT_RESET;
@@ -841,7 +900,10 @@ int mpu_init(struct int_param_s *int_param)
         reg_int_cb(int_param);
 
 #if defined AK89xx_SECONDARY || defined HMC5883L_SECONDARY
+    get_ms(&start_ms);
     setup_compass();
+    get_ms(&end_ms);
+    st.chip_cfg.compass_setup_ms = end_ms - start_ms;
     if (mpu_set_compass_sample_rate(10))
         return -1;
 #else
@@ -1080,6 +1142,8 @@ int mpu_reset_fifo(void)
     if (!(st.chip_cfg.sensors))
         return -1;
 
+    st.chip_cfg.fifo_resets++;
+
     data = 0;
     if (i2c_write(st.hw->addr, st.reg->int_enable, 1, &data))
         return -1;
@@ -1472,7 +1536,7 @@ int mpu_get_accel_sens(unsigned short *sens)
         sens[0] = 16384;
         break;
     case INV_FSR_4G:
-        sens[0] = 8092;
+        sens[0] = 8192;
         break;
     case INV_FSR_8G:
         sens[0] = 4096;
@@ -1753,9 +1817,133 @@ int mpu_read_fifo(short *gyro, short *accel, uint32_t *timestamp,
     return 0;
 }
 
+/* Tries at draining an overflowed FIFO before it is reset. Each try reads
+ * what arrived during the last one, which only converges while the bus
+ * outruns the sensors.
+ */
+#define FIFO_DRAIN_TRIES (10)
+
+/* A FIFO that overflowed is still full and overflows again with every new
+ * packet, quicker than a read of the whole FIFO takes at high rates. The
+ * head is read off in bulk down to a quarter until the FIFO stays below
+ * half, overflows during that don't matter since those bytes are dropped
+ * anyway. Then the flag is cleared and the head realigned on the packet
+ * boundary of the tail.
+ */
+static int mpu_drain_fifo_head(unsigned short packet_size)
+{
+    unsigned char data[MAX_FIFO_READ];
+    unsigned short fifo_count, low, skip;
+    int tries;
+
+    low = st.hw->max_fifo >> 2;
+    for (tries = 0; ; tries++) {
+        if (mpu_get_fifo_count(&fifo_count))
+            return -1;
+        if (fifo_count <= (st.hw->max_fifo >> 1))
+            break;
+        if (tries == FIFO_DRAIN_TRIES)
+            return -1;
+        while (fifo_count > low) {
+            skip = min(fifo_count - low, MAX_FIFO_READ);
+            if (i2c_read(st.hw->addr, st.reg->fifo_r_w, skip, data))
+                return -1;
+            fifo_count -= skip;
+        }
+    }
+
+    /* Half a FIFO takes long enough to fill that no overflow comes between
+     * clearing the flag and the realignment.
+     */
+    if (i2c_read(st.hw->addr, st.reg->int_status, 1, data))
+        return -1;
+    if (mpu_get_fifo_count(&fifo_count))
+        return -1;
+    skip = fifo_count % packet_size;
+    if (skip && i2c_read(st.hw->addr, st.reg->fifo_r_w, skip, data))
+        return -1;
+    return 0;
+}
+
+/**
+ *  @brief      Drain gyro and accel packets from the FIFO in one burst.
+ *  Unlike mpu_read_fifo, which costs a FIFO count and a data read per packet,
+ *  all available packets (up to @e max_packets) are fetched in one transfer.
+ *  Requires the FIFO to be configured for INV_XYZ_GYRO | INV_XYZ_ACCEL.
+ *  \n @e gyro and @e accel receive three values per packet, oldest first.
+ *  \n On overflow the FIFO is not reset. The oldest half of it is dropped
+ *  to get ahead of the sensors again. With the DMP off the hardware only
+ *  writes whole packets, so the tail of the FIFO is on a packet boundary and
+ *  dropping fifo_count % packet size bytes at the head realigns the stream.
+ *  @param[out] gyro        Gyro data in hardware units.
+ *  @param[out] accel       Accel data in hardware units.
+ *  @param[in]  max_packets Room in @e gyro and @e accel, in packets.
+ *  @param[out] packets     Number of packets read.
+ *  @param[out] more        Number of packets left in the FIFO.
+ *  @return     0 if successful.
+ */
+int mpu_read_fifo_burst(short *gyro, short *accel, unsigned short max_packets,
+                        unsigned short *packets, unsigned short *more)
+{
+    const unsigned short packet_size = 12;
+    unsigned char data[MAX_FIFO_SIZE], *ptr;
+    unsigned short fifo_count, count, remaining, ii;
+    int result, tries;
+
+    packets[0] = 0;
+    more[0] = 0;
+    if (st.chip_cfg.dmp_on)
+        return -1;
+    if (!st.chip_cfg.sensors)
+        return -1;
+    if (st.chip_cfg.fifo_enable != (INV_XYZ_GYRO | INV_XYZ_ACCEL))
+        return -1;
+
+    for (tries = 0; ; tries++) {
+        if (mpu_get_fifo_count(&fifo_count))
+            return -1;
+        count = min(fifo_count / packet_size, max_packets);
+        count = min(count, MAX_FIFO_SIZE / packet_size);
+        if (!count)
+            return 0;
+
+        result = mpu_read_fifo_bytes(count * packet_size, data, &remaining);
+        if (result != -2 || tries)
+            break;
+        if (mpu_drain_fifo_head(packet_size))
+            break;
+    }
+    if (result == -2) {
+        /* Overflowing faster than we can drain. */
+        mpu_reset_fifo();
+        return -1;
+    }
+    if (result)
+        return -1;
+
+    ptr = data;
+    for (ii = 0; ii < count; ii++) {
+        accel[0] = (ptr[0] << 8) | ptr[1];
+        accel[1] = (ptr[2] << 8) | ptr[3];
+        accel[2] = (ptr[4] << 8) | ptr[5];
+        gyro[0] = (ptr[6] << 8) | ptr[7];
+        gyro[1] = (ptr[8] << 8) | ptr[9];
+        gyro[2] = (ptr[10] << 8) | ptr[11];
+        accel += 3;
+        gyro += 3;
+        ptr += packet_size;
+    }
+    packets[0] = count;
+    more[0] = remaining / packet_size;
+    return 0;
+}
+
 /**
  *  @brief      Get one unparsed packet from the FIFO.
  *  This function should be used if the packet is to be parsed elsewhere.
+ *  \n On overflow the FIFO is left as it is and -2 is returned. The oldest
+ *  bytes have been dropped by the hardware, so the caller has to find the
+ *  packet boundary again or call mpu_reset_fifo.
  *  @param[in]  length  Length of one FIFO packet.
  *  @param[in]  data    FIFO packet.
  *  @param[in]  more    Number of remaining packets.
@@ -1763,33 +1951,105 @@ int mpu_read_fifo(short *gyro, short *accel, uint32_t *timestamp,
 int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
                          unsigned char *more)
 {
-    unsigned char tmp[2];
-    unsigned short fifo_count;
+    unsigned short remaining;
+    int result;
+
     if (!st.chip_cfg.dmp_on)
         return -1;
+
+    result = mpu_read_fifo_bytes(length, data, &remaining);
+    if (result) {
+        more[0] = 0;
+        return result;
+    }
+    more[0] = remaining / length;
+    return 0;
+}
+
+/**
+ *  @brief      Read raw bytes from the FIFO without any packet framing.
+ *  Reads longer than one I2C transfer are split up transparently.
+ *  @param[in]  length      Number of bytes to read.
+ *  @param[out] data        Bytes read.
+ *  @param[out] remaining   Bytes left in the FIFO after this read.
+ *  @return     0 if successful, -1 if not enough data, -2 on FIFO overflow.
+ */
+int mpu_read_fifo_bytes(unsigned short length, unsigned char *data,
+                        unsigned short *remaining)
+{
+    unsigned char tmp[2];
+    unsigned short fifo_count, this_read;
+
     if (!st.chip_cfg.sensors)
         return -1;
+    if (!st.chip_cfg.dmp_on && !st.chip_cfg.fifo_enable)
+        return -1;
 
     if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, tmp))
         return -1;
     fifo_count = (tmp[0] << 8) | tmp[1];
-    if (fifo_count < length) {
-        more[0] = 0;
+    if (fifo_count < length)
         return -1;
-    }
     if (fifo_count > (st.hw->max_fifo >> 1)) {
         /* FIFO is 50% full, better check overflow bit. */
         if (i2c_read(st.hw->addr, st.reg->int_status, 1, tmp))
             return -1;
         if (tmp[0] & BIT_FIFO_OVERFLOW) {
-            mpu_reset_fifo();
+            st.chip_cfg.fifo_overflows++;
             return -2;
         }
     }
 
-    if (i2c_read(st.hw->addr, st.reg->fifo_r_w, length, data))
+    remaining[0] = fifo_count - length;
+    while (length) {
+        this_read = min(length, MAX_FIFO_READ);
+        if (i2c_read(st.hw->addr, st.reg->fifo_r_w, this_read, data))
+            return -1;
+        data += this_read;
+        length -= this_read;
+    }
+    return 0;
+}
+
+/**
+ *  @brief      Get the number of bytes waiting in the FIFO.
+ *  @param[out] count   FIFO_COUNT register.
+ *  @return     0 if successful.
+ */
+int mpu_get_fifo_count(unsigned short *count)
+{
+    unsigned char tmp[2];
+
+    if (!st.chip_cfg.sensors)
+        return -1;
+    if (i2c_read(st.hw->addr, st.reg->fifo_count_h, 2, tmp))
         return -1;
-    more[0] = fifo_count / length - 1;
+    count[0] = (tmp[0] << 8) | tmp[1];
+    return 0;
+}
+
+/**
+ *  @brief      Get the number of FIFO overflows since power up.
+ *  Only overflows noticed while reading through mpu_read_fifo_bytes count.
+ *  @param[out] count   Number of overflows.
+ *  @return     0 if successful.
+ */
+int mpu_get_fifo_overflow_count(uint32_t *count)
+{
+    count[0] = st.chip_cfg.fifo_overflows;
+    return 0;
+}
+
+/**
+ *  @brief      Get the number of FIFO resets since power up.
+ *  Code that buffers FIFO data can compare this against an earlier value to
+ *  find out whether its buffered bytes are stale.
+ *  @param[out] count   Number of calls to mpu_reset_fifo.
+ *  @return     0 if successful.
+ */
+int mpu_get_fifo_reset_count(uint32_t *count)
+{
+    count[0] = st.chip_cfg.fifo_resets;
     return 0;
 }
 
@@ -2429,7 +2689,31 @@ void hmc5883_setMode(unsigned char mode) {
     }
 
     i2c_write(st.chip_cfg.compass_addr, HMC58X3_R_MODE, 1, &mode);
-    delay_ms(100);
+}
+
+/* When the last conversion was read or the configuration changed. */
+static unsigned long hmc_paced_ms;
+
+/* The next read waits a whole conversion from now. */
+static void hmc5883_pace(void)
+{
+    get_ms(&hmc_paced_ms);
+}
+
+/* Polls the status register instead of sleeping for a whole conversion. */
+static int hmc5883_waitReady(unsigned int timeout_ms)
+{
+    unsigned char status;
+    unsigned int waited;
+
+    for (waited = 0; waited <= timeout_ms; waited++) {
+        if (i2c_read(st.chip_cfg.compass_addr, HMC58X3_R_STATUS, 1, &status))
+            return -1;
+        if (status & HMC58X3_STATUS_RDY)
+            return 0;
+        delay_ms(1);
+    }
+    return -1;
 }
 
 void hmc5883_getRaw(int16_t *x, int16_t *y, int16_t *z)
@@ -2444,8 +2728,22 @@ void hmc5883_getRaw(int16_t *x, int16_t *y, int16_t *z)
     *y = (rx[4] << 8) | rx[5];
 }
 
+/* Waits for the next measurement and reads it. */
+static int hmc5883_getNext(int16_t *x, int16_t *y, int16_t *z)
+{
+    unsigned long now;
+
+    get_ms(&now);
+    if (now - hmc_paced_ms < HMC_CONVERSION_MS)
+        delay_ms(HMC_CONVERSION_MS - (now - hmc_paced_ms));
+    if (hmc5883_waitReady(HMC_READY_TIMEOUT_MS))
+        return -1;
+    hmc5883_getRaw(x, y, z);
+    hmc5883_pace();
+    return 0;
+}
 
-void hmc5883_calibrate(unsigned char gain, unsigned int n_samples)
+int hmc5883_calibrate(unsigned char gain, unsigned int n_samples)
 {
     int16_t xyz[3];                     // 16 bit integer values for each axis.
     int32_t xyz_total[3]={0,0,0};  // 32 bit totals so they won't overflow.
@@ -2463,7 +2761,7 @@ void hmc5883_calibrate(unsigned char gain, unsigned int n_samples)
                 Use the positive bias current to impose a known field on each axis.
                 This field depends on the device and the axis.
             */
-            data[0]=0x010 + HMC_POS_BIAS; // Reg A DOR=0x010 + MS1,MS0 set to pos bias
+            data[0]=HMC_CAL_CONFA + HMC_POS_BIAS; // Reg A DOR=75 Hz + MS1,MS0 set to pos bias
             i2c_write(st.chip_cfg.compass_addr, HMC58X3_R_CONFA, 1, data);
 
             /*
@@ -2471,13 +2769,22 @@ void hmc5883_calibrate(unsigned char gain, unsigned int n_samples)
                 The new gain setting is effective from the second measurement and on.
             */
             hmc5883_setGain(gain);
-            hmc5883_setMode(1);                         // Change to single measurement mode.
-            hmc5883_getRaw(&xyz[0],&xyz[1],&xyz[2]);    // Get the raw values and ignore since this reading may use previous gain.
+            hmc5883_setMode(0);                         // Continuous measurement, polled on the RDY bit.
+            hmc5883_pace();
+            for (unsigned int i=0; i<HMC_CAL_SETTLE; i++)
+            {
+                if (hmc5883_getNext(&xyz[0],&xyz[1],&xyz[2]))   // Ignore, may use the previous gain.
+                    bret=false;
+            }
 
-            for (unsigned int i=0; i<n_samples; i++)
+            for (unsigned int i=0; bret && i<n_samples; i++)
             {
-                hmc5883_setMode(1);
-                hmc5883_getRaw(&xyz[0],&xyz[1],&xyz[2]);   // Get the raw values in case the scales have already been changed.
+                if (hmc5883_getNext(&xyz[0],&xyz[1],&xyz[2]))
+                {
+                    DEBUG_PRINT("HMC58x3 Self test timed out.");
+                    bret=false;
+                    break;
+                }
                 /*
                     Since the measurements are noisy, they should be averaged rather than taking the max.
                 */
@@ -2497,12 +2804,22 @@ void hmc5883_calibrate(unsigned char gain, unsigned int n_samples)
             /*
                 Apply the negative bias. (Same gain)
             */
-            data[0]=0x010 + HMC_NEG_BIAS; // Reg A DOR=0x010 + MS1,MS0 set to negative bias.
+            data[0]=HMC_CAL_CONFA + HMC_NEG_BIAS; // Reg A DOR=75 Hz + MS1,MS0 set to negative bias.
             i2c_write(st.chip_cfg.compass_addr, HMC58X3_R_CONFA, 1, data);
-            for (unsigned int i=0; i<n_samples; i++)
+            hmc5883_pace();
+            for (unsigned int i=0; bret && i<HMC_CAL_SETTLE; i++)
             {
-                hmc5883_setMode(1);
-                hmc5883_getRaw(&xyz[0],&xyz[1],&xyz[2]);   // Get the raw values in case the scales have already been changed.
+                if (hmc5883_getNext(&xyz[0],&xyz[1],&xyz[2]))   // Ignore, may use the positive bias.
+                    bret=false;
+            }
+            for (unsigned int i=0; bret && i<n_samples; i++)
+            {
+                if (hmc5883_getNext(&xyz[0],&xyz[1],&xyz[2]))
+                {
+                    DEBUG_PRINT("HMC58x3 Self test timed out.");
+                    bret=false;
+                    break;
+                }
                 /*
                     Since the measurements are noisy, they should be averaged.
                 */
@@ -2547,7 +2864,44 @@ void hmc5883_calibrate(unsigned char gain, unsigned int n_samples)
             }
             data[0]=0x010; // // set RegA/DOR back to default.
             i2c_write(st.chip_cfg.compass_addr, HMC58X3_R_CONFA, 1, data);
+            st.chip_cfg.mag_sens_tested = bret;
+            return bret ? 0 : -1;
     }
+    return -1;
+}
+
+/**
+ *  @brief      Use the sensitivity adjustment of an earlier self test.
+ *  Must be called before mpu_init, which then skips the HMC5883L self test.
+ *  @param[in]  adj     Adjustment per axis, NULL to self test again.
+ *  @return     0 if successful.
+ */
+int mpu_set_compass_sens_adj(const float *adj)
+{
+    if (!adj) {
+        st.chip_cfg.mag_sens_given = 0;
+        return 0;
+    }
+    st.chip_cfg.mag_sens_adj[0] = adj[0];
+    st.chip_cfg.mag_sens_adj[1] = adj[1];
+    st.chip_cfg.mag_sens_adj[2] = adj[2];
+    st.chip_cfg.mag_sens_given = 1;
+    return 0;
+}
+
+/**
+ *  @brief      Get the sensitivity adjustment in use.
+ *  @param[out] adj     Adjustment per axis.
+ *  @param[out] tested  1 if it comes from a self test that passed in mpu_init.
+ *  @return     0 if successful.
+ */
+int mpu_get_compass_sens_adj(float *adj, unsigned char *tested)
+{
+    adj[0] = st.chip_cfg.mag_sens_adj[0];
+    adj[1] = st.chip_cfg.mag_sens_adj[1];
+    adj[2] = st.chip_cfg.mag_sens_adj[2];
+    tested[0] = st.chip_cfg.mag_sens_tested;
+    return 0;
 }
 #endif
 
@@ -2673,9 +3027,12 @@ static int setup_compass(void)
     if (i2c_write(st.chip_cfg.compass_addr, HMC58X3_R_MODE, 1, data))
         return -1;
 
-    hmc5883_calibrate(1,32); // Use gain 1=default, valid 0-7, 7 not recommended.
+    st.chip_cfg.mag_sens_tested = 0;
+    if (!st.chip_cfg.mag_sens_given)
+        hmc5883_calibrate(1,32); // Use gain 1=default, valid 0-7, 7 not recommended.
 
-    // Single mode conversion was used in calibration, now set continuous mode
+    // Continuous mode at the normal gain and bias
+    hmc5883_setGain(1);
     hmc5883_setMode(0);
     delay_ms(10);
     hmc5883_setDOR(0b110);
@@ -2832,6 +3189,22 @@ int mpu_get_compass_fsr(unsigned short *fsr)
 #endif
 }
 
+/**
+ *  @brief      Get the time the compass setup took in the last mpu_init.
+ *  This includes the HMC5883L self test unless it was skipped.
+ *  @param[out] ms  Milliseconds.
+ *  @return     0 if successful.
+ */
+int mpu_get_compass_setup_ms(unsigned long *ms)
+{
+#if defined AK89xx_SECONDARY || defined HMC5883L_SECONDARY
+    ms[0] = st.chip_cfg.compass_setup_ms;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 /**
  *  @brief      Enters LP accel motion interrupt mode.
  *  The behavior of this feature is very different between the MPU6050 and the
@@ -3068,10 +3441,15 @@ lp_int_restore:
     mpu_set_accel_fsr(st.chip_cfg.cache.accel_fsr);
     mpu_set_lpf(st.chip_cfg.cache.lpf);
     mpu_set_sample_rate(st.chip_cfg.cache.sample_rate);
-    mpu_configure_fifo(st.chip_cfg.cache.fifo_sensors);
 
-    if (st.chip_cfg.cache.dmp_on)
+    if (st.chip_cfg.cache.dmp_on) {
+        /* Enabling the DMP resets the FIFO anyway, a second reset would only
+         * add its 50 ms to the wake up.
+         */
+        st.chip_cfg.fifo_enable = st.chip_cfg.cache.fifo_sensors & ~INV_XYZ_COMPASS;
         mpu_set_dmp_state(1);
+    } else
+        mpu_configure_fifo(st.chip_cfg.cache.fifo_sensors);
 
 #ifdef MPU6500
     /* Disable motion interrupt (MPU6500 version). */
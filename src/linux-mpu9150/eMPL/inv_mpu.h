@@ -60,7 +60,11 @@ struct int_param_s {
 #define MPU_INT_STATUS_DMP_4            (0x1000)
 #define MPU_INT_STATUS_DMP_5            (0x2000)
 
+/* Maximum number of devices the driver keeps state for. */
+#define MPU_MAX_DEVICES (4)
+
 /* Set up APIs */
+int mpu_select_device(unsigned char device);
 int mpu_init(struct int_param_s *int_param);
 int mpu_init_slave(void);
 int mpu_set_bypass(unsigned char bypass_on);
@@ -85,6 +89,7 @@ int mpu_get_accel_fsr(unsigned char *fsr);
 int mpu_set_accel_fsr(unsigned char fsr);
 
 int mpu_get_compass_fsr(unsigned short *fsr);
+int mpu_get_compass_setup_ms(unsigned long *ms);
 
 int mpu_get_gyro_sens(float *sens);
 int mpu_get_accel_sens(unsigned short *sens);
@@ -106,6 +111,13 @@ int mpu_set_accel_bias(const int32_t *accel_bias);
 int mpu_get_gyro_reg(short *data, uint32_t *timestamp);
 int mpu_get_accel_reg(short *data, uint32_t *timestamp);
 int mpu_get_compass_reg(short *data, uint32_t *timestamp);
+#ifdef HMC5883L_SECONDARY
+int mpu_set_compass_sens_adj(const float *adj);
+int mpu_get_compass_sens_adj(float *adj, unsigned char *tested);
+#define HMC_MODE_CONTINUOUS     (0)
+#define HMC_MODE_IDLE           (2)
+void hmc5883_setMode(unsigned char mode);
+#endif
 int mpu_get_temperature(int32_t *data, uint32_t *timestamp);
 
 int mpu_get_int_status(short *status);
@@ -113,7 +125,14 @@ int mpu_read_fifo(short *gyro, short *accel, uint32_t *timestamp,
     unsigned char *sensors, unsigned char *more);
 int mpu_read_fifo_stream(unsigned short length, unsigned char *data,
     unsigned char *more);
+int mpu_read_fifo_bytes(unsigned short length, unsigned char *data,
+    unsigned short *remaining);
+int mpu_read_fifo_burst(short *gyro, short *accel, unsigned short max_packets,
+    unsigned short *packets, unsigned short *more);
 int mpu_reset_fifo(void);
+int mpu_get_fifo_count(unsigned short *count);
+int mpu_get_fifo_overflow_count(uint32_t *count);
+int mpu_get_fifo_reset_count(uint32_t *count);
 
 int mpu_write_mem(unsigned short mem_addr, unsigned short length,
     unsigned char *data);
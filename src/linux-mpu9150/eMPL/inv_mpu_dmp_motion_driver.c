@@ -478,6 +478,16 @@ static const unsigned short sStartAddress = 0x0400;
 #define QUAT_MAG_SQ_MAX         (QUAT_MAG_SQ_NORMALIZED + QUAT_ERROR_THRESH)
 #endif
 
+/* Packets that must pass the quaternion check before a packet boundary found
+ * after an overflow is trusted.
+ */
+#define DMP_RESYNC_PACKETS  (3)
+
+/* Host side FIFO cache, large enough to drain the whole hardware FIFO in one
+ * burst (see dmp_prefetch_fifo).
+ */
+#define DMP_CACHE_SIZE      (1024)
+
 struct dmp_s {
     void (*tap_cb)(unsigned char count, unsigned char direction);
     void (*android_orient_cb)(unsigned char orientation);
@@ -485,17 +495,47 @@ struct dmp_s {
     unsigned short feature_mask;
     unsigned short fifo_rate;
     unsigned char packet_length;
+    /* FIFO bytes read ahead of the caller. cache_pos is always on a packet
+     * boundary, a partial packet may follow the last complete one.
+     */
+    unsigned char cache[DMP_CACHE_SIZE];
+    unsigned short cache_len;
+    unsigned short cache_pos;
+    unsigned short fifo_remaining;
+    unsigned char resync;
+    uint32_t fifo_resets;
+    struct dmp_fifo_stats_s stats;
 };
 
-static struct dmp_s dmp = {
-    .tap_cb = NULL,
-    .android_orient_cb = NULL,
-    .orient = 0,
-    .feature_mask = 0,
-    .fifo_rate = 0,
-    .packet_length = 0
+static struct dmp_s dmp_state[MPU_MAX_DEVICES] = {
+    [0 ... MPU_MAX_DEVICES - 1] = {
+        .tap_cb = NULL,
+        .android_orient_cb = NULL,
+        .orient = 0,
+        .feature_mask = 0,
+        .fifo_rate = 0,
+        .packet_length = 0
+    }
 };
 
+/* Mirrors the device selected in the MPU driver, see dmp_select_device. */
+static __thread unsigned char active_dev;
+#define dmp (dmp_state[active_dev])
+
+/**
+ *  @brief      Select the device used by subsequent DMP calls.
+ *  Must be kept in step with mpu_select_device.
+ *  @param[in]  device  Device index, 0 to MPU_MAX_DEVICES - 1.
+ *  @return     0 if successful.
+ */
+int dmp_select_device(unsigned char device)
+{
+    if (device >= MPU_MAX_DEVICES)
+        return -1;
+    active_dev = device;
+    return 0;
+}
+
 /**
  *  @brief  Load the DMP with this image.
  *  @return 0 if successful.
@@ -614,6 +654,41 @@ int dmp_set_gyro_bias(int32_t *bias)
     return mpu_write_mem(D_EXT_GYRO_BIAS_Z, 4, regs);
 }
 
+/**
+ *  @brief      Read the gyro biases back from the DMP.
+ *  With DMP_FEATURE_GYRO_CAL these are the DMP's own estimate once it has
+ *  seen enough stillness, otherwise the last ones pushed by
+ *  dmp_set_gyro_bias.
+ *  @param[out] bias    Gyro biases in q16.
+ *  @return     0 if successful.
+ */
+int dmp_get_gyro_bias(int32_t *bias)
+{
+    int32_t gyro_bias_body[3];
+    unsigned char regs[4];
+    unsigned short addr[3] = {D_EXT_GYRO_BIAS_X, D_EXT_GYRO_BIAS_Y,
+        D_EXT_GYRO_BIAS_Z};
+    int ii;
+
+    for (ii = 0; ii < 3; ii++) {
+        if (mpu_read_mem(addr[ii], 4, regs))
+            return -1;
+        gyro_bias_body[ii] = (int32_t)(((uint32_t)regs[0] << 24) |
+            ((uint32_t)regs[1] << 16) | ((uint32_t)regs[2] << 8) | regs[3]);
+#ifdef EMPL_NO_64BIT
+        gyro_bias_body[ii] = (int32_t)(((float)gyro_bias_body[ii] * 1073741824.f) / GYRO_SF);
+#else
+        gyro_bias_body[ii] = (int32_t)(((int64_t)gyro_bias_body[ii] << 30) / GYRO_SF);
+#endif
+    }
+
+    /* Undo the orientation applied by dmp_set_gyro_bias. */
+    bias[dmp.orient & 3] = (dmp.orient & 4) ? -gyro_bias_body[0] : gyro_bias_body[0];
+    bias[(dmp.orient >> 3) & 3] = (dmp.orient & 0x20) ? -gyro_bias_body[1] : gyro_bias_body[1];
+    bias[(dmp.orient >> 6) & 3] = (dmp.orient & 0x100) ? -gyro_bias_body[2] : gyro_bias_body[2];
+    return 0;
+}
+
 /**
  *  @brief      Push accel biases to the DMP.
  *  These biases will be removed from the DMP 6-axis quaternion.
@@ -1236,6 +1311,242 @@ int dmp_set_interrupt_mode(unsigned char mode)
     }
 }
 
+#ifdef FIFO_CORRUPTION_CHECK
+/* We can detect a corrupted FIFO by monitoring the quaternion data and
+ * ensuring that the magnitude is always normalized to one. This shouldn't
+ * happen in normal operation, but if an I2C error occurs or the FIFO
+ * overflows, the FIFO reads might become misaligned.
+ *
+ * Only the upper 16 bits of each element are used to avoid int64_t math.
+ */
+static int quat_valid(const unsigned char *data)
+{
+    int32_t quat_q14[4], quat_mag_sq;
+
+    quat_q14[0] = (short)((data[0] << 8) | data[1]);
+    quat_q14[1] = (short)((data[4] << 8) | data[5]);
+    quat_q14[2] = (short)((data[8] << 8) | data[9]);
+    quat_q14[3] = (short)((data[12] << 8) | data[13]);
+    quat_mag_sq = quat_q14[0] * quat_q14[0] + quat_q14[1] * quat_q14[1] +
+        quat_q14[2] * quat_q14[2] + quat_q14[3] * quat_q14[3];
+    return (quat_mag_sq >= QUAT_MAG_SQ_MIN) && (quat_mag_sq <= QUAT_MAG_SQ_MAX);
+}
+#endif
+
+/* Anything cached from before a FIFO reset is stale. */
+static void dmp_check_fifo_reset(void)
+{
+    uint32_t fifo_resets;
+
+    mpu_get_fifo_reset_count(&fifo_resets);
+    if (fifo_resets != dmp.fifo_resets) {
+        dmp.fifo_resets = fifo_resets;
+        dmp.cache_len = 0;
+        dmp.cache_pos = 0;
+        dmp.resync = 0;
+    }
+}
+
+/* Make sure at least length bytes are cached past cache_pos. */
+static int dmp_fill_cache(unsigned short length)
+{
+    unsigned short have;
+    int result;
+
+    have = dmp.cache_len - dmp.cache_pos;
+    if (have >= length)
+        return 0;
+
+    /* Move a partial packet to the front to make room. */
+    if (dmp.cache_pos) {
+        memmove(dmp.cache, dmp.cache + dmp.cache_pos, have);
+        dmp.cache_pos = 0;
+        dmp.cache_len = have;
+    }
+
+    result = mpu_read_fifo_bytes(length - have, dmp.cache + have,
+        &dmp.fifo_remaining);
+    if (result == -2) {
+        /* The hardware dropped the oldest bytes, so a partial packet in the
+         * cache no longer lines up with the FIFO. Whole packets read before
+         * the overflow are still good and in order, they are served before
+         * the FIFO is realigned.
+         */
+        dmp.stats.overflows++;
+        dmp.stats.bytes_discarded += have % dmp.packet_length;
+        dmp.cache_len = have - have % dmp.packet_length;
+        dmp.fifo_remaining = 0;
+        dmp.resync = 1;
+        return -1;
+    }
+    if (result)
+        return -1;
+    dmp.cache_len = length;
+    return 0;
+}
+
+/* Check that every packet in the window starting at offset holds a unit
+ * quaternion.
+ */
+#ifdef FIFO_CORRUPTION_CHECK
+static int resync_offset_valid(unsigned short offset)
+{
+    unsigned short ii;
+
+    for (ii = 0; ii < DMP_RESYNC_PACKETS; ii++) {
+        if (!quat_valid(dmp.cache + offset + ii * dmp.packet_length))
+            return 0;
+    }
+    return 1;
+}
+#endif
+
+/* Whole packets still cached, e.g. from before an overflow. */
+static int dmp_cached_packets(void)
+{
+    return (dmp.cache_len - dmp.cache_pos) / dmp.packet_length;
+}
+
+/* Find the packet boundary again after the FIFO stream lost alignment.
+ * The DMP only ever appends whole packets, so the tail of the FIFO is on a
+ * packet boundary and the first boundary is fifo_count % packet_length bytes
+ * in. A window of DMP_RESYNC_PACKETS packets is read from there and checked
+ * with the quaternion test. If the check fails, e.g. because a partial write
+ * was counted, every other offset is tried and only taken if it is the only
+ * one that passes, since a static sensor can look like a unit quaternion at a
+ * wrong offset. The packets from the boundary on are kept in the cache, so
+ * only the bytes before it are lost. The FIFO is only reset if no boundary can
+ * be found.
+ */
+static int dmp_resync_fifo(void)
+{
+#ifdef FIFO_CORRUPTION_CHECK
+    unsigned short window, remaining, offset, ii, found;
+    int result;
+#endif
+
+    dmp.stats.bytes_discarded += dmp.cache_len - dmp.cache_pos;
+    dmp.cache_len = 0;
+    dmp.cache_pos = 0;
+
+#ifdef FIFO_CORRUPTION_CHECK
+    if (dmp.feature_mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)) {
+        window = (DMP_RESYNC_PACKETS + 1) * dmp.packet_length - 1;
+        result = mpu_read_fifo_bytes(window, dmp.cache, &remaining);
+        if (result == -2) {
+            /* More bytes were dropped before this read. That doesn't matter
+             * since the boundary has to be found again anyway.
+             */
+            dmp.stats.overflows++;
+            result = mpu_read_fifo_bytes(window, dmp.cache, &remaining);
+        }
+        if (result) {
+            /* Not enough data yet, try again on the next read. */
+            dmp.stats.resync_waits++;
+            return -1;
+        }
+
+        offset = (window + remaining) % dmp.packet_length;
+        if (!resync_offset_valid(offset)) {
+            found = 0;
+            for (ii = 0; ii < dmp.packet_length; ii++) {
+                if (resync_offset_valid(ii)) {
+                    offset = ii;
+                    found++;
+                }
+            }
+            if (found != 1)
+                offset = dmp.packet_length;
+        }
+        if (offset < dmp.packet_length) {
+            dmp.cache_pos = offset;
+            dmp.cache_len = window;
+            dmp.fifo_remaining = remaining;
+            dmp.stats.bytes_discarded += offset;
+            dmp.stats.resyncs++;
+            dmp.resync = 0;
+            return 0;
+        }
+        dmp.stats.bytes_discarded += window;
+    }
+#endif
+
+    /* No way to find the boundary, start over with an empty FIFO. */
+    dmp.stats.resets++;
+    dmp.resync = 0;
+    mpu_reset_fifo();
+    mpu_get_fifo_reset_count(&dmp.fifo_resets);
+    return -1;
+}
+
+/**
+ *  @brief      Burst-read all complete packets from the FIFO into the cache.
+ *  One FIFO_COUNT read and one transfer replace the per packet count and
+ *  data reads of dmp_read_fifo, which then serves the packets from the cache.
+ *  @param[out] packets Number of packets ready for dmp_read_fifo.
+ *  @return     0 if successful.
+ */
+int dmp_prefetch_fifo(unsigned short *packets)
+{
+    unsigned short count, have, length;
+    int tries;
+
+    packets[0] = 0;
+    if (!dmp.packet_length)
+        return -1;
+
+    dmp_check_fifo_reset();
+    if (dmp.resync) {
+        /* Serve what was kept from before the overflow first. */
+        if (dmp_cached_packets()) {
+            packets[0] = dmp_cached_packets();
+            return 0;
+        }
+        if (dmp_resync_fifo())
+            /* Still waiting for enough data to realign. */
+            return 0;
+    }
+
+    if (mpu_get_fifo_count(&count))
+        return -1;
+
+    for (tries = 0; tries < 2; tries++) {
+        have = dmp.cache_len - dmp.cache_pos;
+        length = min(count, DMP_CACHE_SIZE - have);
+        /* Stop on a packet boundary. */
+        length -= (have + length) % dmp.packet_length;
+        if (!length || !dmp_fill_cache(have + length))
+            break;
+        if (!dmp.resync)
+            return -1;
+        /* The FIFO overflowed. Serve the packets kept from before it, or
+         * realign and fetch what follows the resync window.
+         */
+        if (dmp_cached_packets()) {
+            packets[0] = dmp_cached_packets();
+            return 0;
+        }
+        if (dmp_resync_fifo())
+            return 0;
+        count = dmp.fifo_remaining;
+    }
+
+    packets[0] = (dmp.cache_len - dmp.cache_pos + dmp.fifo_remaining) /
+        dmp.packet_length;
+    return 0;
+}
+
+/**
+ *  @brief      Get FIFO loss and recovery counters for this device.
+ *  @param[out] stats   Counters since power up.
+ *  @return     0 if successful.
+ */
+int dmp_get_fifo_stats(struct dmp_fifo_stats_s *stats)
+{
+    memcpy(stats, &dmp.stats, sizeof(struct dmp_fifo_stats_s));
+    return 0;
+}
+
 /**
  *  @brief      Get one packet from the FIFO.
  *  If @e sensors does not contain a particular sensor, disregard the data
@@ -1259,23 +1570,33 @@ int dmp_set_interrupt_mode(unsigned char mode)
 int dmp_read_fifo(short *gyro, short *accel, int32_t *quat,
     uint32_t *timestamp, short *sensors, unsigned char *more)
 {
-    unsigned char fifo_data[MAX_PACKET_LENGTH];
+    unsigned char *fifo_data;
     unsigned char ii = 0;
 
     /* TODO: sensors[0] only changes when dmp_enable_feature is called. We can
      * cache this value and save some cycles.
      */
     sensors[0] = 0;
+    more[0] = 0;
 
-    /* Get a packet. */
-    if (mpu_read_fifo_stream(dmp.packet_length, fifo_data, more))
+    dmp_check_fifo_reset();
+    /* Packets kept from before an overflow go out before realigning. */
+    if (dmp.resync && !dmp_cached_packets() && dmp_resync_fifo())
         return -1;
 
+    /* Get a packet. After an overflow, realign and try once more. */
+    if (dmp_fill_cache(dmp.packet_length)) {
+        if (!dmp.resync || dmp_resync_fifo() ||
+            dmp_fill_cache(dmp.packet_length))
+            return -1;
+    }
+    fifo_data = dmp.cache + dmp.cache_pos;
+    dmp.cache_pos += dmp.packet_length;
+    more[0] = (dmp.cache_len - dmp.cache_pos + dmp.fifo_remaining) /
+        dmp.packet_length;
+
     /* Parse DMP packet. */
     if (dmp.feature_mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)) {
-#ifdef FIFO_CORRUPTION_CHECK
-        int32_t quat_q14[4], quat_mag_sq;
-#endif
         quat[0] = ((int32_t)fifo_data[0] << 24) | ((int32_t)fifo_data[1] << 16) |
             ((int32_t)fifo_data[2] << 8) | fifo_data[3];
         quat[1] = ((int32_t)fifo_data[4] << 24) | ((int32_t)fifo_data[5] << 16) |
@@ -1286,25 +1607,18 @@ int dmp_read_fifo(short *gyro, short *accel, int32_t *quat,
             ((int32_t)fifo_data[14] << 8) | fifo_data[15];
         ii += 16;
 #ifdef FIFO_CORRUPTION_CHECK
-        /* We can detect a corrupted FIFO by monitoring the quaternion data and
-         * ensuring that the magnitude is always normalized to one. This
-         * shouldn't happen in normal operation, but if an I2C error occurs,
-         * the FIFO reads might become misaligned.
-         *
-         * Let's start by scaling down the quaternion data to avoid int64_t
-         * math.
-         */
-        quat_q14[0] = quat[0] >> 16;
-        quat_q14[1] = quat[1] >> 16;
-        quat_q14[2] = quat[2] >> 16;
-        quat_q14[3] = quat[3] >> 16;
-        quat_mag_sq = quat_q14[0] * quat_q14[0] + quat_q14[1] * quat_q14[1] +
-            quat_q14[2] * quat_q14[2] + quat_q14[3] * quat_q14[3];
-        if ((quat_mag_sq < QUAT_MAG_SQ_MIN) ||
-            (quat_mag_sq > QUAT_MAG_SQ_MAX)) {
-            /* Quaternion is outside of the acceptable threshold. */
-            mpu_reset_fifo();
+        if (!quat_valid(fifo_data)) {
+            /* Quaternion is outside of the acceptable threshold, the stream
+             * is misaligned. Drop this packet and realign on the next read.
+             */
+            dmp.stats.corruptions++;
+            dmp.stats.bytes_discarded += dmp.packet_length +
+                dmp.cache_len - dmp.cache_pos;
+            dmp.cache_len = 0;
+            dmp.cache_pos = 0;
+            dmp.resync = 1;
             sensors[0] = 0;
+            more[0] = 0;
             return -1;
         }
         sensors[0] |= INV_WXYZ_QUAT;
@@ -49,7 +49,18 @@
 
 #define INV_WXYZ_QUAT       (0x100)
 
+/* FIFO loss and recovery counters, see dmp_get_fifo_stats. */
+struct dmp_fifo_stats_s {
+    uint32_t overflows;         /* Hardware FIFO overflows. */
+    uint32_t corruptions;       /* Packets failing the quaternion check. */
+    uint32_t resyncs;           /* Packet boundary found again. */
+    uint32_t resync_waits;      /* Reads short of the bytes to realign. */
+    uint32_t resets;            /* Gave up and reset the FIFO. */
+    uint32_t bytes_discarded;   /* Bytes read but not returned as packets. */
+};
+
 /* Set up functions. */
+int dmp_select_device(unsigned char device);
 int dmp_load_motion_driver_firmware(void);
 int dmp_set_fifo_rate(unsigned short rate);
 int dmp_get_fifo_rate(unsigned short *rate);
@@ -58,6 +69,7 @@ int dmp_get_enabled_features(unsigned short *mask);
 int dmp_set_interrupt_mode(unsigned char mode);
 int dmp_set_orientation(unsigned short orient);
 int dmp_set_gyro_bias(int32_t *bias);
+int dmp_get_gyro_bias(int32_t *bias);
 int dmp_set_accel_bias(int32_t *bias);
 
 /* Tap functions. */
@@ -92,6 +104,8 @@ int dmp_enable_gyro_cal(unsigned char enable);
  */
 int dmp_read_fifo(short *gyro, short *accel, int32_t *quat,
     uint32_t *timestamp, short *sensors, unsigned char *more);
+int dmp_prefetch_fifo(unsigned short *packets);
+int dmp_get_fifo_stats(struct dmp_fifo_stats_s *stats);
 
 #endif  /* #ifndef _INV_MPU_DMP_MOTION_DRIVER_H_ */
 
@@ -0,0 +1,467 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/types.h>
+#include <linux/i2c-dev.h>
+
+#include "mpu_sim.h"
+#include "i2cfake.h"
+
+#define MAX_FDS 1024
+#define MAX_EVENTS 64
+#define MAX_PENDING 256
+
+enum { ACT_NACK, ACT_SHORT, ACT_STALL };
+
+#define DO_NACK (1 << ACT_NACK)
+#define DO_SHORT (1 << ACT_SHORT)
+#define DO_STALL (1 << ACT_STALL)
+
+typedef struct {
+	unsigned long at;
+	unsigned long every;
+	int action;
+	unsigned long ms;
+} fakeevent_t;
+
+// one open /dev/i2c-N, backed by a /dev/null descriptor
+typedef struct {
+	int bus;
+	unsigned char slave;
+	unsigned char reg;
+
+	// rest of a short read, handed out on the next read()
+	unsigned char pending[MAX_PENDING];
+	int pendingLen;
+	int pendingPos;
+} fakefd_t;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+
+static fakefd_t *fds[MAX_FDS];
+static fakeevent_t events[MAX_EVENTS];
+static int num_events;
+static unsigned long transfers;
+static int up;
+static i2cfake_stats_t stats;
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void load_script(const char *path)
+{
+	FILE *fh;
+	char line[128], word[16], *p;
+	fakeevent_t *e;
+	int n;
+
+	fh = fopen(path, "r");
+
+	if (!fh) {
+		fprintf(stderr, "i2cfake: cannot open %s\n", path);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fh) && num_events < MAX_EVENTS) {
+		p = line;
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+
+		e = &events[num_events];
+		memset(e, 0, sizeof(fakeevent_t));
+
+		if (!strncmp(p, "every", 5))
+			n = sscanf(p + 5, "%lu %15s %lu", &e->every, word, &e->ms) + 1;
+		else
+			n = sscanf(p, "%lu %15s %lu", &e->at, word, &e->ms);
+
+		if (n < 2 || (!e->at && !e->every)) {
+			fprintf(stderr, "i2cfake: bad line in %s: %s", path, line);
+			continue;
+		}
+
+		if (!strcmp(word, "nack")) {
+			e->action = ACT_NACK;
+		}
+		else if (!strcmp(word, "short")) {
+			e->action = ACT_SHORT;
+		}
+		else if (!strcmp(word, "stall") && n == 3) {
+			e->action = ACT_STALL;
+		}
+		else {
+			fprintf(stderr, "i2cfake: bad line in %s: %s", path, line);
+			continue;
+		}
+
+		num_events++;
+	}
+
+	fclose(fh);
+}
+
+static void report()
+{
+	unsigned long n = stats.reads + stats.writes;
+
+	fprintf(stderr, "i2cfake: %lu opens, %lu ioctls, %lu reads (%lu bytes), %lu writes (%lu bytes), "
+		"%lu nacks, %lu short reads, %lu stalls, %.1f us per transfer\n",
+		stats.opens, stats.ioctls, stats.reads, stats.bytesRead, stats.writes, stats.bytesWritten,
+		stats.nacks, stats.shortReads, stats.stalls,
+		n ? (stats.readNs + stats.writeNs) / 1000.0 / n : 0.0);
+}
+
+static void setup()
+{
+	mpu_sim_config_t config;
+	const char *env;
+
+	if (up)
+		return;
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_write = dlsym(RTLD_NEXT, "write");
+
+	mpu_sim_default_config(&config);
+	config.realtime = 1;
+
+	env = getenv("I2CFAKE_SEED");
+
+	if (env)
+		config.seed = strtoul(env, NULL, 0);
+
+	mpu_sim_init(&config);
+
+	env = getenv("I2CFAKE_MOTION");
+
+	if (env)
+		mpu_sim_load_motion(env);
+
+	env = getenv("I2CFAKE_SCRIPT");
+
+	if (env)
+		load_script(env);
+
+	atexit(report);
+	up = 1;
+}
+
+// Returns the DO_ bits of every line matching this transfer, ms gets the
+// sum of their stalls. Short reads are counted among the reads alone.
+static int next_events(int is_read, unsigned long *ms)
+{
+	unsigned long n;
+	int i, actions;
+
+	transfers++;
+	actions = 0;
+	*ms = 0;
+
+	for (i = 0; i < num_events; i++) {
+		if (events[i].action == ACT_SHORT) {
+			if (!is_read)
+				continue;
+
+			n = stats.reads;
+		}
+		else {
+			n = transfers;
+		}
+
+		if (events[i].at == n || (events[i].every && n % events[i].every == 0)) {
+			actions |= 1 << events[i].action;
+
+			if (events[i].action == ACT_STALL)
+				*ms += events[i].ms;
+		}
+	}
+
+	return actions;
+}
+
+static void stall(unsigned long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+	stats.stalls++;
+}
+
+static fakefd_t *lookup(int fd)
+{
+	if (fd < 0 || fd >= MAX_FDS)
+		return NULL;
+
+	return fds[fd];
+}
+
+int i2cfake_get_stats(i2cfake_stats_t *s)
+{
+	if (!s)
+		return -1;
+
+	*s = stats;
+
+	return 0;
+}
+
+static int open_fake(const char *path, int flags, mode_t mode)
+{
+	fakefd_t *f;
+	int bus, fd;
+
+	setup();
+
+	if (sscanf(path, "/dev/i2c-%d", &bus) != 1 || bus < MIN_I2C_BUS || bus > MAX_I2C_BUS)
+		return real_open(path, flags, mode);
+
+	fd = real_open("/dev/null", O_RDWR);
+
+	if (fd < 0 || fd >= MAX_FDS) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	f = (fakefd_t *)calloc(1, sizeof(fakefd_t));
+
+	if (!f) {
+		real_close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	f->bus = bus;
+	fds[fd] = f;
+	stats.opens++;
+
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+
+	return open_fake(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+
+	return open_fake(path, flags, mode);
+}
+
+int close(int fd)
+{
+	fakefd_t *f;
+
+	setup();
+
+	f = lookup(fd);
+
+	if (f) {
+		free(f);
+		fds[fd] = NULL;
+	}
+
+	return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	unsigned long arg;
+	fakefd_t *f;
+
+	setup();
+
+	va_start(ap, request);
+	arg = va_arg(ap, unsigned long);
+	va_end(ap);
+
+	f = lookup(fd);
+
+	if (!f)
+		return real_ioctl(fd, request, arg);
+
+	stats.ioctls++;
+
+	if (request == I2C_SLAVE || request == I2C_SLAVE_FORCE) {
+		f->slave = (unsigned char)arg;
+		return 0;
+	}
+
+	errno = ENOTTY;
+
+	return -1;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	const unsigned char *data = (const unsigned char *)buf;
+	unsigned long ms;
+	fakefd_t *f;
+	uint64_t start;
+	int actions, result;
+
+	setup();
+
+	f = lookup(fd);
+
+	if (!f)
+		return real_write(fd, buf, count);
+
+	start = mono_ns();
+	stats.writes++;
+
+	actions = next_events(0, &ms);
+
+	if (actions & DO_STALL)
+		stall(ms);
+
+	if ((actions & DO_NACK) || count < 1 || count > 256) {
+		stats.nacks++;
+		stats.writeNs += mono_ns() - start;
+		errno = EREMOTEIO;
+		return -1;
+	}
+
+	f->reg = data[0];
+	f->pendingLen = 0;
+	result = 0;
+
+	// a lone register byte only sets up the following read
+	if (count > 1)
+		result = mpu_sim_write(f->bus, f->slave, data[0], count - 1, data + 1);
+
+	stats.writeNs += mono_ns() - start;
+
+	if (result) {
+		stats.nacks++;
+		errno = EREMOTEIO;
+		return -1;
+	}
+
+	stats.bytesWritten += count;
+
+	return count;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	unsigned long ms;
+	fakefd_t *f;
+	uint64_t start;
+	int actions, n;
+
+	setup();
+
+	f = lookup(fd);
+
+	if (!f)
+		return real_read(fd, buf, count);
+
+	start = mono_ns();
+	stats.reads++;
+
+	actions = next_events(1, &ms);
+
+	if (actions & DO_STALL)
+		stall(ms);
+
+	if (actions & DO_NACK) {
+		stats.nacks++;
+		stats.readNs += mono_ns() - start;
+		errno = EREMOTEIO;
+		return -1;
+	}
+
+	// the remainder of a short read
+	if (f->pendingPos < f->pendingLen) {
+		n = f->pendingLen - f->pendingPos;
+
+		if ((size_t)n > count)
+			n = count;
+
+		memcpy(buf, f->pending + f->pendingPos, n);
+		f->pendingPos += n;
+		stats.bytesRead += n;
+		stats.readNs += mono_ns() - start;
+
+		return n;
+	}
+
+	if (count > MAX_PENDING) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (mpu_sim_read(f->bus, f->slave, f->reg, count, f->pending)) {
+		stats.nacks++;
+		stats.readNs += mono_ns() - start;
+		errno = EREMOTEIO;
+		return -1;
+	}
+
+	n = count;
+
+	if (actions & DO_SHORT) {
+		n = count / 2;
+		stats.shortReads++;
+	}
+
+	memcpy(buf, f->pending, n);
+	f->pendingLen = count;
+	f->pendingPos = n;
+	stats.bytesRead += n;
+	stats.readNs += mono_ns() - start;
+
+	return n;
+}
@@ -0,0 +1,50 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef I2CFAKE_H
+#define I2CFAKE_H
+
+#include <stdint.h>
+
+// LD_PRELOAD shim that turns /dev/i2c-N into the mpu_sim device model, so
+// the real open/ioctl/read/write path of linux_glue.c runs without hardware.
+//
+//   LD_PRELOAD=./i2cfake.so I2CFAKE_SCRIPT=scenario.txt ./i2cbench
+//
+// The scenario script injects faults by transfer number, one per line:
+//
+//   <n> nack             transfer n fails with EREMOTEIO
+//   <n> short            read n returns half the bytes, the rest on retry
+//   <n> stall <ms>       transfer n is held for ms, the FIFO keeps filling
+//   every <k> <action>   the same on every k-th transfer
+//
+// Transfers are the reads and writes on the fake bus, counted from 1.
+// Short reads count the reads alone, so "every 50 short" is every 50th
+// read. All lines matching a transfer apply: their stalls add up, then a
+// nack fails the transfer, and only a read that isn't nacked comes short.
+// I2CFAKE_SEED and I2CFAKE_MOTION set the simulator seed and a recorded
+// motion file. Counters are printed to stderr at exit. Nothing here is
+// thread safe, run one device or one thread at a time.
+
+typedef struct {
+	unsigned long opens;
+	unsigned long ioctls;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long bytesRead;
+	unsigned long bytesWritten;
+	unsigned long nacks;
+	unsigned long shortReads;
+	unsigned long stalls;
+	uint64_t readNs;
+	uint64_t writeNs;
+} i2cfake_stats_t;
+
+// for programs running under the shim, look it up with dlsym()
+int i2cfake_get_stats(i2cfake_stats_t *stats);
+
+#endif /* I2CFAKE_H */
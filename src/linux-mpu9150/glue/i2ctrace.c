@@ -0,0 +1,337 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "i2ctrace.h"
+
+// One per thread that has done a traced transfer, pushed on a list that
+// is never shrunk. A block with an old generation is cleared by its owner
+// on its next transfer and skipped by snapshots until then.
+typedef struct block_s {
+	struct block_s *next;
+	unsigned int generation;
+	i2ctrace_t trace;
+} block_t;
+
+static block_t *volatile blocks;
+static __thread block_t *my_block;
+static volatile int enabled;
+static volatile unsigned int generation;
+
+static const struct {
+	int reg;
+	const char *name;
+} mpu_regs[] = {
+	{ 0x19, "SMPLRT_DIV" },
+	{ 0x1A, "CONFIG" },
+	{ 0x1B, "GYRO_CONFIG" },
+	{ 0x1C, "ACCEL_CONFIG" },
+	{ 0x23, "FIFO_EN" },
+	{ 0x24, "I2C_MST_CTRL" },
+	{ 0x37, "INT_PIN_CFG" },
+	{ 0x38, "INT_ENABLE" },
+	{ 0x39, "DMP_INT_STATUS" },
+	{ 0x3A, "INT_STATUS" },
+	{ 0x3B, "ACCEL_XOUT_H" },
+	{ 0x41, "TEMP_OUT_H" },
+	{ 0x43, "GYRO_XOUT_H" },
+	{ 0x49, "EXT_SENS_DATA" },
+	{ 0x6A, "USER_CTRL" },
+	{ 0x6B, "PWR_MGMT_1" },
+	{ 0x6C, "PWR_MGMT_2" },
+	{ 0x6D, "BANK_SEL" },
+	{ 0x6E, "MEM_START_ADDR" },
+	{ 0x6F, "MEM_R_W" },
+	{ 0x70, "PRGM_START_H" },
+	{ 0x72, "FIFO_COUNT_H" },
+	{ 0x74, "FIFO_R_W" },
+	{ 0x75, "WHO_AM_I" }
+};
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void i2ctrace_enable(int on)
+{
+	enabled = on;
+}
+
+int i2ctrace_enabled()
+{
+	return enabled;
+}
+
+void i2ctrace_reset()
+{
+	__sync_fetch_and_add(&generation, 1);
+}
+
+static block_t *get_block()
+{
+	block_t *block = my_block;
+
+	if (!block) {
+		block = (block_t *)calloc(1, sizeof(block_t));
+
+		if (!block)
+			return NULL;
+
+		block->generation = generation;
+
+		do {
+			block->next = blocks;
+		} while (!__sync_bool_compare_and_swap(&blocks, block->next, block));
+
+		my_block = block;
+	}
+	else if (block->generation != generation) {
+		memset(&block->trace, 0, sizeof(i2ctrace_t));
+		block->generation = generation;
+	}
+
+	return block;
+}
+
+static i2ctrace_slave_t *find_slave(i2ctrace_t *trace, int bus, int slave)
+{
+	i2ctrace_slave_t *s;
+	int i;
+
+	for (i = 0; i < trace->numSlaves; i++) {
+		s = &trace->slaves[i];
+
+		if (s->bus == bus && s->slave == slave)
+			return s;
+	}
+
+	if (trace->numSlaves == I2CTRACE_MAX_SLAVES) {
+		// full, the last entry is the overflow
+		s = &trace->slaves[I2CTRACE_MAX_SLAVES - 1];
+		s->bus = -1;
+		s->slave = -1;
+		return s;
+	}
+
+	s = &trace->slaves[trace->numSlaves++];
+	s->bus = trace->numSlaves == I2CTRACE_MAX_SLAVES ? -1 : bus;
+	s->slave = trace->numSlaves == I2CTRACE_MAX_SLAVES ? -1 : slave;
+
+	return s;
+}
+
+static int bucket(uint64_t ns)
+{
+	int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	return b < I2CTRACE_BUCKETS ? b : I2CTRACE_BUCKETS - 1;
+}
+
+uint64_t i2ctrace_start()
+{
+	return enabled ? mono_ns() : 0;
+}
+
+void i2ctrace_record(uint64_t start_ns, int bus, unsigned char slave_addr, unsigned char reg_addr,
+		int write, unsigned char length, int retries, int error)
+{
+	block_t *block;
+	i2ctrace_slave_t *s;
+	i2ctrace_reg_t *r;
+	uint64_t ns;
+
+	if (!start_ns)
+		return;
+
+	ns = mono_ns() - start_ns;
+	block = get_block();
+
+	if (!block)
+		return;
+
+	s = find_slave(&block->trace, bus, slave_addr);
+	s->transfers++;
+	s->bytes += length;
+	s->retries += retries;
+	s->ns += ns;
+	s->hist[bucket(ns)]++;
+
+	if (ns > s->maxNs)
+		s->maxNs = ns;
+
+	r = &s->regs[reg_addr];
+
+	if (write)
+		r->writes++;
+	else
+		r->reads++;
+
+	r->bytes += length;
+	r->retries += retries;
+	r->ns += ns;
+
+	if (error) {
+		s->errors++;
+		r->errors++;
+	}
+}
+
+void i2ctrace_snapshot(i2ctrace_t *trace)
+{
+	const block_t *block;
+	const i2ctrace_slave_t *from;
+	i2ctrace_slave_t *to;
+	int i, j;
+
+	memset(trace, 0, sizeof(i2ctrace_t));
+
+	for (block = blocks; block; block = block->next) {
+		if (block->generation != generation)
+			continue;
+
+		for (i = 0; i < block->trace.numSlaves; i++) {
+			from = &block->trace.slaves[i];
+			to = find_slave(trace, from->bus, from->slave);
+
+			to->transfers += from->transfers;
+			to->bytes += from->bytes;
+			to->retries += from->retries;
+			to->errors += from->errors;
+			to->ns += from->ns;
+
+			if (from->maxNs > to->maxNs)
+				to->maxNs = from->maxNs;
+
+			for (j = 0; j < I2CTRACE_BUCKETS; j++)
+				to->hist[j] += from->hist[j];
+
+			for (j = 0; j < I2CTRACE_REGS; j++) {
+				to->regs[j].reads += from->regs[j].reads;
+				to->regs[j].writes += from->regs[j].writes;
+				to->regs[j].bytes += from->regs[j].bytes;
+				to->regs[j].retries += from->regs[j].retries;
+				to->regs[j].errors += from->regs[j].errors;
+				to->regs[j].ns += from->regs[j].ns;
+			}
+		}
+	}
+}
+
+uint64_t i2ctrace_percentile(const i2ctrace_slave_t *slave, double p)
+{
+	uint64_t rank, seen;
+	int i;
+
+	if (slave->transfers == 0)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * slave->transfers + 0.5);
+
+	if (rank == 0)
+		rank = 1;
+
+	seen = 0;
+
+	for (i = 0; i < I2CTRACE_BUCKETS - 1; i++) {
+		seen += slave->hist[i];
+
+		if (seen >= rank)
+			break;
+	}
+
+	// upper edge of the bucket
+	if (i == I2CTRACE_BUCKETS - 1 || (1ULL << i) > slave->maxNs)
+		return slave->maxNs;
+
+	return 1ULL << i;
+}
+
+const char *i2ctrace_reg_name(int slave, int reg)
+{
+	unsigned int i;
+
+	if (slave != 0x68 && slave != 0x69)
+		return NULL;
+
+	for (i = 0; i < sizeof(mpu_regs) / sizeof(mpu_regs[0]); i++) {
+		if (mpu_regs[i].reg == reg)
+			return mpu_regs[i].name;
+	}
+
+	return NULL;
+}
+
+void i2ctrace_print(FILE *fh, const i2ctrace_t *trace, int top)
+{
+	const i2ctrace_slave_t *s, *best_s;
+	const i2ctrace_reg_t *r;
+	const char *name;
+	uint64_t total_ns, best_ns;
+	unsigned char done[I2CTRACE_MAX_SLAVES][I2CTRACE_REGS];
+	int i, j, n, best_i, best_j;
+
+	fprintf(fh, "\n%3s %5s %10s %10s %8s %8s %10s %8s %8s %8s\n",
+		"bus", "slave", "transfers", "bytes", "retries", "errors", "time ms", "p50 us", "p99 us", "max us");
+
+	total_ns = 0;
+
+	for (i = 0; i < trace->numSlaves; i++) {
+		s = &trace->slaves[i];
+		total_ns += s->ns;
+
+		fprintf(fh, "%3d  0x%02X %10lu %10lu %8lu %8lu %10.1f %8.1f %8.1f %8.1f\n",
+			s->bus, s->slave & 0xff, s->transfers, s->bytes, s->retries, s->errors,
+			s->ns / 1e6, i2ctrace_percentile(s, 50.0) / 1e3,
+			i2ctrace_percentile(s, 99.0) / 1e3, s->maxNs / 1e3);
+	}
+
+	if (top <= 0 || total_ns == 0)
+		return;
+
+	fprintf(fh, "\n%3s %5s %4s %-16s %8s %8s %10s %8s %8s %10s %6s\n",
+		"bus", "slave", "reg", "name", "reads", "writes", "bytes", "retries", "errors", "time ms", "share");
+
+	memset(done, 0, sizeof(done));
+
+	// selection of the top registers, the tables are small
+	for (n = 0; n < top; n++) {
+		best_ns = 0;
+		best_i = -1;
+		best_j = -1;
+
+		for (i = 0; i < trace->numSlaves; i++) {
+			for (j = 0; j < I2CTRACE_REGS; j++) {
+				if (!done[i][j] && trace->slaves[i].regs[j].ns > best_ns) {
+					best_ns = trace->slaves[i].regs[j].ns;
+					best_i = i;
+					best_j = j;
+				}
+			}
+		}
+
+		if (best_i < 0)
+			break;
+
+		done[best_i][best_j] = 1;
+		best_s = &trace->slaves[best_i];
+		r = &best_s->regs[best_j];
+		name = i2ctrace_reg_name(best_s->slave, best_j);
+
+		fprintf(fh, "%3d  0x%02X 0x%02X %-16s %8u %8u %10u %8u %8u %10.1f %5.1f%%\n",
+			best_s->bus, best_s->slave & 0xff, best_j, name ? name : "",
+			r->reads, r->writes, r->bytes, r->retries, r->errors,
+			r->ns / 1e6, 100.0 * r->ns / total_ns);
+	}
+}
@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef I2CTRACE_H
+#define I2CTRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Transaction counters for linux_i2c_read() and linux_i2c_write(), for
+// finding out which registers, and so which driver calls, use the bus.
+// Off by default. When on, each transfer costs two clock reads and a few
+// increments in a block owned by the calling thread, no locks are taken.
+// Snapshots add up the blocks of all threads, counters of a transfer in
+// progress may be one behind.
+//
+// Devices are told apart by bus and slave address. The first
+// I2CTRACE_MAX_SLAVES - 1 seen get their own entries, any others share
+// the last one, with bus and slave -1. A thread's block outlives it so
+// its counts stay in the totals.
+
+#define I2CTRACE_MAX_SLAVES		8
+#define I2CTRACE_REGS			256
+// log2 buckets of the transfer time in ns, the last one holds the rest
+#define I2CTRACE_BUCKETS		32
+
+typedef struct {
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t bytes;
+	uint32_t retries;
+	uint32_t errors;
+	uint64_t ns;
+} i2ctrace_reg_t;
+
+typedef struct {
+	int bus;
+	int slave;
+	unsigned long transfers;
+	unsigned long bytes;
+	unsigned long retries;
+	unsigned long errors;
+	uint64_t ns;
+	uint64_t maxNs;
+	uint32_t hist[I2CTRACE_BUCKETS];
+	i2ctrace_reg_t regs[I2CTRACE_REGS];
+} i2ctrace_slave_t;
+
+typedef struct {
+	int numSlaves;
+	i2ctrace_slave_t slaves[I2CTRACE_MAX_SLAVES];
+} i2ctrace_t;
+
+void i2ctrace_enable(int on);
+int i2ctrace_enabled();
+// clears the counters of every thread
+void i2ctrace_reset();
+void i2ctrace_snapshot(i2ctrace_t *trace);
+
+// Called by the glue around each transfer. start_ns is 0 when tracing was off
+// at the start of the transfer.
+uint64_t i2ctrace_start();
+void i2ctrace_record(uint64_t start_ns, int bus, unsigned char slave_addr, unsigned char reg_addr,
+		int write, unsigned char length, int retries, int error);
+
+// p in percent, from the log2 histogram so only within a factor of 2
+uint64_t i2ctrace_percentile(const i2ctrace_slave_t *slave, double p);
+// MPU6050/9150 register name or NULL
+const char *i2ctrace_reg_name(int slave, int reg);
+// Per device totals and the top registers by bus time
+void i2ctrace_print(FILE *fh, const i2ctrace_t *trace, int top);
+
+#endif /* I2CTRACE_H */
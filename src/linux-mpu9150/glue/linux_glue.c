@@ -33,15 +33,27 @@
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
 #include "linux_glue.h"
+#include "i2ctrace.h"
 
 #define MAX_WRITE_LEN 511
 
-// default is the RPi
-int i2c_bus = 1;
+// default is the RPi, per thread like the driver's device selection
+__thread int i2c_bus = 1;
 
-int i2c_fd;
-int current_slave;
-unsigned char txBuff[MAX_WRITE_LEN + 1];
+// one open descriptor and selected slave per bus, so switching
+// between devices on different buses doesn't reopen the device
+int i2c_fds[MAX_I2C_BUS + 1];
+int current_slaves[MAX_I2C_BUS + 1];
+
+#define i2c_fd (i2c_fds[i2c_bus])
+#define current_slave (current_slaves[i2c_bus])
+
+__thread unsigned char txBuff[MAX_WRITE_LEN + 1];
+
+// NULL means /dev/i2c-N
+const i2c_transport_t *i2c_transport;
+
+unsigned long i2c_errors;
 
 
 void __no_operation(void) { }
@@ -80,12 +92,12 @@ void i2c_close()
 
 int i2c_select_slave(unsigned char slave_addr)
 {
-	if (current_slave == slave_addr)
-		return 0;
-
 	if (i2c_open())
 		return -1;
 
+	if (current_slave == slave_addr)
+		return 0;
+
 #ifdef I2C_DEBUG
 	printf("\t\ti2c_select_slave(%02X)\n", slave_addr);
 #endif
@@ -100,15 +112,52 @@ int i2c_select_slave(unsigned char slave_addr)
 	return 0;
 }
 
+void linux_set_transport(const i2c_transport_t *transport)
+{
+	linux_close_i2c();
+	i2c_transport = transport;
+}
+
+const char *linux_transport_name()
+{
+	return i2c_transport ? i2c_transport->name : "i2c-dev";
+}
+
+int linux_transport_concurrent()
+{
+	return i2c_transport ? i2c_transport->concurrent : 1;
+}
+
 void linux_set_i2c_bus(int bus)
 {
-	if (i2c_fd)
-		i2c_close();
+	if (bus < MIN_I2C_BUS || bus > MAX_I2C_BUS)
+		return;
 
 	i2c_bus = bus;
 }
 
-int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
+void linux_close_i2c()
+{
+	int bus, saved_bus;
+
+	if (i2c_transport) {
+		if (i2c_transport->close)
+			i2c_transport->close();
+
+		return;
+	}
+
+	saved_bus = i2c_bus;
+
+	for (bus = MIN_I2C_BUS; bus <= MAX_I2C_BUS; bus++) {
+		i2c_bus = bus;
+		i2c_close();
+	}
+
+	i2c_bus = saved_bus;
+}
+
+static int dev_write(unsigned char slave_addr, unsigned char reg_addr,
        unsigned char length, unsigned char const *data)
 {
 	int result, i;
@@ -132,6 +181,9 @@ int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
 	}
 #endif
 
+	if (i2c_transport)
+		return i2c_transport->write(i2c_bus, slave_addr, reg_addr, length, data);
+
 	if (i2c_select_slave(slave_addr))
 		return -1;
 
@@ -168,10 +220,11 @@ int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
 	return 0;
 }
 
-int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
-       unsigned char length, unsigned char *data)
+// tries is the number of extra reads needed after short ones
+static int dev_read(unsigned char slave_addr, unsigned char reg_addr,
+       unsigned char length, unsigned char *data, int *tries)
 {
-	int tries, result, total;
+	int result, total;
 
 #ifdef I2C_DEBUG
 	int i;
@@ -179,13 +232,16 @@ int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
 	printf("\tlinux_i2c_read(%02X, %02X, %u, ...)\n", slave_addr, reg_addr, length);
 #endif
 
-	if (linux_i2c_write(slave_addr, reg_addr, 0, NULL))
+	if (i2c_transport)
+		return i2c_transport->read(i2c_bus, slave_addr, reg_addr, length, data);
+
+	if (dev_write(slave_addr, reg_addr, 0, NULL))
 		return -1;
 
 	total = 0;
-	tries = 0;
+	*tries = 0;
 
-	while (total < length && tries < 5) {
+	while (total < length && *tries < 5) {
 		result = read(i2c_fd, data + total, length - total);
 
 		if (result < 0) {
@@ -198,7 +254,7 @@ int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
 		if (total == length)
 			break;
 
-		tries++;		
+		(*tries)++;
 		linux_delay_ms(10);
 	}
 
@@ -217,10 +273,48 @@ int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
 	return 0;
 }
 
+int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
+       unsigned char length, unsigned char const *data)
+{
+	uint64_t start = i2ctrace_start();
+	int result;
+
+	result = dev_write(slave_addr, reg_addr, length, data);
+	i2ctrace_record(start, i2c_bus, slave_addr, reg_addr, 1, length, 0, result != 0);
+
+	if (result)
+		__sync_fetch_and_add(&i2c_errors, 1);
+
+	return result;
+}
+
+int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
+       unsigned char length, unsigned char *data)
+{
+	uint64_t start = i2ctrace_start();
+	int result, tries = 0;
+
+	result = dev_read(slave_addr, reg_addr, length, data, &tries);
+	i2ctrace_record(start, i2c_bus, slave_addr, reg_addr, 0, length, tries, result != 0);
+
+	if (result)
+		__sync_fetch_and_add(&i2c_errors, 1);
+
+	return result;
+}
+
+unsigned long linux_i2c_errors()
+{
+	return i2c_errors;
+}
+
 int linux_delay_ms(unsigned long num_ms)
 {
 	struct timespec ts;
 
+	if (i2c_transport && i2c_transport->delay_ms)
+		return i2c_transport->delay_ms(num_ms);
+
 	ts.tv_sec = num_ms / 1000;
 	ts.tv_nsec = (num_ms % 1000) * 1000000;
 
@@ -234,6 +328,9 @@ int linux_get_ms(unsigned long *count)
 	if (!count)
 		return -1;
 
+	if (i2c_transport && i2c_transport->get_ms)
+		return i2c_transport->get_ms(count);
+
 	if (gettimeofday(&t, NULL) < 0) {
 		perror("gettimeofday");
 		return -1;
@@ -47,7 +47,29 @@ static inline int reg_int_cb(struct int_param_s *int_param)
 
 void __no_operation(void);
 
+// Everything the drivers do goes through one of these. Without one the
+// glue talks to /dev/i2c-N, see mpu_sim.h for an in-process device.
+// A transport can leave delay_ms and get_ms NULL to use the system clock.
+// concurrent says it takes calls from several threads, one per bus.
+typedef struct {
+	const char *name;
+	int (*write)(int bus, unsigned char slave_addr, unsigned char reg_addr,
+		unsigned char length, unsigned char const *data);
+	int (*read)(int bus, unsigned char slave_addr, unsigned char reg_addr,
+		unsigned char length, unsigned char *data);
+	int (*delay_ms)(unsigned long num_ms);
+	int (*get_ms)(unsigned long *count);
+	void (*close)(void);
+	int concurrent;
+} i2c_transport_t;
+
+void linux_set_transport(const i2c_transport_t *transport);
+const char *linux_transport_name();
+// whether devices on different buses can be driven from their own threads
+int linux_transport_concurrent();
+
 void linux_set_i2c_bus(int bus);
+void linux_close_i2c();
 
 int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
        unsigned char length, unsigned char const *data);
@@ -55,6 +77,9 @@ int linux_i2c_write(unsigned char slave_addr, unsigned char reg_addr,
 int linux_i2c_read(unsigned char slave_addr, unsigned char reg_addr,
        unsigned char length, unsigned char *data);
  
+// failed reads and writes on any bus since start
+unsigned long linux_i2c_errors();
+
 int linux_delay_ms(unsigned long num_ms);
 int linux_get_ms(unsigned long *count);
 
@@ -0,0 +1,1180 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "mpu_sim.h"
+
+#define NUM_BUSES (MAX_I2C_BUS + 1)
+
+// MPU6050 registers the model gives a meaning to
+#define REG_ACCEL_OFFS		0x06
+#define REG_SMPLRT_DIV		0x19
+#define REG_CONFIG			0x1A
+#define REG_GYRO_CONFIG		0x1B
+#define REG_ACCEL_CONFIG	0x1C
+#define REG_MOT_THR			0x1F
+#define REG_MOT_DUR			0x20
+#define REG_FIFO_EN			0x23
+#define REG_I2C_SLV0_ADDR	0x25
+#define REG_INT_PIN_CFG		0x37
+#define REG_INT_ENABLE		0x38
+#define REG_DMP_INT_STATUS	0x39
+#define REG_INT_STATUS		0x3A
+#define REG_ACCEL_XOUT_H	0x3B
+#define REG_EXT_SENS_DATA	0x49
+#define REG_I2C_SLV0_DO		0x63
+#define REG_USER_CTRL		0x6A
+#define REG_PWR_MGMT_1		0x6B
+#define REG_BANK_SEL		0x6D
+#define REG_MEM_START_ADDR	0x6E
+#define REG_MEM_R_W			0x6F
+#define REG_FIFO_COUNT_H	0x72
+#define REG_FIFO_COUNT_L	0x73
+#define REG_FIFO_R_W		0x74
+#define REG_WHO_AM_I		0x75
+#define NUM_REGS			128
+
+#define EXT_SENS_DATA_LEN	24
+
+#define FIFO_EN_TEMP		0x80
+#define FIFO_EN_XG			0x40
+#define FIFO_EN_YG			0x20
+#define FIFO_EN_ZG			0x10
+#define FIFO_EN_ACCEL		0x08
+
+#define USER_DMP_EN			0x80
+#define USER_FIFO_EN		0x40
+#define USER_I2C_MST_EN		0x20
+#define USER_DMP_RST		0x08
+#define USER_FIFO_RST		0x04
+#define USER_SELF_CLEARING	0x0F
+
+#define INT_MOT				0x40
+#define INT_FIFO_OFLOW		0x10
+#define INT_DMP				0x02
+#define INT_DATA_RDY		0x01
+
+#define PWR_RESET			0x80
+#define PWR_SLEEP			0x40
+
+#define PIN_BYPASS_EN		0x02
+
+// accel high pass filter setting that holds the motion reference
+#define ACCEL_HPF_HOLD		0x07
+// motion threshold LSB, g
+#define MOT_THR_G			0.032
+
+// DMP memory the driver writes to select the packet layout and rate,
+// see inv_mpu_dmp_motion_driver.c
+#define DMP_D_0_22			(22 + 512)
+#define DMP_CFG_LP_QUAT		2712
+#define DMP_CFG_8			2718
+#define DMP_CFG_15			2727
+#define DMP_CFG_20			2224
+#define DMP_CFG_ANDROID_ORIENT_INT	1853
+#define DMP_CFG_MOTION_BIAS	1208
+#define DMP_D_EXT_GYRO_BIAS	(61 * 16)
+
+// GYRO_CAL's stillness before it writes an estimate and the scale of
+// D_EXT_GYRO_BIAS, dmp_set_gyro_bias's GYRO_SF over 2^30 on q16 deg/s
+#define DMP_GYRO_CAL_MS		8000.0
+#define DMP_GYRO_BIAS_LSB	(65536.0 * 46850825.0 / 1073741824.0)
+
+// HMC5883L
+#define HMC_CONFA			0
+#define HMC_CONFB			1
+#define HMC_MODE			2
+#define HMC_XM				3
+#define HMC_STATUS			9
+#define HMC_NUM_REGS		13
+
+// RDY drops while a conversion is written out, reading the data leaves it set
+#define HMC_RDY_LOW_NS		250000
+
+// AK8975
+#define AKM_WIA				0x00
+#define AKM_ST1				0x02
+#define AKM_HXL				0x03
+#define AKM_ST2				0x09
+#define AKM_CNTL			0x0A
+#define AKM_ASAX			0x10
+#define AKM_NUM_REGS		0x13
+#define AKM_GAUSS_PER_LSB	0.003
+
+#define DEG_TO_RAD			(M_PI / 180.0)
+
+typedef struct {
+	double t;
+	float accel[3];
+	float gyro[3];
+	float mag[3];
+	int hasMag;
+} motionrow_t;
+
+typedef struct {
+	int up;
+
+	unsigned char regs[NUM_REGS];
+	unsigned char mem[MPU_SIM_MEM_SIZE];
+	int memAddr;
+
+	unsigned char fifo[MPU_SIM_FIFO_SIZE];
+	int fifoHead;
+	int fifoCount;
+
+	unsigned char hmc[HMC_NUM_REGS];
+	uint64_t hmcNext;
+	uint64_t hmcWritten;
+	unsigned char akm[AKM_NUM_REGS];
+
+	// ns on the device clock
+	uint64_t nextSample;
+	unsigned int dmpTick;
+
+	// true attitude, start frame to chip
+	double q[4];
+	double t;
+	int motionIndex;
+	unsigned int rng;
+
+	// latest sensor values in g, deg/s and gauss
+	double accel[3];
+	double gyro[3];
+	double mag[3];
+
+	// motion interrupt, accel held by the high pass filter and time over the threshold
+	double motionRef[3];
+	double motionMs;
+
+	// time without rotation, for the DMP's gyro calibration
+	double stillMs;
+
+	mpu_sim_stats_t stats;
+} simdev_t;
+
+static mpu_sim_config_t config;
+static simdev_t devices[NUM_BUSES];
+
+static uint64_t virtual_ns;
+static uint64_t start_ns;
+
+static motionrow_t *motion;
+static int motion_rows;
+
+static const unsigned char default_accel_offs[6] = { 0xFA, 0x3C, 0x05, 0x61, 0x04, 0xEA };
+static const int hmc_counts_per_gauss[8] = { 1370, 1090, 820, 660, 440, 390, 330, 230 };
+static const double hmc_rate[8] = { 0.75, 1.5, 3.0, 7.5, 15.0, 30.0, 75.0, 75.0 };
+static const double hmc_bias[3] = { 1.16, 1.16, 1.08 };
+
+static void reset_device(simdev_t *dev);
+static void sync_device(simdev_t *dev);
+
+void mpu_sim_default_config(mpu_sim_config_t *c)
+{
+	memset(c, 0, sizeof(mpu_sim_config_t));
+
+	c->gyroRate[2] = 10.0f;
+	c->wobbleAmp = 20.0f;
+	c->wobbleHz = 0.2f;
+
+	c->gyroBias[0] = 0.5f;
+	c->gyroBias[1] = -0.3f;
+	c->gyroBias[2] = 0.2f;
+	c->gyroNoise = 0.05f;
+	c->accelNoise = 0.004f;
+	c->magNoise = 0.002f;
+
+	c->temperature = 25.0f;
+
+	c->magField[0] = 0.22f;
+	c->magField[2] = -0.40f;
+	c->magSelfTest = 1.0f;
+
+	c->seed = 1;
+	c->busKHz = 400;
+}
+
+static uint64_t wall_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ns()
+{
+	if (config.realtime)
+		return wall_ns() - start_ns;
+
+	return virtual_ns;
+}
+
+uint64_t mpu_sim_time_us()
+{
+	return now_ns() / 1000;
+}
+
+void mpu_sim_advance_us(uint64_t us)
+{
+	virtual_ns += us * 1000;
+}
+
+int mpu_sim_init(const mpu_sim_config_t *c)
+{
+	int bus;
+
+	if (c)
+		config = *c;
+	else
+		mpu_sim_default_config(&config);
+
+	virtual_ns = 0;
+	start_ns = wall_ns();
+
+	for (bus = 0; bus < NUM_BUSES; bus++)
+		devices[bus].up = 0;
+
+	return 0;
+}
+
+void mpu_sim_exit()
+{
+	if (motion) {
+		free(motion);
+		motion = NULL;
+	}
+
+	motion_rows = 0;
+}
+
+// One sample per line: time in s, accel x y z in g, gyro x y z in deg/s
+// and optionally mag x y z in gauss. Lines starting with # are skipped.
+int mpu_sim_load_motion(const char *path)
+{
+	FILE *fh;
+	char line[256];
+	motionrow_t row, *rows;
+	int n, count, size;
+
+	fh = fopen(path, "r");
+
+	if (!fh) {
+		perror(path);
+		return -1;
+	}
+
+	rows = NULL;
+	count = 0;
+	size = 0;
+
+	while (fgets(line, sizeof(line), fh)) {
+		if (line[0] == '#')
+			continue;
+
+		n = sscanf(line, "%lf %f %f %f %f %f %f %f %f %f", &row.t,
+			&row.accel[0], &row.accel[1], &row.accel[2],
+			&row.gyro[0], &row.gyro[1], &row.gyro[2],
+			&row.mag[0], &row.mag[1], &row.mag[2]);
+
+		if (n <= 0)
+			continue;
+
+		if (n != 7 && n != 10) {
+			printf("Bad motion sample in %s: %s", path, line);
+			free(rows);
+			fclose(fh);
+			return -1;
+		}
+
+		row.hasMag = (n == 10);
+
+		if (count == size) {
+			size = size ? 2 * size : 1024;
+			rows = (motionrow_t *)realloc(rows, size * sizeof(motionrow_t));
+
+			if (!rows) {
+				perror("realloc");
+				fclose(fh);
+				return -1;
+			}
+		}
+
+		rows[count++] = row;
+	}
+
+	fclose(fh);
+
+	if (count < 2) {
+		printf("Need at least two motion samples in %s\n", path);
+		free(rows);
+		return -1;
+	}
+
+	mpu_sim_exit();
+
+	motion = rows;
+	motion_rows = count;
+
+	return 0;
+}
+
+static double gaussian(simdev_t *dev)
+{
+	double u1, u2;
+
+	// xorshift32, the device state keeps runs reproducible
+	dev->rng ^= dev->rng << 13;
+	dev->rng ^= dev->rng >> 17;
+	dev->rng ^= dev->rng << 5;
+	u1 = (dev->rng + 1.0) / 4294967297.0;
+
+	dev->rng ^= dev->rng << 13;
+	dev->rng ^= dev->rng >> 17;
+	dev->rng ^= dev->rng << 5;
+	u2 = dev->rng / 4294967296.0;
+
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+// start frame vector into the chip frame
+static void to_chip(const double *q, const float *v, double *out)
+{
+	double w = q[0], x = -q[1], y = -q[2], z = -q[3];
+
+	out[0] = (1 - 2 * (y * y + z * z)) * v[0] + 2 * (x * y - w * z) * v[1] + 2 * (x * z + w * y) * v[2];
+	out[1] = 2 * (x * y + w * z) * v[0] + (1 - 2 * (x * x + z * z)) * v[1] + 2 * (y * z - w * x) * v[2];
+	out[2] = 2 * (x * z - w * y) * v[0] + 2 * (y * z + w * x) * v[1] + (1 - 2 * (x * x + y * y)) * v[2];
+}
+
+static void integrate(double *q, const double *rate, double dt)
+{
+	double wx, wy, wz, dq[4], norm;
+	int i;
+
+	wx = rate[0] * DEG_TO_RAD;
+	wy = rate[1] * DEG_TO_RAD;
+	wz = rate[2] * DEG_TO_RAD;
+
+	dq[0] = 0.5 * (-q[1] * wx - q[2] * wy - q[3] * wz);
+	dq[1] = 0.5 * (q[0] * wx + q[2] * wz - q[3] * wy);
+	dq[2] = 0.5 * (q[0] * wy - q[1] * wz + q[3] * wx);
+	dq[3] = 0.5 * (q[0] * wz + q[1] * wy - q[2] * wx);
+
+	norm = 0;
+
+	for (i = 0; i < 4; i++) {
+		q[i] += dq[i] * dt;
+		norm += q[i] * q[i];
+	}
+
+	norm = sqrt(norm);
+
+	for (i = 0; i < 4; i++)
+		q[i] /= norm;
+}
+
+static const motionrow_t *recorded_motion(simdev_t *dev)
+{
+	double span, t;
+
+	span = motion[motion_rows - 1].t - motion[0].t;
+	t = motion[0].t + fmod(dev->t, span);
+
+	if (t < motion[dev->motionIndex].t)
+		dev->motionIndex = 0;
+
+	while (dev->motionIndex < motion_rows - 1 && motion[dev->motionIndex + 1].t <= t)
+		dev->motionIndex++;
+
+	return &motion[dev->motionIndex];
+}
+
+static double die_temperature(const simdev_t *dev)
+{
+	return config.temperature + config.temperatureRate * dev->t;
+}
+
+static void update_motion(simdev_t *dev, double dt)
+{
+	const motionrow_t *row;
+	double rate[3], phase;
+	float gravity[3] = { 0.0f, 0.0f, 1.0f };
+	int i, still;
+
+	if (motion) {
+		row = recorded_motion(dev);
+
+		for (i = 0; i < 3; i++) {
+			rate[i] = row->gyro[i];
+			dev->accel[i] = row->accel[i];
+			dev->gyro[i] = row->gyro[i];
+		}
+
+		integrate(dev->q, rate, dt);
+
+		if (row->hasMag) {
+			for (i = 0; i < 3; i++)
+				dev->mag[i] = row->mag[i];
+		}
+		else {
+			to_chip(dev->q, config.magField, dev->mag);
+		}
+	}
+	else {
+		phase = 2.0 * M_PI * config.wobbleHz * dev->t;
+		still = dev->t < config.restSeconds;
+
+		for (i = 0; i < 3; i++)
+			rate[i] = still ? 0.0 : config.gyroRate[i];
+
+		if (!still) {
+			rate[0] += config.wobbleAmp * sin(phase);
+			rate[1] += config.wobbleAmp * cos(phase);
+		}
+
+		integrate(dev->q, rate, dt);
+
+		if (rate[0] == 0.0 && rate[1] == 0.0 && rate[2] == 0.0)
+			dev->stillMs += dt * 1000.0;
+		else
+			dev->stillMs = 0.0;
+
+		to_chip(dev->q, gravity, dev->accel);
+
+		if (!still)
+			dev->accel[2] += config.vibrationAmp * sin(2.0 * M_PI * config.vibrationHz * dev->t);
+
+		to_chip(dev->q, config.magField, dev->mag);
+
+		for (i = 0; i < 3; i++) {
+			dev->gyro[i] = rate[i] + config.gyroBias[i] + config.gyroTempco[i] * (die_temperature(dev) - 25.0)
+				+ config.gyroNoise * gaussian(dev);
+			dev->accel[i] += config.accelNoise * gaussian(dev);
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+		dev->mag[i] += config.magNoise * gaussian(dev);
+
+	dev->t += dt;
+}
+
+static short saturate(double v, int limit)
+{
+	long n = lround(v);
+
+	if (n > limit)
+		return limit;
+
+	if (n < -limit - 1)
+		return -limit - 1;
+
+	return (short)n;
+}
+
+static void put_short_be(unsigned char *p, short v)
+{
+	p[0] = (unsigned char)((v >> 8) & 0xFF);
+	p[1] = (unsigned char)(v & 0xFF);
+}
+
+static void put_short_le(unsigned char *p, short v)
+{
+	p[0] = (unsigned char)(v & 0xFF);
+	p[1] = (unsigned char)((v >> 8) & 0xFF);
+}
+
+static void hmc_measure(simdev_t *dev, uint64_t now)
+{
+	double counts, bias;
+	int gain, sign, i;
+	short v;
+	// register order is X, Z, Y
+	static const int slot[3] = { 0, 4, 2 };
+
+	gain = dev->hmc[HMC_CONFB] >> 5;
+	sign = 0;
+
+	if ((dev->hmc[HMC_CONFA] & 0x03) == 1)
+		sign = 1;
+	else if ((dev->hmc[HMC_CONFA] & 0x03) == 2)
+		sign = -1;
+
+	for (i = 0; i < 3; i++) {
+		bias = sign * hmc_bias[i] * config.magSelfTest;
+		counts = (dev->mag[i] + bias) * hmc_counts_per_gauss[gain];
+
+		if (counts < -2048 || counts > 2047)
+			v = -4096;
+		else
+			v = saturate(counts, 2047);
+
+		put_short_be(dev->hmc + HMC_XM + slot[i], v);
+	}
+
+	dev->hmc[HMC_STATUS] |= 0x01;
+	dev->hmcWritten = now;
+}
+
+static void akm_measure(simdev_t *dev)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		put_short_le(dev->akm + AKM_HXL + 2 * i, saturate(dev->mag[i] / AKM_GAUSS_PER_LSB, 4095));
+
+	dev->akm[AKM_ST1] |= 0x01;
+}
+
+static int aux_write(simdev_t *dev, unsigned char addr, unsigned char reg,
+	unsigned char length, unsigned char const *data)
+{
+	int i;
+
+	if (addr == MPU_SIM_HMC_ADDR) {
+		for (i = 0; i < length; i++, reg++) {
+			if (reg >= HMC_XM)
+				continue;
+
+			dev->hmc[reg] = data[i];
+
+			if (reg == HMC_MODE && (data[i] & 0x03) == 1) {
+				hmc_measure(dev, now_ns());
+				dev->hmc[HMC_MODE] = (data[i] & 0x80) | 0x03;
+			}
+		}
+
+		return 0;
+	}
+
+	if (addr == MPU_SIM_AKM_ADDR) {
+		for (i = 0; i < length; i++, reg++) {
+			if (reg != AKM_CNTL) {
+				// fuse ROM and data are read only
+				if (reg > AKM_ST2 && reg < AKM_ASAX)
+					dev->akm[reg] = data[i];
+
+				continue;
+			}
+
+			dev->akm[AKM_CNTL] = data[i] & 0x0F;
+
+			if (dev->akm[AKM_CNTL] == 0x01) {
+				akm_measure(dev);
+				dev->akm[AKM_CNTL] = 0;
+			}
+		}
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static int aux_read(simdev_t *dev, unsigned char addr, unsigned char reg,
+	unsigned char length, unsigned char *data)
+{
+	int i;
+
+	if (addr == MPU_SIM_HMC_ADDR) {
+		for (i = 0; i < length; i++) {
+			if (reg >= HMC_NUM_REGS)
+				reg = 0;
+
+			data[i] = dev->hmc[reg];
+
+			if (reg == HMC_STATUS && now_ns() < dev->hmcWritten + HMC_RDY_LOW_NS)
+				data[i] &= ~0x01;
+
+			reg++;
+		}
+
+		return 0;
+	}
+
+	if (addr == MPU_SIM_AKM_ADDR) {
+		for (i = 0; i < length; i++, reg++) {
+			data[i] = reg < AKM_NUM_REGS ? dev->akm[reg] : 0;
+
+			if (reg == AKM_ST2)
+				dev->akm[AKM_ST1] &= ~0x01;
+		}
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static void run_aux_master(simdev_t *dev)
+{
+	unsigned char addr, reg, ctrl, *ext;
+	int slave, len, used;
+
+	used = 0;
+
+	// slave 0 reads come first so a slave 1 trigger is picked up next sample
+	for (slave = 0; slave < 2; slave++) {
+		addr = dev->regs[REG_I2C_SLV0_ADDR + 3 * slave];
+		reg = dev->regs[REG_I2C_SLV0_ADDR + 3 * slave + 1];
+		ctrl = dev->regs[REG_I2C_SLV0_ADDR + 3 * slave + 2];
+		len = ctrl & 0x0F;
+
+		if (!(ctrl & 0x80) || !len)
+			continue;
+
+		if (addr & 0x80) {
+			if (used + len > EXT_SENS_DATA_LEN)
+				continue;
+
+			ext = dev->regs + REG_EXT_SENS_DATA + used;
+
+			if (aux_read(dev, addr & 0x7F, reg, len, ext))
+				memset(ext, 0, len);
+
+			used += len;
+		}
+		else {
+			aux_write(dev, addr, reg, 1, dev->regs + REG_I2C_SLV0_DO + slave);
+		}
+	}
+}
+
+static void fifo_clear(simdev_t *dev)
+{
+	dev->fifoHead = 0;
+	dev->fifoCount = 0;
+}
+
+static void fifo_push(simdev_t *dev, const unsigned char *data, int length)
+{
+	int drop, i;
+
+	drop = dev->fifoCount + length - MPU_SIM_FIFO_SIZE;
+
+	// the oldest bytes are overwritten, which misaligns the reader
+	if (drop > 0) {
+		dev->fifoHead = (dev->fifoHead + drop) % MPU_SIM_FIFO_SIZE;
+		dev->fifoCount -= drop;
+		dev->regs[REG_INT_STATUS] |= INT_FIFO_OFLOW;
+		dev->stats.fifoOverflows++;
+		dev->stats.bytesDropped += drop;
+	}
+
+	for (i = 0; i < length; i++)
+		dev->fifo[(dev->fifoHead + dev->fifoCount + i) % MPU_SIM_FIFO_SIZE] = data[i];
+
+	dev->fifoCount += length;
+	dev->stats.fifoPackets++;
+}
+
+static unsigned char fifo_pop(simdev_t *dev)
+{
+	unsigned char c;
+
+	if (!dev->fifoCount)
+		return 0;
+
+	c = dev->fifo[dev->fifoHead];
+	dev->fifoHead = (dev->fifoHead + 1) % MPU_SIM_FIFO_SIZE;
+	dev->fifoCount--;
+
+	return c;
+}
+
+static void push_dmp_packet(simdev_t *dev)
+{
+	unsigned char packet[32];
+	const unsigned char *mem = dev->mem;
+	long q30;
+	int len, i;
+
+	len = 0;
+
+	if (mem[DMP_CFG_LP_QUAT] == 0xC0 || mem[DMP_CFG_8] == 0x20) {
+		for (i = 0; i < 4; i++) {
+			q30 = lround(dev->q[i] * 1073741824.0);
+			packet[len++] = (unsigned char)((q30 >> 24) & 0xFF);
+			packet[len++] = (unsigned char)((q30 >> 16) & 0xFF);
+			packet[len++] = (unsigned char)((q30 >> 8) & 0xFF);
+			packet[len++] = (unsigned char)(q30 & 0xFF);
+		}
+	}
+
+	if (mem[DMP_CFG_15 + 1] == 0xC0) {
+		memcpy(packet + len, dev->regs + REG_ACCEL_XOUT_H, 6);
+		len += 6;
+	}
+
+	if (mem[DMP_CFG_15 + 4] == 0xC4) {
+		memcpy(packet + len, dev->regs + REG_ACCEL_XOUT_H + 8, 6);
+		len += 6;
+	}
+
+	if (mem[DMP_CFG_20] == 0xF8 || mem[DMP_CFG_ANDROID_ORIENT_INT] == 0xD9) {
+		memset(packet + len, 0, 4);
+		len += 4;
+	}
+
+	if (!len)
+		return;
+
+	fifo_push(dev, packet, len);
+
+	dev->regs[REG_DMP_INT_STATUS] |= 0x01;
+	dev->regs[REG_INT_STATUS] |= INT_DMP;
+}
+
+static void push_raw_packet(simdev_t *dev)
+{
+	unsigned char packet[14], fifo_en;
+	int len, i;
+
+	fifo_en = dev->regs[REG_FIFO_EN];
+	len = 0;
+
+	if (fifo_en & FIFO_EN_ACCEL) {
+		memcpy(packet, dev->regs + REG_ACCEL_XOUT_H, 6);
+		len += 6;
+	}
+
+	if (fifo_en & FIFO_EN_TEMP) {
+		memcpy(packet + len, dev->regs + REG_ACCEL_XOUT_H + 6, 2);
+		len += 2;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (fifo_en & (FIFO_EN_XG >> i)) {
+			memcpy(packet + len, dev->regs + REG_ACCEL_XOUT_H + 8 + 2 * i, 2);
+			len += 2;
+		}
+	}
+
+	if (len)
+		fifo_push(dev, packet, len);
+}
+
+// Accel departing from the held reference for MOT_DUR ms raises the
+// motion interrupt, as in wake on motion.
+static void detect_motion(simdev_t *dev, double ms)
+{
+	double thresh = dev->regs[REG_MOT_THR] * MOT_THR_G;
+	int i, over = 0;
+
+	for (i = 0; i < 3; i++) {
+		if (fabs(dev->accel[i] - dev->motionRef[i]) > thresh)
+			over = 1;
+	}
+
+	dev->motionMs = over ? dev->motionMs + ms : 0.0;
+
+	if (over && dev->motionMs >= dev->regs[REG_MOT_DUR])
+		dev->regs[REG_INT_STATUS] |= INT_MOT;
+}
+
+// GYRO_CAL, enabled by the driver writing its code to CFG_MOTION_BIAS,
+// puts the DMP's estimate where dmp_get_gyro_bias reads it after every
+// DMP_GYRO_CAL_MS of stillness. The estimate is the true bias, in the
+// chip frame as the driver's orientation is the identity.
+static void dmp_gyro_cal(simdev_t *dev)
+{
+	static const unsigned char enable[9] = { 0xb8, 0xaa, 0xb3, 0x8d, 0xb4, 0x98, 0x0d, 0x35, 0x5d };
+	unsigned char *out;
+	double bias;
+	long lsb;
+	int i;
+
+	if (motion || dev->stillMs < DMP_GYRO_CAL_MS || memcmp(dev->mem + DMP_CFG_MOTION_BIAS, enable, 9))
+		return;
+
+	for (i = 0; i < 3; i++) {
+		bias = config.gyroBias[i] + config.gyroTempco[i] * (die_temperature(dev) - 25.0);
+		lsb = lround(bias * DMP_GYRO_BIAS_LSB);
+		out = dev->mem + DMP_D_EXT_GYRO_BIAS + 4 * i;
+		out[0] = (unsigned char)((lsb >> 24) & 0xFF);
+		out[1] = (unsigned char)((lsb >> 16) & 0xFF);
+		out[2] = (unsigned char)((lsb >> 8) & 0xFF);
+		out[3] = (unsigned char)(lsb & 0xFF);
+	}
+
+	dev->stillMs = 0.0;
+}
+
+static void sample(simdev_t *dev, double dt)
+{
+	double accel_lsb, gyro_lsb;
+	unsigned char *out;
+	unsigned int div;
+	uint64_t now;
+	int i;
+
+	update_motion(dev, dt);
+
+	accel_lsb = 16384 >> ((dev->regs[REG_ACCEL_CONFIG] >> 3) & 0x03);
+	gyro_lsb = 131.0 / (1 << ((dev->regs[REG_GYRO_CONFIG] >> 3) & 0x03));
+
+	out = dev->regs + REG_ACCEL_XOUT_H;
+
+	for (i = 0; i < 3; i++) {
+		put_short_be(out + 2 * i, saturate(dev->accel[i] * accel_lsb, 32767));
+		put_short_be(out + 8 + 2 * i, saturate(dev->gyro[i] * gyro_lsb, 32767));
+	}
+
+	// 340 LSB per C, -521 at 35 C
+	put_short_be(out + 6, saturate((die_temperature(dev) - 35.0) * 340.0 - 521.0, 32767));
+
+	now = dev->nextSample;
+
+	if ((dev->hmc[HMC_MODE] & 0x03) == 0 && now >= dev->hmcNext) {
+		hmc_measure(dev, now);
+		dev->hmcNext = now + (uint64_t)(1e9 / hmc_rate[(dev->hmc[HMC_CONFA] >> 2) & 0x07]);
+	}
+
+	if (dev->regs[REG_USER_CTRL] & USER_I2C_MST_EN)
+		run_aux_master(dev);
+
+	dev->regs[REG_INT_STATUS] |= INT_DATA_RDY;
+	dev->stats.samples++;
+
+	if (dev->regs[REG_INT_ENABLE] & INT_MOT)
+		detect_motion(dev, dt * 1000.0);
+
+	if (!(dev->regs[REG_USER_CTRL] & USER_FIFO_EN))
+		return;
+
+	if (dev->regs[REG_USER_CTRL] & USER_DMP_EN) {
+		dmp_gyro_cal(dev);
+
+		div = (dev->mem[DMP_D_0_22] << 8) | dev->mem[DMP_D_0_22 + 1];
+
+		if (dev->dmpTick++ % (div + 1) == 0)
+			push_dmp_packet(dev);
+	}
+	else {
+		push_raw_packet(dev);
+	}
+}
+
+static uint64_t sample_period_ns(simdev_t *dev)
+{
+	int dlpf = dev->regs[REG_CONFIG] & 0x07;
+	uint64_t base = (dlpf == 0 || dlpf == 7) ? 125000 : 1000000;
+
+	return base * (1 + dev->regs[REG_SMPLRT_DIV]);
+}
+
+// Catches the device up with the clock. A backlog of more than a second
+// is skipped, the FIFO would have wrapped long before anyway.
+static void sync_device(simdev_t *dev)
+{
+	uint64_t now, period;
+
+	now = now_ns();
+	period = sample_period_ns(dev);
+
+	if (dev->regs[REG_PWR_MGMT_1] & PWR_SLEEP) {
+		dev->nextSample = now + period;
+		return;
+	}
+
+	if (now > dev->nextSample + 1000000000ULL) {
+		dev->t += (now - dev->nextSample - 1000000000ULL) / 1e9;
+		dev->nextSample = now - 1000000000ULL;
+	}
+
+	while (dev->nextSample <= now) {
+		sample(dev, period / 1e9);
+		dev->nextSample += period;
+	}
+}
+
+static void reset_device(simdev_t *dev)
+{
+	memset(dev->regs, 0, NUM_REGS);
+	memset(dev->mem, 0, MPU_SIM_MEM_SIZE);
+	memcpy(dev->regs + REG_ACCEL_OFFS, default_accel_offs, 6);
+	dev->regs[REG_PWR_MGMT_1] = PWR_SLEEP;
+	dev->regs[REG_WHO_AM_I] = MPU_SIM_ADDR;
+	dev->memAddr = 0;
+	dev->dmpTick = 0;
+
+	fifo_clear(dev);
+}
+
+static simdev_t *get_device(int bus)
+{
+	simdev_t *dev;
+
+	if (bus < 0 || bus >= NUM_BUSES)
+		return NULL;
+
+	dev = &devices[bus];
+
+	if (!dev->up) {
+		memset(dev, 0, sizeof(simdev_t));
+		reset_device(dev);
+
+		dev->hmc[HMC_CONFA] = 0x10;
+		dev->hmc[HMC_CONFB] = 0x20;
+		dev->hmc[HMC_MODE] = 0x01;
+		dev->hmc[10] = 'H';
+		dev->hmc[11] = '4';
+		dev->hmc[12] = '3';
+
+		dev->akm[AKM_WIA] = 0x48;
+		dev->akm[AKM_ASAX] = 0x80;
+		dev->akm[AKM_ASAX + 1] = 0x80;
+		dev->akm[AKM_ASAX + 2] = 0x80;
+
+		dev->q[0] = 1.0;
+		dev->rng = config.seed * 2654435761U + bus + 1;
+
+		if (!dev->rng)
+			dev->rng = 1;
+
+		dev->nextSample = now_ns();
+		dev->up = 1;
+	}
+
+	return dev;
+}
+
+static void update_mem_addr(simdev_t *dev)
+{
+	dev->memAddr = ((dev->regs[REG_BANK_SEL] & 0x0F) << 8) | dev->regs[REG_MEM_START_ADDR];
+}
+
+static void reg_write(simdev_t *dev, unsigned char reg, unsigned char val)
+{
+	switch (reg) {
+	case REG_PWR_MGMT_1:
+		if (val & PWR_RESET)
+			reset_device(dev);
+		else
+			dev->regs[reg] = val;
+
+		break;
+
+	case REG_USER_CTRL:
+		if (val & USER_FIFO_RST)
+			fifo_clear(dev);
+
+		if (val & USER_DMP_RST)
+			dev->dmpTick = 0;
+
+		dev->regs[reg] = val & ~USER_SELF_CLEARING;
+		break;
+
+	case REG_ACCEL_CONFIG:
+		if ((val & 0x07) == ACCEL_HPF_HOLD)
+			memcpy(dev->motionRef, dev->accel, sizeof(dev->motionRef));
+
+		dev->motionMs = 0.0;
+		dev->regs[reg] = val;
+		break;
+
+	case REG_BANK_SEL:
+	case REG_MEM_START_ADDR:
+		dev->regs[reg] = val;
+		update_mem_addr(dev);
+		break;
+
+	case REG_MEM_R_W:
+		dev->mem[dev->memAddr] = val;
+		dev->memAddr = (dev->memAddr + 1) % MPU_SIM_MEM_SIZE;
+		break;
+
+	case REG_FIFO_R_W:
+		fifo_push(dev, &val, 1);
+		break;
+
+	case REG_DMP_INT_STATUS:
+	case REG_INT_STATUS:
+	case REG_FIFO_COUNT_H:
+	case REG_FIFO_COUNT_L:
+	case REG_WHO_AM_I:
+		break;
+
+	default:
+		if (reg >= REG_ACCEL_XOUT_H && reg < REG_I2C_SLV0_DO)
+			break;
+
+		dev->regs[reg] = val;
+		break;
+	}
+}
+
+static unsigned char reg_read(simdev_t *dev, unsigned char reg)
+{
+	unsigned char val;
+
+	switch (reg) {
+	case REG_FIFO_COUNT_H:
+		return (unsigned char)(dev->fifoCount >> 8);
+
+	case REG_FIFO_COUNT_L:
+		return (unsigned char)(dev->fifoCount & 0xFF);
+
+	case REG_FIFO_R_W:
+		return fifo_pop(dev);
+
+	case REG_MEM_R_W:
+		val = dev->mem[dev->memAddr];
+		dev->memAddr = (dev->memAddr + 1) % MPU_SIM_MEM_SIZE;
+		return val;
+
+	case REG_DMP_INT_STATUS:
+	case REG_INT_STATUS:
+		val = dev->regs[reg];
+		dev->regs[reg] = 0;
+		return val;
+
+	default:
+		return dev->regs[reg];
+	}
+}
+
+// FIFO and memory reads stay on their register, the rest auto-increment
+static unsigned char next_reg(unsigned char reg)
+{
+	if (reg == REG_FIFO_R_W || reg == REG_MEM_R_W)
+		return reg;
+
+	return (reg + 1) % NUM_REGS;
+}
+
+static int bypass_on(simdev_t *dev)
+{
+	return (dev->regs[REG_INT_PIN_CFG] & PIN_BYPASS_EN)
+		&& !(dev->regs[REG_USER_CTRL] & USER_I2C_MST_EN);
+}
+
+// address, register and data bytes at 9 bits each
+static void charge_bus(int bytes)
+{
+	if (!config.realtime && config.busKHz > 0)
+		virtual_ns += (uint64_t)bytes * 9 * 1000000 / config.busKHz;
+}
+
+int mpu_sim_write(int bus, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned char length, unsigned char const *data)
+{
+	simdev_t *dev;
+	int i;
+
+	dev = get_device(bus);
+
+	if (!dev)
+		return -1;
+
+	charge_bus(length + 2);
+	sync_device(dev);
+
+	dev->stats.writes++;
+	dev->stats.bytesWritten += length;
+
+	if (slave_addr == MPU_SIM_ADDR) {
+		reg_addr %= NUM_REGS;
+
+		for (i = 0; i < length; i++) {
+			reg_write(dev, reg_addr, data[i]);
+			reg_addr = next_reg(reg_addr);
+		}
+
+		return 0;
+	}
+
+	if (bypass_on(dev) && !aux_write(dev, slave_addr, reg_addr, length, data))
+		return 0;
+
+	dev->stats.nacks++;
+
+	return -1;
+}
+
+int mpu_sim_read(int bus, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned char length, unsigned char *data)
+{
+	simdev_t *dev;
+	int i;
+
+	dev = get_device(bus);
+
+	if (!dev)
+		return -1;
+
+	charge_bus(length + 3);
+	sync_device(dev);
+
+	dev->stats.reads++;
+	dev->stats.bytesRead += length;
+
+	if (slave_addr == MPU_SIM_ADDR) {
+		reg_addr %= NUM_REGS;
+
+		for (i = 0; i < length; i++) {
+			data[i] = reg_read(dev, reg_addr);
+			reg_addr = next_reg(reg_addr);
+		}
+
+		return 0;
+	}
+
+	if (bypass_on(dev) && !aux_read(dev, slave_addr, reg_addr, length, data))
+		return 0;
+
+	dev->stats.nacks++;
+
+	return -1;
+}
+
+int mpu_sim_get_stats(int bus, mpu_sim_stats_t *stats)
+{
+	if (bus < 0 || bus >= NUM_BUSES || !stats)
+		return -1;
+
+	*stats = devices[bus].stats;
+
+	return 0;
+}
+
+static int sim_delay_ms(unsigned long num_ms)
+{
+	virtual_ns += (uint64_t)num_ms * 1000000;
+
+	return 0;
+}
+
+static int sim_get_ms(unsigned long *count)
+{
+	*count = (unsigned long)(virtual_ns / 1000000);
+
+	return 0;
+}
+
+// The realtime flavour keeps the system delay and clock. Its devices share
+// nothing but the configuration, so each bus can have its own thread. The
+// virtual clock is shared by all of them.
+static const i2c_transport_t realtime_transport = {
+	"sim", mpu_sim_write, mpu_sim_read, NULL, NULL, NULL, 1
+};
+
+static const i2c_transport_t virtual_transport = {
+	"sim-virtual", mpu_sim_write, mpu_sim_read, sim_delay_ms, sim_get_ms, NULL, 0
+};
+
+const i2c_transport_t *mpu_sim_transport()
+{
+	return config.realtime ? &realtime_transport : &virtual_transport;
+}
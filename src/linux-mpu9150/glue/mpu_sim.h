@@ -0,0 +1,99 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef MPU_SIM_H
+#define MPU_SIM_H
+
+#include <stdint.h>
+#include "linux_glue.h"
+
+// Register level model of an MPU6050 with its FIFO, DMP memory and
+// interrupt status, plus the compasses the drivers know about on the
+// aux bus (HMC5883L at 0x1E, AK8975 at 0x0C) reachable in bypass mode or
+// through slave 0/1 of the I2C master. There is one device at 0x68 on
+// every bus. The DMP itself isn't emulated: once enabled it emits packets
+// laid out as the loaded configuration asks, holding the true attitude.
+// With its gyro calibration on it writes the true gyro bias to the
+// external bias registers after 8 s still, as the real one does once it
+// has estimated it.
+//
+// Motion comes from a synthetic profile or from a recording. In realtime
+// mode the device clock follows the wall clock so a node can run on it,
+// otherwise only delays and bus traffic advance it, which makes runs
+// repeatable for a given seed.
+
+#define MPU_SIM_ADDR 0x68
+#define MPU_SIM_HMC_ADDR 0x1E
+#define MPU_SIM_AKM_ADDR 0x0C
+
+#define MPU_SIM_FIFO_SIZE 1024
+#define MPU_SIM_MEM_SIZE 4096
+
+typedef struct {
+	// synthetic motion, ignored when a recording is loaded
+	float gyroRate[3];		// constant body rate, deg/s
+	float wobbleAmp;		// sine on the x and y rates, deg/s
+	float wobbleHz;
+	float vibrationAmp;		// sine on the accel z axis, g
+	float vibrationHz;
+	float restSeconds;		// no motion before this
+
+	// sensor errors
+	float gyroBias[3];		// deg/s, at 25 C
+	float gyroTempco[3];		// deg/s per C
+	float gyroNoise;		// deg/s rms
+	float accelNoise;		// g rms
+	float magNoise;			// gauss rms
+
+	// die temperature, C, and its drift, C/s
+	float temperature;
+	float temperatureRate;
+
+	// local field in the start frame, gauss
+	float magField[3];
+	// HMC5883L self test field against the specified one, 1 for a good part
+	float magSelfTest;
+
+	unsigned int seed;
+	int realtime;
+
+	// bus clock used to charge transfers to the virtual clock, 0 for free
+	int busKHz;
+} mpu_sim_config_t;
+
+typedef struct {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long bytesRead;
+	unsigned long bytesWritten;
+	unsigned long nacks;
+	unsigned long samples;
+	unsigned long fifoPackets;
+	unsigned long fifoOverflows;
+	unsigned long bytesDropped;
+} mpu_sim_stats_t;
+
+void mpu_sim_default_config(mpu_sim_config_t *config);
+int mpu_sim_init(const mpu_sim_config_t *config);
+int mpu_sim_load_motion(const char *path);
+void mpu_sim_exit();
+
+const i2c_transport_t *mpu_sim_transport();
+
+// bus level access, also what the transport uses
+int mpu_sim_write(int bus, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned char length, unsigned char const *data);
+int mpu_sim_read(int bus, unsigned char slave_addr, unsigned char reg_addr,
+	unsigned char length, unsigned char *data);
+
+// device clock in microseconds
+uint64_t mpu_sim_time_us();
+void mpu_sim_advance_us(uint64_t us);
+
+int mpu_sim_get_stats(int bus, mpu_sim_stats_t *stats);
+
+#endif /* MPU_SIM_H */
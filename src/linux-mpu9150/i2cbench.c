@@ -0,0 +1,202 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "mpu9150.h"
+#include "linux_glue.h"
+#include "i2cfake.h"
+#include "i2ctrace.h"
+#include "local_defaults.h"
+
+// Reads a fixed number of samples through the normal /dev/i2c path and
+// reports what each one cost. Meant to run under the i2cfake.so shim,
+// which also supplies the syscall counters, but works on hardware too.
+
+void usage(char *argv_0)
+{
+	printf("\nUsage: %s [options]\n", argv_0);
+	printf("  -b <i2c-bus>          The I2C bus number where the IMU is. The default is 1 to use /dev/i2c-1.\n");
+	printf("  -s <sample-rate>      The IMU sample rate in Hz. Default 10, up to 100 or 1000 with -r.\n");
+	printf("  -n <samples>          Number of samples to read. Default 500.\n");
+	printf("  -r                    Raw mode, FIFO of gyro and accel fused on the host\n");
+	printf("  -t                    Count the transfers per register after init, see glue/i2ctrace.h\n");
+	printf("  -h                    Show this help\n");
+
+	printf("\nExample: LD_PRELOAD=./i2cfake.so I2CFAKE_SCRIPT=faults.txt %s -s100 -n2000\n\n", argv_0);
+
+	exit(1);
+}
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, raw, trace, samples, polls, failed, max_rate;
+	int i2c_bus = DEFAULT_I2C_BUS;
+	int sample_rate = DEFAULT_SAMPLE_RATE_HZ;
+	int count = 500;
+	int (*get_stats)(i2cfake_stats_t *);
+	i2cfake_stats_t before, after;
+	uint64_t start, t, busy, worst, elapsed;
+	unsigned long loop_delay, transfers;
+	i2ctrace_t *snapshot;
+	mpudata_t mpu;
+
+	raw = 0;
+	trace = 0;
+
+	while ((opt = getopt(argc, argv, "b:s:n:rth")) != -1) {
+		switch (opt) {
+		case 'b':
+			i2c_bus = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL || i2c_bus < MIN_I2C_BUS || i2c_bus > MAX_I2C_BUS)
+				usage(argv[0]);
+
+			break;
+
+		case 's':
+			sample_rate = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL)
+				usage(argv[0]);
+
+			break;
+
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL || count < 1)
+				usage(argv[0]);
+
+			break;
+
+		case 'r':
+			raw = 1;
+			break;
+
+		case 't':
+			trace = 1;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	max_rate = raw ? MAX_RAW_SAMPLE_RATE : MAX_SAMPLE_RATE;
+
+	if (sample_rate < MIN_SAMPLE_RATE || sample_rate > max_rate)
+		usage(argv[0]);
+
+	get_stats = (int (*)(i2cfake_stats_t *))dlsym(RTLD_DEFAULT, "i2cfake_get_stats");
+
+	if (!get_stats)
+		printf("Not running under i2cfake.so, no syscall counts\n");
+
+	if (raw ? mpu9150_init_raw(i2c_bus, sample_rate, 0, 0) : mpu9150_init(i2c_bus, sample_rate, 0))
+		exit(1);
+
+	memset(&mpu, 0, sizeof(mpudata_t));
+	memset(&before, 0, sizeof(before));
+	memset(&after, 0, sizeof(after));
+
+	if (get_stats)
+		get_stats(&before);
+
+	i2ctrace_enable(trace);
+
+	// poll twice per sample, as a reader that doesn't want to lag would
+	loop_delay = 500 / sample_rate;
+
+	if (loop_delay < 1)
+		loop_delay = 1;
+
+	samples = 0;
+	polls = 0;
+	failed = 0;
+	busy = 0;
+	worst = 0;
+	start = mono_ns();
+
+	while (samples < count) {
+		t = mono_ns();
+
+		if (mpu9150_read(&mpu) == 0) {
+			samples++;
+			t = mono_ns() - t;
+
+			if (t > worst)
+				worst = t;
+		}
+		else {
+			failed++;
+			t = mono_ns() - t;
+		}
+
+		busy += t;
+		polls++;
+
+		linux_delay_ms(loop_delay);
+	}
+
+	elapsed = mono_ns() - start;
+
+	if (get_stats)
+		get_stats(&after);
+
+	i2ctrace_enable(0);
+	mpu9150_exit();
+
+	printf("\n%d samples in %.2f s, %d polls, %d without data\n",
+		samples, elapsed / 1e9, polls, failed);
+	printf("read time per sample %.1f us, worst successful read %.1f us\n",
+		busy / 1000.0 / samples, worst / 1000.0);
+
+	if (get_stats) {
+		transfers = (after.reads - before.reads) + (after.writes - before.writes);
+
+		printf("per sample: %.2f syscalls (%.2f read, %.2f write, %.2f ioctl), %.1f bytes, %.1f us in the bus\n",
+			(double)(transfers + after.ioctls - before.ioctls) / samples,
+			(double)(after.reads - before.reads) / samples,
+			(double)(after.writes - before.writes) / samples,
+			(double)(after.ioctls - before.ioctls) / samples,
+			(double)(after.bytesRead - before.bytesRead + after.bytesWritten - before.bytesWritten) / samples,
+			(after.readNs - before.readNs + after.writeNs - before.writeNs) / 1000.0 / samples);
+	}
+
+	if (trace) {
+		snapshot = (i2ctrace_t *)malloc(sizeof(i2ctrace_t));
+
+		if (snapshot) {
+			i2ctrace_snapshot(snapshot);
+			i2ctrace_print(stdout, snapshot, 10);
+			free(snapshot);
+		}
+	}
+
+	return 0;
+}
@@ -31,6 +31,8 @@
 
 #include "mpu9150.h"
 #include "linux_glue.h"
+#include "mpu_sim.h"
+#include "rawlog.h"
 #include "local_defaults.h"
 
 int set_cal(int mag, char *cal_file);
@@ -56,6 +58,8 @@ void usage(char *argv_0)
 	printf("                           The default is 4.\n");
 	printf("  -a <accelcal file>    Path to accelerometer calibration file. Default is ./accelcal.txt\n");
 	printf("  -m <magcal file>      Path to mag calibration file. Default is ./magcal.txt\n");
+	printf("  -l <log prefix>       Record raw samples to <log prefix>-NNNN.raw for imureplay\n");
+	printf("  -S                    Run against the simulated IMU instead of /dev/i2c-<i2c-bus>\n");
 	printf("  -v                    Verbose messages\n");
 	printf("  -h                    Show this help\n");
 
@@ -71,10 +75,14 @@ int main(int argc, char **argv)
 	int sample_rate = DEFAULT_SAMPLE_RATE_HZ;
 	int yaw_mix_factor = DEFAULT_YAW_MIX_FACTOR;
 	int verbose = 0;
+	int simulate = 0;
+	mpu_sim_config_t sim_config;
 	char *mag_cal_file = NULL;
 	char *accel_cal_file = NULL;
+	char *log_prefix = NULL;
+	rawlog_t log;
 
-	while ((opt = getopt(argc, argv, "b:s:y:a:m:vh")) != -1) {
+	while ((opt = getopt(argc, argv, "b:s:y:a:m:l:Svh")) != -1) {
 		switch (opt) {
 		case 'b':
 			i2c_bus = strtoul(optarg, NULL, 0);
@@ -135,6 +143,14 @@ int main(int argc, char **argv)
 			strcpy(mag_cal_file, optarg);
 			break;
 
+		case 'l':
+			log_prefix = optarg;
+			break;
+
+		case 'S':
+			simulate = 1;
+			break;
+
 		case 'v':
 			verbose = 1;
 			break;
@@ -150,9 +166,23 @@ int main(int argc, char **argv)
 
 	mpu9150_set_debug(verbose);
 
+	if (simulate) {
+		mpu_sim_default_config(&sim_config);
+		sim_config.realtime = 1;
+		mpu_sim_init(&sim_config);
+		linux_set_transport(mpu_sim_transport());
+	}
+
 	if (mpu9150_init(i2c_bus, sample_rate, yaw_mix_factor))
 		exit(1);
 
+	if (verbose) {
+		char init_times[256];
+
+		mpu9150_format_init_times(0, init_times, sizeof(init_times));
+		printf("Up in %s\n\n", init_times);
+	}
+
 	set_cal(0, accel_cal_file);
 	set_cal(1, mag_cal_file);
 
@@ -162,8 +192,20 @@ int main(int argc, char **argv)
 	if (mag_cal_file)
 		free(mag_cal_file);
 
+	if (log_prefix) {
+		if (rawlog_open(&log, log_prefix, 0, 0, sample_rate))
+			exit(1);
+
+		mpu9150_set_rawlog(&log);
+	}
+
 	read_loop(sample_rate);
 
+	if (log_prefix) {
+		mpu9150_set_rawlog(NULL);
+		rawlog_close(&log);
+	}
+
 	mpu9150_exit();
 
 	return 0;
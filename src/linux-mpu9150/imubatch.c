@@ -0,0 +1,1037 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mpu9150.h"
+#include "hostfusion.h"
+#include "rawlog.h"
+#include "rawmap.h"
+#include "local_defaults.h"
+
+// Reruns calibration and fusion over recorded raw sample logs for every
+// combination of yaw mixing factor, fusion backend and calibration files
+// given, a parameter sweep over real motion. Each combination writes one
+// binary file per output column, so a sweep over a long recording can be
+// loaded a column at a time.
+//
+// The work is split into chunks of the recording per combination, spread
+// over threads. A chunk starts from a checkpoint of the filter state built
+// by running the records just before it. The yaw error of a wrong starting
+// state shrinks by 1 - 1/mix per sample, so the checkpoint run is as long
+// as it takes for that to get below CHECKPOINT_YAW_ERROR. A mix factor of
+// 0 never forgets its start, those combinations run as one chunk.
+//
+// Given a reference heading, and optionally roll and pitch, each
+// combination is also scored: the rms and largest errors after a settling
+// time, how long the yaw took to stay within a threshold of the reference,
+// and the CPU time per sample. The rms errors are what the node's
+// yaw_stdev and pitch_roll_stdev parameters should be.
+
+#define MAX_CONFIGS 256
+#define MAX_FILES 256
+#define MAX_THREADS 64
+#define MAX_LIST 16
+
+#define BACKEND_DMP 0
+#define BACKEND_HOST 1
+
+#define CHECKPOINT_YAW_ERROR 1.0e-6
+// the host filter's gyro bias estimate settles slower than the yaw
+#define HOST_CHECKPOINT_SECONDS 30
+#define DEFAULT_GYRO_SENS 16.4f
+
+#define DEFAULT_SETTLE_SECONDS 10.0
+#define DEFAULT_CONVERGED_DEG 2.0
+
+#define OUT_ROWS 4096
+#define NUM_COLUMNS 7
+
+static const char *column_names[NUM_COLUMNS] = { "qw", "qx", "qy", "qz", "roll", "pitch", "yaw" };
+
+typedef struct {
+	char label[64];
+	fusion_config_t fusion;
+	int backend;
+	const char *accelCalFile;
+	const char *magCalFile;
+	unsigned long checkpoint;
+	int fd[NUM_COLUMNS];
+
+	unsigned long rows;
+	unsigned long errors;
+	double jitterSum;
+	unsigned long jitterCount;
+
+	// against the reference, from the settling time on
+	double yawErrSq;
+	double maxYawErr;
+	unsigned long yawCount;
+	double rollErrSq;
+	double pitchErrSq;
+	unsigned long attitudeCount;
+	// one past the last record with the yaw outside the threshold
+	unsigned long unconverged;
+
+	uint64_t cpuNs;
+	unsigned long processed;
+} batchconfig_t;
+
+typedef struct {
+	double t;
+	float yaw;
+	float roll;
+	float pitch;
+	int attitude;
+} refpoint_t;
+
+typedef struct {
+	int config;
+	unsigned long first;
+	unsigned long count;
+} work_t;
+
+rawmap_t maps[MAX_FILES];
+unsigned long file_base[MAX_FILES + 1];
+int num_files;
+unsigned long total_records;
+
+batchconfig_t configs[MAX_CONFIGS];
+int num_configs;
+
+refpoint_t *reference;
+int num_reference;
+uint64_t start_ns;
+double settle_s = DEFAULT_SETTLE_SECONDS;
+double converged_deg = DEFAULT_CONVERGED_DEG;
+
+work_t *work;
+int num_work;
+int next_work;
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int load_cal(const char *cal_file, caldata_t *cal);
+
+void usage(char *argv_0)
+{
+	printf("\nUsage: %s [options] -o <output dir> <log file> ...\n", argv_0);
+	printf("  -y <list>             Yaw mix factors to try, e.g. 2,4,8,16. Default 4.\n");
+	printf("  -f <list>             Fusion backends, dmp (recorded quaternion) and/or host\n");
+	printf("                        (quaternion recomputed from gyro and accel). Default dmp.\n");
+	printf("  -a <list>             Accelerometer calibration files, none for no calibration\n");
+	printf("  -m <list>             Mag calibration files, none for no calibration\n");
+	printf("  -r <reference file>   Reference attitude to score against, lines of\n");
+	printf("                        <seconds from start> <yaw> [<roll> <pitch>] in degrees\n");
+	printf("  -s <seconds>          Settling time left out of the error figures. Default %.0f.\n",
+		DEFAULT_SETTLE_SECONDS);
+	printf("  -c <degrees>          Yaw error counted as converged. Default %.0f.\n",
+		DEFAULT_CONVERGED_DEG);
+	printf("  -j <threads>          Worker threads, 0 for one per CPU. Default 0.\n");
+	printf("  -o <output dir>       Where the columns of each combination go\n");
+	printf("  -h                    Show this help\n");
+
+	printf("\nLog files are one recording, in the order given. Lists are comma separated\n");
+	printf("and every combination is run.\n");
+	printf("\nExample: %s -y2,4,8,16 -f dmp,host -m none,magcal.txt -o sweep run-*.raw\n\n", argv_0);
+
+	exit(1);
+}
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int split_list(char *arg, char **items)
+{
+	int n = 0;
+	char *item;
+
+	for (item = strtok(arg, ","); item && n < MAX_LIST; item = strtok(NULL, ","))
+		items[n++] = item;
+
+	return n;
+}
+
+// Record i of the recording, *file caches where the last one was found.
+static const rawlog_record_t *record_at(unsigned long i, int *file)
+{
+	while (i >= file_base[*file + 1])
+		(*file)++;
+
+	while (i < file_base[*file])
+		(*file)--;
+
+	return maps[*file].records + (i - file_base[*file]);
+}
+
+static uint64_t thread_cpu_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// a - b in degrees, wrapped to -180..180
+static double angle_diff(double a, double b)
+{
+	double d = fmod(a - b, 360.0);
+
+	if (d >= 180.0)
+		d -= 360.0;
+	else if (d < -180.0)
+		d += 360.0;
+
+	return d;
+}
+
+static int load_reference(const char *path)
+{
+	FILE *fh;
+	char line[256];
+	refpoint_t *p;
+	int n, size;
+
+	fh = fopen(path, "r");
+
+	if (!fh) {
+		perror(path);
+		return -1;
+	}
+
+	size = 0;
+
+	while (fgets(line, sizeof(line), fh)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (num_reference == size) {
+			size = size ? 2 * size : 4096;
+			p = (refpoint_t *)realloc(reference, size * sizeof(refpoint_t));
+
+			if (!p) {
+				printf("Out of memory\n");
+				fclose(fh);
+				return -1;
+			}
+
+			reference = p;
+		}
+
+		p = &reference[num_reference];
+		n = sscanf(line, "%lf %f %f %f", &p->t, &p->yaw, &p->roll, &p->pitch);
+
+		if (n < 2 || (num_reference > 0 && p->t <= reference[num_reference - 1].t)) {
+			printf("Bad reference line: %s", line);
+			fclose(fh);
+			return -1;
+		}
+
+		p->attitude = (n == 4);
+		num_reference++;
+	}
+
+	fclose(fh);
+
+	if (num_reference < 2) {
+		printf("Reference %s needs at least two points\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Interpolates the reference at t. Returns -1 outside it, 1 if roll and
+// pitch were given too, otherwise 0.
+static int reference_at(double t, double *yaw, double *roll, double *pitch)
+{
+	const refpoint_t *a, *b;
+	double f;
+	int lo, hi, mid;
+
+	if (t < reference[0].t || t > reference[num_reference - 1].t)
+		return -1;
+
+	lo = 0;
+	hi = num_reference - 1;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+
+		if (reference[mid].t <= t)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	a = &reference[lo];
+	b = &reference[hi];
+	f = (t - a->t) / (b->t - a->t);
+
+	*yaw = a->yaw + f * angle_diff(b->yaw, a->yaw);
+
+	if (!a->attitude || !b->attitude)
+		return 0;
+
+	*roll = a->roll + f * (b->roll - a->roll);
+	*pitch = a->pitch + f * (b->pitch - a->pitch);
+
+	return 1;
+}
+
+static unsigned long checkpoint_length(const batchconfig_t *config)
+{
+	unsigned long n;
+	int mix = config->fusion.yawMixFactor;
+
+	// one record before the chunk gives the last DMP yaw
+	if (mix <= 1)
+		n = 1;
+	else
+		n = 1 + (unsigned long)ceil(log(CHECKPOINT_YAW_ERROR / M_PI) / log(1.0 - 1.0 / mix));
+
+	if (config->backend == BACKEND_HOST && n < HOST_CHECKPOINT_SECONDS * maps[0].header->sampleRate)
+		n = HOST_CHECKPOINT_SECONDS * maps[0].header->sampleRate;
+
+	return n;
+}
+
+// a summary field, empty when there was nothing to score it on
+static void write_score(FILE *fh, const char *fmt, double value, int scored)
+{
+	fputc(',', fh);
+
+	if (scored)
+		fprintf(fh, fmt, value);
+}
+
+static int write_column(int fd, const float *values, unsigned long rows, unsigned long row)
+{
+	size_t len = rows * sizeof(float);
+	off_t off = (off_t)row * sizeof(float);
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, values, len, off);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("pwrite");
+			return -1;
+		}
+
+		values += n / sizeof(float);
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+static void run_work(const work_t *w, float out[NUM_COLUMNS][OUT_ROWS])
+{
+	batchconfig_t *config = &configs[w->config];
+	const rawlog_record_t *rec;
+	unsigned long i, start, end, row, rows, jitter_count, errors;
+	unsigned long yaw_count, attitude_count, unconverged;
+	double jitter_sum, yaw, dyaw, last_dyaw;
+	double ref_yaw, ref_roll, ref_pitch, t, err;
+	double yaw_err_sq, max_yaw_err, roll_err_sq, pitch_err_sq;
+	uint64_t cpu_start, cpu_ns, write_start, write_ns;
+	int ref;
+	float gyro_sens, dt;
+	hostfusion_t host;
+	mpudata_t mpu;
+	int file, prev, c, have, ok;
+
+	start = w->first > config->checkpoint ? w->first - config->checkpoint : 0;
+	end = w->first + w->count;
+
+	memset(&mpu, 0, sizeof(mpudata_t));
+	hostfusion_init(&host, DEFAULT_HOSTFUSION_KP, DEFAULT_HOSTFUSION_KI);
+
+	file = 0;
+	prev = -1;
+	gyro_sens = DEFAULT_GYRO_SENS;
+	dt = 0.0f;
+	row = w->first;
+	rows = 0;
+	errors = 0;
+	jitter_sum = 0.0;
+	jitter_count = 0;
+	have = 0;
+	yaw = 0.0;
+	last_dyaw = 0.0;
+	yaw_count = 0;
+	attitude_count = 0;
+	unconverged = 0;
+	yaw_err_sq = 0.0;
+	max_yaw_err = 0.0;
+	roll_err_sq = 0.0;
+	pitch_err_sq = 0.0;
+	write_ns = 0;
+	cpu_start = thread_cpu_ns();
+
+	for (i = start; i < end; i++) {
+		rec = record_at(i, &file);
+
+		if (file != prev) {
+			if (maps[file].header->gyroSens > 0.0f)
+				gyro_sens = maps[file].header->gyroSens;
+
+			dt = 1.0f / maps[file].header->sampleRate;
+			prev = file;
+		}
+
+		rawlog_unpack(rec, &mpu);
+
+		if (config->backend == BACKEND_HOST)
+			hostfusion_update(&host, mpu.rawGyro, mpu.rawAccel, gyro_sens, dt, mpu.rawQuat);
+
+		ok = !mpu9150_process_config(&config->fusion, &mpu);
+
+		if (!ok) {
+			if (i >= w->first)
+				errors++;
+
+			have = 0;
+		}
+		else {
+			// second difference of the yaw, a measure of how much the mag
+			// mixing shakes it, counted from the checkpoint run on
+			dyaw = mpu.fusedEuler[VEC3_Z] - yaw;
+
+			if (dyaw > M_PI)
+				dyaw -= 2.0 * M_PI;
+			else if (dyaw < -M_PI)
+				dyaw += 2.0 * M_PI;
+
+			if (have >= 2 && i >= w->first) {
+				jitter_sum += (dyaw - last_dyaw) * (dyaw - last_dyaw);
+				jitter_count++;
+			}
+
+			yaw = mpu.fusedEuler[VEC3_Z];
+			last_dyaw = dyaw;
+
+			if (have < 2)
+				have++;
+		}
+
+		if (i < w->first)
+			continue;
+
+		if (ok && reference) {
+			t = (rec->timeNs - start_ns) / 1e9;
+			ref = reference_at(t, &ref_yaw, &ref_roll, &ref_pitch);
+
+			if (ref >= 0) {
+				err = fabs(angle_diff(mpu.fusedEuler[VEC3_Z] * RAD_TO_DEGREE, ref_yaw));
+
+				if (err > converged_deg)
+					unconverged = i + 1;
+
+				if (t >= settle_s) {
+					yaw_err_sq += err * err;
+					yaw_count++;
+
+					if (err > max_yaw_err)
+						max_yaw_err = err;
+				}
+			}
+
+			if (ref > 0 && t >= settle_s) {
+				err = angle_diff(mpu.fusedEuler[VEC3_X] * RAD_TO_DEGREE, ref_roll);
+				roll_err_sq += err * err;
+				err = angle_diff(mpu.fusedEuler[VEC3_Y] * RAD_TO_DEGREE, ref_pitch);
+				pitch_err_sq += err * err;
+				attitude_count++;
+			}
+		}
+
+		// rows of failed records are left zero
+		if (ok) {
+			for (c = 0; c < 4; c++)
+				out[c][rows] = mpu.fusedQuat[c];
+
+			for (c = 0; c < 3; c++)
+				out[4 + c][rows] = mpu.fusedEuler[c] * RAD_TO_DEGREE;
+		}
+		else {
+			for (c = 0; c < NUM_COLUMNS; c++)
+				out[c][rows] = 0.0f;
+		}
+
+		rows++;
+
+		if (rows == OUT_ROWS || i == end - 1) {
+			write_start = thread_cpu_ns();
+
+			for (c = 0; c < NUM_COLUMNS; c++)
+				write_column(config->fd[c], out[c], rows, row);
+
+			write_ns += thread_cpu_ns() - write_start;
+			row += rows;
+			rows = 0;
+		}
+	}
+
+	// the fusion cost, checkpoint runs included, output excluded
+	cpu_ns = thread_cpu_ns() - cpu_start - write_ns;
+
+	pthread_mutex_lock(&work_lock);
+	config->rows += w->count;
+	config->errors += errors;
+	config->jitterSum += jitter_sum;
+	config->jitterCount += jitter_count;
+	config->yawErrSq += yaw_err_sq;
+	config->yawCount += yaw_count;
+	config->rollErrSq += roll_err_sq;
+	config->pitchErrSq += pitch_err_sq;
+	config->attitudeCount += attitude_count;
+
+	if (max_yaw_err > config->maxYawErr)
+		config->maxYawErr = max_yaw_err;
+
+	if (unconverged > config->unconverged)
+		config->unconverged = unconverged;
+
+	config->cpuNs += cpu_ns;
+	config->processed += end - start;
+	pthread_mutex_unlock(&work_lock);
+}
+
+static void *worker(void *arg)
+{
+	float (*out)[OUT_ROWS];
+	int n;
+
+	out = (float (*)[OUT_ROWS])malloc(NUM_COLUMNS * OUT_ROWS * sizeof(float));
+
+	if (!out) {
+		printf("Out of memory\n");
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&work_lock);
+		n = next_work++;
+		pthread_mutex_unlock(&work_lock);
+
+		if (n >= num_work)
+			break;
+
+		run_work(&work[n], out);
+	}
+
+	free(out);
+
+	return NULL;
+}
+
+static int open_columns(const char *dir, batchconfig_t *config)
+{
+	char path[512];
+	FILE *fh;
+	int c;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, config->label);
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+
+	for (c = 0; c < NUM_COLUMNS; c++) {
+		snprintf(path, sizeof(path), "%s/%s/%s.f32", dir, config->label, column_names[c]);
+		config->fd[c] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+		if (config->fd[c] < 0 || ftruncate(config->fd[c], total_records * sizeof(float)) < 0) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/%s/config.txt", dir, config->label);
+	fh = fopen(path, "w");
+
+	if (!fh) {
+		perror(path);
+		return -1;
+	}
+
+	fprintf(fh, "yaw_mix_factor %d\n", config->fusion.yawMixFactor);
+	fprintf(fh, "backend %s\n", config->backend == BACKEND_HOST ? "host" : "dmp");
+	fprintf(fh, "accelcal %s\n", config->accelCalFile ? config->accelCalFile : "none");
+	fprintf(fh, "magcal %s\n", config->magCalFile ? config->magCalFile : "none");
+	fprintf(fh, "rows %lu\n", total_records);
+	fprintf(fh, "columns float32, host byte order, degrees for roll pitch yaw, rows match ../time_ns.u64\n");
+	fclose(fh);
+
+	return 0;
+}
+
+static int write_times(const char *dir)
+{
+	char path[512];
+	uint64_t *times;
+	unsigned long i;
+	FILE *fh;
+	int file = 0;
+
+	snprintf(path, sizeof(path), "%s/time_ns.u64", dir);
+	fh = fopen(path, "wb");
+
+	if (!fh) {
+		perror(path);
+		return -1;
+	}
+
+	times = (uint64_t *)malloc(OUT_ROWS * sizeof(uint64_t));
+
+	if (!times) {
+		fclose(fh);
+		return -1;
+	}
+
+	for (i = 0; i < total_records; i++) {
+		times[i % OUT_ROWS] = record_at(i, &file)->timeNs;
+
+		if (i % OUT_ROWS == OUT_ROWS - 1 || i == total_records - 1)
+			fwrite(times, sizeof(uint64_t), i % OUT_ROWS + 1, fh);
+	}
+
+	free(times);
+	fclose(fh);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i, j, y, f, a, m, threads, started;
+	int num_mix, num_backends, num_accel, num_mag;
+	char *mix_list[MAX_LIST], *backend_list[MAX_LIST];
+	char *accel_list[MAX_LIST], *mag_list[MAX_LIST];
+	char *out_dir = NULL;
+	char *reference_file = NULL;
+	char default_mix[16], default_backend[] = "dmp", none[] = "none";
+	unsigned long chunks, chunk_len, first;
+	uint64_t start;
+	double converge_s, jitter, yaw_rms, roll_rms, pitch_rms, cpu;
+	int best, file;
+	pthread_t tid[MAX_THREADS];
+	batchconfig_t *config;
+	caldata_t cal;
+	FILE *fh;
+	char path[512];
+
+	threads = 0;
+	snprintf(default_mix, sizeof(default_mix), "%d", DEFAULT_YAW_MIX_FACTOR);
+	mix_list[0] = default_mix;
+	num_mix = 1;
+	backend_list[0] = default_backend;
+	num_backends = 1;
+	accel_list[0] = none;
+	num_accel = 1;
+	mag_list[0] = none;
+	num_mag = 1;
+
+	while ((opt = getopt(argc, argv, "y:f:a:m:r:s:c:j:o:h")) != -1) {
+		switch (opt) {
+		case 'y':
+			num_mix = split_list(optarg, mix_list);
+			break;
+
+		case 'f':
+			num_backends = split_list(optarg, backend_list);
+			break;
+
+		case 'a':
+			num_accel = split_list(optarg, accel_list);
+			break;
+
+		case 'm':
+			num_mag = split_list(optarg, mag_list);
+			break;
+
+		case 'r':
+			reference_file = optarg;
+			break;
+
+		case 's':
+			settle_s = atof(optarg);
+
+			if (settle_s < 0.0)
+				usage(argv[0]);
+
+			break;
+
+		case 'c':
+			converged_deg = atof(optarg);
+
+			if (converged_deg <= 0.0)
+				usage(argv[0]);
+
+			break;
+
+		case 'j':
+			threads = strtol(optarg, NULL, 0);
+
+			if (errno == EINVAL || threads < 0)
+				usage(argv[0]);
+
+			break;
+
+		case 'o':
+			out_dir = optarg;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (!out_dir || optind >= argc || num_mix < 1 || num_backends < 1 || num_accel < 1 || num_mag < 1)
+		usage(argv[0]);
+
+	if (argc - optind > MAX_FILES) {
+		printf("At most %d log files\n", MAX_FILES);
+		exit(1);
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (rawmap_open(&maps[num_files], argv[i], 0))
+			exit(1);
+
+		file_base[num_files] = total_records;
+		total_records += maps[num_files].count;
+		num_files++;
+	}
+
+	file_base[num_files] = total_records;
+
+	if (total_records == 0) {
+		printf("No records\n");
+		exit(1);
+	}
+
+	start_ns = maps[0].records[0].timeNs;
+
+	if (reference_file && load_reference(reference_file))
+		exit(1);
+
+	if (mkdir(out_dir, 0755) < 0 && errno != EEXIST) {
+		perror(out_dir);
+		exit(1);
+	}
+
+	// every combination, the calibration goes through the library setters
+	// so it is clamped the same way as on the robot
+	mpu9150_init_replay(DEFAULT_YAW_MIX_FACTOR);
+
+	for (y = 0; y < num_mix; y++) {
+		for (f = 0; f < num_backends; f++) {
+			for (a = 0; a < num_accel; a++) {
+				for (m = 0; m < num_mag; m++) {
+					if (num_configs == MAX_CONFIGS) {
+						printf("Too many combinations, at most %d\n", MAX_CONFIGS);
+						exit(1);
+					}
+
+					config = &configs[num_configs];
+					memset(config, 0, sizeof(batchconfig_t));
+
+					if (!strcmp(backend_list[f], "dmp")) {
+						config->backend = BACKEND_DMP;
+					}
+					else if (!strcmp(backend_list[f], "host")) {
+						config->backend = BACKEND_HOST;
+					}
+					else {
+						printf("Unknown fusion backend %s\n", backend_list[f]);
+						usage(argv[0]);
+					}
+
+					j = strtol(mix_list[y], NULL, 0);
+
+					if (j < 0 || j > 100)
+						usage(argv[0]);
+
+					mpu9150_init_replay(j);
+
+					if (strcmp(accel_list[a], "none")) {
+						if (load_cal(accel_list[a], &cal))
+							exit(1);
+
+						mpu9150_set_accel_cal(&cal);
+						config->accelCalFile = accel_list[a];
+					}
+					else {
+						mpu9150_set_accel_cal(NULL);
+					}
+
+					if (strcmp(mag_list[m], "none")) {
+						if (load_cal(mag_list[m], &cal))
+							exit(1);
+
+						mpu9150_set_mag_cal(&cal);
+						config->magCalFile = mag_list[m];
+					}
+					else {
+						mpu9150_set_mag_cal(NULL);
+					}
+
+					mpu9150_get_fusion_config(&config->fusion);
+					config->checkpoint = checkpoint_length(config);
+
+					snprintf(config->label, sizeof(config->label), "y%d-%s-a%d-m%d",
+						j, backend_list[f], a, m);
+
+					if (open_columns(out_dir, config))
+						exit(1);
+
+					num_configs++;
+				}
+			}
+		}
+	}
+
+	if (write_times(out_dir))
+		exit(1);
+
+	if (threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	// enough chunks to keep every thread busy, but each much longer than
+	// its checkpoint run
+	work = (work_t *)malloc(num_configs * (4 * MAX_THREADS + 1) * sizeof(work_t));
+
+	if (!work) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < num_configs; i++) {
+		config = &configs[i];
+		chunks = (4 * threads + num_configs - 1) / num_configs;
+
+		if (config->fusion.yawMixFactor == 0)
+			chunks = 1;
+		else if (chunks > total_records / (10 * config->checkpoint))
+			chunks = total_records / (10 * config->checkpoint);
+
+		if (chunks < 1)
+			chunks = 1;
+
+		chunk_len = (total_records + chunks - 1) / chunks;
+
+		for (first = 0; first < total_records; first += chunk_len) {
+			work[num_work].config = i;
+			work[num_work].first = first;
+			work[num_work].count = first + chunk_len > total_records ? total_records - first : chunk_len;
+			num_work++;
+		}
+	}
+
+	printf("%d combinations, %lu records, %d chunks on %d threads\n",
+		num_configs, total_records, num_work, threads);
+
+	start = mono_ns();
+
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&tid[started], NULL, worker, NULL))
+			break;
+	}
+
+	if (started == 0) {
+		printf("Could not start any threads\n");
+		exit(1);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	printf("done in %.3f s\n\n", (mono_ns() - start) / 1e9);
+
+	snprintf(path, sizeof(path), "%s/summary.csv", out_dir);
+	fh = fopen(path, "w");
+
+	if (fh) {
+		fprintf(fh, "label,yaw_mix_factor,backend,accelcal,magcal,rows,errors,yaw_jitter_deg,"
+			"cpu_ns_per_sample,yaw_rms_deg,yaw_max_deg,roll_rms_deg,pitch_rms_deg,converged_s,"
+			"yaw_stdev,pitch_roll_stdev\n");
+	}
+
+	printf("%-20s %7s %8s %8s", "combination", "errors", "jitter", "ns/samp");
+
+	if (reference)
+		printf(" %8s %8s %8s %8s %10s", "yaw rms", "yaw max", "roll rms", "ptch rms", "converged");
+
+	printf("\n");
+
+	best = -1;
+	file = 0;
+
+	for (i = 0; i < num_configs; i++) {
+		config = &configs[i];
+
+		for (j = 0; j < NUM_COLUMNS; j++)
+			close(config->fd[j]);
+
+		jitter = config->jitterCount ? sqrt(config->jitterSum / config->jitterCount) * RAD_TO_DEGREE : 0.0;
+		cpu = config->processed ? (double)config->cpuNs / config->processed : 0.0;
+		yaw_rms = config->yawCount ? sqrt(config->yawErrSq / config->yawCount) : 0.0;
+		roll_rms = config->attitudeCount ? sqrt(config->rollErrSq / config->attitudeCount) : 0.0;
+		pitch_rms = config->attitudeCount ? sqrt(config->pitchErrSq / config->attitudeCount) : 0.0;
+
+		// -1 if it was still outside the threshold at the end
+		if (config->unconverged == 0)
+			converge_s = 0.0;
+		else if (config->unconverged >= total_records)
+			converge_s = -1.0;
+		else
+			converge_s = (record_at(config->unconverged, &file)->timeNs - start_ns) / 1e9;
+
+		printf("%-20s %7lu %8.4f %8.0f", config->label, config->errors, jitter, cpu);
+
+		if (reference && !config->yawCount) {
+			printf(" %8s %8s %8s %8s %10s", "-", "-", "-", "-", "-");
+		}
+		else if (reference) {
+			printf(" %8.3f %8.3f", yaw_rms, config->maxYawErr);
+
+			if (config->attitudeCount)
+				printf(" %8.3f %8.3f ", roll_rms, pitch_rms);
+			else
+				printf(" %8s %8s ", "-", "-");
+
+			if (converge_s < 0.0)
+				printf("%10s", "never");
+			else
+				printf("%9.1fs", converge_s);
+
+			if (config->yawCount && (best < 0 || yaw_rms < sqrt(configs[best].yawErrSq / configs[best].yawCount)))
+				best = i;
+		}
+
+		printf("\n");
+
+		// the scores stay empty without a reference to compare with
+		if (fh) {
+			fprintf(fh, "%s,%d,%s,%s,%s,%lu,%lu,%f,%.1f", config->label,
+				config->fusion.yawMixFactor,
+				config->backend == BACKEND_HOST ? "host" : "dmp",
+				config->accelCalFile ? config->accelCalFile : "none",
+				config->magCalFile ? config->magCalFile : "none",
+				config->rows, config->errors, jitter, cpu);
+			write_score(fh, "%f", yaw_rms, config->yawCount);
+			write_score(fh, "%f", config->maxYawErr, config->yawCount);
+			write_score(fh, "%f", roll_rms, config->attitudeCount);
+			write_score(fh, "%f", pitch_rms, config->attitudeCount);
+			write_score(fh, "%.3f", converge_s, config->yawCount);
+			write_score(fh, "%f", yaw_rms / RAD_TO_DEGREE, config->yawCount);
+			write_score(fh, "%f", 0.5 * (roll_rms + pitch_rms) / RAD_TO_DEGREE, config->attitudeCount);
+			fputc('\n', fh);
+		}
+	}
+
+	if (fh)
+		fclose(fh);
+
+	if (best >= 0) {
+		config = &configs[best];
+		yaw_rms = sqrt(config->yawErrSq / config->yawCount);
+
+		printf("\nLowest yaw error: %s, for the node yaw_stdev %.4f", config->label, yaw_rms / RAD_TO_DEGREE);
+
+		if (config->attitudeCount) {
+			printf(" pitch_roll_stdev %.4f",
+				0.5 * (sqrt(config->rollErrSq / config->attitudeCount)
+					+ sqrt(config->pitchErrSq / config->attitudeCount)) / RAD_TO_DEGREE);
+		}
+
+		printf("\n");
+	}
+
+	for (i = 0; i < num_files; i++)
+		rawmap_close(&maps[i]);
+
+	free(work);
+
+	return 0;
+}
+
+int load_cal(const char *cal_file, caldata_t *cal)
+{
+	int i;
+	FILE *f;
+	char buff[32];
+	long val[6];
+
+	f = fopen(cal_file, "r");
+
+	if (!f) {
+		perror("open(<cal-file>)");
+		return -1;
+	}
+
+	memset(buff, 0, sizeof(buff));
+
+	for (i = 0; i < 6; i++) {
+		if (!fgets(buff, 20, f)) {
+			printf("Not enough lines in calibration file\n");
+			break;
+		}
+
+		val[i] = atoi(buff);
+
+		if (val[i] == 0) {
+			printf("Invalid cal value: %s\n", buff);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	if (i != 6)
+		return -1;
+
+	cal->offset[0] = (short)((val[0] + val[1]) / 2);
+	cal->offset[1] = (short)((val[2] + val[3]) / 2);
+	cal->offset[2] = (short)((val[4] + val[5]) / 2);
+
+	cal->range[0] = (short)(val[1] - cal->offset[0]);
+	cal->range[1] = (short)(val[3] - cal->offset[1]);
+	cal->range[2] = (short)(val[5] - cal->offset[2]);
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "bench.h"
+
+// Microbenchmarks of the per-sample path: FIFO packet parsing against the
+// simulated IMU, calibration, fusion and the quaternion helpers. No IMU is
+// needed. Save the JSON output from two builds to compare them.
+
+void usage(char *argv_0)
+{
+	printf("\nUsage: %s [options]\n", argv_0);
+	printf("  -t <seconds>          Minimum time per case. The default is %.1f.\n", DEFAULT_BENCH_SECONDS);
+	printf("  -f <filter>           Only run the cases whose name contains filter\n");
+	printf("  -o <json file>        Write the results as JSON\n");
+	printf("  -l <label>            Label stored in the JSON, e.g. the commit\n");
+	printf("  -h                    Show this help\n");
+
+	printf("\nInstructions per operation need perf counters, see\n");
+	printf("/proc/sys/kernel/perf_event_paranoid.\n");
+	printf("\nExample: %s -t1 -l $(git rev-parse --short HEAD) -o bench.json\n\n", argv_0);
+
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	double seconds = DEFAULT_BENCH_SECONDS;
+	char *filter = NULL;
+	char *json_file = NULL;
+	char *label = NULL;
+	bench_t bench;
+
+	while ((opt = getopt(argc, argv, "t:f:o:l:h")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atof(optarg);
+
+			if (seconds <= 0.0)
+				usage(argv[0]);
+
+			break;
+
+		case 'f':
+			filter = optarg;
+			break;
+
+		case 'o':
+			json_file = optarg;
+			break;
+
+		case 'l':
+			label = optarg;
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	bench_init(&bench, seconds, filter);
+
+	if (bench_library(&bench)) {
+		bench_close(&bench);
+		exit(1);
+	}
+
+	bench_print(&bench);
+
+	if (json_file && bench_write_json(&bench, json_file, label)) {
+		bench_close(&bench);
+		exit(1);
+	}
+
+	bench_close(&bench);
+
+	return 0;
+}
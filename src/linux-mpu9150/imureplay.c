@@ -0,0 +1,365 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+
+#include "mpu9150.h"
+#include "rawlog.h"
+#include "rawmap.h"
+#include "local_defaults.h"
+
+// Feeds raw sample logs recorded with imu -l or the node's rawlog_path
+// back through calibrate_data() and data_fusion(), as fast as they can go.
+// No IMU is needed, so fusion and calibration changes can be compared on
+// the same recorded motion. Logs are mapped, so a window of a long log
+// only reads the pages it needs, and the work can be split over threads.
+
+#define DEFAULT_WARMUP_SECONDS 10
+
+typedef struct {
+	float quat[4];
+	float euler[3];
+	int ok;
+} result_t;
+
+typedef struct {
+	result_t *results;
+	unsigned long first;
+} output_t;
+
+int set_cal(int mag, char *cal_file);
+
+void usage(char *argv_0)
+{
+	printf("\nUsage: %s [options] <log file> ...\n", argv_0);
+	printf("  -y <yaw-mix-factor>   Effect of mag yaw on fused yaw data. The default is 4.\n");
+	printf("  -a <accelcal file>    Path to accelerometer calibration file\n");
+	printf("  -m <magcal file>      Path to mag calibration file\n");
+	printf("  -o <csv file>         Write the fused output, one line per record\n");
+	printf("  -s <seconds>          Start this far into the recording\n");
+	printf("  -d <seconds>          Only replay this long\n");
+	printf("  -j <threads>          Split each log over threads, 0 for one per CPU. Default 1.\n");
+	printf("  -w <records>          Records each thread runs before its chunk. Default %d s worth.\n",
+		DEFAULT_WARMUP_SECONDS);
+	printf("  -h                    Show this help\n");
+
+	printf("\nLog files are replayed in the order given, as one recording. With -j the\n");
+	printf("fusion restarts at each chunk and file, so the yaw only matches a single\n");
+	printf("thread after the warmup.\n");
+	printf("\nExample: %s -y10 -j0 -o fused.csv run-0000.raw run-0001.raw\n\n", argv_0);
+
+	exit(1);
+}
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void store_result(void *arg, unsigned long index, const rawlog_record_t *rec,
+		const mpudata_t *mpu)
+{
+	output_t *output = (output_t *)arg;
+	result_t *r = &output->results[index - output->first];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		r->quat[i] = mpu->fusedQuat[i];
+
+	for (i = 0; i < 3; i++)
+		r->euler[i] = mpu->fusedEuler[i];
+
+	r->ok = 1;
+}
+
+static void write_results(FILE *out, const rawmap_t *map, const output_t *output, unsigned long count)
+{
+	const rawlog_record_t *rec;
+	const result_t *r;
+	unsigned long i;
+
+	rec = rawmap_span(map, output->first, &count);
+
+	for (i = 0; i < count; i++, rec++) {
+		r = &output->results[i];
+
+		if (!r->ok)
+			continue;
+
+		fprintf(out, "%llu,%u,%u,%f,%f,%f,%f,%f,%f,%f\n",
+			(unsigned long long)rec->timeNs, rec->device, rec->flags,
+			r->quat[QUAT_W], r->quat[QUAT_X], r->quat[QUAT_Y], r->quat[QUAT_Z],
+			r->euler[VEC3_X] * RAD_TO_DEGREE,
+			r->euler[VEC3_Y] * RAD_TO_DEGREE,
+			r->euler[VEC3_Z] * RAD_TO_DEGREE);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i;
+	int yaw_mix_factor = DEFAULT_YAW_MIX_FACTOR;
+	int threads = 1;
+	long warmup = -1;
+	long errors;
+	double start_s = 0.0;
+	double duration_s = 0.0;
+	char *mag_cal_file = NULL;
+	char *accel_cal_file = NULL;
+	char *csv_file = NULL;
+	unsigned long first, last, count, j, records, fusion_errors;
+	uint64_t start, elapsed, replayed_ns, t0;
+	const rawlog_record_t *span;
+	rawmap_t map;
+	output_t output;
+	mpudata_t mpu;
+	FILE *out = NULL;
+
+	while ((opt = getopt(argc, argv, "y:a:m:o:s:d:j:w:h")) != -1) {
+		switch (opt) {
+		case 'y':
+			yaw_mix_factor = strtoul(optarg, NULL, 0);
+
+			if (errno == EINVAL)
+				usage(argv[0]);
+
+			if (yaw_mix_factor < 0 || yaw_mix_factor > 100)
+				usage(argv[0]);
+
+			break;
+
+		case 'a':
+			accel_cal_file = optarg;
+			break;
+
+		case 'm':
+			mag_cal_file = optarg;
+			break;
+
+		case 'o':
+			csv_file = optarg;
+			break;
+
+		case 's':
+			start_s = atof(optarg);
+
+			if (start_s < 0.0)
+				usage(argv[0]);
+
+			break;
+
+		case 'd':
+			duration_s = atof(optarg);
+
+			if (duration_s <= 0.0)
+				usage(argv[0]);
+
+			break;
+
+		case 'j':
+			threads = strtol(optarg, NULL, 0);
+
+			if (errno == EINVAL || threads < 0)
+				usage(argv[0]);
+
+			break;
+
+		case 'w':
+			warmup = strtol(optarg, NULL, 0);
+
+			if (errno == EINVAL || warmup < 0)
+				usage(argv[0]);
+
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+
+	mpu9150_init_replay(yaw_mix_factor);
+
+	if (accel_cal_file && set_cal(0, accel_cal_file))
+		exit(1);
+
+	if (mag_cal_file && set_cal(1, mag_cal_file))
+		exit(1);
+
+	if (csv_file) {
+		out = fopen(csv_file, "w");
+
+		if (!out) {
+			perror(csv_file);
+			exit(1);
+		}
+
+		fprintf(out, "time_ns,device,flags,qw,qx,qy,qz,roll,pitch,yaw\n");
+	}
+
+	records = 0;
+	fusion_errors = 0;
+	replayed_ns = 0;
+	output.results = NULL;
+	t0 = 0;
+	memset(&mpu, 0, sizeof(mpudata_t));
+	start = mono_ns();
+
+	for (i = optind; i < argc; i++) {
+		if (rawmap_open(&map, argv[i], 0))
+			exit(1);
+
+		if (map.count == 0) {
+			rawmap_close(&map);
+			continue;
+		}
+
+		if (t0 == 0)
+			t0 = map.records[0].timeNs;
+
+		first = rawmap_seek(&map, t0 + (uint64_t)(start_s * 1e9));
+		last = map.count;
+
+		if (duration_s > 0.0)
+			last = rawmap_seek(&map, t0 + (uint64_t)((start_s + duration_s) * 1e9));
+
+		if (first >= last) {
+			rawmap_close(&map);
+			continue;
+		}
+
+		count = last - first;
+
+		if (out) {
+			output.results = (result_t *)calloc(count, sizeof(result_t));
+
+			if (!output.results) {
+				printf("Out of memory\n");
+				exit(1);
+			}
+
+			output.first = first;
+		}
+
+		span = rawmap_span(&map, first, &count);
+
+		if (threads == 1) {
+			// in place and in order, the fusion state carries over between files
+			errors = 0;
+
+			for (j = 0; j < count; j++) {
+				rawlog_unpack(&span[j], &mpu);
+
+				if (mpu9150_process(&mpu))
+					errors++;
+				else if (out)
+					store_result(&output, first + j, &span[j], &mpu);
+			}
+		}
+		else {
+			errors = rawmap_process(&map, first, count, threads,
+				warmup >= 0 ? (unsigned long)warmup : map.header->sampleRate * DEFAULT_WARMUP_SECONDS,
+				out ? store_result : NULL, &output);
+
+			if (errors < 0)
+				exit(1);
+		}
+
+		if (out) {
+			write_results(out, &map, &output, count);
+			free(output.results);
+		}
+
+		replayed_ns += span[count - 1].timeNs - span[0].timeNs;
+		records += count;
+		fusion_errors += errors;
+
+		rawmap_close(&map);
+	}
+
+	elapsed = mono_ns() - start;
+
+	if (out)
+		fclose(out);
+
+	printf("%lu records from %d files, %lu fusion errors\n",
+		records, argc - optind, fusion_errors);
+
+	if (records > 0) {
+		printf("%.2f s of data replayed in %.3f s, %.0f records/s\n",
+			replayed_ns / 1e9, elapsed / 1e9,
+			elapsed ? records / (elapsed / 1e9) : 0.0);
+	}
+
+	return 0;
+}
+
+int set_cal(int mag, char *cal_file)
+{
+	int i;
+	FILE *f;
+	char buff[32];
+	long val[6];
+	caldata_t cal;
+
+	f = fopen(cal_file, "r");
+
+	if (!f) {
+		perror("open(<cal-file>)");
+		return -1;
+	}
+
+	memset(buff, 0, sizeof(buff));
+
+	for (i = 0; i < 6; i++) {
+		if (!fgets(buff, 20, f)) {
+			printf("Not enough lines in calibration file\n");
+			break;
+		}
+
+		val[i] = atoi(buff);
+
+		if (val[i] == 0) {
+			printf("Invalid cal value: %s\n", buff);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	if (i != 6)
+		return -1;
+
+	cal.offset[0] = (short)((val[0] + val[1]) / 2);
+	cal.offset[1] = (short)((val[2] + val[3]) / 2);
+	cal.offset[2] = (short)((val[4] + val[5]) / 2);
+
+	cal.range[0] = (short)(val[1] - cal.offset[0]);
+	cal.range[1] = (short)(val[3] - cal.offset[1]);
+	cal.range[2] = (short)(val[5] - cal.offset[2]);
+
+	if (mag)
+		mpu9150_set_mag_cal(&cal);
+	else
+		mpu9150_set_accel_cal(&cal);
+
+	return 0;
+}
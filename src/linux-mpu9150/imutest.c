@@ -0,0 +1,751 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "mpu9150.h"
+#include "mpu_sim.h"
+#include "hostfusion.h"
+#include "rawlog.h"
+#include "tempcomp.h"
+#include "inv_mpu.h"
+#include "inv_mpu_dmp_motion_driver.h"
+
+// Checks of the library against the simulated IMU on its virtual clock,
+// run by make check. No IMU is needed and every run is the same. Exits
+// with 1 if a case fails.
+
+#define TEST_BUS		1
+#define TEST_RATE		100
+#define TEST_YAW_RATE		30.0f
+
+typedef struct {
+	const char *name;
+	int (*run)(void);
+} test_case_t;
+
+// a constant yaw rate without noise or bias, so the attitude is known
+static void sim_config(mpu_sim_config_t *config)
+{
+	mpu_sim_default_config(config);
+
+	memset(config->gyroBias, 0, sizeof(config->gyroBias));
+	config->gyroRate[2] = TEST_YAW_RATE;
+	config->wobbleAmp = 0.0f;
+	config->gyroNoise = 0.0f;
+	config->accelNoise = 0.0f;
+}
+
+static int init_sim(const mpu_sim_config_t *config)
+{
+	mpu_sim_init(config);
+	linux_set_transport(mpu_sim_transport());
+	mpu9150_set_init_progress(0);
+
+	if (mpu9150_init(TEST_BUS, TEST_RATE, 0)) {
+		printf("  mpu9150_init() failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int init_dmp(void)
+{
+	mpu_sim_config_t config;
+
+	sim_config(&config);
+
+	return init_sim(&config);
+}
+
+static int init_raw_sim(const mpu_sim_config_t *config, int rate, int lpf)
+{
+	mpu_sim_init(config);
+	linux_set_transport(mpu_sim_transport());
+	mpu9150_set_init_progress(0);
+
+	if (mpu9150_init_raw(TEST_BUS, rate, lpf, 0)) {
+		printf("  mpu9150_init_raw() failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int init_raw(int rate, int lpf)
+{
+	mpu_sim_config_t config;
+
+	sim_config(&config);
+
+	return init_raw_sim(&config, rate, lpf);
+}
+
+// the newest sample after waiting one sample period at most 10 times
+static int read_next(mpudata_t *mpu)
+{
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		linux_delay_ms(1000 / TEST_RATE);
+
+		if (mpu9150_read(mpu) == 0)
+			return 0;
+	}
+
+	printf("  no sample\n");
+
+	return -1;
+}
+
+static void quat_from_q30(const int32_t *raw, double *q)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		q[i] = raw[i] / 1073741824.0;
+}
+
+// rotation from a to b in degrees, and how far its axis is off z
+static void relative_rotation(const double *a, const double *b, double *angle, double *tilt)
+{
+	double r[4], n;
+
+	// conj(a) * b
+	r[QUAT_W] = a[QUAT_W] * b[QUAT_W] + a[QUAT_X] * b[QUAT_X] + a[QUAT_Y] * b[QUAT_Y] + a[QUAT_Z] * b[QUAT_Z];
+	r[QUAT_X] = a[QUAT_W] * b[QUAT_X] - a[QUAT_X] * b[QUAT_W] - a[QUAT_Y] * b[QUAT_Z] + a[QUAT_Z] * b[QUAT_Y];
+	r[QUAT_Y] = a[QUAT_W] * b[QUAT_Y] + a[QUAT_X] * b[QUAT_Z] - a[QUAT_Y] * b[QUAT_W] - a[QUAT_Z] * b[QUAT_X];
+	r[QUAT_Z] = a[QUAT_W] * b[QUAT_Z] - a[QUAT_X] * b[QUAT_Y] + a[QUAT_Y] * b[QUAT_X] - a[QUAT_Z] * b[QUAT_W];
+
+	n = sqrt(r[QUAT_X] * r[QUAT_X] + r[QUAT_Y] * r[QUAT_Y] + r[QUAT_Z] * r[QUAT_Z]);
+
+	*angle = 2.0 * atan2(n, fabs(r[QUAT_W])) * RAD_TO_DEGREE;
+	*tilt = n > 0.0 ? acos(fabs(r[QUAT_Z]) / n) * RAD_TO_DEGREE : 0.0;
+}
+
+// the yaw turned over a second of reads against the simulated rate
+static int check_yaw_rate(const char *source, double tolerance)
+{
+	mpudata_t mpu;
+	double first[4], last[4], angle, tilt;
+	unsigned long start, end;
+
+	memset(&mpu, 0, sizeof(mpu));
+
+	if (read_next(&mpu))
+		return -1;
+
+	quat_from_q30(mpu.rawQuat, first);
+	linux_get_ms(&start);
+
+	do {
+		if (read_next(&mpu))
+			return -1;
+
+		linux_get_ms(&end);
+	} while (end - start < 1000);
+
+	quat_from_q30(mpu.rawQuat, last);
+	relative_rotation(first, last, &angle, &tilt);
+
+	// the timestamps are those of the newest sample, a period apart at most
+	if (fabs(angle - TEST_YAW_RATE * (end - start) / 1000.0) > tolerance || tilt > 2.0) {
+		printf("  %s turned %.2f deg in %lu ms, %.2f deg off the z axis\n", source, angle, end - start, tilt);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int test_init(void)
+{
+	int result;
+
+	result = init_dmp();
+
+	if (result == 0 && mpu9150_sample_rate() != TEST_RATE) {
+		printf("  sample rate %d\n", mpu9150_sample_rate());
+		result = -1;
+	}
+
+	mpu9150_exit();
+
+	return result;
+}
+
+static int test_dmp_attitude(void)
+{
+	int result;
+
+	if (init_dmp())
+		return -1;
+
+	result = check_yaw_rate("DMP quaternion", 0.5);
+
+	mpu9150_exit();
+
+	return result;
+}
+
+// the burst reads recover from an overflow and keep up afterwards
+static int test_fifo_overflow(void)
+{
+	struct dmp_fifo_stats_s before, after;
+	mpu9150_stats_t stats;
+	unsigned long errors;
+	mpu_sim_stats_t sim;
+	mpudata_t mpu;
+	int queued, i, k, packets = 0, result = 0;
+
+	if (init_dmp())
+		return -1;
+
+	dmp_get_fifo_stats(&before);
+	mpu9150_get_stats(&stats);
+	errors = stats.readErrors;
+
+	// 200 packets of 28 bytes do not fit the 1024 byte FIFO
+	linux_delay_ms(2000);
+
+	memset(&mpu, 0, sizeof(mpu));
+
+	for (i = 0; i < 50 && result == 0; i++) {
+		if (mpu9150_fifo_queued(&queued)) {
+			result = -1;
+			break;
+		}
+
+		for (k = 0; k < queued; k++) {
+			if (mpu9150_read_fifo_packet(&mpu) == 0)
+				packets++;
+		}
+
+		linux_delay_ms(40);
+	}
+
+	dmp_get_fifo_stats(&after);
+	mpu9150_get_stats(&stats);
+	mpu_sim_get_stats(TEST_BUS, &sim);
+
+	if (result == 0 && (sim.fifoOverflows == 0 || after.overflows == before.overflows)) {
+		printf("  overflow not seen, %lu in the simulator\n", sim.fifoOverflows);
+		result = -1;
+	}
+
+	if (result == 0 && after.resyncs == before.resyncs) {
+		printf("  no resync after the overflow, %u resets\n", after.resets - before.resets);
+		result = -1;
+	}
+
+	// waiting to realign is not a read error
+	if (result == 0 && stats.readErrors != errors) {
+		printf("  %lu read errors, %lu resync waits\n", stats.readErrors - errors, stats.resyncWaits);
+		result = -1;
+	}
+
+	// four packets a read from then on
+	if (result == 0 && packets < 180) {
+		printf("  only %d packets after the overflow\n", packets);
+		result = -1;
+	}
+
+	if (result == 0)
+		result = check_yaw_rate("DMP quaternion after the overflow", 0.5);
+
+	mpu9150_exit();
+
+	return result;
+}
+
+// raw mode gives the host filter's output for the packets it read
+static int test_raw_hostfusion(void)
+{
+	hostfusion_t fusion;
+	mpudata_t mpu;
+	int32_t quat[4];
+	float gyro_sens, accel_sens, dt;
+	int queued, i, k, packets = 0, result = 0;
+
+	if (init_raw(TEST_RATE, 42))
+		return -1;
+
+	mpu9150_get_sens(&gyro_sens, &accel_sens);
+	dt = 1.0f / mpu9150_sample_rate();
+	hostfusion_init(&fusion, DEFAULT_HOSTFUSION_KP, DEFAULT_HOSTFUSION_KI);
+
+	memset(&mpu, 0, sizeof(mpu));
+
+	for (i = 0; i < 50 && result == 0; i++) {
+		linux_delay_ms(40);
+
+		if (mpu9150_fifo_queued(&queued)) {
+			result = -1;
+			break;
+		}
+
+		for (k = 0; k < queued && result == 0; k++) {
+			if (mpu9150_read_fifo_packet(&mpu)) {
+				result = -1;
+				break;
+			}
+
+			hostfusion_update(&fusion, mpu.rawGyro, mpu.rawAccel, gyro_sens, dt, quat);
+
+			if (memcmp(quat, mpu.rawQuat, sizeof(quat))) {
+				printf("  packet %d differs from the host filter\n", packets);
+				result = -1;
+			}
+
+			packets++;
+		}
+	}
+
+	if (result == 0 && packets < 150) {
+		printf("  only %d packets\n", packets);
+		result = -1;
+	}
+
+	if (result == 0)
+		result = check_yaw_rate("host filter quaternion", 1.0);
+
+	mpu9150_exit();
+
+	return result;
+}
+
+// at 1 kHz a full FIFO overflows again before it is read, the burst reads
+// still have to catch up without a reset and stay on the packet boundary
+static int test_raw_overflow(void)
+{
+	mpudata_t mpu;
+	uint32_t overflows, resets, before_overflows, before_resets;
+	double g;
+	int queued, i, packets = 0, result = 0;
+
+	if (init_raw(1000, 188))
+		return -1;
+
+	mpu_get_fifo_overflow_count(&before_overflows);
+	mpu_get_fifo_reset_count(&before_resets);
+
+	linux_delay_ms(200);
+
+	memset(&mpu, 0, sizeof(mpu));
+
+	for (i = 0; i < 50 && result == 0; i++) {
+		if (mpu9150_fifo_queued(&queued)) {
+			result = -1;
+			break;
+		}
+
+		while (mpu9150_read_fifo_packet(&mpu) == 0) {
+			// 16384 LSB per g, a shifted packet puts gyro bytes in the accel
+			g = sqrt((double)mpu.rawAccel[0] * mpu.rawAccel[0] + (double)mpu.rawAccel[1] * mpu.rawAccel[1]
+				+ (double)mpu.rawAccel[2] * mpu.rawAccel[2]) / 16384.0;
+
+			if (fabs(g - 1.0) > 0.1) {
+				printf("  packet %d reads %.2f g\n", packets, g);
+				result = -1;
+				break;
+			}
+
+			packets++;
+		}
+
+		linux_delay_ms(5);
+	}
+
+	mpu_get_fifo_overflow_count(&overflows);
+	mpu_get_fifo_reset_count(&resets);
+
+	if (result == 0 && overflows == before_overflows) {
+		printf("  overflow not seen\n");
+		result = -1;
+	}
+
+	if (result == 0 && resets != before_resets) {
+		printf("  FIFO reset %u times\n", resets - before_resets);
+		result = -1;
+	}
+
+	// 250 ms of samples less the half FIFO dropped
+	if (result == 0 && packets < 200) {
+		printf("  only %d packets\n", packets);
+		result = -1;
+	}
+
+	mpu9150_exit();
+
+	return result;
+}
+
+// raw mode learns the bias from the detector's rest windows and takes it
+// off the gyro
+static int test_raw_tempcomp(void)
+{
+	mpu_sim_config_t config;
+	mpudata_t mpu;
+	float gyro_sens, accel_sens, temp, bias[3];
+	int queued, i, k, axis, result = 0;
+
+	sim_config(&config);
+	config.gyroBias[0] = 0.5f;
+	config.gyroBias[1] = -0.3f;
+	config.gyroBias[2] = 0.2f;
+	config.gyroNoise = 0.05f;
+	config.accelNoise = 0.002f;
+	config.restSeconds = 60.0f;
+
+	if (init_raw_sim(&config, TEST_RATE, 42))
+		return -1;
+
+	mpu9150_get_sens(&gyro_sens, &accel_sens);
+	mpu9150_enable_tempcomp(1);
+
+	memset(&mpu, 0, sizeof(mpu));
+
+	for (i = 0; i < 100 && result == 0; i++) {
+		linux_delay_ms(40);
+
+		if (mpu9150_fifo_queued(&queued)) {
+			result = -1;
+			break;
+		}
+
+		for (k = 0; k < queued; k++) {
+			if (mpu9150_read_fifo_packet(&mpu)) {
+				result = -1;
+				break;
+			}
+		}
+	}
+
+	if (result == 0 && (mpu9150_get_temperature(&temp)
+			|| tempcomp_predict(mpu9150_get_tempcomp(), temp, bias))) {
+		printf("  nothing learned\n");
+		result = -1;
+	}
+
+	for (axis = 0; axis < 3 && result == 0; axis++) {
+		if (fabsf(bias[axis] - config.gyroBias[axis]) > 0.02f) {
+			printf("  learned %.3f %.3f %.3f\n", bias[0], bias[1], bias[2]);
+			result = -1;
+		}
+	}
+
+	// the last sample, corrected
+	for (axis = 0; axis < 3 && result == 0; axis++) {
+		if (fabsf(mpu.rawGyro[axis] / gyro_sens) > 0.25f) {
+			printf("  gyro %d still off by %.3f deg/s\n", axis, mpu.rawGyro[axis] / gyro_sens);
+			result = -1;
+		}
+	}
+
+	mpu9150_exit();
+
+	return result;
+}
+
+static int same_record(const rawlog_record_t *a, const rawlog_record_t *b)
+{
+	return a->dmpTimestamp == b->dmpTimestamp && a->magTimestamp == b->magTimestamp
+		&& !memcmp(a->quat, b->quat, sizeof(a->quat)) && !memcmp(a->gyro, b->gyro, sizeof(a->gyro))
+		&& !memcmp(a->accel, b->accel, sizeof(a->accel)) && !memcmp(a->mag, b->mag, sizeof(a->mag))
+		&& a->flags == b->flags && a->device == b->device;
+}
+
+// what mpu9150_process() logs reads back as it was read
+static int test_rawlog_roundtrip(void)
+{
+	rawlog_t log;
+	rawlog_reader_t reader;
+	rawlog_record_t sent[100], rec;
+	mpudata_t mpu;
+	char base[64], path[80];
+	int i, n, result = 0;
+
+	if (init_dmp())
+		return -1;
+
+	snprintf(base, sizeof(base), "/tmp/imutest-%d", (int)getpid());
+	snprintf(path, sizeof(path), "%s-0000.raw", base);
+
+	if (rawlog_open(&log, base, 0, 0, mpu9150_sample_rate())) {
+		printf("  cannot open %s\n", path);
+		mpu9150_exit();
+		return -1;
+	}
+
+	mpu9150_set_rawlog(&log);
+	memset(&mpu, 0, sizeof(mpu));
+
+	for (i = 0; i < 100 && result == 0; i++) {
+		result = read_next(&mpu);
+		rawlog_pack(&sent[i], &mpu, RAWLOG_DMP, 0);
+	}
+
+	mpu9150_set_rawlog(NULL);
+	rawlog_close(&log);
+	mpu9150_exit();
+
+	if (result) {
+		unlink(path);
+		return -1;
+	}
+
+	if (rawlog_reader_open(&reader, path)) {
+		printf("  cannot read %s\n", path);
+		unlink(path);
+		return -1;
+	}
+
+	if (reader.header.sampleRate != TEST_RATE) {
+		printf("  header sample rate %u\n", reader.header.sampleRate);
+		result = -1;
+	}
+
+	for (n = 0; result == 0 && rawlog_reader_next(&reader, &rec) == 1; n++) {
+		// the compass flag depends on when it was read
+		rec.flags &= ~RAWLOG_MAG;
+
+		if (n >= 100 || !same_record(&sent[n], &rec)) {
+			printf("  record %d differs\n", n);
+			result = -1;
+		}
+	}
+
+	if (result == 0 && n != 100) {
+		printf("  %d records, 100 written\n", n);
+		result = -1;
+	}
+
+	rawlog_reader_close(&reader);
+	unlink(path);
+
+	return result;
+}
+
+static int check_bias(const char *what, const float *want, float tolerance)
+{
+	float bias[3];
+	int i;
+
+	if (mpu9150_get_gyro_bias(bias)) {
+		printf("  mpu9150_get_gyro_bias() failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (fabsf(bias[i] - want[i]) > tolerance) {
+			printf("  %s bias %.4f %.4f %.4f, expected %.4f %.4f %.4f\n", what,
+				bias[0], bias[1], bias[2], want[0], want[1], want[2]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// A seeded bias is replaced by the DMP's own estimate once it has lain
+// still, which is saved and comes back on the next start.
+static int test_bias_state(void)
+{
+	mpu_sim_config_t config;
+	mpudata_t mpu;
+	char path[64];
+	float seed[3] = { 0.1f, 0.1f, 0.1f };
+	float learned[3];
+	FILE *fh;
+	int i, result = 0;
+
+	snprintf(path, sizeof(path), "/tmp/imutest-%d.bias", (int)getpid());
+
+	fh = fopen(path, "w");
+
+	if (!fh) {
+		printf("  cannot write %s\n", path);
+		return -1;
+	}
+
+	fprintf(fh, "gyro %f %f %f\n", seed[0], seed[1], seed[2]);
+	fclose(fh);
+
+	sim_config(&config);
+	config.gyroBias[0] = 0.5f;
+	config.gyroBias[1] = -0.3f;
+	config.gyroBias[2] = 0.2f;
+	config.restSeconds = 60.0f;
+
+	if (init_sim(&config)) {
+		unlink(path);
+		return -1;
+	}
+
+	if (mpu9150_load_bias_state(path, NULL) || check_bias("seeded", seed, 0.001f))
+		result = -1;
+
+	// 10 s still, the DMP needs 8
+	for (i = 0; result == 0 && i < 10 * TEST_RATE; i++) {
+		if (read_next(&mpu))
+			result = -1;
+	}
+
+	if (result == 0 && check_bias("converged", config.gyroBias, 0.001f))
+		result = -1;
+
+	if (result == 0 && (mpu9150_get_gyro_bias(learned) || mpu9150_save_bias_state(path, learned)))
+		result = -1;
+
+	mpu9150_exit();
+
+	// turning from the start so the DMP has no estimate of its own
+	if (result == 0) {
+		sim_config(&config);
+
+		if (init_sim(&config))
+			result = -1;
+	}
+
+	if (result == 0) {
+		if (mpu9150_load_bias_state(path, NULL) || check_bias("reloaded", learned, 0.001f))
+			result = -1;
+
+		mpu9150_exit();
+	}
+
+	unlink(path);
+
+	return result;
+}
+
+#ifdef HMC5883L_SECONDARY
+// The self test needs a new conversion for every read, RDY stays set after
+// the data is read. A weak part fails it and its result is not cached.
+static int test_compass_selftest(void)
+{
+	mpu_sim_config_t config;
+	char path[64];
+	float adj[3], cached[3];
+	unsigned char tested;
+	FILE *fh;
+	int i, result = 0;
+
+	snprintf(path, sizeof(path), "/tmp/imutest-%d.compass", (int)getpid());
+	mpu9150_set_compass_cache(path);
+
+	sim_config(&config);
+	config.magSelfTest = 0.5f;
+
+	if (init_sim(&config)) {
+		mpu9150_set_compass_cache(NULL);
+		return -1;
+	}
+
+	mpu_get_compass_sens_adj(adj, &tested);
+	mpu9150_exit();
+
+	if (tested || access(path, F_OK) == 0) {
+		printf("  half the self test field passed\n");
+		result = -1;
+	}
+
+	sim_config(&config);
+
+	if (result == 0 && init_sim(&config))
+		result = -1;
+
+	if (result == 0) {
+		mpu_get_compass_sens_adj(adj, &tested);
+		mpu9150_exit();
+
+		for (i = 0; i < 3; i++) {
+			if (!tested || fabsf(adj[i] - 1.0f) > 0.1f) {
+				printf("  self test %s, adjustment %.3f %.3f %.3f\n", tested ? "passed" : "failed",
+					adj[0], adj[1], adj[2]);
+				result = -1;
+				break;
+			}
+		}
+	}
+
+	// the next init takes the cached result
+	if (result == 0) {
+		fh = fopen(path, "r");
+
+		if (!fh || fscanf(fh, "%f %f %f", &cached[0], &cached[1], &cached[2]) != 3) {
+			printf("  no result in %s\n", path);
+			result = -1;
+		}
+
+		if (fh)
+			fclose(fh);
+	}
+
+	if (result == 0 && init_sim(&config))
+		result = -1;
+
+	if (result == 0) {
+		mpu_get_compass_sens_adj(adj, &tested);
+		mpu9150_exit();
+
+		if (tested || memcmp(adj, cached, sizeof(adj))) {
+			printf("  cached result not used\n");
+			result = -1;
+		}
+	}
+
+	mpu9150_set_compass_cache(NULL);
+	unlink(path);
+
+	return result;
+}
+#endif
+
+static const test_case_t tests[] = {
+	{ "init", test_init },
+	{ "dmp_attitude", test_dmp_attitude },
+	{ "fifo_overflow", test_fifo_overflow },
+	{ "raw_hostfusion", test_raw_hostfusion },
+	{ "raw_overflow", test_raw_overflow },
+	{ "raw_tempcomp", test_raw_tempcomp },
+	{ "rawlog_roundtrip", test_rawlog_roundtrip },
+	{ "bias_state", test_bias_state },
+#ifdef HMC5883L_SECONDARY
+	{ "compass_selftest", test_compass_selftest },
+#endif
+};
+
+int main(int argc, char **argv)
+{
+	int i, failed = 0;
+	int count = sizeof(tests) / sizeof(tests[0]);
+
+	for (i = 0; i < count; i++) {
+		printf("%s ... ", tests[i].name);
+		fflush(stdout);
+
+		if (tests[i].run()) {
+			printf("FAIL\n");
+			failed++;
+		}
+		else {
+			printf("ok\n");
+		}
+	}
+
+	mpu_sim_exit();
+
+	printf("\n%d of %d passed\n", count - failed, count);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,464 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mpu9150.h"
+#include "hostfusion.h"
+#include "linux_glue.h"
+#include "mpu_sim.h"
+#include "inv_mpu.h"
+#include "inv_mpu_dmp_motion_driver.h"
+#include "bench.h"
+
+// distinct inputs the cases cycle through, so nothing is constant
+#define NUM_INPUTS 256
+#define BENCH_RATE 100
+#define BENCH_BUS 1
+
+// packets the simulated FIFO fills with between prefetches
+#define BENCH_PACKETS 10
+
+static uint64_t mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t read_insn(const bench_t *bench)
+{
+	uint64_t count;
+
+	if (bench->perfFd < 0 || read(bench->perfFd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+
+	return count;
+}
+
+void bench_use(const void *p)
+{
+	__asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+int bench_init(bench_t *bench, double min_seconds, const char *filter)
+{
+	struct perf_event_attr attr;
+
+	memset(bench, 0, sizeof(bench_t));
+	bench->minSeconds = min_seconds > 0.0 ? min_seconds : DEFAULT_BENCH_SECONDS;
+	bench->filter = filter;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	bench->perfFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+
+	if (bench->perfFd < 0)
+		printf("No perf counters, instructions are not counted\n");
+
+	return 0;
+}
+
+void bench_close(bench_t *bench)
+{
+	if (bench->perfFd >= 0) {
+		close(bench->perfFd);
+		bench->perfFd = -1;
+	}
+}
+
+void bench_pause(bench_t *bench)
+{
+	bench->pauseStartInsn = read_insn(bench);
+	bench->pauseStartNs = mono_ns();
+}
+
+void bench_resume(bench_t *bench)
+{
+	bench->pausedNs += mono_ns() - bench->pauseStartNs;
+	bench->pausedInsn += read_insn(bench) - bench->pauseStartInsn;
+}
+
+void bench_run(bench_t *bench, const char *name, bench_fn_t fn, void *arg)
+{
+	bench_result_t *result;
+	unsigned long n;
+	uint64_t start, elapsed, insn;
+
+	if (bench->filter && !strstr(name, bench->filter))
+		return;
+
+	if (bench->count == BENCH_MAX_RESULTS) {
+		printf("bench: too many cases, %s skipped\n", name);
+		return;
+	}
+
+	// warm up caches and branch predictors
+	fn(bench, arg, 1);
+
+	for (n = 1; ; n *= 2) {
+		bench->pausedNs = 0;
+		bench->pausedInsn = 0;
+
+		insn = read_insn(bench);
+		start = mono_ns();
+
+		fn(bench, arg, n);
+
+		elapsed = mono_ns() - start - bench->pausedNs;
+		insn = read_insn(bench) - insn - bench->pausedInsn;
+
+		if (elapsed >= bench->minSeconds * 1e9 || n >= (1UL << 30))
+			break;
+	}
+
+	result = &bench->results[bench->count++];
+	strncpy(result->name, name, sizeof(result->name) - 1);
+	result->name[sizeof(result->name) - 1] = 0;
+	result->iterations = n;
+	result->nsPerOp = (double)elapsed / n;
+	result->insnPerOp = bench->perfFd >= 0 ? (double)insn / n : -1.0;
+}
+
+void bench_print(const bench_t *bench)
+{
+	const bench_result_t *r;
+	int i;
+
+	printf("\n%-32s %12s %12s %12s\n", "case", "iterations", "ns/op", "insn/op");
+
+	for (i = 0; i < bench->count; i++) {
+		r = &bench->results[i];
+
+		if (r->insnPerOp < 0.0)
+			printf("%-32s %12lu %12.1f %12s\n", r->name, r->iterations, r->nsPerOp, "-");
+		else
+			printf("%-32s %12lu %12.1f %12.0f\n", r->name, r->iterations, r->nsPerOp, r->insnPerOp);
+	}
+}
+
+int bench_write_json(const bench_t *bench, const char *path, const char *label)
+{
+	const bench_result_t *r;
+	FILE *fh;
+	int i;
+
+	fh = fopen(path, "w");
+
+	if (!fh) {
+		perror(path);
+		return -1;
+	}
+
+	fprintf(fh, "{\n  \"label\": \"%s\",\n  \"time\": %ld,\n  \"instructions\": %s,\n  \"benchmarks\": [\n",
+		label ? label : "", (long)time(NULL), bench->perfFd >= 0 ? "true" : "false");
+
+	for (i = 0; i < bench->count; i++) {
+		r = &bench->results[i];
+
+		fprintf(fh, "    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f, ",
+			r->name, r->iterations, r->nsPerOp);
+
+		if (r->insnPerOp < 0.0)
+			fprintf(fh, "\"instructions_per_op\": null}");
+		else
+			fprintf(fh, "\"instructions_per_op\": %.1f}", r->insnPerOp);
+
+		fprintf(fh, "%s\n", i < bench->count - 1 ? "," : "");
+	}
+
+	fprintf(fh, "  ]\n}\n");
+	fclose(fh);
+
+	return 0;
+}
+
+// Library cases
+
+typedef struct {
+	mpudata_t mpu[NUM_INPUTS];
+	fusion_config_t config;
+	hostfusion_t host;
+	quaternion_t q[NUM_INPUTS];
+	vector3d_t v[NUM_INPUTS];
+} inputs_t;
+
+static void make_inputs(inputs_t *in)
+{
+	mpudata_t *mpu;
+	float a;
+	int i;
+
+	memset(in, 0, sizeof(inputs_t));
+	srand(1);
+
+	for (i = 0; i < NUM_INPUTS; i++) {
+		mpu = &in->mpu[i];
+		a = i * 0.05f;
+
+		// a slow roll with noise, in DMP units
+		mpu->rawQuat[QUAT_W] = (int32_t)(cosf(a / 2) * 1073741824.0f);
+		mpu->rawQuat[QUAT_X] = (int32_t)(sinf(a / 2) * 1073741824.0f);
+		mpu->rawQuat[QUAT_Y] = rand() % 1000000;
+		mpu->rawQuat[QUAT_Z] = rand() % 1000000;
+
+		mpu->rawGyro[VEC3_X] = 100 + rand() % 50;
+		mpu->rawGyro[VEC3_Y] = rand() % 50;
+		mpu->rawGyro[VEC3_Z] = rand() % 50;
+		mpu->rawAccel[VEC3_X] = rand() % 500;
+		mpu->rawAccel[VEC3_Y] = (short)(sinf(a) * 16384);
+		mpu->rawAccel[VEC3_Z] = (short)(cosf(a) * 16384);
+		mpu->rawMag[VEC3_X] = 200 + rand() % 20;
+		mpu->rawMag[VEC3_Y] = -100 + rand() % 20;
+		mpu->rawMag[VEC3_Z] = 300 + rand() % 20;
+
+		in->q[i][QUAT_W] = cosf(a / 2);
+		in->q[i][QUAT_X] = sinf(a / 2);
+		in->q[i][QUAT_Y] = 0.1f * sinf(a);
+		in->q[i][QUAT_Z] = 0.1f * cosf(a);
+
+		in->v[i][VEC3_X] = a;
+		in->v[i][VEC3_Y] = 0.5f * a;
+		in->v[i][VEC3_Z] = -a;
+	}
+
+	in->config.yawMixFactor = 4;
+	in->config.useAccelCal = 1;
+	in->config.useMagCal = 1;
+
+	for (i = 0; i < 3; i++) {
+		in->config.accelCal.offset[i] = 100;
+		in->config.accelCal.range[i] = 16500;
+		in->config.magCal.offset[i] = 50;
+		in->config.magCal.range[i] = 400;
+	}
+
+	hostfusion_init(&in->host, DEFAULT_HOSTFUSION_KP, DEFAULT_HOSTFUSION_KI);
+}
+
+static void case_fifo_parse(bench_t *bench, void *arg, unsigned long n)
+{
+	mpudata_t *mpu = (mpudata_t *)arg;
+	unsigned short queued = 0;
+	unsigned char more;
+	short sensors;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		if (queued == 0) {
+			// refill the driver's packet cache off the clock
+			bench_pause(bench);
+			mpu_sim_advance_us(BENCH_PACKETS * 1000000ULL / BENCH_RATE);
+
+			if (dmp_prefetch_fifo(&queued) < 0 || queued == 0) {
+				printf("bench: no FIFO data\n");
+				bench_resume(bench);
+				return;
+			}
+
+			bench_resume(bench);
+		}
+
+		dmp_read_fifo(mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &mpu->dmpTimestamp, &sensors, &more);
+		queued--;
+	}
+
+	bench_use(mpu);
+}
+
+static void case_fifo_burst(bench_t *bench, void *arg, unsigned long n)
+{
+	mpudata_t *mpu = (mpudata_t *)arg;
+	unsigned short queued;
+	unsigned char more;
+	short sensors;
+	unsigned long i;
+
+	// per packet, one prefetch brings in BENCH_PACKETS
+	for (i = 0; i < n; i += BENCH_PACKETS) {
+		bench_pause(bench);
+		mpu_sim_advance_us(BENCH_PACKETS * 1000000ULL / BENCH_RATE);
+		bench_resume(bench);
+
+		if (dmp_prefetch_fifo(&queued) < 0) {
+			printf("bench: prefetch failed\n");
+			return;
+		}
+
+		// drain the cache off the clock
+		bench_pause(bench);
+
+		while (queued-- > 0)
+			dmp_read_fifo(mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &mpu->dmpTimestamp, &sensors, &more);
+
+		bench_resume(bench);
+	}
+
+	bench_use(mpu);
+}
+
+static void case_calibrate(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		mpu9150_calibrate(&in->config, &in->mpu[i % NUM_INPUTS]);
+
+	bench_use(in->mpu);
+}
+
+static void case_fusion(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		mpu9150_fuse(&in->config, &in->mpu[i % NUM_INPUTS]);
+
+	bench_use(in->mpu);
+}
+
+static void case_process(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		mpu9150_process_config(&in->config, &in->mpu[i % NUM_INPUTS]);
+
+	bench_use(in->mpu);
+}
+
+static void case_hostfusion(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	mpudata_t *mpu;
+	unsigned long i;
+
+	for (i = 0; i < n; i++) {
+		mpu = &in->mpu[i % NUM_INPUTS];
+		hostfusion_update(&in->host, mpu->rawGyro, mpu->rawAccel, 16.4f, 1.0f / BENCH_RATE, mpu->rawQuat);
+	}
+
+	bench_use(in->mpu);
+}
+
+static void case_normalize(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		quaternionNormalize(in->q[i % NUM_INPUTS]);
+
+	bench_use(in->q);
+}
+
+static void case_to_euler(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		quaternionToEuler(in->q[i % NUM_INPUTS], in->v[i % NUM_INPUTS]);
+
+	bench_use(in->v);
+}
+
+static void case_to_quaternion(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		eulerToQuaternion(in->v[i % NUM_INPUTS], in->q[i % NUM_INPUTS]);
+
+	bench_use(in->q);
+}
+
+static void case_multiply(bench_t *bench, void *arg, unsigned long n)
+{
+	inputs_t *in = (inputs_t *)arg;
+	quaternion_t d;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		quaternionMultiply(in->q[i % NUM_INPUTS], in->q[(i + 1) % NUM_INPUTS], d);
+
+	bench_use(d);
+}
+
+int bench_library(bench_t *bench)
+{
+	mpu_sim_config_t sim_config;
+	inputs_t *in;
+	mpudata_t mpu;
+
+	in = (inputs_t *)malloc(sizeof(inputs_t));
+
+	if (!in) {
+		printf("bench: out of memory\n");
+		return -1;
+	}
+
+	make_inputs(in);
+
+	bench_run(bench, "calibrate_data", case_calibrate, in);
+	bench_run(bench, "data_fusion", case_fusion, in);
+	bench_run(bench, "calibrate_data+data_fusion", case_process, in);
+	bench_run(bench, "hostfusion_update", case_hostfusion, in);
+	bench_run(bench, "quaternionNormalize", case_normalize, in);
+	bench_run(bench, "quaternionToEuler", case_to_euler, in);
+	bench_run(bench, "eulerToQuaternion", case_to_quaternion, in);
+	bench_run(bench, "quaternionMultiply", case_multiply, in);
+
+	free(in);
+
+	if (bench->filter && !strstr("dmp_read_fifo dmp_prefetch_fifo", bench->filter))
+		return 0;
+
+	// the packet cases run the real driver against the simulator
+	mpu_sim_default_config(&sim_config);
+	sim_config.realtime = 0;
+	mpu_sim_init(&sim_config);
+	linux_set_transport(mpu_sim_transport());
+
+	if (mpu9150_init(BENCH_BUS, BENCH_RATE, 0)) {
+		mpu_sim_exit();
+		return -1;
+	}
+
+	memset(&mpu, 0, sizeof(mpudata_t));
+
+	bench_run(bench, "dmp_read_fifo", case_fifo_parse, &mpu);
+	bench_run(bench, "dmp_prefetch_fifo", case_fifo_burst, &mpu);
+
+	mpu9150_exit();
+	linux_set_transport(NULL);
+	mpu_sim_exit();
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// Minimal microbenchmark harness for the per-sample path. A case is a
+// function that does its operation n times. The harness grows n until a
+// run takes minSeconds and reports time per operation, and instructions
+// per operation when perf counters are available (perf_event_open, see
+// /proc/sys/kernel/perf_event_paranoid). Results can be written as JSON
+// to compare across commits.
+
+#define BENCH_MAX_RESULTS 64
+#define DEFAULT_BENCH_SECONDS 0.2
+
+typedef struct bench_s bench_t;
+
+typedef void (*bench_fn_t)(bench_t *bench, void *arg, unsigned long n);
+
+typedef struct {
+	char name[48];
+	unsigned long iterations;
+	double nsPerOp;
+	// < 0 without perf counters
+	double insnPerOp;
+} bench_result_t;
+
+struct bench_s {
+	double minSeconds;
+	const char *filter;
+	int perfFd;
+
+	bench_result_t results[BENCH_MAX_RESULTS];
+	int count;
+
+	// time and instructions spent paused in the current run
+	uint64_t pausedNs;
+	uint64_t pausedInsn;
+	uint64_t pauseStartNs;
+	uint64_t pauseStartInsn;
+};
+
+// filter is a substring of the case names to run, NULL for all
+int bench_init(bench_t *bench, double min_seconds, const char *filter);
+void bench_close(bench_t *bench);
+void bench_run(bench_t *bench, const char *name, bench_fn_t fn, void *arg);
+
+// Leave setup inside a case out of the measurement.
+void bench_pause(bench_t *bench);
+void bench_resume(bench_t *bench);
+
+void bench_print(const bench_t *bench);
+int bench_write_json(const bench_t *bench, const char *path, const char *label);
+
+// The library's own cases: FIFO packet parsing over the simulated
+// transport, calibration, fusion, the host filter and the quaternion
+// helpers. Installs the simulator as the transport.
+int bench_library(bench_t *bench);
+
+// Keeps the compiler from dropping a result.
+void bench_use(const void *p);
+
+#endif /* BENCH_H */
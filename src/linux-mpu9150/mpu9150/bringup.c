@@ -0,0 +1,121 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "linux_glue.h"
+#include "mpu9150.h"
+
+// Most of a bring-up is waiting, on the reset, the compass self test and
+// the firmware verify reads, so devices on buses of their own come up in
+// about the time of the slowest one. The driver's device selection is per
+// thread, each thread only touches its own bus and device state.
+
+typedef struct {
+	pthread_t thread;
+	int started;
+	int device;
+	int bus;
+	int sampleRate;
+	int mixFactor;
+	int result;
+} bringup_t;
+
+static void *bringup_thread(void *arg)
+{
+	bringup_t *b = (bringup_t *)arg;
+
+	mpu9150_set_init_progress(0);
+	b->result = mpu9150_init_device(b->device, b->bus, b->sampleRate, b->mixFactor);
+
+	return NULL;
+}
+
+static int buses_differ(int count, const int *buses)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		for (j = i + 1; j < count; j++) {
+			if (buses[i] == buses[j])
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+int mpu9150_init_devices(int count, const int *buses, int sample_rate, int mix_factor, int *results)
+{
+	bringup_t bringup[MPU_MAX_DEVICES];
+	int i, parallel, failed;
+
+	if (count < 1 || count > MPU_MAX_DEVICES) {
+		printf("Invalid device count %d\n", count);
+		return -1;
+	}
+
+	parallel = count > 1 && buses_differ(count, buses) && linux_transport_concurrent();
+
+	for (i = 0; i < count; i++) {
+		bringup[i].device = i;
+		bringup[i].bus = buses[i];
+		bringup[i].sampleRate = sample_rate;
+		bringup[i].mixFactor = mix_factor;
+		bringup[i].result = -1;
+		bringup[i].started = 0;
+	}
+
+	if (parallel) {
+		printf("\nInitializing %d IMUs in parallel ...", count);
+		fflush(stdout);
+
+		for (i = 0; i < count; i++) {
+			if (pthread_create(&bringup[i].thread, NULL, bringup_thread, &bringup[i])) {
+				perror("pthread_create");
+				// run this one here, the others carry on
+				bringup_thread(&bringup[i]);
+				mpu9150_set_init_progress(1);
+			}
+			else {
+				bringup[i].started = 1;
+			}
+		}
+
+		for (i = 0; i < count; i++) {
+			if (bringup[i].started)
+				pthread_join(bringup[i].thread, NULL);
+		}
+
+		printf(" done\n\n");
+	}
+	else {
+		for (i = 0; i < count; i++) {
+			bringup[i].result = mpu9150_init_device(i, buses[i], sample_rate, mix_factor);
+
+			if (bringup[i].result)
+				break;
+		}
+	}
+
+	failed = 0;
+
+	for (i = 0; i < count; i++) {
+		if (results)
+			results[i] = bringup[i].result;
+
+		if (bringup[i].result)
+			failed = 1;
+	}
+
+	// the threads selected their devices for themselves only
+	mpu9150_select_device(0);
+
+	return failed ? -1 : 0;
+}
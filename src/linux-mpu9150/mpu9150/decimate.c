@@ -0,0 +1,199 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "decimate.h"
+
+// the CIC output has to fit a signed 64 bit integer, inputs up to about
+// 2^27 fixed point units leave 2^36 for the gain
+#define MAX_CIC_GAIN	68719476736.0
+
+int decimate_filter_from_name(const char *name)
+{
+	if (!strcmp(name, "none"))
+		return DECIMATE_NONE;
+
+	if (!strcmp(name, "cic"))
+		return DECIMATE_CIC;
+
+	if (!strcmp(name, "fir"))
+		return DECIMATE_FIR;
+
+	return -1;
+}
+
+static void design_fir(decimator_t *d)
+{
+	float fc, center, x, sum;
+	int i;
+
+	// cycles per input sample
+	fc = 0.4f / d->factor;
+	center = (d->taps - 1) / 2.0f;
+	sum = 0.0f;
+
+	for (i = 0; i < d->taps; i++) {
+		x = 2.0f * fc * (i - center);
+		d->coeff[i] = 2.0f * fc * (x == 0.0f ? 1.0f : sinf((float)M_PI * x) / ((float)M_PI * x));
+
+		if (d->taps > 1)
+			d->coeff[i] *= 0.54f - 0.46f * cosf(2.0f * (float)M_PI * i / (d->taps - 1));
+
+		sum += d->coeff[i];
+	}
+
+	// unity gain at DC
+	for (i = 0; i < d->taps; i++)
+		d->coeff[i] /= sum;
+
+	d->delay = center;
+}
+
+int decimate_init(decimator_t *d, int factor, int filter, int size)
+{
+	if (factor < 1 || factor > DECIMATE_MAX_FACTOR) {
+		printf("Invalid decimation factor %d\n", factor);
+		return -1;
+	}
+
+	memset(d, 0, sizeof(decimator_t));
+
+	d->factor = factor;
+	d->filter = filter;
+
+	switch (filter) {
+	case DECIMATE_NONE:
+		break;
+
+	case DECIMATE_CIC:
+		d->order = size > 0 ? size : 2;
+		d->gain = pow(factor, d->order);
+
+		if (d->order > DECIMATE_MAX_ORDER || d->gain > MAX_CIC_GAIN) {
+			printf("CIC order %d too high for factor %d\n", d->order, factor);
+			return -1;
+		}
+
+		d->delay = d->order * (factor - 1) / 2.0f;
+		break;
+
+	case DECIMATE_FIR:
+		d->taps = size > 0 ? size : 8 * factor + 1;
+
+		// fewer taps than the default would pass aliases, use the CIC
+		// filter for factors that need more
+		if (d->taps > DECIMATE_MAX_TAPS) {
+			printf("At most %d FIR taps, factor %d needs the cic filter\n",
+				DECIMATE_MAX_TAPS, factor);
+			return -1;
+		}
+
+		design_fir(d);
+		break;
+
+	default:
+		printf("Invalid decimation filter %d\n", filter);
+		return -1;
+	}
+
+	// outputs held back until the filter has a full history
+	if (filter == DECIMATE_CIC)
+		d->warmup = d->order;
+	else if (filter == DECIMATE_FIR)
+		d->warmup = (d->taps - 1) / factor;
+
+	return 0;
+}
+
+static void add_cic(decimator_t *d, const float *sample)
+{
+	uint64_t v, prev;
+	int i, k;
+
+	for (i = 0; i < DECIMATE_CHANNELS; i++) {
+		v = (uint64_t)llround(sample[i] * DECIMATE_FIXED_ONE);
+
+		for (k = 0; k < d->order; k++) {
+			d->integ[k][i] += v;
+			v = d->integ[k][i];
+		}
+	}
+
+	if (d->phase < d->factor - 1)
+		return;
+
+	// the combs run at the output rate whether the output is fetched or not
+	for (i = 0; i < DECIMATE_CHANNELS; i++) {
+		v = d->integ[d->order - 1][i];
+
+		for (k = 0; k < d->order; k++) {
+			prev = d->comb[k][i];
+			d->comb[k][i] = v;
+			v -= prev;
+		}
+
+		d->out[i] = (float)((double)(int64_t)v / d->gain / DECIMATE_FIXED_ONE);
+	}
+}
+
+int decimate_add(decimator_t *d, const float *sample)
+{
+	switch (d->filter) {
+	case DECIMATE_CIC:
+		add_cic(d, sample);
+		break;
+
+	case DECIMATE_FIR:
+		memcpy(d->history[d->head], sample, sizeof(d->history[0]));
+
+		if (++d->head == d->taps)
+			d->head = 0;
+
+		break;
+
+	default:
+		if (d->phase >= d->factor - 1)
+			memcpy(d->out, sample, sizeof(d->out));
+
+		break;
+	}
+
+	if (++d->phase < d->factor)
+		return 0;
+
+	d->phase = 0;
+
+	if (d->warmup > 0) {
+		d->warmup--;
+		return 0;
+	}
+
+	return 1;
+}
+
+void decimate_output(decimator_t *d, float *out)
+{
+	int i, k, j;
+
+	if (d->filter == DECIMATE_FIR) {
+		memset(d->out, 0, sizeof(d->out));
+
+		// the coefficients are symmetric, the history order does not matter
+		for (k = 0, j = d->head; k < d->taps; k++) {
+			for (i = 0; i < DECIMATE_CHANNELS; i++)
+				d->out[i] += d->coeff[k] * d->history[j][i];
+
+			if (++j == d->taps)
+				j = 0;
+		}
+	}
+
+	memcpy(out, d->out, sizeof(d->out));
+}
@@ -0,0 +1,69 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef DECIMATE_H
+#define DECIMATE_H
+
+#include <stdint.h>
+
+// An output stream at a fraction of the sample rate. Every sample goes in,
+// one in factor comes out. Without a filter that is the newest sample.
+//
+// The CIC filter averages the last factor samples, order times over. It
+// runs in wrapping 64 bit integers on a fixed point copy of the input, so
+// its integrators never lose precision however long it runs. The FIR
+// filter is a Hamming windowed sinc cut off at 0.4 of the output rate,
+// only evaluated when an output is fetched. Its default length fits
+// DECIMATE_MAX_TAPS up to a factor of 16, larger factors need the CIC
+// filter. Both delay the output by delay input samples.
+
+#define DECIMATE_CHANNELS	6
+#define DECIMATE_MAX_FACTOR	1000
+#define DECIMATE_MAX_ORDER	4
+#define DECIMATE_MAX_TAPS	129
+
+// fixed point scale of the CIC input, 1/65536 of an input unit
+#define DECIMATE_FIXED_ONE	65536.0
+
+enum {
+	DECIMATE_NONE = 0,
+	DECIMATE_CIC,
+	DECIMATE_FIR
+};
+
+typedef struct {
+	int factor;
+	int filter;
+	float delay;
+	int phase;
+	int warmup;
+
+	// FIR
+	int taps;
+	float coeff[DECIMATE_MAX_TAPS];
+	float history[DECIMATE_MAX_TAPS][DECIMATE_CHANNELS];
+	int head;
+
+	// CIC
+	int order;
+	double gain;
+	uint64_t integ[DECIMATE_MAX_ORDER][DECIMATE_CHANNELS];
+	uint64_t comb[DECIMATE_MAX_ORDER][DECIMATE_CHANNELS];
+
+	float out[DECIMATE_CHANNELS];
+} decimator_t;
+
+// none, cic or fir, -1 for anything else
+int decimate_filter_from_name(const char *name);
+// size is the CIC order or the FIR taps, 0 for the default of 2 or
+// 8 * factor + 1, more than DECIMATE_MAX_TAPS taps fail
+int decimate_init(decimator_t *d, int factor, int filter, int size);
+// 1 when an output is due, fetch it with decimate_output() before the next
+int decimate_add(decimator_t *d, const float *sample);
+void decimate_output(decimator_t *d, float *out);
+
+#endif /* DECIMATE_H */
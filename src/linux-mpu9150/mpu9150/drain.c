@@ -0,0 +1,136 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "drain.h"
+
+// Smoothing of the measured packet rate and latency.
+#define RATE_GAIN		0.05f
+#define LATENCY_GAIN	0.05f
+
+static const char *policy_names[] = { "fixed", "latency", "wakeups" };
+
+int drain_policy_from_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i <= DRAIN_WAKEUPS; i++) {
+		if (!strcmp(name, policy_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+const char *drain_policy_name(int policy)
+{
+	if (policy < 0 || policy > DRAIN_WAKEUPS)
+		return "unknown";
+
+	return policy_names[policy];
+}
+
+void drain_init(drain_t *drain, int policy, int sample_rate, int fifo_packets,
+		uint32_t max_latency_ms, float fill_target)
+{
+	memset(drain, 0, sizeof(drain_t));
+
+	if (sample_rate < 1)
+		sample_rate = 1;
+
+	if (fill_target <= 0.0f)
+		fill_target = DEFAULT_DRAIN_FILL_TARGET;
+	else if (fill_target > MAX_DRAIN_FILL_TARGET)
+		fill_target = MAX_DRAIN_FILL_TARGET;
+
+	drain->policy = policy;
+	drain->maxLatency = max_latency_ms;
+	drain->fillTarget = fill_target;
+	drain->fifoPackets = fifo_packets;
+	drain->period = 1000.0f / sample_rate;
+	drain->rate = 1.0f / drain->period;
+	drain->nextWait = (uint32_t)(drain->period + 0.5f);
+}
+
+// Call after each wake up with the number of packets that were waiting in
+// the FIFO, all of which are assumed to be drained. Returns the time to
+// sleep before the next wake up in ms.
+uint32_t drain_update(drain_t *drain, uint32_t now, int queued)
+{
+	float wait, latency, limit;
+	uint32_t elapsed;
+
+	if (queued < 0)
+		queued = 0;
+
+	elapsed = now - drain->lastWake;
+
+	// The FIFO was empty after the last wake up, so everything found now
+	// arrived since then. Long intervals give the better estimate.
+	if (drain->wakeups > 0 && elapsed > 0 && queued < drain->fifoPackets) {
+		float gain = RATE_GAIN * elapsed / drain->period;
+
+		if (gain > 1.0f)
+			gain = 1.0f;
+
+		drain->rate += gain * ((float)queued / elapsed - drain->rate);
+
+		// don't let a few empty wake ups stall the loop
+		if (drain->rate < 0.1f / drain->period)
+			drain->rate = 0.1f / drain->period;
+	}
+
+	drain->lastWake = now;
+	drain->wakeups++;
+	drain->packets += queued;
+
+	if (queued == 0)
+		drain->emptyWakeups++;
+
+	if (queued > drain->maxQueued)
+		drain->maxQueued = queued;
+
+	latency = queued / drain->rate;
+	drain->avgLatency += LATENCY_GAIN * (latency - drain->avgLatency);
+
+	if (latency > drain->maxLatencySeen)
+		drain->maxLatencySeen = latency;
+
+	switch (drain->policy) {
+	case DRAIN_LATENCY:
+		// no point waking before the next packet can be there
+		wait = drain->maxLatency;
+
+		if (wait < 1.0f / drain->rate)
+			wait = 1.0f / drain->rate;
+
+		break;
+
+	case DRAIN_WAKEUPS:
+		wait = drain->fillTarget * drain->fifoPackets / drain->rate;
+		break;
+
+	default:
+		wait = drain->period;
+		break;
+	}
+
+	// never let the FIFO get close to overflowing
+	limit = MAX_DRAIN_FILL_TARGET * drain->fifoPackets / drain->rate;
+
+	if (wait > limit)
+		wait = limit;
+
+	if (wait < 1.0f)
+		wait = 1.0f;
+
+	drain->nextWait = (uint32_t)(wait + 0.5f);
+
+	return drain->nextWait;
+}
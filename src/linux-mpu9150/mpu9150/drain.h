@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef DRAIN_H
+#define DRAIN_H
+
+#include <stdint.h>
+
+// Decides when to wake up next and drain the DMP FIFO, based on how many
+// packets were queued at each wake up.
+//
+// DRAIN_FIXED    wake once per sample period, the original behaviour
+// DRAIN_LATENCY  wake often enough that no packet waits longer than maxLatency
+// DRAIN_WAKEUPS  wake as rarely as possible, letting the FIFO fill up to
+//                fillTarget before draining it in one burst
+
+#define DRAIN_FIXED		0
+#define DRAIN_LATENCY	1
+#define DRAIN_WAKEUPS	2
+
+#define DEFAULT_DRAIN_LATENCY_MS	20
+#define DEFAULT_DRAIN_FILL_TARGET	0.5f
+#define MAX_DRAIN_FILL_TARGET		0.9f
+
+typedef struct {
+	int policy;
+	float maxLatency;
+	float fillTarget;
+	// FIFO capacity in packets
+	int fifoPackets;
+
+	// packets per ms, starts at the nominal rate and tracks the DMP clock
+	float rate;
+	float period;
+
+	uint32_t lastWake;
+	uint32_t nextWait;
+
+	unsigned long wakeups;
+	unsigned long emptyWakeups;
+	unsigned long packets;
+	int maxQueued;
+
+	// age of the oldest packet at wake up, in ms
+	float avgLatency;
+	float maxLatencySeen;
+} drain_t;
+
+int drain_policy_from_name(const char *name);
+const char *drain_policy_name(int policy);
+void drain_init(drain_t *drain, int policy, int sample_rate, int fifo_packets,
+		uint32_t max_latency_ms, float fill_target);
+uint32_t drain_update(drain_t *drain, uint32_t now, int queued);
+
+#endif /* DRAIN_H */
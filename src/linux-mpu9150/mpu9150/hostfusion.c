@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <math.h>
+#include <string.h>
+
+#include "hostfusion.h"
+
+// q30, as produced by the DMP
+#define QUAT_SCALE	1073741824.0f
+
+static void seed_from_accel(hostfusion_t *fusion, const float *a);
+
+void hostfusion_init(hostfusion_t *fusion, float kp, float ki)
+{
+	memset(fusion, 0, sizeof(hostfusion_t));
+
+	fusion->q[QUAT_W] = 1.0f;
+	fusion->kp = kp;
+	fusion->ki = ki;
+}
+
+void hostfusion_update(hostfusion_t *fusion, const short *gyro, const short *accel,
+		float gyro_sens, float dt, int32_t *quat)
+{
+	float a[3], w[3], v[3], e[3];
+	float norm, qw, qx, qy, qz;
+	float *q = fusion->q;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		a[i] = accel[i];
+		w[i] = gyro[i] / gyro_sens * DEGREE_TO_RAD;
+	}
+
+	norm = sqrtf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+
+	if (!fusion->initialized && norm > 0.0f) {
+		seed_from_accel(fusion, a);
+		fusion->initialized = 1;
+	}
+
+	// free fall or garbage gives no usable gravity reference
+	if (norm > 0.0f) {
+		for (i = 0; i < 3; i++)
+			a[i] /= norm;
+
+		// gravity direction as predicted by the current estimate
+		v[0] = 2.0f * (q[QUAT_X] * q[QUAT_Z] - q[QUAT_W] * q[QUAT_Y]);
+		v[1] = 2.0f * (q[QUAT_W] * q[QUAT_X] + q[QUAT_Y] * q[QUAT_Z]);
+		v[2] = q[QUAT_W] * q[QUAT_W] - q[QUAT_X] * q[QUAT_X]
+			- q[QUAT_Y] * q[QUAT_Y] + q[QUAT_Z] * q[QUAT_Z];
+
+		e[0] = a[1] * v[2] - a[2] * v[1];
+		e[1] = a[2] * v[0] - a[0] * v[2];
+		e[2] = a[0] * v[1] - a[1] * v[0];
+
+		for (i = 0; i < 3; i++) {
+			fusion->bias[i] -= fusion->ki * e[i] * dt;
+			w[i] += fusion->kp * e[i];
+		}
+	}
+
+	for (i = 0; i < 3; i++)
+		w[i] -= fusion->bias[i];
+
+	qw = q[QUAT_W];
+	qx = q[QUAT_X];
+	qy = q[QUAT_Y];
+	qz = q[QUAT_Z];
+
+	q[QUAT_W] += 0.5f * dt * (-qx * w[0] - qy * w[1] - qz * w[2]);
+	q[QUAT_X] += 0.5f * dt * (qw * w[0] + qy * w[2] - qz * w[1]);
+	q[QUAT_Y] += 0.5f * dt * (qw * w[1] - qx * w[2] + qz * w[0]);
+	q[QUAT_Z] += 0.5f * dt * (qw * w[2] + qx * w[1] - qy * w[0]);
+
+	quaternionNormalize(q);
+
+	for (i = 0; i < 4; i++)
+		quat[i] = (int32_t)(q[i] * QUAT_SCALE);
+}
+
+// Start level with the measured gravity instead of converging from identity.
+void seed_from_accel(hostfusion_t *fusion, const float *a)
+{
+	vector3d_t euler;
+
+	euler[VEC3_X] = atan2f(a[1], a[2]);
+	euler[VEC3_Y] = atan2f(-a[0], sqrtf(a[1] * a[1] + a[2] * a[2]));
+	euler[VEC3_Z] = 0.0f;
+
+	eulerToQuaternion(euler, fusion->q);
+}
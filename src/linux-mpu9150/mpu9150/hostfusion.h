@@ -0,0 +1,36 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef HOSTFUSION_H
+#define HOSTFUSION_H
+
+#include <stdint.h>
+
+#include "quaternion.h"
+
+// 6-axis attitude estimate computed on the host for the raw (non-DMP) mode.
+// A complementary filter in the style of Mahony: the gyro is integrated and
+// the accel pulls roll and pitch towards gravity. The result is written in
+// the DMP's q30 format so data_fusion() can use it unchanged.
+
+#define DEFAULT_HOSTFUSION_KP	1.0f
+#define DEFAULT_HOSTFUSION_KI	0.05f
+
+typedef struct {
+	quaternion_t q;
+	float kp;
+	float ki;
+	// gyro bias estimate in rad/s
+	float bias[3];
+	int initialized;
+} hostfusion_t;
+
+void hostfusion_init(hostfusion_t *fusion, float kp, float ki);
+void hostfusion_update(hostfusion_t *fusion, const short *gyro, const short *accel,
+		float gyro_sens, float dt, int32_t *quat);
+
+#endif /* HOSTFUSION_H */
@@ -0,0 +1,385 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "imuarray.h"
+
+// Starting noise estimates, roughly one datasheet RMS noise figure
+// at the default 2000 dps / 2 g full scale ranges.
+#define GYRO_VAR_PRIOR		1.0f
+#define ACCEL_VAR_PRIOR		2000.0f
+
+// Floors keep one quiet device from taking all of the weight.
+#define GYRO_VAR_MIN		0.05f
+#define ACCEL_VAR_MIN		50.0f
+
+// Smoothing of the running noise and heading alignment estimates.
+#define VAR_GAIN			0.01f
+#define ALIGN_GAIN			0.01f
+
+static void matrix_to_quaternion(const float *m, quaternion_t q);
+static void rotate(const float *m, const short *in, float *out);
+static float median(float *v, int n);
+static void combine_axis(imuarray_t *array, float (*x)[3], int *use, int axis,
+		int gyro, float *result);
+
+void imuarray_init(imuarray_t *array, int num_devices, float outlier_sigma, uint32_t max_skew_ms)
+{
+	int i, j;
+	signed char identity[9] = { 1, 0, 0,
+								0, 1, 0,
+								0, 0, 1 };
+
+	memset(array, 0, sizeof(imuarray_t));
+
+	if (num_devices > IMUARRAY_MAX_DEVICES)
+		num_devices = IMUARRAY_MAX_DEVICES;
+
+	array->numDevices = num_devices;
+	array->outlierSigma = outlier_sigma;
+	array->maxSkew = max_skew_ms;
+
+	for (i = 0; i < num_devices; i++) {
+		imuarray_set_orientation(array, i, identity);
+
+		for (j = 0; j < 3; j++) {
+			array->dev[i].gyroVar[j] = GYRO_VAR_PRIOR;
+			array->dev[i].accelVar[j] = ACCEL_VAR_PRIOR;
+		}
+	}
+}
+
+int imuarray_set_orientation(imuarray_t *array, int device, const signed char *mtx)
+{
+	int i, det;
+	quaternion_t q;
+	imudevice_t *dev;
+
+	if (device < 0 || device >= array->numDevices)
+		return -1;
+
+	// only proper rotations, a mirrored mount can't be expressed as a quaternion
+	det = mtx[0] * (mtx[4] * mtx[8] - mtx[5] * mtx[7])
+		- mtx[1] * (mtx[3] * mtx[8] - mtx[5] * mtx[6])
+		+ mtx[2] * (mtx[3] * mtx[7] - mtx[4] * mtx[6]);
+
+	if (det != 1) {
+		printf("Invalid mounting matrix for device %d\n", device);
+		return -1;
+	}
+
+	dev = &array->dev[device];
+
+	for (i = 0; i < 9; i++)
+		dev->mount[i] = mtx[i];
+
+	matrix_to_quaternion(dev->mount, q);
+	quaternionConjugate(q, dev->mountConj);
+
+	dev->yawAlign[QUAT_W] = 1.0f;
+	dev->yawAlign[QUAT_X] = 0.0f;
+	dev->yawAlign[QUAT_Y] = 0.0f;
+	dev->yawAlign[QUAT_Z] = 0.0f;
+	dev->aligned = 0;
+
+	return 0;
+}
+
+int imuarray_combine(imuarray_t *array, mpudata_t *samples, const int *valid, mpudata_t *out)
+{
+	int i, axis, ref, count;
+	int use[IMUARRAY_MAX_DEVICES];
+	float gyro[IMUARRAY_MAX_DEVICES][3];
+	float accel[IMUARRAY_MAX_DEVICES][3];
+	float mag[IMUARRAY_MAX_DEVICES][3];
+	quaternion_t quat[IMUARRAY_MAX_DEVICES];
+	quaternion_t chipQuat, tmpQuat, alignQuat, refConj;
+	vector3d_t euler;
+	float combinedGyro[3], combinedAccel[3], combinedMag[3];
+	float weight, dot;
+	uint32_t newest;
+	imudevice_t *dev;
+
+	newest = 0;
+	count = 0;
+
+	for (i = 0; i < array->numDevices; i++) {
+		if (valid[i] && (count == 0 || (int32_t)(samples[i].dmpTimestamp - newest) > 0))
+			newest = samples[i].dmpTimestamp;
+
+		if (valid[i])
+			count++;
+	}
+
+	if (count == 0)
+		return -1;
+
+	// drop anything read too long before the newest sample, see imuarray.h
+	ref = -1;
+	count = 0;
+
+	for (i = 0; i < array->numDevices; i++) {
+		use[i] = 0;
+
+		if (!valid[i])
+			continue;
+
+		if (newest - samples[i].dmpTimestamp > array->maxSkew) {
+			array->dev[i].stale++;
+			continue;
+		}
+
+		dev = &array->dev[i];
+
+		rotate(dev->mount, samples[i].rawGyro, gyro[i]);
+		rotate(dev->mount, samples[i].rawAccel, accel[i]);
+		rotate(dev->mount, samples[i].rawMag, mag[i]);
+
+		chipQuat[QUAT_W] = (float)samples[i].rawQuat[QUAT_W];
+		chipQuat[QUAT_X] = (float)samples[i].rawQuat[QUAT_X];
+		chipQuat[QUAT_Y] = (float)samples[i].rawQuat[QUAT_Y];
+		chipQuat[QUAT_Z] = (float)samples[i].rawQuat[QUAT_Z];
+		quaternionNormalize(chipQuat);
+
+		// body orientation is chip orientation followed by body-to-chip
+		quaternionMultiply(chipQuat, dev->mountConj, quat[i]);
+
+		use[i] = 1;
+		count++;
+
+		if (ref < 0)
+			ref = i;
+	}
+
+	if (count == 0)
+		return -1;
+
+	// each DMP starts its heading at zero in its own chip frame, so the
+	// quaternions only agree after removing a per-device yaw offset,
+	// measured against the reference device and then slowly tracked
+	dev = &array->dev[ref];
+	quaternionMultiply(dev->yawAlign, quat[ref], tmpQuat);
+	memcpy(quat[ref], tmpQuat, sizeof(quaternion_t));
+	dev->aligned = 1;
+
+	quaternionConjugate(quat[ref], refConj);
+
+	for (i = ref + 1; i < array->numDevices; i++) {
+		if (!use[i])
+			continue;
+
+		dev = &array->dev[i];
+
+		quaternionMultiply(dev->yawAlign, quat[i], tmpQuat);
+		quaternionMultiply(tmpQuat, refConj, alignQuat);
+		quaternionToEuler(alignQuat, euler);
+
+		euler[VEC3_X] = 0.0f;
+		euler[VEC3_Y] = 0.0f;
+		euler[VEC3_Z] = -euler[VEC3_Z] * (dev->aligned ? ALIGN_GAIN : 1.0f);
+		eulerToQuaternion(euler, alignQuat);
+
+		quaternionMultiply(alignQuat, dev->yawAlign, tmpQuat);
+		memcpy(dev->yawAlign, tmpQuat, sizeof(quaternion_t));
+		quaternionNormalize(dev->yawAlign);
+		dev->aligned = 1;
+
+		quaternionMultiply(dev->yawAlign, quat[i], tmpQuat);
+		memcpy(quat[i], tmpQuat, sizeof(quaternion_t));
+	}
+
+	for (axis = 0; axis < 3; axis++) {
+		combine_axis(array, gyro, use, axis, 1, &combinedGyro[axis]);
+		combine_axis(array, accel, use, axis, 0, &combinedAccel[axis]);
+	}
+
+	// orientation and mag are averaged over every device still in use,
+	// quaternions sign-aligned to the reference first
+	memset(chipQuat, 0, sizeof(quaternion_t));
+	memset(combinedMag, 0, sizeof(combinedMag));
+
+	for (i = 0; i < array->numDevices; i++) {
+		if (!use[i])
+			continue;
+
+		dev = &array->dev[i];
+		weight = 3.0f / (dev->gyroVar[0] + dev->gyroVar[1] + dev->gyroVar[2]);
+
+		dot = quat[i][QUAT_W] * quat[ref][QUAT_W] + quat[i][QUAT_X] * quat[ref][QUAT_X]
+			+ quat[i][QUAT_Y] * quat[ref][QUAT_Y] + quat[i][QUAT_Z] * quat[ref][QUAT_Z];
+
+		if (dot < 0.0f)
+			weight = -weight;
+
+		chipQuat[QUAT_W] += weight * quat[i][QUAT_W];
+		chipQuat[QUAT_X] += weight * quat[i][QUAT_X];
+		chipQuat[QUAT_Y] += weight * quat[i][QUAT_Y];
+		chipQuat[QUAT_Z] += weight * quat[i][QUAT_Z];
+
+		combinedMag[VEC3_X] += mag[i][VEC3_X];
+		combinedMag[VEC3_Y] += mag[i][VEC3_Y];
+		combinedMag[VEC3_Z] += mag[i][VEC3_Z];
+
+		dev->used++;
+	}
+
+	quaternionNormalize(chipQuat);
+
+	for (axis = 0; axis < 3; axis++) {
+		out->rawGyro[axis] = (short)lrintf(combinedGyro[axis]);
+		out->rawAccel[axis] = (short)lrintf(combinedAccel[axis]);
+		out->rawMag[axis] = (short)lrintf(combinedMag[axis] / count);
+	}
+
+	// back to the DMP's q30 format so the usual fusion applies unchanged
+	out->rawQuat[QUAT_W] = (int32_t)(chipQuat[QUAT_W] * 1073741824.0f);
+	out->rawQuat[QUAT_X] = (int32_t)(chipQuat[QUAT_X] * 1073741824.0f);
+	out->rawQuat[QUAT_Y] = (int32_t)(chipQuat[QUAT_Y] * 1073741824.0f);
+	out->rawQuat[QUAT_Z] = (int32_t)(chipQuat[QUAT_Z] * 1073741824.0f);
+
+	out->dmpTimestamp = newest;
+	out->magTimestamp = samples[ref].magTimestamp;
+
+	return 0;
+}
+
+// Inverse-variance weighted mean of one axis with median based outlier
+// rejection. Also updates the running noise estimate of every device.
+static void combine_axis(imuarray_t *array, float (*x)[3], int *use, int axis,
+		int gyro, float *result)
+{
+	int i, n, kept;
+	float v[IMUARRAY_MAX_DEVICES];
+	float limit[IMUARRAY_MAX_DEVICES];
+	float med, r, varMin;
+	float weight, weightSum, sum;
+	float *devVar;
+
+	n = 0;
+
+	for (i = 0; i < array->numDevices; i++) {
+		if (use[i])
+			v[n++] = x[i][axis];
+	}
+
+	med = median(v, n);
+	varMin = gyro ? GYRO_VAR_MIN : ACCEL_VAR_MIN;
+
+	kept = 0;
+	sum = 0.0f;
+	weightSum = 0.0f;
+
+	for (i = 0; i < array->numDevices; i++) {
+		if (!use[i])
+			continue;
+
+		devVar = gyro ? array->dev[i].gyroVar : array->dev[i].accelVar;
+		r = x[i][axis] - med;
+		limit[i] = array->outlierSigma * sqrtf(devVar[axis] + varMin);
+
+		// rejection is only meaningful with a majority to vote against
+		if (n > 2 && fabsf(r) > limit[i]) {
+			array->dev[i].rejected++;
+			continue;
+		}
+
+		weight = 1.0f / devVar[axis];
+		sum += weight * x[i][axis];
+		weightSum += weight;
+		kept++;
+	}
+
+	if (kept == 0) {
+		// no consensus, plain median is the safest answer
+		*result = med;
+		return;
+	}
+
+	*result = sum / weightSum;
+
+	// residuals are clipped at the rejection limit so that a glitching
+	// device loses weight gradually instead of talking its way back in
+	for (i = 0; i < array->numDevices; i++) {
+		if (!use[i])
+			continue;
+
+		devVar = gyro ? array->dev[i].gyroVar : array->dev[i].accelVar;
+		r = fminf(fabsf(x[i][axis] - *result), limit[i]);
+		devVar[axis] += VAR_GAIN * (r * r - devVar[axis]);
+
+		if (devVar[axis] < varMin)
+			devVar[axis] = varMin;
+	}
+}
+
+static float median(float *v, int n)
+{
+	int i, j;
+	float t;
+
+	// n is tiny, insertion sort
+	for (i = 1; i < n; i++) {
+		t = v[i];
+
+		for (j = i - 1; j >= 0 && v[j] > t; j--)
+			v[j + 1] = v[j];
+
+		v[j + 1] = t;
+	}
+
+	if (n & 1)
+		return v[n / 2];
+
+	return 0.5f * (v[n / 2 - 1] + v[n / 2]);
+}
+
+static void rotate(const float *m, const short *in, float *out)
+{
+	out[VEC3_X] = m[0] * in[VEC3_X] + m[1] * in[VEC3_Y] + m[2] * in[VEC3_Z];
+	out[VEC3_Y] = m[3] * in[VEC3_X] + m[4] * in[VEC3_Y] + m[5] * in[VEC3_Z];
+	out[VEC3_Z] = m[6] * in[VEC3_X] + m[7] * in[VEC3_Y] + m[8] * in[VEC3_Z];
+}
+
+static void matrix_to_quaternion(const float *m, quaternion_t q)
+{
+	float trace = m[0] + m[4] + m[8];
+	float s;
+
+	if (trace > 0.0f) {
+		s = sqrtf(trace + 1.0f) * 2.0f;
+		q[QUAT_W] = 0.25f * s;
+		q[QUAT_X] = (m[7] - m[5]) / s;
+		q[QUAT_Y] = (m[2] - m[6]) / s;
+		q[QUAT_Z] = (m[3] - m[1]) / s;
+	}
+	else if (m[0] > m[4] && m[0] > m[8]) {
+		s = sqrtf(1.0f + m[0] - m[4] - m[8]) * 2.0f;
+		q[QUAT_W] = (m[7] - m[5]) / s;
+		q[QUAT_X] = 0.25f * s;
+		q[QUAT_Y] = (m[1] + m[3]) / s;
+		q[QUAT_Z] = (m[2] + m[6]) / s;
+	}
+	else if (m[4] > m[8]) {
+		s = sqrtf(1.0f + m[4] - m[0] - m[8]) * 2.0f;
+		q[QUAT_W] = (m[2] - m[6]) / s;
+		q[QUAT_X] = (m[1] + m[3]) / s;
+		q[QUAT_Y] = 0.25f * s;
+		q[QUAT_Z] = (m[5] + m[7]) / s;
+	}
+	else {
+		s = sqrtf(1.0f + m[8] - m[0] - m[4]) * 2.0f;
+		q[QUAT_W] = (m[3] - m[1]) / s;
+		q[QUAT_X] = (m[2] + m[6]) / s;
+		q[QUAT_Y] = (m[5] + m[7]) / s;
+		q[QUAT_Z] = 0.25f * s;
+	}
+
+	quaternionNormalize(q);
+}
@@ -0,0 +1,58 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef IMUARRAY_H
+#define IMUARRAY_H
+
+#include "mpu9150.h"
+
+// Combines several rigidly mounted IMUs into one virtual IMU.
+// Every device is rotated into the common body frame with its mounting
+// matrix, outliers are rejected against the per-axis median and the
+// remaining samples are averaged with inverse-variance weights.
+//
+// This is not a time alignment. DMP packets carry no sensor time, the
+// timestamps are the host clock at the read, and each read returns the
+// newest packet of its device. The skew check only drops samples read
+// more than maxSkew ms after the newest one, e.g. behind a slow bus
+// retry. Devices are only as aligned as their sample clocks.
+
+#define IMUARRAY_MAX_DEVICES 4
+
+#define DEFAULT_OUTLIER_SIGMA 4.0f
+#define DEFAULT_MAX_SKEW_MS 10
+
+typedef struct {
+	// chip to body, same layout as gyro_orientation in mpu9150.c
+	float mount[9];
+	quaternion_t mountConj;
+
+	// removes the arbitrary start heading of this device's DMP
+	quaternion_t yawAlign;
+	int aligned;
+
+	// running noise estimates in hardware units squared
+	float gyroVar[3];
+	float accelVar[3];
+
+	unsigned long used;
+	unsigned long rejected;
+	unsigned long stale;
+} imudevice_t;
+
+typedef struct {
+	int numDevices;
+	imudevice_t dev[IMUARRAY_MAX_DEVICES];
+	float outlierSigma;
+	uint32_t maxSkew;
+} imuarray_t;
+
+void imuarray_init(imuarray_t *array, int num_devices, float outlier_sigma, uint32_t max_skew_ms);
+int imuarray_set_orientation(imuarray_t *array, int device, const signed char *mtx);
+int imuarray_combine(imuarray_t *array, mpudata_t *samples, const int *valid, mpudata_t *out);
+
+#endif /* IMUARRAY_H */
@@ -0,0 +1,131 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+static const char *stage_names[] = { "bus", "fusion", "publish", "total", "age" };
+
+static int bucket_index(uint64_t ns)
+{
+	int e;
+
+	if (ns < LATENCY_SUB_BUCKETS)
+		return (int)ns;
+
+	e = 63 - __builtin_clzll(ns);
+
+	if (e >= LATENCY_MAX_BITS)
+		return LATENCY_BUCKETS - 1;
+
+	return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS
+		+ (int)(ns >> (e - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS;
+}
+
+// middle of the range of values a bucket holds
+static uint64_t bucket_value(int index)
+{
+	int group = index / LATENCY_SUB_BUCKETS;
+	int sub = index % LATENCY_SUB_BUCKETS;
+	int shift;
+
+	if (group == 0)
+		return sub;
+
+	shift = group - 1;
+
+	return ((uint64_t)(LATENCY_SUB_BUCKETS + sub) << shift) + ((1ULL << shift) >> 1);
+}
+
+void latency_hist_reset(latency_hist_t *hist)
+{
+	memset(hist, 0, sizeof(latency_hist_t));
+}
+
+void latency_hist_add(latency_hist_t *hist, uint64_t ns)
+{
+	hist->counts[bucket_index(ns)]++;
+	hist->count++;
+	hist->sum += ns;
+
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+uint64_t latency_hist_percentile(const latency_hist_t *hist, double p)
+{
+	uint64_t rank, seen, value;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	if (p >= 100.0)
+		return hist->max;
+
+	// smallest value with at least p percent of the samples at or below it
+	rank = (uint64_t)(p / 100.0 * hist->count + 0.5);
+
+	if (rank == 0)
+		rank = 1;
+
+	seen = 0;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->counts[i];
+
+		if (seen >= rank)
+			break;
+	}
+
+	value = bucket_value(i);
+
+	return value < hist->max ? value : hist->max;
+}
+
+void latency_init(latency_t *latency)
+{
+	int i;
+
+	for (i = 0; i < LATENCY_STAGES; i++)
+		latency_hist_reset(&latency->stage[i]);
+}
+
+const char *latency_stage_name(int stage)
+{
+	if (stage < 0 || stage >= LATENCY_STAGES)
+		return "unknown";
+
+	return stage_names[stage];
+}
+
+uint64_t latency_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// a stage that ran backwards counts as 0
+static uint64_t span(uint64_t from, uint64_t to)
+{
+	return to > from ? to - from : 0;
+}
+
+void latency_add_sample(latency_t *latency, uint64_t sample_ns, uint64_t ready_ns,
+		uint64_t bus_ns, uint64_t fusion_ns, uint64_t published_ns)
+{
+	latency_hist_add(&latency->stage[LATENCY_BUS], span(ready_ns, bus_ns));
+	latency_hist_add(&latency->stage[LATENCY_FUSION], span(bus_ns, fusion_ns));
+	latency_hist_add(&latency->stage[LATENCY_PUBLISH], span(fusion_ns, published_ns));
+	latency_hist_add(&latency->stage[LATENCY_TOTAL], span(ready_ns, published_ns));
+	latency_hist_add(&latency->stage[LATENCY_AGE], span(sample_ns, published_ns));
+}
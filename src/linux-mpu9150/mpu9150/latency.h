@@ -0,0 +1,63 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+// Where the time goes between a sample becoming available and it being
+// published. Each stage has a fixed bucket log-linear histogram, HDR style:
+// LATENCY_SUB_BUCKETS buckets per power of two of nanoseconds, so any
+// percentile is within about 3% and adding a value is a few shifts.
+//
+// LATENCY_BUS      data ready seen to the sample read off the bus
+// LATENCY_FUSION   calibration and fusion
+// LATENCY_PUBLISH  message fill and publish
+// LATENCY_TOTAL    data ready seen to published
+// LATENCY_AGE      estimated sample time to published, includes the time
+//                  the packet waited in the FIFO
+
+#define LATENCY_BUS			0
+#define LATENCY_FUSION		1
+#define LATENCY_PUBLISH		2
+#define LATENCY_TOTAL		3
+#define LATENCY_AGE			4
+#define LATENCY_STAGES		5
+
+#define LATENCY_SUB_BITS	5
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+// values from 2^LATENCY_MAX_BITS ns, about 2 minutes, go in the last bucket
+#define LATENCY_MAX_BITS	37
+#define LATENCY_BUCKETS		((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+	uint32_t counts[LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+} latency_hist_t;
+
+typedef struct {
+	latency_hist_t stage[LATENCY_STAGES];
+} latency_t;
+
+void latency_hist_reset(latency_hist_t *hist);
+void latency_hist_add(latency_hist_t *hist, uint64_t ns);
+// p in percent, 0 when the histogram is empty
+uint64_t latency_hist_percentile(const latency_hist_t *hist, double p);
+
+void latency_init(latency_t *latency);
+const char *latency_stage_name(int stage);
+uint64_t latency_now_ns();
+
+// All times from latency_now_ns(). sample_ns is when the sample is
+// thought to have been taken, ready_ns when the loop found it waiting.
+void latency_add_sample(latency_t *latency, uint64_t sample_ns, uint64_t ready_ns,
+		uint64_t bus_ns, uint64_t fusion_ns, uint64_t published_ns);
+
+#endif /* LATENCY_H */
@@ -23,264 +23,1415 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
 
 #include "linux_glue.h"
 #include "inv_mpu.h"
 #include "inv_mpu_dmp_motion_driver.h"
 #include "mpu9150.h"
+#include "hostfusion.h"
+#include "rawlog.h"
+#include "latency.h"
+#include "tempcomp.h"
+#include "stationary.h"
 
 static int data_ready();
-static void calibrate_data(mpudata_t *mpu);
+static int read_raw(mpudata_t *mpu);
+static void calibrate_data(const fusion_config_t *config, mpudata_t *mpu);
+static void tempcomp_raw(mpudata_t *mpu);
+static void tempcomp_dmp();
 static void tilt_compensate(quaternion_t magQ, quaternion_t unfusedQ);
-static int data_fusion(mpudata_t *mpu);
+static int data_fusion(const fusion_config_t *config, mpudata_t *mpu);
 static unsigned short inv_row_2_scale(const signed char *row);
 static unsigned short inv_orientation_matrix_to_scalar(const signed char *mtx);
 
 int debug_on;
-int yaw_mixing_factor;
 
-int use_accel_cal;
-caldata_t accel_cal_data;
+// yaw mixing and calibration used by mpu9150_process()
+fusion_config_t fusion_config;
+
+// bus and init state of every device, see mpu9150_select_device()
+int device_bus[MPU_MAX_DEVICES];
+int device_up[MPU_MAX_DEVICES];
+__thread int current_device;
+
+// FIFO buffer and attitude filter of a device in raw mode
+typedef struct {
+	int on;
+	float dt;
+	float gyroSens;
+	hostfusion_t fusion;
+	short gyro[RAW_FIFO_PACKETS][3];
+	short accel[RAW_FIFO_PACKETS][3];
+	int count;
+	int next;
+	// when the last burst was read, the time of its newest packet
+	unsigned long readTime;
+} rawstate_t;
+
+rawstate_t raw_state[MPU_MAX_DEVICES];
+
+mpu9150_stats_t read_stats[MPU_MAX_DEVICES];
+
+// how often the temperature is read, and how far it has to move before
+// the DMP gets a new bias from the model
+#define TEMPCOMP_CHECK_MS 1000
+#define TEMPCOMP_PUSH_C 0.5f
+
+// gyro bias against temperature, see mpu9150_enable_tempcomp()
+typedef struct {
+	int on;
+	tempcomp_t model;
+	int haveTemp;
+	float temp;
+	unsigned long lastCheckMs;
+	// raw mode: the rest windows the model learns from and its bias, taken
+	// off the gyro, deg/s
+	stationary_t still;
+	int haveBias;
+	float bias[3];
+	// DMP mode: the bias the DMP last held and the temperature then
+	float dmpBias[3];
+	int pushed;
+	float pushedTemp;
+} tempstate_t;
+
+tempstate_t temp_state[MPU_MAX_DEVICES];
+
+// in low power wake on motion, see mpu9150_enter_idle()
+int idle_on[MPU_MAX_DEVICES];
+
+// yaw left to the gyros alone, see mpu9150_set_mag_yaw_hold()
+int mag_yaw_hold;
+// compass left unread, see mpu9150_set_mag_reads()
+int mag_reads_off;
+
+// every processed sample is appended here when set
+rawlog_t *rawlog;
+uint32_t last_mag_timestamp[MPU_MAX_DEVICES];
+
+// no chip, samples come from a log
+int replay_on;
+
+// HMC5883L self test result kept across restarts, see mpu9150_set_compass_cache()
+char compass_cache[256];
+
+// time of each bring-up step, see mpu9150_get_init_times()
+mpu9150_init_times_t init_times[MPU_MAX_DEVICES];
+__thread uint64_t phase_start_ns;
+// no progress dots, see mpu9150_set_init_progress()
+__thread int init_quiet;
 
-int use_mag_cal;
-caldata_t mag_cal_data;
+void mpu9150_set_debug(int on)
+{
+	debug_on = on;
+}
+
+void mpu9150_set_compass_cache(const char *path)
+{
+	if (path)
+		snprintf(compass_cache, sizeof(compass_cache), "%s", path);
+	else
+		compass_cache[0] = 0;
+}
+
+// files kept per device are "base" for device 0 and "base.N" for the others
+static void device_path(const char *base, int device, char *path, int len)
+{
+	if (device == 0)
+		snprintf(path, len, "%s", base);
+	else
+		snprintf(path, len, "%s.%d", base, device);
+}
+
+#ifdef HMC5883L_SECONDARY
+
+// Hands a cached self test result to mpu_init(), which then skips the
+// self test. A missing or implausible file means a fresh self test.
+static void load_compass_cache(int device)
+{
+	char path[300];
+	float adj[3];
+	FILE *fh;
+	int i, n;
+
+	mpu_set_compass_sens_adj(NULL);
+
+	if (!compass_cache[0])
+		return;
+
+	device_path(compass_cache, device, path, sizeof(path));
+
+	fh = fopen(path, "r");
+
+	if (!fh)
+		return;
+
+	n = fscanf(fh, "%f %f %f", &adj[0], &adj[1], &adj[2]);
+	fclose(fh);
+
+	if (n != 3) {
+		printf("Ignoring compass cache %s\n", path);
+		return;
+	}
+
+	// the self test limits allow about 0.7 to 1.4
+	for (i = 0; i < 3; i++) {
+		if (!isfinite(adj[i]) || adj[i] < 0.5f || adj[i] > 1.5f) {
+			printf("Ignoring compass cache %s\n", path);
+			return;
+		}
+	}
+
+	mpu_set_compass_sens_adj(adj);
+}
+
+static void save_compass_cache(int device)
+{
+	char path[300];
+	float adj[3];
+	unsigned char tested;
+	FILE *fh;
+
+	if (!compass_cache[0])
+		return;
+
+	mpu_get_compass_sens_adj(adj, &tested);
+
+	if (!tested)
+		return;
+
+	device_path(compass_cache, device, path, sizeof(path));
+
+	fh = fopen(path, "w");
+
+	if (!fh) {
+		printf("Failed to write compass cache %s\n", path);
+		return;
+	}
+
+	fprintf(fh, "%f %f %f\n", adj[0], adj[1], adj[2]);
+	fclose(fh);
+}
+#else
+static void load_compass_cache(int device)
+{
+	(void)device;
+}
+
+static void save_compass_cache(int device)
+{
+	(void)device;
+}
+#endif
+
+void mpu9150_set_init_progress(int on)
+{
+	init_quiet = !on;
+}
+
+static void progress(const char *text)
+{
+	if (init_quiet)
+		return;
+
+	printf("%s", text);
+	fflush(stdout);
+}
+
+static void begin_phases(const char *banner)
+{
+	memset(&init_times[current_device], 0, sizeof(mpu9150_init_times_t));
+	phase_start_ns = latency_now_ns();
+	progress(banner);
+}
+
+static void add_phase(const char *name, uint64_t ns)
+{
+	mpu9150_init_times_t *times = &init_times[current_device];
+
+	if (times->count < MPU9150_MAX_INIT_PHASES) {
+		times->name[times->count] = name;
+		times->ns[times->count] = ns;
+		times->count++;
+	}
+
+	times->totalNs += ns;
+}
+
+static void end_phase(const char *name)
+{
+	uint64_t now = latency_now_ns();
+
+	add_phase(name, now - phase_start_ns);
+	phase_start_ns = now;
+	progress(".");
+}
+
+// mpu_init() resets the chip and then sets up the compass, which the
+// driver times on its own clock
+static void end_mpu_init_phase()
+{
+	uint64_t now = latency_now_ns();
+	uint64_t ns = now - phase_start_ns;
+	uint64_t compass_ns;
+	unsigned long compass_ms;
+
+	if (mpu_get_compass_setup_ms(&compass_ms)) {
+		add_phase("reset", ns);
+	}
+	else {
+		compass_ns = (uint64_t)compass_ms * 1000000;
+
+		if (compass_ns > ns)
+			compass_ns = ns;
+
+		add_phase("reset", ns - compass_ns);
+		add_phase("compass", compass_ns);
+	}
+
+	phase_start_ns = now;
+	progress(".");
+}
+
+int mpu9150_get_init_times(int device, mpu9150_init_times_t *times)
+{
+	if (device < 0 || device >= MPU_MAX_DEVICES)
+		return -1;
+
+	memcpy(times, &init_times[device], sizeof(mpu9150_init_times_t));
+
+	return 0;
+}
+
+int mpu9150_format_init_times(int device, char *buf, int len)
+{
+	const mpu9150_init_times_t *times;
+	int i, n;
+
+	if (device < 0 || device >= MPU_MAX_DEVICES || len < 1)
+		return -1;
+
+	times = &init_times[device];
+	n = snprintf(buf, len, "%.0f ms", times->totalNs / 1e6);
+
+	for (i = 0; i < times->count && n < len; i++)
+		n += snprintf(buf + n, len - n, "%s%s %.0f", i ? ", " : " (",
+			times->name[i], times->ns[i] / 1e6);
+
+	if (times->count && n < len)
+		snprintf(buf + n, len - n, ")");
+
+	return 0;
+}
+
+static void select_device(int device)
+{
+	current_device = device;
+	mpu_select_device(device);
+	dmp_select_device(device);
+	linux_set_i2c_bus(device_bus[device]);
+}
+
+int mpu9150_init(int i2c_bus, int sample_rate, int mix_factor)
+{
+	return mpu9150_init_device(0, i2c_bus, sample_rate, mix_factor);
+}
+
+int mpu9150_init_device(int device, int i2c_bus, int sample_rate, int mix_factor)
+{
+	signed char gyro_orientation[9] = { 1, 0, 0, //YXZ
+                                        0, 1, 0,
+                                        0, 0, 1 };
+
+	if (device < 0 || device >= MPU_MAX_DEVICES) {
+		printf("Invalid device %d\n", device);
+		return -1;
+	}
+
+    if (i2c_bus < MIN_I2C_BUS || i2c_bus > MAX_I2C_BUS) {
+		printf("Invalid I2C bus %d\n", i2c_bus);
+		return -1;
+    }
+
+	if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE) {
+		printf("Invalid sample rate %d\n", sample_rate);
+		return -1;
+	}
+
+	if (mix_factor < 0 || mix_factor > 100) {
+		printf("Invalid mag mixing factor %d\n", mix_factor);
+		return -1;
+	}
+
+	fusion_config.yawMixFactor = mix_factor;
+
+	device_bus[device] = i2c_bus;
+	device_up[device] = 0;
+	raw_state[device].on = 0;
+	temp_state[device].on = 0;
+	idle_on[device] = 0;
+	memset(&read_stats[device], 0, sizeof(mpu9150_stats_t));
+	select_device(device);
+
+	begin_phases("\nInitializing IMU .");
+
+	load_compass_cache(device);
+
+	if (mpu_init(NULL)) {
+		printf("\nmpu_init() failed\n");
+		return -1;
+	}
+
+	save_compass_cache(device);
+
+	end_mpu_init_phase();
+
+    if (mpu_set_sensors(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS)) {
+		printf("\nmpu_set_sensors() failed\n");
+		return -1;
+	}
+
+	end_phase("sensors");
+
+	if (mpu_configure_fifo(INV_XYZ_GYRO | INV_XYZ_ACCEL)) {
+		printf("\nmpu_configure_fifo() failed\n");
+		return -1;
+	}
+
+	end_phase("fifo");
+	
+	if (mpu_set_sample_rate(200)) {
+		printf("\nmpu_set_sample_rate() failed\n");
+		return -1;
+	}
+
+	end_phase("sample_rate");
+
+    if (mpu_set_compass_sample_rate(50)) {
+        printf("\nmpu_set_compass_sample_rate() failed\n");
+        return -1;
+    }
+
+	end_phase("compass_rate");
+
+	if (dmp_load_motion_driver_firmware()) {
+		printf("\ndmp_load_motion_driver_firmware() failed\n");
+		return -1;
+	}
+
+	end_phase("firmware");
+
+	if (dmp_set_orientation(inv_orientation_matrix_to_scalar(gyro_orientation))) {
+		printf("\ndmp_set_orientation() failed\n");
+		return -1;
+	}
+
+	end_phase("orientation");
+
+  	if (dmp_enable_feature(DMP_FEATURE_6X_LP_QUAT | DMP_FEATURE_SEND_RAW_ACCEL 
+						| DMP_FEATURE_SEND_CAL_GYRO | DMP_FEATURE_GYRO_CAL)) {
+		printf("\ndmp_enable_feature() failed\n");
+		return -1;
+	}
+
+	end_phase("features");
+ 
+	if (dmp_set_fifo_rate(sample_rate)) {
+		printf("\ndmp_set_fifo_rate() failed\n");
+		return -1;
+	}
+
+	end_phase("fifo_rate");
+
+	if (mpu_set_dmp_state(1)) {
+		printf("\nmpu_set_dmp_state(1) failed\n");
+		return -1;
+	}
+
+	end_phase("dmp_on");
+	progress(" done\n\n");
+
+	device_up[device] = 1;
+
+	return 0;
+}
+
+// Sets up device 0 without the DMP. Gyro and accel go through the FIFO at
+// up to MAX_RAW_SAMPLE_RATE and the attitude is computed on the host.
+// An lpf of 0 keeps the driver default of half the sample rate.
+int mpu9150_init_raw(int i2c_bus, int sample_rate, int lpf, int mix_factor)
+{
+	rawstate_t *raw = &raw_state[0];
+	unsigned short rate;
+
+    if (i2c_bus < MIN_I2C_BUS || i2c_bus > MAX_I2C_BUS) {
+		printf("Invalid I2C bus %d\n", i2c_bus);
+		return -1;
+    }
+
+	if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_RAW_SAMPLE_RATE) {
+		printf("Invalid sample rate %d\n", sample_rate);
+		return -1;
+	}
+
+	if (mix_factor < 0 || mix_factor > 100) {
+		printf("Invalid mag mixing factor %d\n", mix_factor);
+		return -1;
+	}
+
+	fusion_config.yawMixFactor = mix_factor;
+
+	device_bus[0] = i2c_bus;
+	device_up[0] = 0;
+	raw->on = 0;
+	temp_state[0].on = 0;
+	idle_on[0] = 0;
+	memset(&read_stats[0], 0, sizeof(mpu9150_stats_t));
+	select_device(0);
+
+	begin_phases("\nInitializing IMU (raw) .");
+
+	load_compass_cache(0);
+
+	if (mpu_init(NULL)) {
+		printf("\nmpu_init() failed\n");
+		return -1;
+	}
+
+	save_compass_cache(0);
+
+	end_mpu_init_phase();
+
+    if (mpu_set_sensors(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS)) {
+		printf("\nmpu_set_sensors() failed\n");
+		return -1;
+	}
+
+	end_phase("sensors");
+
+	if (mpu_set_sample_rate(sample_rate)) {
+		printf("\nmpu_set_sample_rate() failed\n");
+		return -1;
+	}
+
+	end_phase("sample_rate");
+
+	// after the sample rate, which resets the filter to half of it
+	if (lpf > 0 && mpu_set_lpf(lpf)) {
+		printf("\nmpu_set_lpf() failed\n");
+		return -1;
+	}
+
+	end_phase("lpf");
+
+    if (mpu_set_compass_sample_rate(sample_rate < 50 ? sample_rate : 50)) {
+        printf("\nmpu_set_compass_sample_rate() failed\n");
+        return -1;
+    }
+
+	end_phase("compass_rate");
+
+	if (mpu_configure_fifo(INV_XYZ_GYRO | INV_XYZ_ACCEL)) {
+		printf("\nmpu_configure_fifo() failed\n");
+		return -1;
+	}
+
+	if (mpu_get_sample_rate(&rate) || mpu_get_gyro_sens(&raw->gyroSens)) {
+		printf("\nfailed to read back the configuration\n");
+		return -1;
+	}
+
+	raw->dt = 1.0f / rate;
+	raw->count = 0;
+	raw->next = 0;
+	hostfusion_init(&raw->fusion, DEFAULT_HOSTFUSION_KP, DEFAULT_HOSTFUSION_KI);
+	raw->on = 1;
+
+	end_phase("fifo");
+
+	if (!init_quiet)
+		printf(" done, %u Hz\n\n", rate);
+
+	device_up[0] = 1;
+
+	return 0;
+}
+
+int mpu9150_select_device(int device)
+{
+	if (device < 0 || device >= MPU_MAX_DEVICES || !device_up[device])
+		return -1;
+
+	select_device(device);
+
+	return 0;
+}
+
+void mpu9150_exit()
+{
+	int i;
+
+	for (i = 0; i < MPU_MAX_DEVICES; i++) {
+		if (!device_up[i])
+			continue;
+
+		select_device(i);
+
+		// turn off the DMP on exit 
+		if (mpu_set_dmp_state(0))
+			printf("mpu_set_dmp_state(0) failed\n");
+
+		device_up[i] = 0;
+	}
+
+	linux_close_i2c();
+
+	// TODO: Should turn off the sensors too
+}
+
+#ifdef HMC5883L_SECONDARY
+// the compass hangs off the auxiliary master, it is reached through the bypass
+static void set_compass_mode(unsigned char mode)
+{
+	mpu_set_bypass(1);
+	hmc5883_setMode(mode);
+	mpu_set_bypass(0);
+}
+#endif
+
+int mpu9150_enter_idle(int thresh_mg, int duration_ms, int wake_hz)
+{
+	if (!device_up[current_device] || idle_on[current_device])
+		return -1;
+
+	if (thresh_mg < 1 || duration_ms < 1 || duration_ms > 255) {
+		printf("Invalid wake on motion setting %d mg %d ms\n", thresh_mg, duration_ms);
+		return -1;
+	}
+
+	// caches the full configuration and the DMP state for the wake up
+	if (mpu_lp_motion_interrupt(thresh_mg, duration_ms, wake_hz)) {
+		printf("mpu_lp_motion_interrupt() failed\n");
+		return -1;
+	}
+
+#ifdef HMC5883L_SECONDARY
+	// the compass in continuous mode draws more than the accel in cycles
+	set_compass_mode(HMC_MODE_IDLE);
+#endif
+
+	idle_on[current_device] = 1;
+
+	return 0;
+}
+
+int mpu9150_idle_motion()
+{
+	short status;
+
+	if (!idle_on[current_device])
+		return -1;
+
+	// latched, the read clears it
+	if (mpu_get_int_status(&status))
+		return -1;
+
+	return (status & MPU_INT_STATUS_MOT) ? 1 : 0;
+}
+
+int mpu9150_exit_idle()
+{
+	rawstate_t *raw = &raw_state[current_device];
+
+	if (!idle_on[current_device])
+		return 0;
+
+#ifdef HMC5883L_SECONDARY
+	// while the DMP is still off
+	set_compass_mode(HMC_MODE_CONTINUOUS);
+#endif
+
+	if (mpu_lp_motion_interrupt(0, 0, 0)) {
+		printf("mpu_lp_motion_interrupt(0) failed\n");
+		return -1;
+	}
+
+	// the restore reset the FIFO, nothing buffered is current
+	raw->count = 0;
+	raw->next = 0;
+	idle_on[current_device] = 0;
+
+	return 0;
+}
+
+int mpu9150_idle()
+{
+	return idle_on[current_device];
+}
+
+void mpu9150_set_accel_cal(caldata_t *cal)
+{
+	int i;
+	int32_t bias[3];
+
+	if (!cal) {
+		fusion_config.useAccelCal = 0;
+		return;
+	}
+
+	memcpy(&fusion_config.accelCal, cal, sizeof(caldata_t));
+
+	for (i = 0; i < 3; i++) {
+		if (fusion_config.accelCal.range[i] < 1)
+			fusion_config.accelCal.range[i] = 1;
+		else if (fusion_config.accelCal.range[i] > ACCEL_SENSOR_RANGE)
+			fusion_config.accelCal.range[i] = ACCEL_SENSOR_RANGE;
+
+		bias[i] = -fusion_config.accelCal.offset[i];
+	}
+
+	if (debug_on) {
+		printf("\naccel cal (range : offset)\n");
+
+		for (i = 0; i < 3; i++)
+			printf("%d : %d\n", fusion_config.accelCal.range[i], fusion_config.accelCal.offset[i]);
+	}
+
+	// a replayed log already has the bias applied
+	if (!replay_on)
+		mpu_set_accel_bias(bias);
+
+	fusion_config.useAccelCal = 1;
+}
+
+void mpu9150_set_mag_cal(caldata_t *cal)
+{
+	int i;
+
+	if (!cal) {
+		fusion_config.useMagCal = 0;
+		return;
+	}
+
+	memcpy(&fusion_config.magCal, cal, sizeof(caldata_t));
+
+	for (i = 0; i < 3; i++) {
+		if (fusion_config.magCal.range[i] < 1)
+			fusion_config.magCal.range[i] = 1;
+		else if (fusion_config.magCal.range[i] > MAG_SENSOR_RANGE)
+			fusion_config.magCal.range[i] = MAG_SENSOR_RANGE;
+
+		if (fusion_config.magCal.offset[i] < -MAG_SENSOR_RANGE)
+			fusion_config.magCal.offset[i] = -MAG_SENSOR_RANGE;
+		else if (fusion_config.magCal.offset[i] > MAG_SENSOR_RANGE)
+			fusion_config.magCal.offset[i] = MAG_SENSOR_RANGE;
+	}
+
+	if (debug_on) {
+		printf("\nmag cal (range : offset)\n");
+
+		for (i = 0; i < 3; i++)
+			printf("%d : %d\n", fusion_config.magCal.range[i], fusion_config.magCal.offset[i]);
+	}
+
+	fusion_config.useMagCal = 1;
+}
+
+int mpu9150_get_gyro_bias(float *dps)
+{
+	int32_t bias[3];
+	int i;
+
+	if (raw_state[current_device].on || dmp_get_gyro_bias(bias))
+		return -1;
+
+	for (i = 0; i < 3; i++)
+		dps[i] = bias[i] / 65536.0f;
+
+	return 0;
+}
+
+int mpu9150_set_gyro_bias(const float *dps)
+{
+	int32_t bias[3];
+	int i;
+
+	if (raw_state[current_device].on)
+		return -1;
+
+	for (i = 0; i < 3; i++)
+		bias[i] = (int32_t)(dps[i] * 65536.0f);
+
+	return dmp_set_gyro_bias(bias);
+}
+
+int mpu9150_load_bias_state(const char *path, float *dps)
+{
+	char file[300];
+	float bias[3];
+	FILE *fh;
+	int i, n;
+
+	device_path(path, current_device, file, sizeof(file));
+
+	fh = fopen(file, "r");
+
+	if (!fh)
+		return -1;
+
+	n = fscanf(fh, "gyro %f %f %f", &bias[0], &bias[1], &bias[2]);
+	fclose(fh);
+
+	if (n != 3) {
+		printf("Ignoring bias state %s\n", file);
+		return -1;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (!isfinite(bias[i]) || fabsf(bias[i]) > MAX_GYRO_BIAS_DPS) {
+			printf("Ignoring bias state %s\n", file);
+			return -1;
+		}
+	}
+
+	if (mpu9150_set_gyro_bias(bias))
+		return -1;
+
+	if (dps)
+		memcpy(dps, bias, sizeof(bias));
+
+	return 0;
+}
+
+int mpu9150_save_bias_state(const char *path, const float *dps)
+{
+	char file[300], tmp[310];
+	FILE *fh;
+
+	device_path(path, current_device, file, sizeof(file));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+	fh = fopen(tmp, "w");
+
+	if (!fh) {
+		printf("Failed to write bias state %s\n", tmp);
+		return -1;
+	}
+
+	fprintf(fh, "gyro %f %f %f\n", dps[0], dps[1], dps[2]);
+
+	// a power cut leaves the old file or the new one, never half of one
+	if (fflush(fh) || fsync(fileno(fh))) {
+		fclose(fh);
+		unlink(tmp);
+		return -1;
+	}
+
+	fclose(fh);
+
+	if (rename(tmp, file)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+int mpu9150_enable_tempcomp(int on)
+{
+	tempstate_t *ts = &temp_state[current_device];
+
+	if (!device_up[current_device])
+		return -1;
+
+	memset(ts, 0, sizeof(tempstate_t));
+
+	tempcomp_init(&ts->model);
+	// rest windows of about a second, raw mode only
+	stationary_init(&ts->still, mpu9150_sample_rate(), DEFAULT_STATIONARY_GYRO_STD, DEFAULT_STATIONARY_ACCEL_STD);
+	ts->on = on;
+
+	return 0;
+}
+
+void mpu9150_set_tempcomp_stationary(int window, float gyro_std, float accel_std)
+{
+	stationary_init(&temp_state[current_device].still, window, gyro_std, accel_std);
+}
+
+int mpu9150_load_tempcomp(const char *path)
+{
+	char file[300];
+
+	device_path(path, current_device, file, sizeof(file));
+
+	if (tempcomp_load(&temp_state[current_device].model, file))
+		return -1;
+
+	// the DMP gets the model's bias at the next temperature reading
+	temp_state[current_device].pushed = 0;
+
+	return 0;
+}
+
+int mpu9150_save_tempcomp(const char *path)
+{
+	char file[300];
+
+	// an empty model never replaces a saved one
+	if (tempcomp_learned_bins(&temp_state[current_device].model) == 0)
+		return 0;
+
+	device_path(path, current_device, file, sizeof(file));
+
+	return tempcomp_save(&temp_state[current_device].model, file);
+}
+
+int mpu9150_get_temperature(float *celsius)
+{
+	tempstate_t *ts = &temp_state[current_device];
+
+	if (!ts->on || !ts->haveTemp)
+		return -1;
+
+	*celsius = ts->temp;
+
+	return 0;
+}
+
+const struct tempcomp_s *mpu9150_get_tempcomp()
+{
+	tempstate_t *ts = &temp_state[current_device];
+
+	return ts->on ? &ts->model : NULL;
+}
+
+// at most once per TEMPCOMP_CHECK_MS, returns 1 when it read a new value
+static int sample_temperature(tempstate_t *ts)
+{
+	unsigned long now;
+	int32_t temp;
+
+	linux_get_ms(&now);
+
+	if (ts->haveTemp && now - ts->lastCheckMs < TEMPCOMP_CHECK_MS)
+		return 0;
+
+	ts->lastCheckMs = now;
+
+	if (mpu_get_temperature(&temp, NULL))
+		return 0;
+
+	ts->temp = temp / 65536.0f;
+	ts->haveTemp = 1;
+
+	return 1;
+}
+
+// Raw mode, before the host fusion. Rest windows of the uncorrected gyro
+// train the model, the model's bias comes off the gyro.
+static void tempcomp_raw(mpudata_t *mpu)
+{
+	rawstate_t *raw = &raw_state[current_device];
+	tempstate_t *ts = &temp_state[current_device];
+	float gyro[3], accel[3];
+	unsigned short accel_sens;
+	long corrected;
+	int i, changed;
+
+	if (!ts->on)
+		return;
+
+	changed = sample_temperature(ts);
+
+	if (!ts->haveTemp)
+		return;
+
+	if (mpu_get_accel_sens(&accel_sens))
+		return;
+
+	for (i = 0; i < 3; i++) {
+		gyro[i] = mpu->rawGyro[i] / raw->gyroSens;
+		accel[i] = (float)mpu->rawAccel[i] / accel_sens;
+	}
+
+	stationary_add(&ts->still, gyro, accel);
+
+	if (stationary_window_done(&ts->still)) {
+		stationary_gyro_mean(&ts->still, gyro);
+		tempcomp_learn(&ts->model, ts->temp, gyro);
+		changed = 1;
+	}
+
+	if (changed)
+		ts->haveBias = tempcomp_predict(&ts->model, ts->temp, ts->bias) == 0;
+
+	if (!ts->haveBias)
+		return;
+
+	for (i = 0; i < 3; i++) {
+		corrected = mpu->rawGyro[i] - lroundf(ts->bias[i] * raw->gyroSens);
+
+		if (corrected > 32767)
+			corrected = 32767;
+		else if (corrected < -32768)
+			corrected = -32768;
+
+		mpu->rawGyro[i] = (short)corrected;
+	}
+}
 
-void mpu9150_set_debug(int on)
+// DMP mode. The DMP's own estimates, made while it lies still, train the
+// model. When the temperature has moved the model's bias goes to the DMP,
+// until the DMP replaces it with a new estimate of its own.
+static void tempcomp_dmp()
 {
-	debug_on = on;
+	tempstate_t *ts = &temp_state[current_device];
+	float bias[3];
+
+	if (!ts->on || !sample_temperature(ts))
+		return;
+
+	if (mpu9150_get_gyro_bias(bias))
+		return;
+
+	// zero until its first estimate
+	if ((bias[0] != 0.0f || bias[1] != 0.0f || bias[2] != 0.0f)
+			&& (fabsf(bias[0] - ts->dmpBias[0]) >= 0.001f || fabsf(bias[1] - ts->dmpBias[1]) >= 0.001f
+				|| fabsf(bias[2] - ts->dmpBias[2]) >= 0.001f)) {
+		tempcomp_learn(&ts->model, ts->temp, bias);
+		memcpy(ts->dmpBias, bias, sizeof(bias));
+		ts->pushed = 1;
+		ts->pushedTemp = ts->temp;
+		return;
+	}
+
+	if (ts->pushed && fabsf(ts->temp - ts->pushedTemp) < TEMPCOMP_PUSH_C)
+		return;
+
+	if (tempcomp_predict(&ts->model, ts->temp, bias) || mpu9150_set_gyro_bias(bias))
+		return;
+
+	// what the DMP holds now, quantized, so it is not taken for an estimate
+	if (mpu9150_get_gyro_bias(ts->dmpBias))
+		memcpy(ts->dmpBias, bias, sizeof(bias));
+
+	ts->pushed = 1;
+	ts->pushedTemp = ts->temp;
 }
 
-int mpu9150_init(int i2c_bus, int sample_rate, int mix_factor)
+// A failed read is counted, as a resync wait if the DMP is only waiting for
+// the bytes to realign after an overflow, otherwise as an error.
+static int read_dmp_packet(mpudata_t *mpu, unsigned char *more)
 {
-	signed char gyro_orientation[9] = { 1, 0, 0, //YXZ
-                                        0, 1, 0,
-                                        0, 0, 1 };
+	mpu9150_stats_t *stats = &read_stats[current_device];
+	struct dmp_fifo_stats_s before, after;
+	short sensors;
 
-    if (i2c_bus < MIN_I2C_BUS || i2c_bus > MAX_I2C_BUS) {
-		printf("Invalid I2C bus %d\n", i2c_bus);
-		return -1;
-    }
+	dmp_get_fifo_stats(&before);
 
-	if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE) {
-		printf("Invalid sample rate %d\n", sample_rate);
+	if (dmp_read_fifo(mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &mpu->dmpTimestamp, &sensors, more) == 0)
+		return 0;
+
+	dmp_get_fifo_stats(&after);
+
+	if (after.resync_waits != before.resync_waits)
+		stats->resyncWaits++;
+	else
+		stats->readErrors++;
+
+	return -1;
+}
+
+int mpu9150_read_dmp(mpudata_t *mpu)
+{
+	mpu9150_stats_t *stats = &read_stats[current_device];
+	unsigned char more;
+
+	if (!data_ready()) {
+		stats->noData++;
 		return -1;
 	}
 
-	if (mix_factor < 0 || mix_factor > 100) {
-		printf("Invalid mag mixing factor %d\n", mix_factor);
+	if (read_dmp_packet(mpu, &more))
 		return -1;
+
+	while (more) {
+		// Fell behind, reading again
+		stats->dropped++;
+
+		if (read_dmp_packet(mpu, &more))
+			return -1;
 	}
 
-	yaw_mixing_factor = mix_factor;
+	stats->samples++;
+	tempcomp_dmp();
 
-    linux_set_i2c_bus(i2c_bus);
+	return 0;
+}
 
-	printf("\nInitializing IMU .");
-	fflush(stdout);
+// Packet rate actually configured on the selected device, which can differ
+// from the requested one since the hardware divides down from 1 kHz.
+int mpu9150_sample_rate()
+{
+	unsigned short rate;
 
-	if (mpu_init(NULL)) {
-		printf("\nmpu_init() failed\n");
+	if (raw_state[current_device].on)
+		return (int)(1.0f / raw_state[current_device].dt + 0.5f);
+
+	if (dmp_get_fifo_rate(&rate))
 		return -1;
-	}
 
-	printf(".");
-	fflush(stdout);
+	return rate;
+}
 
-    if (mpu_set_sensors(INV_XYZ_GYRO | INV_XYZ_ACCEL | INV_XYZ_COMPASS)) {
-		printf("\nmpu_set_sensors() failed\n");
+int mpu9150_set_sample_rate(int sample_rate)
+{
+	rawstate_t *raw = &raw_state[current_device];
+	unsigned short rate;
+
+	if (!device_up[current_device] || idle_on[current_device])
 		return -1;
-	}
 
-	printf(".");
-	fflush(stdout);
+	if (!raw->on) {
+		if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_SAMPLE_RATE) {
+			printf("Invalid sample rate %d\n", sample_rate);
+			return -1;
+		}
 
-	if (mpu_configure_fifo(INV_XYZ_GYRO | INV_XYZ_ACCEL)) {
-		printf("\nmpu_configure_fifo() failed\n");
+		if (dmp_set_fifo_rate(sample_rate)) {
+			printf("dmp_set_fifo_rate() failed\n");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (sample_rate < MIN_SAMPLE_RATE || sample_rate > MAX_RAW_SAMPLE_RATE) {
+		printf("Invalid sample rate %d\n", sample_rate);
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
-	
-	if (mpu_set_sample_rate(200)) {
-		printf("\nmpu_set_sample_rate() failed\n");
+	if (mpu_set_sample_rate(sample_rate)
+			|| mpu_set_compass_sample_rate(sample_rate < 50 ? sample_rate : 50)
+			|| mpu_get_sample_rate(&rate)) {
+		printf("mpu_set_sample_rate() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	raw->dt = 1.0f / rate;
 
-    if (mpu_set_compass_sample_rate(50)) {
-        printf("\nmpu_set_compass_sample_rate() failed\n");
-        return -1;
-    }
+	return 0;
+}
 
-	printf(".");
-	fflush(stdout);
+int mpu9150_set_lpf(int lpf)
+{
+	if (!device_up[current_device] || idle_on[current_device])
+		return -1;
 
-	if (dmp_load_motion_driver_firmware()) {
-		printf("\ndmp_load_motion_driver_firmware() failed\n");
+	if (lpf < 5) {
+		printf("Invalid lpf %d\n", lpf);
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
-
-	if (dmp_set_orientation(inv_orientation_matrix_to_scalar(gyro_orientation))) {
-		printf("\ndmp_set_orientation() failed\n");
+	if (mpu_set_lpf(lpf)) {
+		printf("mpu_set_lpf() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	return 0;
+}
 
-  	if (dmp_enable_feature(DMP_FEATURE_6X_LP_QUAT | DMP_FEATURE_SEND_RAW_ACCEL 
-						| DMP_FEATURE_SEND_CAL_GYRO | DMP_FEATURE_GYRO_CAL)) {
-		printf("\ndmp_enable_feature() failed\n");
+int mpu9150_set_gyro_fsr(int dps)
+{
+	rawstate_t *raw = &raw_state[current_device];
+
+	if (!device_up[current_device] || idle_on[current_device])
+		return -1;
+
+	// the DMP integrates its quaternion at 2000 dps
+	if (!raw->on && dps != 2000) {
+		printf("The DMP needs a gyro range of 2000 dps\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
- 
-	if (dmp_set_fifo_rate(sample_rate)) {
-		printf("\ndmp_set_fifo_rate() failed\n");
+	if (mpu_set_gyro_fsr(dps) || mpu_get_gyro_sens(&raw->gyroSens)) {
+		printf("mpu_set_gyro_fsr() failed\n");
 		return -1;
 	}
 
-	printf(".");
-	fflush(stdout);
+	return 0;
+}
 
-	if (mpu_set_dmp_state(1)) {
-		printf("\nmpu_set_dmp_state(1) failed\n");
+int mpu9150_set_accel_fsr(int g)
+{
+	if (!device_up[current_device] || idle_on[current_device])
+		return -1;
+
+	// the DMP's 6-axis quaternion expects 2 g
+	if (!raw_state[current_device].on && g != 2) {
+		printf("The DMP needs an accel range of 2 g\n");
 		return -1;
 	}
 
-	printf(" done\n\n");
+	if (mpu_set_accel_fsr(g)) {
+		printf("mpu_set_accel_fsr() failed\n");
+		return -1;
+	}
 
 	return 0;
 }
 
-void mpu9150_exit()
+int mpu9150_get_sens(float *gyro, float *accel)
 {
-	// turn off the DMP on exit 
-	if (mpu_set_dmp_state(0))
-		printf("mpu_set_dmp_state(0) failed\n");
+	unsigned short accel_sens;
 
-	// TODO: Should turn off the sensors too
+	if (mpu_get_gyro_sens(gyro) || mpu_get_accel_sens(&accel_sens))
+		return -1;
+
+	*accel = accel_sens;
+
+	return 0;
 }
 
-void mpu9150_set_accel_cal(caldata_t *cal)
+int mpu9150_set_mix_factor(int mix_factor)
 {
-	int i;
-	int32_t bias[3];
-
-	if (!cal) {
-		use_accel_cal = 0;
-		return;
+	if (mix_factor < 0 || mix_factor > 100) {
+		printf("Invalid mag mixing factor %d\n", mix_factor);
+		return -1;
 	}
 
-	memcpy(&accel_cal_data, cal, sizeof(caldata_t));
+	fusion_config.yawMixFactor = mix_factor;
 
-	for (i = 0; i < 3; i++) {
-		if (accel_cal_data.range[i] < 1)
-			accel_cal_data.range[i] = 1;
-		else if (accel_cal_data.range[i] > ACCEL_SENSOR_RANGE)
-			accel_cal_data.range[i] = ACCEL_SENSOR_RANGE;
+	return 0;
+}
+
+// Burst-reads the FIFO and reports how many packets are waiting. Fetch
+// them with mpu9150_read_fifo_packet(). In DMP mode the packets are kept in
+// the driver's cache, in raw mode in raw_state.
+int mpu9150_fifo_queued(int *packets)
+{
+	rawstate_t *raw = &raw_state[current_device];
+	unsigned short queued, more;
+	int left;
+
+	if (!raw->on) {
+		if (dmp_prefetch_fifo(&queued) < 0) {
+			printf("dmp_prefetch_fifo() failed\n");
+			return -1;
+		}
+
+		*packets = queued;
 
-		bias[i] = -accel_cal_data.offset[i];
+		return 0;
 	}
 
-	if (debug_on) {
-		printf("\naccel cal (range : offset)\n");
+	// keep what the caller didn't get to
+	left = raw->count - raw->next;
 
-		for (i = 0; i < 3; i++)
-			printf("%d : %d\n", accel_cal_data.range[i], accel_cal_data.offset[i]);
+	if (left > 0 && raw->next > 0) {
+		memmove(raw->gyro, raw->gyro[raw->next], left * sizeof(raw->gyro[0]));
+		memmove(raw->accel, raw->accel[raw->next], left * sizeof(raw->accel[0]));
+	}
+	else if (left < 0) {
+		left = 0;
+	}
+
+	if (mpu_read_fifo_burst(raw->gyro[left], raw->accel[left], RAW_FIFO_PACKETS - left, &queued, &more)) {
+		printf("mpu_read_fifo_burst() failed\n");
+		return -1;
 	}
 
-	mpu_set_accel_bias(bias);
+	linux_get_ms(&raw->readTime);
+	raw->count = left + queued;
+	raw->next = 0;
+	*packets = raw->count;
 
-	use_accel_cal = 1;
+	return 0;
 }
 
-void mpu9150_set_mag_cal(caldata_t *cal)
+// Reads the oldest queued packet, unlike mpu9150_read_dmp() nothing
+// is skipped. In raw mode the host filter provides rawQuat.
+int mpu9150_read_fifo_packet(mpudata_t *mpu)
 {
-	int i;
+	rawstate_t *raw = &raw_state[current_device];
+	unsigned char more;
 
-	if (!cal) {
-		use_mag_cal = 0;
-		return;
-	}
+	if (raw->on) {
+		if (raw->next >= raw->count)
+			return -1;
 
-	memcpy(&mag_cal_data, cal, sizeof(caldata_t));
+		memcpy(mpu->rawGyro, raw->gyro[raw->next], sizeof(mpu->rawGyro));
+		memcpy(mpu->rawAccel, raw->accel[raw->next], sizeof(mpu->rawAccel));
+		raw->next++;
+		tempcomp_raw(mpu);
 
-	for (i = 0; i < 3; i++) {
-		if (mag_cal_data.range[i] < 1)
-			mag_cal_data.range[i] = 1;
-		else if (mag_cal_data.range[i] > MAG_SENSOR_RANGE)
-			mag_cal_data.range[i] = MAG_SENSOR_RANGE;
+		hostfusion_update(&raw->fusion, mpu->rawGyro, mpu->rawAccel, raw->gyroSens, raw->dt, mpu->rawQuat);
+		// the packets of a burst are one sample period apart, counting
+		// back from the newest
+		mpu->dmpTimestamp = raw->readTime - (unsigned long)((raw->count - raw->next) * raw->dt * 1000.0f + 0.5f);
+		read_stats[current_device].samples++;
 
-		if (mag_cal_data.offset[i] < -MAG_SENSOR_RANGE)
-			mag_cal_data.offset[i] = -MAG_SENSOR_RANGE;
-		else if (mag_cal_data.offset[i] > MAG_SENSOR_RANGE)
-			mag_cal_data.offset[i] = MAG_SENSOR_RANGE;
+		return 0;
 	}
 
-	if (debug_on) {
-		printf("\nmag cal (range : offset)\n");
+	if (read_dmp_packet(mpu, &more))
+		return -1;
 
-		for (i = 0; i < 3; i++)
-			printf("%d : %d\n", mag_cal_data.range[i], mag_cal_data.offset[i]);
-	}
+	read_stats[current_device].samples++;
+	tempcomp_dmp();
 
-	use_mag_cal = 1;
+	return 0;
 }
 
-int mpu9150_read_dmp(mpudata_t *mpu)
+void mpu9150_set_mag_reads(int on)
 {
-	short sensors;
-	unsigned char more;
+	mag_reads_off = !on;
+}
+
+int mpu9150_read_mag(mpudata_t *mpu)
+{
+	if (mag_reads_off)
+		return 0;
 
-	if (!data_ready())
+    if (mpu_get_compass_reg(mpu->rawMag, &mpu->magTimestamp) < 0) {
+		printf("mpu_get_compass_reg() failed\n");
+		read_stats[current_device].readErrors++;
 		return -1;
+    }
+
+	return 0;
+}
 
-	if (dmp_read_fifo(mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &mpu->dmpTimestamp, &sensors, &more) < 0) {
-		printf("dmp_read_fifo() failed\n");
+int mpu9150_read(mpudata_t *mpu)
+{
+	if (mpu9150_read_sample(mpu) != 0)
 		return -1;
-	}
 
-	while (more) {
-		// Fell behind, reading again
-		if (dmp_read_fifo(mpu->rawGyro, mpu->rawAccel, mpu->rawQuat, &mpu->dmpTimestamp, &sensors, &more) < 0) {
-			printf("dmp_read_fifo() failed\n");
+	return mpu9150_process(mpu);
+}
+
+int mpu9150_read_sample(mpudata_t *mpu)
+{
+	if (raw_state[current_device].on) {
+		if (read_raw(mpu) != 0)
 			return -1;
-		}
 	}
+	else if (mpu9150_read_dmp(mpu) != 0)
+		return -1;
 
-	return 0;
+	return mpu9150_read_mag(mpu);
 }
 
-int mpu9150_read_mag(mpudata_t *mpu)
+void mpu9150_set_rawlog(rawlog_t *log)
 {
-    if (mpu_get_compass_reg(mpu->rawMag, &mpu->magTimestamp) < 0) {
-		printf("mpu_get_compass_reg() failed\n");
+	rawlog = log;
+	memset(last_mag_timestamp, 0, sizeof(last_mag_timestamp));
+}
+
+void mpu9150_init_replay(int mix_factor)
+{
+	fusion_config.yawMixFactor = mix_factor;
+	replay_on = 1;
+}
+
+void mpu9150_set_mag_yaw_hold(int on)
+{
+	mag_yaw_hold = on;
+}
+
+int mpu9150_process(mpudata_t *mpu)
+{
+	const fusion_config_t *config = &fusion_config;
+	fusion_config_t held;
+	rawlog_record_t rec;
+	int flags;
+
+	if (rawlog && !replay_on) {
+		flags = raw_state[current_device].on ? RAWLOG_HOST : RAWLOG_DMP;
+
+		if (mpu->magTimestamp != last_mag_timestamp[current_device])
+			flags |= RAWLOG_MAG;
+
+		last_mag_timestamp[current_device] = mpu->magTimestamp;
+		rawlog_pack(&rec, mpu, flags, current_device);
+		rawlog_append(rawlog, &rec);
+	}
+
+	if (mag_yaw_hold) {
+		memcpy(&held, &fusion_config, sizeof(fusion_config_t));
+		held.yawMixFactor = 0;
+		config = &held;
+	}
+
+	if (mpu9150_process_config(config, mpu))
 		return -1;
-    }
+
+	if (!isfinite(mpu->fusedQuat[QUAT_W]) || !isfinite(mpu->fusedQuat[QUAT_X])
+			|| !isfinite(mpu->fusedQuat[QUAT_Y]) || !isfinite(mpu->fusedQuat[QUAT_Z])
+			|| !isfinite(mpu->lastYaw)) {
+		// a NaN yaw would otherwise carry over to every later sample
+		read_stats[current_device].fusionErrors++;
+		mpu->lastYaw = 0.0f;
+		mpu->lastDMPYaw = 0.0f;
+		return -1;
+	}
 
 	return 0;
 }
 
-int mpu9150_read(mpudata_t *mpu)
+void mpu9150_get_stats(mpu9150_stats_t *stats)
+{
+	memcpy(stats, &read_stats[current_device], sizeof(mpu9150_stats_t));
+}
+
+void mpu9150_get_fusion_config(fusion_config_t *config)
+{
+	memcpy(config, &fusion_config, sizeof(fusion_config_t));
+}
+
+// Only reads config and mpu, so threads can each run their own.
+int mpu9150_process_config(const fusion_config_t *config, mpudata_t *mpu)
+{
+	calibrate_data(config, mpu);
+
+	return data_fusion(config, mpu);
+}
+
+void mpu9150_calibrate(const fusion_config_t *config, mpudata_t *mpu)
+{
+	calibrate_data(config, mpu);
+}
+
+int mpu9150_fuse(const fusion_config_t *config, mpudata_t *mpu)
 {
-	if (mpu9150_read_dmp(mpu) != 0)
+	return data_fusion(config, mpu);
+}
+
+// Raw mode counterpart of mpu9150_read_dmp(), every queued packet goes
+// through the host filter and the newest one is kept.
+int read_raw(mpudata_t *mpu)
+{
+	int queued, i;
+
+	if (mpu9150_fifo_queued(&queued) != 0) {
+		read_stats[current_device].readErrors++;
 		return -1;
+	}
 
-	if (mpu9150_read_mag(mpu) != 0)
+	if (queued == 0) {
+		read_stats[current_device].noData++;
 		return -1;
+	}
 
-	calibrate_data(mpu);
+	for (i = 0; i < queued; i++) {
+		if (mpu9150_read_fifo_packet(mpu) != 0)
+			return -1;
+	}
 
-	return data_fusion(mpu);
+	return 0;
 }
 
 int data_ready()
@@ -296,30 +1447,33 @@ int data_ready()
 	//if (status != 0x0103)
 	//	fprintf(stderr, "%04X\n", status);
 
+	// a full FIFO keeps flagging overflows, it still has to be drained
+	status &= ~MPU_INT_STATUS_FIFO_OVERFLOW;
+
 	return (status == (MPU_INT_STATUS_DATA_READY | MPU_INT_STATUS_DMP | MPU_INT_STATUS_DMP_0));
 }
 
-void calibrate_data(mpudata_t *mpu)
+void calibrate_data(const fusion_config_t *config, mpudata_t *mpu)
 {
-	if (use_mag_cal) {
+	if (config->useMagCal) {
       #ifdef AK89xx_SECONDARY
-      mpu->calibratedMag[VEC3_Y] = -(short)(((int32_t)(mpu->rawMag[VEC3_X] - mag_cal_data.offset[VEC3_X])
-			* (int32_t)MAG_SENSOR_RANGE) / (int32_t)mag_cal_data.range[VEC3_X]);
+      mpu->calibratedMag[VEC3_Y] = -(short)(((int32_t)(mpu->rawMag[VEC3_X] - config->magCal.offset[VEC3_X])
+			* (int32_t)MAG_SENSOR_RANGE) / (int32_t)config->magCal.range[VEC3_X]);
 
-      mpu->calibratedMag[VEC3_X] = (short)(((int32_t)(mpu->rawMag[VEC3_Y] - mag_cal_data.offset[VEC3_Y])
-			* (int32_t)MAG_SENSOR_RANGE) / (int32_t)mag_cal_data.range[VEC3_Y]);
+      mpu->calibratedMag[VEC3_X] = (short)(((int32_t)(mpu->rawMag[VEC3_Y] - config->magCal.offset[VEC3_Y])
+			* (int32_t)MAG_SENSOR_RANGE) / (int32_t)config->magCal.range[VEC3_Y]);
 
-      mpu->calibratedMag[VEC3_Z] = (short)(((int32_t)(mpu->rawMag[VEC3_Z] - mag_cal_data.offset[VEC3_Z])
-			* (int32_t)MAG_SENSOR_RANGE) / (int32_t)mag_cal_data.range[VEC3_Z]);
+      mpu->calibratedMag[VEC3_Z] = (short)(((int32_t)(mpu->rawMag[VEC3_Z] - config->magCal.offset[VEC3_Z])
+			* (int32_t)MAG_SENSOR_RANGE) / (int32_t)config->magCal.range[VEC3_Z]);
       #elif defined HMC5883L_SECONDARY
-        mpu->calibratedMag[VEC3_Y] = -(short)(((int32_t)(mpu->rawMag[VEC3_Y] - mag_cal_data.offset[VEC3_Y])
-              * (int32_t)MAG_SENSOR_RANGE) / (int32_t)mag_cal_data.range[VEC3_Y]);
+        mpu->calibratedMag[VEC3_Y] = -(short)(((int32_t)(mpu->rawMag[VEC3_Y] - config->magCal.offset[VEC3_Y])
+              * (int32_t)MAG_SENSOR_RANGE) / (int32_t)config->magCal.range[VEC3_Y]);
 
-        mpu->calibratedMag[VEC3_X] = (short)(((int32_t)(mpu->rawMag[VEC3_X] - mag_cal_data.offset[VEC3_X])
-              * (int32_t)MAG_SENSOR_RANGE) / (int32_t)mag_cal_data.range[VEC3_X]);
+        mpu->calibratedMag[VEC3_X] = (short)(((int32_t)(mpu->rawMag[VEC3_X] - config->magCal.offset[VEC3_X])
+              * (int32_t)MAG_SENSOR_RANGE) / (int32_t)config->magCal.range[VEC3_X]);
 
-        mpu->calibratedMag[VEC3_Z] = (short)(((int32_t)(mpu->rawMag[VEC3_Z] - mag_cal_data.offset[VEC3_Z])
-              * (int32_t)MAG_SENSOR_RANGE) / (int32_t)mag_cal_data.range[VEC3_Z]);
+        mpu->calibratedMag[VEC3_Z] = (short)(((int32_t)(mpu->rawMag[VEC3_Z] - config->magCal.offset[VEC3_Z])
+              * (int32_t)MAG_SENSOR_RANGE) / (int32_t)config->magCal.range[VEC3_Z]);
       #endif
 	}
 	else {
@@ -334,15 +1488,15 @@ void calibrate_data(mpudata_t *mpu)
         #endif
 	}
 
-	if (use_accel_cal) {
+	if (config->useAccelCal) {
       mpu->calibratedAccel[VEC3_X] = -(short)(((int32_t)mpu->rawAccel[VEC3_X] * (int32_t)ACCEL_SENSOR_RANGE)
-			/ (int32_t)accel_cal_data.range[VEC3_X]);
+			/ (int32_t)config->accelCal.range[VEC3_X]);
 
       mpu->calibratedAccel[VEC3_Y] = (short)(((int32_t)mpu->rawAccel[VEC3_Y] * (int32_t)ACCEL_SENSOR_RANGE)
-			/ (int32_t)accel_cal_data.range[VEC3_Y]);
+			/ (int32_t)config->accelCal.range[VEC3_Y]);
 
       mpu->calibratedAccel[VEC3_Z] = (short)(((int32_t)mpu->rawAccel[VEC3_Z] * (int32_t)ACCEL_SENSOR_RANGE)
-			/ (int32_t)accel_cal_data.range[VEC3_Z]);
+			/ (int32_t)config->accelCal.range[VEC3_Z]);
 	}
 	else {
 		mpu->calibratedAccel[VEC3_X] = -mpu->rawAccel[VEC3_X];
@@ -361,7 +1515,7 @@ void tilt_compensate(quaternion_t magQ, quaternion_t unfusedQ)
 	quaternionMultiply(unfusedQ, tempQ, magQ);
 }
 
-int data_fusion(mpudata_t *mpu)
+int data_fusion(const fusion_config_t *config, mpudata_t *mpu)
 {
 	quaternion_t dmpQuat;
 	vector3d_t dmpEuler;
@@ -389,44 +1543,46 @@ int data_fusion(mpudata_t *mpu)
 	deltaDMPYaw = -dmpEuler[VEC3_Z] + mpu->lastDMPYaw;
 	mpu->lastDMPYaw = dmpEuler[VEC3_Z];
 
-	magQuat[QUAT_W] = 0;
-	magQuat[QUAT_X] = mpu->calibratedMag[VEC3_X];
-  	magQuat[QUAT_Y] = mpu->calibratedMag[VEC3_Y];
-  	magQuat[QUAT_Z] = mpu->calibratedMag[VEC3_Z];
-
-	tilt_compensate(magQuat, unfusedQuat);
-
-	newMagYaw = -atan2f(magQuat[QUAT_Y], magQuat[QUAT_X]);
-
-	if (newMagYaw != newMagYaw) {
-		printf("newMagYaw NAN\n");
-		return -1;
-	}
-
-	if (newMagYaw < 0.0f)
-		newMagYaw = TWO_PI + newMagYaw;
-
 	newYaw = mpu->lastYaw + deltaDMPYaw;
 
 	if (newYaw > TWO_PI)
 		newYaw -= TWO_PI;
 	else if (newYaw < 0.0f)
 		newYaw += TWO_PI;
-	 
-	deltaMagYaw = newMagYaw - newYaw;
-	
-	if (deltaMagYaw >= (float)M_PI)
-		deltaMagYaw -= TWO_PI;
-	else if (deltaMagYaw < -(float)M_PI)
-		deltaMagYaw += TWO_PI;
 
-	if (yaw_mixing_factor > 0)
-		newYaw += deltaMagYaw / yaw_mixing_factor;
+	// the tilt compensated compass is only needed when it is mixed in
+	if (config->yawMixFactor > 0) {
+		magQuat[QUAT_W] = 0;
+		magQuat[QUAT_X] = mpu->calibratedMag[VEC3_X];
+		magQuat[QUAT_Y] = mpu->calibratedMag[VEC3_Y];
+		magQuat[QUAT_Z] = mpu->calibratedMag[VEC3_Z];
 
-	if (newYaw > TWO_PI)
-		newYaw -= TWO_PI;
-	else if (newYaw < 0.0f)
-		newYaw += TWO_PI;
+		tilt_compensate(magQuat, unfusedQuat);
+
+		newMagYaw = -atan2f(magQuat[QUAT_Y], magQuat[QUAT_X]);
+
+		if (newMagYaw != newMagYaw) {
+			printf("newMagYaw NAN\n");
+			return -1;
+		}
+
+		if (newMagYaw < 0.0f)
+			newMagYaw = TWO_PI + newMagYaw;
+
+		deltaMagYaw = newMagYaw - newYaw;
+
+		if (deltaMagYaw >= (float)M_PI)
+			deltaMagYaw -= TWO_PI;
+		else if (deltaMagYaw < -(float)M_PI)
+			deltaMagYaw += TWO_PI;
+
+		newYaw += deltaMagYaw / config->yawMixFactor;
+
+		if (newYaw > TWO_PI)
+			newYaw -= TWO_PI;
+		else if (newYaw < 0.0f)
+			newYaw += TWO_PI;
+	}
 
 	mpu->lastYaw = newYaw;
 
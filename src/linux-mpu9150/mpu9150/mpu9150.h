@@ -40,6 +40,19 @@
 #define MIN_SAMPLE_RATE 2
 #define MAX_SAMPLE_RATE 100
 
+// Raw mode bypasses the DMP and streams gyro and accel through the FIFO,
+// which the hardware can fill at up to 1 kHz.
+#define MAX_RAW_SAMPLE_RATE 1000
+
+// FIFO capacity in packets: 1024 bytes holding 28 byte DMP packets
+// (quaternion, accel, gyro) or 12 byte raw packets (accel, gyro).
+#define DMP_FIFO_PACKETS 36
+#define RAW_FIFO_PACKETS 85
+
+// Zero rate output tolerance of the MPU6050, saved biases beyond it are
+// taken for a corrupt file
+#define MAX_GYRO_BIAS_DPS 20.0f
+
 typedef struct {
 	short offset[3];
 	short range[3];
@@ -64,15 +77,148 @@ typedef struct {
 	float lastYaw;
 } mpudata_t;
 
+// What the reads of one device have run into since it was initialized
+typedef struct {
+	unsigned long samples;
+	// polls that found no new sample
+	unsigned long noData;
+	// older packets mpu9150_read_dmp() skipped to catch up
+	unsigned long dropped;
+	unsigned long readErrors;
+	// reads waiting for the DMP FIFO to hold enough to realign after an overflow
+	unsigned long resyncWaits;
+	// samples whose fused attitude was not finite, the yaw is restarted
+	unsigned long fusionErrors;
+} mpu9150_stats_t;
+
+// Wall time of each step of the last bring-up of a device. "reset" and
+// "compass" are the two halves of mpu_init(), the latter mostly the
+// HMC5883L self test unless it came from the cache.
+#define MPU9150_MAX_INIT_PHASES 12
+
+typedef struct {
+	int count;
+	const char *name[MPU9150_MAX_INIT_PHASES];
+	uint64_t ns[MPU9150_MAX_INIT_PHASES];
+	uint64_t totalNs;
+} mpu9150_init_times_t;
+
+// Everything calibrate_data() and data_fusion() depend on besides the
+// sample, so offline tools can run several settings side by side.
+typedef struct {
+	int yawMixFactor;
+	int useAccelCal;
+	caldata_t accelCal;
+	int useMagCal;
+	caldata_t magCal;
+} fusion_config_t;
+
 
 void mpu9150_set_debug(int on);
+// File keeping the HMC5883L self test result so later inits can skip it,
+// "path" for device 0 and "path.N" for device N. NULL or "" to not cache.
+// Has no effect with other compasses.
+void mpu9150_set_compass_cache(const char *path);
 int mpu9150_init(int i2c_bus, int sample_rate, int mix_factor);
+int mpu9150_init_device(int device, int i2c_bus, int sample_rate, int mix_factor);
+int mpu9150_init_raw(int i2c_bus, int sample_rate, int lpf, int mix_factor);
+// Devices 0 to count - 1 like mpu9150_init_device(), each in a thread of
+// its own when the buses differ and the transport allows it, see bringup.c.
+// results gets the return value of each, may be NULL. Device 0 is
+// selected afterwards. Returns -1 if any failed.
+int mpu9150_init_devices(int count, const int *buses, int sample_rate, int mix_factor, int *results);
+// progress dots while initializing, for the calling thread, on by default
+void mpu9150_set_init_progress(int on);
+int mpu9150_get_init_times(int device, mpu9150_init_times_t *times);
+// "<total> ms (<phase> <ms>, ...)"
+int mpu9150_format_init_times(int device, char *buf, int len);
+int mpu9150_select_device(int device);
 void mpu9150_exit();
 int mpu9150_read(mpudata_t *mpu);
+// mpu9150_read() without the mpu9150_process() step
+int mpu9150_read_sample(mpudata_t *mpu);
 int mpu9150_read_dmp(mpudata_t *mpu);
+int mpu9150_sample_rate();
+// Live changes to the selected device, not while idle. The sample rate
+// resets the low pass filter to half of it in raw mode, set the filter
+// after. In DMP mode the ranges stay at 2000 dps and 2 g, which the
+// DMP's quaternion assumes. The accel calibration and the hardware accel
+// bias hold at any range.
+int mpu9150_set_sample_rate(int sample_rate);
+int mpu9150_set_lpf(int lpf);
+int mpu9150_set_gyro_fsr(int dps);
+int mpu9150_set_accel_fsr(int g);
+// counts per dps and per g at the current ranges
+int mpu9150_get_sens(float *gyro, float *accel);
+// of the yaw mixing in mpu9150_process(), for every device
+int mpu9150_set_mix_factor(int mix_factor);
+int mpu9150_fifo_queued(int *packets);
+int mpu9150_read_fifo_packet(mpudata_t *mpu);
 int mpu9150_read_mag(mpudata_t *mpu);
+int mpu9150_process(mpudata_t *mpu);
+// While on, mpu9150_process() mixes no magnetometer into the yaw, for
+// when the IMU rests next to machinery that disturbs the field. Not
+// recorded in raw logs.
+void mpu9150_set_mag_yaw_hold(int on);
+// Off makes mpu9150_read_mag() and the reads that include it leave the
+// compass alone, rawMag keeps its last value. Hold the yaw as well.
+void mpu9150_set_mag_reads(int on);
+int mpu9150_process_config(const fusion_config_t *config, mpudata_t *mpu);
+void mpu9150_get_fusion_config(fusion_config_t *config);
+// the two steps of mpu9150_process_config() on their own, for benchmarks
+void mpu9150_calibrate(const fusion_config_t *config, mpudata_t *mpu);
+int mpu9150_fuse(const fusion_config_t *config, mpudata_t *mpu);
+// counters of the selected device
+void mpu9150_get_stats(mpu9150_stats_t *stats);
 void mpu9150_set_accel_cal(caldata_t *cal);
 void mpu9150_set_mag_cal(caldata_t *cal);
 
+// Gyro bias of the selected device in dps, DMP mode only. With the DMP's
+// gyro calibration this is its own estimate, which takes about 8 s of
+// stillness after every start. Seeding a saved one skips that wait.
+int mpu9150_get_gyro_bias(float *dps);
+int mpu9150_set_gyro_bias(const float *dps);
+// "path" for device 0 and "path.N" for device N. Loading sets the bias,
+// dps gets what was loaded and may be NULL. Saving replaces the file
+// atomically.
+int mpu9150_load_bias_state(const char *path, float *dps);
+int mpu9150_save_bias_state(const char *path, const float *dps);
+
+// Gyro bias against die temperature for the selected device, see
+// tempcomp.h. The temperature is read once a second. In raw mode the
+// model learns from the rest windows of a stationary.h detector and its
+// bias comes off rawGyro before the host fusion. In DMP mode it learns from the DMP's own estimates and
+// is pushed to the DMP when the temperature moves. Enabling starts with
+// an empty model, load a saved one after.
+struct tempcomp_s;
+int mpu9150_enable_tempcomp(int on);
+// the raw mode detector, a window of about a second with the
+// stationary.h default limits until set, call after enabling
+void mpu9150_set_tempcomp_stationary(int window, float gyro_std, float accel_std);
+// "path" for device 0 and "path.N" for device N
+int mpu9150_load_tempcomp(const char *path);
+int mpu9150_save_tempcomp(const char *path);
+// last reading in C, -1 before the first or with the model off
+int mpu9150_get_temperature(float *celsius);
+// NULL with the model off
+const struct tempcomp_s *mpu9150_get_tempcomp();
+
+// Low power wake on motion for the selected device. The gyros, the DMP
+// and the compass stop, the accel wakes at wake_hz (1, 5, 20 or 40) and
+// compares against the sample held on entry. thresh_mg is rounded down
+// to 32 mg steps, duration_ms is how long it must be exceeded. Nothing
+// is read from the device while idle.
+int mpu9150_enter_idle(int thresh_mg, int duration_ms, int wake_hz);
+// 1 once motion was seen, 0 while still, -1 when not idle or on error
+int mpu9150_idle_motion();
+// back to the configuration before mpu9150_enter_idle(), the FIFO starts empty
+int mpu9150_exit_idle();
+int mpu9150_idle();
+
+// Recording and replaying the input of mpu9150_process(), see rawlog.h
+struct rawlog_s;
+void mpu9150_set_rawlog(struct rawlog_s *log);
+void mpu9150_init_replay(int mix_factor);
+
 #endif /* MPU9150_H */
 
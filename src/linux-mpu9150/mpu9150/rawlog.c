@@ -0,0 +1,324 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "inv_mpu.h"
+#include "rawlog.h"
+
+// the format depends on these
+typedef char rawlog_header_size_check[(sizeof(rawlog_header_t) == RAWLOG_RECORD_SIZE) ? 1 : -1];
+typedef char rawlog_record_size_check[(sizeof(rawlog_record_t) == RAWLOG_RECORD_SIZE) ? 1 : -1];
+
+#define BUFFER_BYTES (RAWLOG_BUFFER_RECORDS * RAWLOG_RECORD_SIZE)
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_all(rawlog_t *log, int len)
+{
+	int n, done;
+
+	for (done = 0; done < len; done += n) {
+		n = write(log->fd, log->buffer + done, len - done);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+
+			if (!log->writeErrors)
+				perror("rawlog write");
+
+			log->writeErrors++;
+			return -1;
+		}
+	}
+
+	log->fileBytes += len;
+
+	return 0;
+}
+
+static int open_file(rawlog_t *log)
+{
+	char path[300];
+	uint32_t rate;
+	int flags;
+
+	snprintf(path, sizeof(path), "%s-%04lu.raw", log->base, log->files);
+
+	flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	if (log->direct) {
+		log->fd = open(path, flags | O_DIRECT, 0644);
+
+		// tmpfs and some others refuse O_DIRECT
+		if (log->fd < 0 && errno == EINVAL) {
+			printf("rawlog: no O_DIRECT on %s, using buffered writes\n", path);
+			log->direct = 0;
+		}
+	}
+
+	if (!log->direct)
+		log->fd = open(path, flags, 0644);
+
+	if (log->fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	rate = log->header.sampleRate;
+	memset(&log->header, 0, sizeof(rawlog_header_t));
+	memcpy(log->header.magic, RAWLOG_MAGIC, sizeof(log->header.magic));
+	log->header.version = RAWLOG_VERSION;
+	log->header.recordSize = RAWLOG_RECORD_SIZE;
+	log->header.sampleRate = rate;
+	log->header.fileIndex = log->files;
+	log->header.startNs = clock_ns(CLOCK_MONOTONIC);
+	log->header.wallNs = clock_ns(CLOCK_REALTIME);
+
+	if (mpu_get_gyro_sens(&log->header.gyroSens))
+		log->header.gyroSens = 0.0f;
+
+	// the header takes the first slot so records stay aligned
+	memcpy(log->buffer, &log->header, RAWLOG_RECORD_SIZE);
+	log->buffered = 1;
+	log->fileBytes = 0;
+	log->files++;
+
+	return 0;
+}
+
+static int close_file(rawlog_t *log)
+{
+	int result = 0;
+
+	if (log->fd < 0)
+		return 0;
+
+	if (log->buffered > 0) {
+		// the tail isn't a whole number of blocks
+		if (log->direct)
+			fcntl(log->fd, F_SETFL, fcntl(log->fd, F_GETFL) & ~O_DIRECT);
+
+		result = write_all(log, log->buffered * RAWLOG_RECORD_SIZE);
+		log->buffered = 0;
+	}
+
+	close(log->fd);
+	log->fd = -1;
+
+	return result;
+}
+
+int rawlog_open(rawlog_t *log, const char *base, uint64_t max_bytes, int direct, int sample_rate)
+{
+	void *buffer;
+
+	memset(log, 0, sizeof(rawlog_t));
+	log->fd = -1;
+
+	if (strlen(base) >= sizeof(log->base)) {
+		printf("rawlog: path too long\n");
+		return -1;
+	}
+
+	if (posix_memalign(&buffer, RAWLOG_ALIGN, BUFFER_BYTES)) {
+		printf("rawlog: out of memory\n");
+		return -1;
+	}
+
+	strcpy(log->base, base);
+	log->buffer = (unsigned char *)buffer;
+	log->direct = direct;
+	log->header.sampleRate = sample_rate;
+
+	// a file holds at least one buffer
+	if (max_bytes && max_bytes < BUFFER_BYTES)
+		max_bytes = BUFFER_BYTES;
+
+	log->maxBytes = max_bytes;
+
+	if (open_file(log)) {
+		free(log->buffer);
+		log->buffer = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int rawlog_append(rawlog_t *log, const rawlog_record_t *rec)
+{
+	if (log->fd < 0)
+		return -1;
+
+	memcpy(log->buffer + log->buffered * RAWLOG_RECORD_SIZE, rec, RAWLOG_RECORD_SIZE);
+	log->buffered++;
+	log->records++;
+
+	if (log->buffered < RAWLOG_BUFFER_RECORDS)
+		return 0;
+
+	if (write_all(log, BUFFER_BYTES)) {
+		log->buffered = 0;
+		return -1;
+	}
+
+	log->buffered = 0;
+
+	if (log->maxBytes && log->fileBytes + BUFFER_BYTES > log->maxBytes) {
+		close_file(log);
+		return open_file(log);
+	}
+
+	return 0;
+}
+
+int rawlog_rotate(rawlog_t *log, int sample_rate)
+{
+	int result = close_file(log);
+
+	log->header.sampleRate = sample_rate;
+
+	if (open_file(log))
+		return -1;
+
+	return result;
+}
+
+// With O_DIRECT only whole buffers can go out before the file is closed.
+int rawlog_flush(rawlog_t *log)
+{
+	int result;
+
+	if (log->fd < 0 || log->direct || log->buffered == 0)
+		return 0;
+
+	result = write_all(log, log->buffered * RAWLOG_RECORD_SIZE);
+	log->buffered = 0;
+
+	return result;
+}
+
+void rawlog_close(rawlog_t *log)
+{
+	close_file(log);
+
+	if (log->buffer) {
+		free(log->buffer);
+		log->buffer = NULL;
+	}
+}
+
+void rawlog_pack(rawlog_record_t *rec, const mpudata_t *mpu, int flags, int device)
+{
+	int i;
+
+	memset(rec, 0, sizeof(rawlog_record_t));
+
+	rec->timeNs = clock_ns(CLOCK_MONOTONIC);
+	rec->dmpTimestamp = mpu->dmpTimestamp;
+	rec->magTimestamp = mpu->magTimestamp;
+
+	for (i = 0; i < 4; i++)
+		rec->quat[i] = mpu->rawQuat[i];
+
+	for (i = 0; i < 3; i++) {
+		rec->gyro[i] = mpu->rawGyro[i];
+		rec->accel[i] = mpu->rawAccel[i];
+		rec->mag[i] = mpu->rawMag[i];
+	}
+
+	rec->flags = flags;
+	rec->device = device;
+}
+
+// Only the raw fields, the fusion state in mpu carries on.
+void rawlog_unpack(const rawlog_record_t *rec, mpudata_t *mpu)
+{
+	int i;
+
+	mpu->dmpTimestamp = rec->dmpTimestamp;
+	mpu->magTimestamp = rec->magTimestamp;
+
+	for (i = 0; i < 4; i++)
+		mpu->rawQuat[i] = rec->quat[i];
+
+	for (i = 0; i < 3; i++) {
+		mpu->rawGyro[i] = rec->gyro[i];
+		mpu->rawAccel[i] = rec->accel[i];
+		mpu->rawMag[i] = rec->mag[i];
+	}
+}
+
+int rawlog_check_header(const rawlog_header_t *header)
+{
+	if (memcmp(header->magic, RAWLOG_MAGIC, sizeof(header->magic))) {
+		printf("rawlog: not a raw sample log\n");
+		return -1;
+	}
+
+	if (header->version != RAWLOG_VERSION || header->recordSize != RAWLOG_RECORD_SIZE) {
+		printf("rawlog: unsupported version %u, record size %u\n", header->version, header->recordSize);
+		return -1;
+	}
+
+	return 0;
+}
+
+int rawlog_reader_open(rawlog_reader_t *reader, const char *path)
+{
+	reader->fh = fopen(path, "rb");
+
+	if (!reader->fh) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(&reader->header, sizeof(rawlog_header_t), 1, reader->fh) != 1
+			|| rawlog_check_header(&reader->header)) {
+		printf("rawlog: bad header in %s\n", path);
+		fclose(reader->fh);
+		reader->fh = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+// 1 for a record, 0 at the end of the file
+int rawlog_reader_next(rawlog_reader_t *reader, rawlog_record_t *rec)
+{
+	if (fread(rec, sizeof(rawlog_record_t), 1, reader->fh) == 1)
+		return 1;
+
+	return ferror(reader->fh) ? -1 : 0;
+}
+
+void rawlog_reader_close(rawlog_reader_t *reader)
+{
+	if (reader->fh) {
+		fclose(reader->fh);
+		reader->fh = NULL;
+	}
+}
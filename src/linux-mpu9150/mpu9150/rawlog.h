@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef RAWLOG_H
+#define RAWLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mpu9150.h"
+
+// Binary log of what goes into calibrate_data() and data_fusion(): the
+// raw quaternion, gyro and accel of a FIFO packet, the last compass read
+// and their timestamps. A file is a header followed by fixed size records
+// in host byte order, so it can be indexed by record number. Logs rotate
+// into <base>-0000.raw, <base>-0001.raw, ... once they reach a size.
+
+#define RAWLOG_MAGIC "MPURAWLG"
+#define RAWLOG_VERSION 1
+#define RAWLOG_RECORD_SIZE 56
+
+// 1024 records are exactly 14 pages, so every full buffer is a valid
+// O_DIRECT write
+#define RAWLOG_BUFFER_RECORDS 1024
+#define RAWLOG_ALIGN 4096
+
+// record flags
+#define RAWLOG_DMP 0x01		// quaternion from the DMP
+#define RAWLOG_HOST 0x02	// quaternion from the host filter in raw mode
+#define RAWLOG_MAG 0x04		// the compass was read for this sample
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t sampleRate;
+	uint32_t fileIndex;
+	uint64_t startNs;		// CLOCK_MONOTONIC when the file was opened
+	uint64_t wallNs;		// CLOCK_REALTIME at the same moment
+	float gyroSens;			// LSB per deg/s of the gyro values, 0 if unknown
+	uint8_t reserved[12];
+} rawlog_header_t;
+
+typedef struct {
+	uint64_t timeNs;		// CLOCK_MONOTONIC
+	uint32_t dmpTimestamp;
+	uint32_t magTimestamp;
+	int32_t quat[4];
+	int16_t gyro[3];
+	int16_t accel[3];
+	int16_t mag[3];
+	uint8_t flags;
+	uint8_t device;
+	uint32_t reserved;
+} rawlog_record_t;
+
+typedef struct rawlog_s {
+	int fd;
+	char base[256];
+	int direct;
+	uint64_t maxBytes;
+	uint64_t fileBytes;
+	rawlog_header_t header;
+
+	unsigned char *buffer;
+	int buffered;
+
+	unsigned long records;
+	unsigned long files;
+	unsigned long writeErrors;
+} rawlog_t;
+
+typedef struct {
+	FILE *fh;
+	rawlog_header_t header;
+} rawlog_reader_t;
+
+int rawlog_open(rawlog_t *log, const char *base, uint64_t max_bytes, int direct, int sample_rate);
+int rawlog_append(rawlog_t *log, const rawlog_record_t *rec);
+// Starts the next file, whose header takes sample_rate and the current
+// gyro sensitivity. For when either changes while logging.
+int rawlog_rotate(rawlog_t *log, int sample_rate);
+int rawlog_flush(rawlog_t *log);
+void rawlog_close(rawlog_t *log);
+
+void rawlog_pack(rawlog_record_t *rec, const mpudata_t *mpu, int flags, int device);
+void rawlog_unpack(const rawlog_record_t *rec, mpudata_t *mpu);
+int rawlog_check_header(const rawlog_header_t *header);
+
+int rawlog_reader_open(rawlog_reader_t *reader, const char *path);
+int rawlog_reader_next(rawlog_reader_t *reader, rawlog_record_t *rec);
+void rawlog_reader_close(rawlog_reader_t *reader);
+
+#endif /* RAWLOG_H */
@@ -0,0 +1,281 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rawmap.h"
+
+#define MAX_THREADS 64
+
+typedef struct {
+	const rawmap_t *map;
+	unsigned long first;
+	unsigned long count;
+	unsigned long warmup;
+	rawmap_sink_t sink;
+	void *arg;
+	long errors;
+} chunk_t;
+
+int rawmap_open(rawmap_t *map, const char *path, unsigned long stride)
+{
+	struct stat st;
+	void *base;
+	unsigned long i;
+
+	memset(map, 0, sizeof(rawmap_t));
+
+	map->fd = open(path, O_RDONLY);
+
+	if (map->fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(map->fd, &st) < 0) {
+		perror(path);
+		goto fail;
+	}
+
+	if (st.st_size < (off_t)sizeof(rawlog_header_t)) {
+		printf("rawmap: %s is too short\n", path);
+		goto fail;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		goto fail;
+	}
+
+	map->base = (const unsigned char *)base;
+	map->size = st.st_size;
+	map->header = (const rawlog_header_t *)map->base;
+
+	if (rawlog_check_header(map->header)) {
+		printf("rawmap: bad header in %s\n", path);
+		goto fail;
+	}
+
+	// a log cut short by a crash can end in a partial record
+	map->records = (const rawlog_record_t *)(map->base + sizeof(rawlog_header_t));
+	map->count = (map->size - sizeof(rawlog_header_t)) / sizeof(rawlog_record_t);
+
+	// building the index touches one page per stride, don't read ahead
+	madvise(base, map->size, MADV_RANDOM);
+
+	map->stride = stride ? stride : RAWMAP_INDEX_STRIDE;
+	map->indexCount = (map->count + map->stride - 1) / map->stride;
+
+	if (map->indexCount > 0) {
+		map->indexNs = (uint64_t *)malloc(map->indexCount * sizeof(uint64_t));
+
+		if (!map->indexNs) {
+			printf("rawmap: out of memory\n");
+			goto fail;
+		}
+
+		for (i = 0; i < map->indexCount; i++)
+			map->indexNs[i] = map->records[i * map->stride].timeNs;
+	}
+
+	return 0;
+
+fail:
+	rawmap_close(map);
+	return -1;
+}
+
+void rawmap_close(rawmap_t *map)
+{
+	if (map->base) {
+		munmap((void *)map->base, map->size);
+		map->base = NULL;
+	}
+
+	if (map->fd >= 0) {
+		close(map->fd);
+		map->fd = -1;
+	}
+
+	if (map->indexNs) {
+		free(map->indexNs);
+		map->indexNs = NULL;
+	}
+
+	map->count = 0;
+	map->indexCount = 0;
+}
+
+unsigned long rawmap_seek(const rawmap_t *map, uint64_t time_ns)
+{
+	unsigned long lo, hi, mid;
+
+	if (map->count == 0 || time_ns <= map->indexNs[0])
+		return 0;
+
+	// last index entry before time_ns
+	lo = 0;
+	hi = map->indexCount;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+
+		if (map->indexNs[mid] < time_ns)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	// then the first record at or after it within that stride
+	hi = (lo + 1) * map->stride;
+	lo = lo * map->stride;
+
+	if (hi > map->count)
+		hi = map->count;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (map->records[mid].timeNs < time_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+const rawlog_record_t *rawmap_span(const rawmap_t *map, unsigned long first, unsigned long *count)
+{
+	if (first >= map->count) {
+		*count = 0;
+		return NULL;
+	}
+
+	if (*count > map->count - first)
+		*count = map->count - first;
+
+	return map->records + first;
+}
+
+// Asks for a range of records to be read in ahead of the sequential pass.
+static void prefetch(const rawmap_t *map, unsigned long first, unsigned long count)
+{
+	uintptr_t start, end;
+	long page = sysconf(_SC_PAGESIZE);
+
+	start = (uintptr_t)(map->records + first) & ~(uintptr_t)(page - 1);
+	end = (uintptr_t)(map->records + first + count);
+
+	madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+static void *process_chunk(void *p)
+{
+	chunk_t *chunk = (chunk_t *)p;
+	const rawlog_record_t *rec;
+	unsigned long start, i, end;
+	mpudata_t mpu;
+
+	start = chunk->first > chunk->warmup ? chunk->first - chunk->warmup : 0;
+	end = chunk->first + chunk->count;
+
+	prefetch(chunk->map, start, end - start);
+	memset(&mpu, 0, sizeof(mpudata_t));
+
+	for (i = start; i < end; i++) {
+		rec = chunk->map->records + i;
+		rawlog_unpack(rec, &mpu);
+
+		if (mpu9150_process(&mpu)) {
+			if (i >= chunk->first)
+				chunk->errors++;
+
+			continue;
+		}
+
+		if (i >= chunk->first && chunk->sink)
+			chunk->sink(chunk->arg, i, rec, &mpu);
+	}
+
+	return NULL;
+}
+
+long rawmap_process(const rawmap_t *map, unsigned long first, unsigned long count,
+		int threads, unsigned long warmup, rawmap_sink_t sink, void *arg)
+{
+	pthread_t tid[MAX_THREADS];
+	chunk_t chunk[MAX_THREADS];
+	unsigned long per_thread;
+	long errors;
+	int i, started;
+
+	rawmap_span(map, first, &count);
+
+	if (count == 0)
+		return 0;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	// no point in chunks that are mostly warmup
+	if ((unsigned long)threads > count / (warmup + 1))
+		threads = count / (warmup + 1);
+
+	if (threads < 1)
+		threads = 1;
+
+	per_thread = (count + threads - 1) / threads;
+	threads = (count + per_thread - 1) / per_thread;
+
+	for (i = 0; i < threads; i++) {
+		chunk[i].map = map;
+		chunk[i].first = first + i * per_thread;
+		chunk[i].count = (i == threads - 1) ? count - i * per_thread : per_thread;
+		chunk[i].warmup = warmup;
+		chunk[i].sink = sink;
+		chunk[i].arg = arg;
+		chunk[i].errors = 0;
+	}
+
+	if (threads == 1) {
+		process_chunk(&chunk[0]);
+
+		return chunk[0].errors;
+	}
+
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&tid[started], NULL, process_chunk, &chunk[started]))
+			break;
+	}
+
+	errors = 0;
+
+	for (i = 0; i < started; i++) {
+		pthread_join(tid[i], NULL);
+		errors += chunk[i].errors;
+	}
+
+	if (started < threads) {
+		printf("rawmap: could only start %d of %d threads\n", started, threads);
+		return -1;
+	}
+
+	return errors;
+}
@@ -0,0 +1,63 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef RAWMAP_H
+#define RAWMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "rawlog.h"
+
+// Random access to a raw sample log, see rawlog.h. The file is mapped
+// read only and records are handed out in place. A sparse index keeps the
+// time of every stride-th record, so finding a time costs a binary search
+// over the index and one over a single stride of records, and only the
+// pages touched on the way are read from disk.
+
+#define RAWMAP_INDEX_STRIDE 1024
+
+typedef struct {
+	int fd;
+	const unsigned char *base;
+	size_t size;
+	const rawlog_header_t *header;
+	const rawlog_record_t *records;
+	unsigned long count;
+
+	uint64_t *indexNs;
+	unsigned long indexCount;
+	unsigned long stride;
+} rawmap_t;
+
+// Called for each record of the requested range, from the worker threads.
+// index is the record number in the file, each one is handed out once.
+typedef void (*rawmap_sink_t)(void *arg, unsigned long index, const rawlog_record_t *rec,
+		const mpudata_t *mpu);
+
+// A stride of 0 uses RAWMAP_INDEX_STRIDE.
+int rawmap_open(rawmap_t *map, const char *path, unsigned long stride);
+void rawmap_close(rawmap_t *map);
+
+// The first record at or after time_ns (CLOCK_MONOTONIC like the records),
+// count if there is none.
+unsigned long rawmap_seek(const rawmap_t *map, uint64_t time_ns);
+
+// Records first to first + *count - 1 without copying, *count is clipped
+// to the end of the file. NULL if first is past the end.
+const rawlog_record_t *rawmap_span(const rawmap_t *map, unsigned long first, unsigned long *count);
+
+// Runs records first to first + count - 1 through mpu9150_process() on
+// threads threads, 0 for one per CPU. Each thread takes a contiguous chunk
+// and first runs up to warmup records before it, without calling sink, so
+// the yaw fusion has converged by the time its chunk starts. Results match
+// a sequential pass only as far as the warmup allows, and not at all with
+// a yaw mixing factor of 0. Returns the number of fusion errors, -1 if the
+// threads could not be started.
+long rawmap_process(const rawmap_t *map, unsigned long first, unsigned long count,
+		int threads, unsigned long warmup, rawmap_sink_t sink, void *arg);
+
+#endif /* RAWMAP_H */
@@ -0,0 +1,221 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "spectrum.h"
+
+#define HALF_SIZE	(SPECTRUM_SIZE / 2)
+
+static void fft_half(spectrum_t *spectrum, float *re, float *im);
+static void analyze_axis(spectrum_t *spectrum, int axis, float *re, float *im);
+
+int spectrum_init(spectrum_t *spectrum, float sample_rate, const float *band_edges, int num_bands)
+{
+	int i, j, bits;
+
+	if (sample_rate <= 0.0f || num_bands < 1 || num_bands > SPECTRUM_MAX_BANDS) {
+		printf("Invalid spectrum configuration\n");
+		return -1;
+	}
+
+	for (i = 0; i < num_bands; i++) {
+		if (band_edges[i + 1] <= band_edges[i]) {
+			printf("Spectrum band edges must increase\n");
+			return -1;
+		}
+	}
+
+	memset(spectrum, 0, sizeof(spectrum_t));
+
+	spectrum->sampleRate = sample_rate;
+	spectrum->numBands = num_bands;
+	memcpy(spectrum->bandEdges, band_edges, (num_bands + 1) * sizeof(float));
+
+	for (i = 0; i < SPECTRUM_SIZE; i++) {
+		spectrum->window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / SPECTRUM_SIZE);
+		spectrum->windowPower += spectrum->window[i] * spectrum->window[i];
+	}
+
+	// W_N^k, the half size FFT uses every other one
+	for (i = 0; i < HALF_SIZE; i++) {
+		spectrum->twiddleRe[i] = cosf(2.0f * (float)M_PI * i / SPECTRUM_SIZE);
+		spectrum->twiddleIm[i] = -sinf(2.0f * (float)M_PI * i / SPECTRUM_SIZE);
+	}
+
+	for (bits = 0; (1 << bits) < HALF_SIZE; bits++)
+		;
+
+	for (i = 0; i < HALF_SIZE; i++) {
+		spectrum->bitrev[i] = 0;
+
+		for (j = 0; j < bits; j++) {
+			if (i & (1 << j))
+				spectrum->bitrev[i] |= 1 << (bits - 1 - j);
+		}
+	}
+
+	return 0;
+}
+
+void spectrum_add(spectrum_t *spectrum, const float *sample)
+{
+	int axis;
+
+	for (axis = 0; axis < SPECTRUM_AXES; axis++)
+		spectrum->history[axis][spectrum->head] = sample[axis];
+
+	spectrum->head = (spectrum->head + 1) % SPECTRUM_SIZE;
+
+	if (spectrum->filled < SPECTRUM_SIZE)
+		spectrum->filled++;
+}
+
+// Updates bandPower, peakFreq and peakAmplitude from the current window.
+// Returns -1 until the window has been filled once.
+int spectrum_compute(spectrum_t *spectrum)
+{
+	float re[HALF_SIZE], im[HALF_SIZE];
+	int axis;
+
+	if (spectrum->filled < SPECTRUM_SIZE)
+		return -1;
+
+	for (axis = 0; axis < SPECTRUM_AXES; axis++)
+		analyze_axis(spectrum, axis, re, im);
+
+	return 0;
+}
+
+// The N real samples are packed into N/2 complex ones, transformed with a
+// half size complex FFT and split into the spectrum of the real signal.
+void analyze_axis(spectrum_t *spectrum, int axis, float *re, float *im)
+{
+	const float *x = spectrum->history[axis];
+	float mean = 0.0f;
+	float power[HALF_SIZE + 1];
+	float binWidth = spectrum->sampleRate / SPECTRUM_SIZE;
+	float scale, a, b, c, offset;
+	int i, k, n, peak, band;
+
+	for (i = 0; i < SPECTRUM_SIZE; i++)
+		mean += x[i];
+
+	mean /= SPECTRUM_SIZE;
+
+	// oldest sample first, DC (gravity, gyro bias) removed
+	for (i = 0; i < HALF_SIZE; i++) {
+		n = (spectrum->head + 2 * i) % SPECTRUM_SIZE;
+		re[spectrum->bitrev[i]] = (x[n] - mean) * spectrum->window[2 * i];
+		n = (n + 1) % SPECTRUM_SIZE;
+		im[spectrum->bitrev[i]] = (x[n] - mean) * spectrum->window[2 * i + 1];
+	}
+
+	fft_half(spectrum, re, im);
+
+	for (k = 0; k <= HALF_SIZE; k++) {
+		int k1 = k % HALF_SIZE;
+		int k2 = (HALF_SIZE - k) % HALF_SIZE;
+		float evenRe = 0.5f * (re[k1] + re[k2]);
+		float evenIm = 0.5f * (im[k1] - im[k2]);
+		float oddRe = 0.5f * (im[k1] + im[k2]);
+		float oddIm = -0.5f * (re[k1] - re[k2]);
+		float wRe, wIm, xRe, xIm;
+
+		if (k < HALF_SIZE) {
+			wRe = spectrum->twiddleRe[k];
+			wIm = spectrum->twiddleIm[k];
+		}
+		else {
+			wRe = -1.0f;
+			wIm = 0.0f;
+		}
+
+		xRe = evenRe + wRe * oddRe - wIm * oddIm;
+		xIm = evenIm + wRe * oddIm + wIm * oddRe;
+		power[k] = xRe * xRe + xIm * xIm;
+	}
+
+	// Parseval: one sided bins sum to the mean square of the signal
+	scale = 2.0f / (SPECTRUM_SIZE * spectrum->windowPower);
+
+	for (band = 0; band < spectrum->numBands; band++)
+		spectrum->bandPower[axis][band] = 0.0f;
+
+	peak = 1;
+
+	for (k = 1; k <= HALF_SIZE; k++) {
+		float f = k * binWidth;
+
+		for (band = 0; band < spectrum->numBands; band++) {
+			if (f >= spectrum->bandEdges[band] && f < spectrum->bandEdges[band + 1])
+				spectrum->bandPower[axis][band] += scale * power[k];
+		}
+
+		if (power[k] > power[peak])
+			peak = k;
+	}
+
+	// parabolic interpolation between bins on the log power
+	offset = 0.0f;
+
+	if (peak < HALF_SIZE && power[peak - 1] > 0.0f && power[peak + 1] > 0.0f) {
+		a = logf(power[peak - 1]);
+		b = logf(power[peak]);
+		c = logf(power[peak + 1]);
+
+		if (a - 2.0f * b + c < 0.0f)
+			offset = 0.5f * (a - c) / (a - 2.0f * b + c);
+	}
+
+	// a flat signal has no peak
+	if (power[peak] <= 0.0f)
+		peak = offset = 0;
+
+	spectrum->peakFreq[axis] = (peak + offset) * binWidth;
+	// A sine of amplitude A has a mean square of A^2 / 2, spread over the
+	// main lobe of the Hann window, two bins either side. Summing the lobe
+	// avoids the scalloping loss of reading the peak bin alone.
+	a = 0.0f;
+
+	for (k = peak - 2; k <= peak + 2; k++) {
+		if (k >= 1 && k <= HALF_SIZE)
+			a += scale * power[k];
+	}
+
+	spectrum->peakAmplitude[axis] = sqrtf(2.0f * a);
+}
+
+// In place radix-2 decimation in time FFT of N/2 points, input in bit
+// reversed order.
+void fft_half(spectrum_t *spectrum, float *re, float *im)
+{
+	int size, half, step, i, j, k;
+	float wRe, wIm, tRe, tIm;
+
+	for (size = 2; size <= HALF_SIZE; size <<= 1) {
+		half = size >> 1;
+		// W_size^j == W_N^(j * N / size)
+		step = SPECTRUM_SIZE / size;
+
+		for (i = 0; i < HALF_SIZE; i += size) {
+			for (j = 0; j < half; j++) {
+				k = i + j;
+				wRe = spectrum->twiddleRe[j * step];
+				wIm = spectrum->twiddleIm[j * step];
+				tRe = wRe * re[k + half] - wIm * im[k + half];
+				tIm = wRe * im[k + half] + wIm * re[k + half];
+				re[k + half] = re[k] - tRe;
+				im[k + half] = im[k] - tIm;
+				re[k] += tRe;
+				im[k] += tIm;
+			}
+		}
+	}
+}
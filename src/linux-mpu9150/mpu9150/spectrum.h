@@ -0,0 +1,47 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+// Vibration spectrum of the accel and gyro axes. Samples go into a sliding
+// window per axis and spectrum_compute() runs a Hann windowed real FFT over
+// the last SPECTRUM_SIZE samples, reducing it to the mean square signal in
+// a few frequency bands and the strongest peak. All buffers live in the
+// spectrum_t, nothing is allocated.
+
+// must be a power of two
+#define SPECTRUM_SIZE		256
+#define SPECTRUM_AXES		6
+#define SPECTRUM_MAX_BANDS	8
+
+typedef struct {
+	float sampleRate;
+	int numBands;
+	float bandEdges[SPECTRUM_MAX_BANDS + 1];
+
+	float window[SPECTRUM_SIZE];
+	float windowPower;
+	float twiddleRe[SPECTRUM_SIZE / 2];
+	float twiddleIm[SPECTRUM_SIZE / 2];
+	unsigned short bitrev[SPECTRUM_SIZE / 2];
+
+	float history[SPECTRUM_AXES][SPECTRUM_SIZE];
+	int head;
+	int filled;
+
+	// mean square per band, in the squared units of the input
+	float bandPower[SPECTRUM_AXES][SPECTRUM_MAX_BANDS];
+	float peakFreq[SPECTRUM_AXES];
+	float peakAmplitude[SPECTRUM_AXES];
+} spectrum_t;
+
+int spectrum_init(spectrum_t *spectrum, float sample_rate, const float *band_edges, int num_bands);
+void spectrum_add(spectrum_t *spectrum, const float *sample);
+int spectrum_compute(spectrum_t *spectrum);
+
+#endif /* SPECTRUM_H */
@@ -0,0 +1,129 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <string.h>
+#include <math.h>
+
+#include "stationary.h"
+
+void stationary_init(stationary_t *s, int window, float gyro_std, float accel_std)
+{
+	memset(s, 0, sizeof(stationary_t));
+
+	if (window < 2)
+		window = 2;
+	else if (window > STATIONARY_MAX_WINDOW)
+		window = STATIONARY_MAX_WINDOW;
+
+	s->window = window;
+	s->gyroStd = gyro_std;
+	s->accelStd = accel_std;
+}
+
+// exact sums once per lap, so the running ones never drift far
+static void resum(stationary_t *s)
+{
+	int i, axis;
+
+	memset(s->gyroSum, 0, sizeof(s->gyroSum));
+	memset(s->gyroSumSq, 0, sizeof(s->gyroSumSq));
+	memset(s->accelSum, 0, sizeof(s->accelSum));
+	memset(s->accelSumSq, 0, sizeof(s->accelSumSq));
+
+	for (i = 0; i < s->count; i++) {
+		for (axis = 0; axis < 3; axis++) {
+			s->gyroSum[axis] += s->gyro[i][axis];
+			s->gyroSumSq[axis] += (double)s->gyro[i][axis] * s->gyro[i][axis];
+			s->accelSum[axis] += s->accel[i][axis];
+			s->accelSumSq[axis] += (double)s->accel[i][axis] * s->accel[i][axis];
+		}
+	}
+}
+
+static int spread_below(const double *sum, const double *sum_sq, int n, float limit)
+{
+	double mean, var;
+	int axis;
+
+	for (axis = 0; axis < 3; axis++) {
+		mean = sum[axis] / n;
+		var = sum_sq[axis] / n - mean * mean;
+
+		if (var > (double)limit * limit)
+			return 0;
+	}
+
+	return 1;
+}
+
+int stationary_add(stationary_t *s, const float *gyro, const float *accel)
+{
+	float *old_gyro, *old_accel;
+	int axis, spike, still;
+
+	spike = 0;
+
+	for (axis = 0; axis < 3 && s->count > 0; axis++) {
+		if (fabs(gyro[axis] - s->gyroSum[axis] / s->count) > STATIONARY_SPIKE * s->gyroStd
+				|| fabs(accel[axis] - s->accelSum[axis] / s->count) > STATIONARY_SPIKE * s->accelStd)
+			spike = 1;
+	}
+
+	old_gyro = s->gyro[s->next];
+	old_accel = s->accel[s->next];
+
+	for (axis = 0; axis < 3; axis++) {
+		if (s->count == s->window) {
+			s->gyroSum[axis] -= old_gyro[axis];
+			s->gyroSumSq[axis] -= (double)old_gyro[axis] * old_gyro[axis];
+			s->accelSum[axis] -= old_accel[axis];
+			s->accelSumSq[axis] -= (double)old_accel[axis] * old_accel[axis];
+		}
+
+		old_gyro[axis] = gyro[axis];
+		old_accel[axis] = accel[axis];
+
+		s->gyroSum[axis] += gyro[axis];
+		s->gyroSumSq[axis] += (double)gyro[axis] * gyro[axis];
+		s->accelSum[axis] += accel[axis];
+		s->accelSumSq[axis] += (double)accel[axis] * accel[axis];
+	}
+
+	if (s->count < s->window)
+		s->count++;
+
+	if (++s->next == s->window) {
+		s->next = 0;
+		resum(s);
+	}
+
+	s->quiet = spike ? 0 : s->quiet + 1;
+
+	still = s->quiet >= (unsigned long)s->window
+		&& spread_below(s->gyroSum, s->gyroSumSq, s->count, s->gyroStd)
+		&& spread_below(s->accelSum, s->accelSumSq, s->count, s->accelStd);
+
+	if (still != s->stationary) {
+		s->stationary = still;
+		s->transitions++;
+	}
+
+	return still;
+}
+
+int stationary_window_done(const stationary_t *s)
+{
+	return s->stationary && s->quiet % s->window == 0;
+}
+
+void stationary_gyro_mean(const stationary_t *s, float *gyro)
+{
+	int axis;
+
+	for (axis = 0; axis < 3; axis++)
+		gyro[axis] = s->count ? s->gyroSum[axis] / s->count : 0.0f;
+}
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef STATIONARY_H
+#define STATIONARY_H
+
+// Tells when the IMU is at rest from the spread of the gyro and the accel
+// over a sliding window. The samples are kept in fixed ring buffers with
+// running sums, so a sample costs the same whatever the window.
+//
+// The state turns stationary once a whole window is quiet and leaves it
+// on the first sample that strays far from the window mean, so motion is
+// seen at once and rest a window late.
+
+#define STATIONARY_MAX_WINDOW		256
+
+// standard deviation limits, deg/s and g
+#define DEFAULT_STATIONARY_GYRO_STD	0.3f
+#define DEFAULT_STATIONARY_ACCEL_STD	0.01f
+
+// a sample this many limits away from the mean ends the rest at once
+#define STATIONARY_SPIKE		4.0f
+
+typedef struct {
+	int window;
+	float gyroStd;
+	float accelStd;
+
+	float gyro[STATIONARY_MAX_WINDOW][3];
+	float accel[STATIONARY_MAX_WINDOW][3];
+	int next;
+	int count;
+	double gyroSum[3];
+	double gyroSumSq[3];
+	double accelSum[3];
+	double accelSumSq[3];
+
+	// samples since the last one that was not quiet
+	unsigned long quiet;
+	int stationary;
+	unsigned long transitions;
+} stationary_t;
+
+void stationary_init(stationary_t *s, int window, float gyro_std, float accel_std);
+// gyro in deg/s, accel in g, returns the state after the sample
+int stationary_add(stationary_t *s, const float *gyro, const float *accel);
+// 1 every window samples of an unbroken rest, when its mean is fresh
+int stationary_window_done(const stationary_t *s);
+void stationary_gyro_mean(const stationary_t *s, float *gyro);
+
+#endif /* STATIONARY_H */
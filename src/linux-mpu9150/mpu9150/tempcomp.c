@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mpu9150.h"
+#include "tempcomp.h"
+
+static int bin_index(float temp)
+{
+	int i = (int)floorf((temp - TEMPCOMP_MIN_C) / TEMPCOMP_BIN_C);
+
+	if (i < 0)
+		return 0;
+
+	if (i >= TEMPCOMP_BINS)
+		return TEMPCOMP_BINS - 1;
+
+	return i;
+}
+
+static float bin_center(int i)
+{
+	return TEMPCOMP_MIN_C + (i + 0.5f) * TEMPCOMP_BIN_C;
+}
+
+void tempcomp_init(tempcomp_t *tc)
+{
+	memset(tc, 0, sizeof(tempcomp_t));
+}
+
+void tempcomp_learn(tempcomp_t *tc, float temp, const float *bias)
+{
+	int i, axis;
+	float w;
+
+	for (axis = 0; axis < 3; axis++) {
+		if (!isfinite(bias[axis]) || fabsf(bias[axis]) > MAX_GYRO_BIAS_DPS)
+			return;
+	}
+
+	if (!isfinite(temp))
+		return;
+
+	i = bin_index(temp);
+	w = tc->weight[i] + 1.0f;
+
+	if (w > TEMPCOMP_MAX_WEIGHT)
+		w = TEMPCOMP_MAX_WEIGHT;
+
+	for (axis = 0; axis < 3; axis++)
+		tc->bias[i][axis] += (bias[axis] - tc->bias[i][axis]) / w;
+
+	tc->weight[i] = w;
+	tc->observations++;
+}
+
+int tempcomp_predict(const tempcomp_t *tc, float temp, float *bias)
+{
+	int i, lo, hi, axis;
+	float f;
+
+	// the learned bins either side of temp
+	lo = -1;
+	hi = -1;
+
+	for (i = 0; i < TEMPCOMP_BINS; i++) {
+		if (tc->weight[i] == 0.0f)
+			continue;
+
+		if (bin_center(i) <= temp)
+			lo = i;
+		else if (hi < 0)
+			hi = i;
+	}
+
+	if (lo < 0 && hi < 0)
+		return -1;
+
+	// flat beyond the outermost ones
+	if (lo < 0)
+		lo = hi;
+	else if (hi < 0)
+		hi = lo;
+
+	if (lo == hi) {
+		memcpy(bias, tc->bias[lo], 3 * sizeof(float));
+		return 0;
+	}
+
+	f = (temp - bin_center(lo)) / (bin_center(hi) - bin_center(lo));
+
+	for (axis = 0; axis < 3; axis++)
+		bias[axis] = tc->bias[lo][axis] + f * (tc->bias[hi][axis] - tc->bias[lo][axis]);
+
+	return 0;
+}
+
+int tempcomp_learned_bins(const tempcomp_t *tc)
+{
+	int i, n = 0;
+
+	for (i = 0; i < TEMPCOMP_BINS; i++) {
+		if (tc->weight[i] > 0.0f)
+			n++;
+	}
+
+	return n;
+}
+
+int tempcomp_save(const tempcomp_t *tc, const char *path)
+{
+	char tmp[300];
+	FILE *fh;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fh = fopen(tmp, "w");
+
+	if (!fh) {
+		printf("Failed to write temperature model %s\n", tmp);
+		return -1;
+	}
+
+	for (i = 0; i < TEMPCOMP_BINS; i++) {
+		if (tc->weight[i] > 0.0f)
+			fprintf(fh, "%.2f %.1f %f %f %f\n", bin_center(i), tc->weight[i],
+				tc->bias[i][0], tc->bias[i][1], tc->bias[i][2]);
+	}
+
+	// the old table or the new one survive a power cut, never half of one
+	if (fflush(fh) || fsync(fileno(fh))) {
+		fclose(fh);
+		unlink(tmp);
+		return -1;
+	}
+
+	fclose(fh);
+
+	if (rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+int tempcomp_load(tempcomp_t *tc, const char *path)
+{
+	float temp, weight, bias[3];
+	FILE *fh;
+	int i, axis, n;
+
+	fh = fopen(path, "r");
+
+	if (!fh)
+		return -1;
+
+	memset(tc->weight, 0, sizeof(tc->weight));
+	memset(tc->bias, 0, sizeof(tc->bias));
+	tc->observations = 0;
+	n = 0;
+
+	while (fscanf(fh, "%f %f %f %f %f", &temp, &weight, &bias[0], &bias[1], &bias[2]) == 5) {
+		if (!isfinite(temp) || !(weight > 0.0f) || weight > TEMPCOMP_MAX_WEIGHT)
+			continue;
+
+		for (axis = 0; axis < 3; axis++) {
+			if (!isfinite(bias[axis]) || fabsf(bias[axis]) > MAX_GYRO_BIAS_DPS)
+				break;
+		}
+
+		if (axis < 3)
+			continue;
+
+		i = bin_index(temp);
+		tc->weight[i] = weight;
+		memcpy(tc->bias[i], bias, sizeof(bias));
+		n++;
+	}
+
+	fclose(fh);
+
+	return n > 0 ? 0 : -1;
+}
@@ -0,0 +1,44 @@
+////////////////////////////////////////////////////////////////////////////
+//
+//  This file is part of linux-mpu9150
+//
+//  Released under the same terms as the rest of linux-mpu9150,
+//  see the LICENSE file.
+
+#ifndef TEMPCOMP_H
+#define TEMPCOMP_H
+
+// Gyro bias as a function of the die temperature, learned online. The
+// range is cut into bins, each holding the average bias seen at that
+// temperature. Between learned bins the bias is interpolated linearly,
+// beyond the outermost ones it is held flat.
+//
+// Observations come from the rest windows of stationary.h or from the
+// DMP's own gyro calibration. A bin averages its last TEMPCOMP_MAX_WEIGHT
+// or so observations, so it follows slow aging.
+
+#define TEMPCOMP_MIN_C			-40.0f
+#define TEMPCOMP_BIN_C			2.5f
+// -40 to 85 C, the operating range of the MPU6050
+#define TEMPCOMP_BINS			50
+#define TEMPCOMP_MAX_WEIGHT		20.0f
+
+typedef struct tempcomp_s {
+	float weight[TEMPCOMP_BINS];
+	// deg/s
+	float bias[TEMPCOMP_BINS][3];
+	unsigned long observations;
+} tempcomp_t;
+
+void tempcomp_init(tempcomp_t *tc);
+void tempcomp_learn(tempcomp_t *tc, float temp, const float *bias);
+// 0 with the bias at temp, -1 while nothing is learned
+int tempcomp_predict(const tempcomp_t *tc, float temp, float *bias);
+int tempcomp_learned_bins(const tempcomp_t *tc);
+
+// One "<temperature> <weight> <x> <y> <z>" line per learned bin. Saving
+// replaces the file atomically.
+int tempcomp_save(const tempcomp_t *tc, const char *path);
+int tempcomp_load(tempcomp_t *tc, const char *path);
+
+#endif /* TEMPCOMP_H */
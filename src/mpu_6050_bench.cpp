@@ -0,0 +1,154 @@
+#include <ros/ros.h>
+#include <ros/serialization.h>
+#include <sensor_msgs/Imu.h>
+#include <tf/transform_datatypes.h>
+#include <getopt.h>
+
+extern "C"{
+#include "mpu9150.h"
+#include "bench.h"
+}
+
+// Microbenchmarks of the node's per-sample path: the library cases of
+// imubench plus filling and serializing the sensor_msgs/Imu message the
+// way the node does. Needs no IMU and no roscore.
+//
+// rosrun mpu_6050 mpu_6050_bench -t 1 -l $(git rev-parse --short HEAD) -o bench.json
+
+#define NUM_INPUTS 256
+
+struct ImuInputs
+{
+    mpudata_t mpu[NUM_INPUTS];
+    sensor_msgs::Imu imu_msg;
+    double covariance;
+};
+
+// Same conversions as the publish in mpu_6050_node.cpp
+static void fill_imu_msg(const mpudata_t &mpu, double covariance, sensor_msgs::Imu &imu_msg)
+{
+    tf::Quaternion quat2 = tf::createQuaternionFromRPY(mpu.fusedEuler[VEC3_X], -mpu.fusedEuler[VEC3_Y], -mpu.fusedEuler[VEC3_Z]);
+
+    imu_msg.header.stamp = ros::Time(mpu.dmpTimestamp / 1000, (mpu.dmpTimestamp % 1000) * 1000000);
+    imu_msg.header.frame_id = "imu";
+
+    imu_msg.orientation.x = quat2.getX();
+    imu_msg.orientation.y = quat2.getY();
+    imu_msg.orientation.z = quat2.getZ();
+    imu_msg.orientation.w = quat2.getW();
+
+    imu_msg.linear_acceleration_covariance[0] = covariance;
+    imu_msg.linear_acceleration_covariance[4] = covariance;
+    imu_msg.linear_acceleration_covariance[8] = covariance;
+    imu_msg.angular_velocity_covariance[0] = covariance;
+    imu_msg.angular_velocity_covariance[4] = covariance;
+    imu_msg.angular_velocity_covariance[8] = covariance;
+    imu_msg.orientation_covariance[0] = covariance;
+    imu_msg.orientation_covariance[4] = covariance;
+    imu_msg.orientation_covariance[8] = covariance;
+
+    imu_msg.linear_acceleration.x = -((float) mpu.calibratedAccel[0]) / (16384 / 9.807);
+    imu_msg.linear_acceleration.y = ((float) mpu.calibratedAccel[1]) / (16384 / 9.807);
+    imu_msg.linear_acceleration.z = ((float) mpu.calibratedAccel[2]) / (16384 / 9.807);
+
+    imu_msg.angular_velocity.x = ((float) mpu.rawGyro[0]) / 16.4f;
+    imu_msg.angular_velocity.y = ((float) mpu.rawGyro[1]) / 16.4f;
+    imu_msg.angular_velocity.z = ((float) mpu.rawGyro[2]) / 16.4f;
+}
+
+static void case_fill(bench_t *bench, void *arg, unsigned long n)
+{
+    ImuInputs *in = (ImuInputs *)arg;
+
+    for (unsigned long i = 0; i < n; i++)
+        fill_imu_msg(in->mpu[i % NUM_INPUTS], in->covariance, in->imu_msg);
+
+    bench_use(&in->imu_msg);
+}
+
+static void case_serialize(bench_t *bench, void *arg, unsigned long n)
+{
+    ImuInputs *in = (ImuInputs *)arg;
+
+    for (unsigned long i = 0; i < n; i++) {
+        in->imu_msg.header.seq = i;
+        ros::SerializedMessage m = ros::serialization::serializeMessage(in->imu_msg);
+        bench_use(m.buf.get());
+    }
+}
+
+static void usage(char *argv_0)
+{
+    printf("\nUsage: %s [-t seconds] [-f filter] [-o json file] [-l label]\n\n", argv_0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    double seconds = DEFAULT_BENCH_SECONDS;
+    char *filter = NULL;
+    char *json_file = NULL;
+    char *label = NULL;
+    bench_t bench;
+
+    while ((opt = getopt(argc, argv, "t:f:o:l:h")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = atof(optarg);
+            if (seconds <= 0.0)
+                usage(argv[0]);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'o':
+            json_file = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    bench_init(&bench, seconds, filter);
+
+    if (bench_library(&bench)) {
+        bench_close(&bench);
+        return 1;
+    }
+
+    ImuInputs *in = new ImuInputs();
+    in->covariance = 0.0025;
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        mpudata_t &mpu = in->mpu[i];
+        float a = i * 0.05f;
+
+        mpu.fusedEuler[VEC3_X] = a;
+        mpu.fusedEuler[VEC3_Y] = 0.5f * a;
+        mpu.fusedEuler[VEC3_Z] = -a;
+        mpu.calibratedAccel[VEC3_Z] = 16384 + i;
+        mpu.rawGyro[VEC3_X] = i;
+        mpu.dmpTimestamp = i * 10;
+    }
+
+    bench_run(&bench, "imu_msg_fill", case_fill, in);
+    fill_imu_msg(in->mpu[0], in->covariance, in->imu_msg);
+    bench_run(&bench, "imu_msg_serialize", case_serialize, in);
+
+    delete in;
+
+    bench_print(&bench);
+
+    int result = 0;
+
+    if (json_file && bench_write_json(&bench, json_file, label))
+        result = 1;
+
+    bench_close(&bench);
+
+    return result;
+}
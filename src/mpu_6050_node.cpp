@@ -2,12 +2,20 @@
 #include <sensor_msgs/Imu.h>
 #include <geometry_msgs/Vector3Stamped.h>
 #include <std_msgs/Bool.h>
+#include <std_msgs/Float32MultiArray.h>
 #include <std_srvs/Empty.h>
 #include <geometry_msgs/Vector3Stamped.h>
 #include <tf/transform_datatypes.h>
+#include <tf/transform_broadcaster.h>
+#include <diagnostic_updater/diagnostic_updater.h>
+#include <dynamic_reconfigure/server.h>
+#include <mpu_6050/MPU6050Config.h>
+#include <signal.h>
 
 
 #define MPU_FRAMEID "base_imu"
+/*Share of each rest window's gyro mean taken into the published gyro bias*/
+#define STATIONARY_BIAS_GAIN 0.25f
 
 bool calibrate;
 ros::Publisher imu_calib_pub;
@@ -16,10 +24,429 @@ ros::ServiceClient * clientptr;
 extern "C"{
 
 #include "mpu9150.h"
+#include "imuarray.h"
+#include "drain.h"
+#include "spectrum.h"
+#include "rawlog.h"
+#include "latency.h"
+#include "tempcomp.h"
+#include "stationary.h"
+#include "decimate.h"
+#include "mpu_sim.h"
+#include "i2ctrace.h"
+#include "inv_mpu_dmp_motion_driver.h"
 #include "local_defaults.h"
 
 }
 
+drain_t drain;
+int num_devices;
+spectrum_t spectrum;
+latency_t latency;
+stationary_t stationary;
+i2ctrace_t i2c_trace;
+volatile sig_atomic_t i2c_trace_dump;
+
+/*Counts per deg/s and per g at the current full scale ranges*/
+float gyro_sens = 16.4f;
+float accel_sens = 16384.0f;
+
+/*Latest dynamic_reconfigure request, applied by the main loop between reads*/
+mpu_6050::MPU6050Config reconfig;
+bool reconfig_pending;
+
+/*Published samples since the last diagnostics update, and the totals seen then*/
+struct {
+    int configured_rate;
+    ros::Time window_start;
+    ros::Time last_stamp;
+    unsigned long samples;
+    double interval_sum;
+    double interval_sum_sq;
+    double interval_max;
+    unsigned long read_failures;
+    unsigned long last_no_data;
+    mpu9150_stats_t last_totals;
+    uint32_t last_overflows;
+    unsigned long last_i2c_errors;
+    /*Part of the period was spent idle, no rate to judge*/
+    bool idled;
+} stream;
+
+/*Low power wake on motion, see the idle_after parameter*/
+struct {
+    bool active;
+    int devices;
+    ros::Time since;
+    double seconds;
+    unsigned long entries;
+    double enter_ms;
+    /*Set at a wake up until its first sample is published*/
+    uint64_t wake_start_ns;
+    double restore_ms;
+    double wake_ms;
+    double max_wake_ms;
+    double wake_limit_ms;
+    unsigned long slow_wakes;
+    unsigned long last_slow_wakes;
+} idle;
+
+static void stream_add(const ros::Time &stamp)
+{
+    if (!stream.last_stamp.isZero()) {
+        double interval = (stamp - stream.last_stamp).toSec();
+        stream.interval_sum += interval;
+        stream.interval_sum_sq += interval * interval;
+        if (interval > stream.interval_max)
+            stream.interval_max = interval;
+    }
+    stream.last_stamp = stamp;
+    stream.samples++;
+}
+
+/*Achieved rate and jitter over the last update period, read problems since the one before*/
+static void stream_diagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    mpu9150_stats_t totals, dev;
+    struct dmp_fifo_stats_s fifo;
+    uint32_t overflows = 0, resets = 0;
+    float temps[IMUARRAY_MAX_DEVICES];
+    int temp_bins[IMUARRAY_MAX_DEVICES];
+
+    memset(&totals, 0, sizeof(totals));
+    for (int i = 0; i < num_devices; i++) {
+        if (mpu9150_select_device(i))
+            continue;
+        mpu9150_get_stats(&dev);
+        totals.samples += dev.samples;
+        totals.noData += dev.noData;
+        totals.dropped += dev.dropped;
+        totals.readErrors += dev.readErrors;
+        totals.resyncWaits += dev.resyncWaits;
+        totals.fusionErrors += dev.fusionErrors;
+        if (dmp_get_fifo_stats(&fifo) == 0) {
+            overflows += fifo.overflows;
+            resets += fifo.resets;
+        }
+        temp_bins[i] = -1;
+        if (mpu9150_get_temperature(&temps[i]) == 0)
+            temp_bins[i] = tempcomp_learned_bins(mpu9150_get_tempcomp());
+    }
+    mpu9150_select_device(0);
+    unsigned long i2c_errors = linux_i2c_errors();
+
+    ros::Time now = ros::Time::now();
+    double elapsed = (now - stream.window_start).toSec();
+    double rate = elapsed > 0.0 ? stream.samples / elapsed : 0.0;
+    unsigned long intervals = stream.samples > 1 ? stream.samples - 1 : 0;
+    double mean = intervals ? stream.interval_sum / intervals : 0.0;
+    double jitter = intervals ? sqrt(std::max(0.0, stream.interval_sum_sq / intervals - mean * mean)) : 0.0;
+
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+    if (stream.idled)
+        stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::OK, "idle");
+    else if (stream.samples == 0)
+        stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::ERROR, "no samples");
+    else if (rate < 0.9 * stream.configured_rate)
+        stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN, "sample rate low");
+    if (totals.dropped > stream.last_totals.dropped || overflows > stream.last_overflows)
+        stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN, "samples lost");
+    if (totals.readErrors > stream.last_totals.readErrors || i2c_errors > stream.last_i2c_errors)
+        stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN, "read errors");
+    if (totals.fusionErrors > stream.last_totals.fusionErrors)
+        stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN, "fusion produced NaN");
+
+    stat.add("configured rate (Hz)", stream.configured_rate);
+    stat.add("achieved rate (Hz)", rate);
+    stat.add("mean interval (ms)", mean * 1000.0);
+    stat.add("interval jitter (ms)", jitter * 1000.0);
+    stat.add("max interval (ms)", stream.interval_max * 1000.0);
+    stat.add("samples", totals.samples);
+    stat.add("polls without data", totals.noData);
+    stat.add("dropped packets", totals.dropped);
+    stat.add("FIFO overflows", overflows);
+    stat.add("FIFO resets", resets);
+    stat.add("read errors", totals.readErrors);
+    stat.add("resync waits", totals.resyncWaits);
+    stat.add("read failures", stream.read_failures);
+    stat.add("I2C errors", i2c_errors);
+    stat.add("fusion NaN events", totals.fusionErrors);
+    for (int i = 0; i < num_devices; i++) {
+        char key[64];
+        if (temp_bins[i] < 0)
+            continue;
+        snprintf(key, sizeof(key), "device %d temperature (C)", i);
+        stat.addf(key, "%.1f", temps[i]);
+        snprintf(key, sizeof(key), "device %d bias model bins", i);
+        stat.add(key, temp_bins[i]);
+    }
+
+    stream.window_start = now;
+    stream.samples = 0;
+    stream.interval_sum = 0.0;
+    stream.interval_sum_sq = 0.0;
+    stream.interval_max = 0.0;
+    stream.last_totals = totals;
+    stream.last_overflows = overflows;
+    stream.last_i2c_errors = i2c_errors;
+    stream.idled = idle.active;
+}
+
+/*Reports the FIFO drain policy and how well it is doing*/
+static void drain_diagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    struct dmp_fifo_stats_s total, dev;
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < num_devices; i++) {
+        if (mpu9150_select_device(i) || dmp_get_fifo_stats(&dev))
+            continue;
+        total.overflows += dev.overflows;
+        total.resyncs += dev.resyncs;
+        total.resets += dev.resets;
+        total.bytes_discarded += dev.bytes_discarded;
+    }
+
+    if (total.overflows > 0)
+        stat.summary(diagnostic_msgs::DiagnosticStatus::WARN, "FIFO overflowed");
+    else
+        stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+
+    stat.add("policy", drain_policy_name(drain.policy));
+    stat.add("wakeups", drain.wakeups);
+    stat.add("empty wakeups", drain.emptyWakeups);
+    stat.add("packets", drain.packets);
+    stat.add("packets per wakeup", drain.wakeups ? (double)drain.packets / drain.wakeups : 0.0);
+    stat.add("max queued packets", drain.maxQueued);
+    stat.add("measured rate (Hz)", drain.rate * 1000.0);
+    stat.add("next wait (ms)", drain.nextWait);
+    stat.add("average latency (ms)", drain.avgLatency);
+    stat.add("max latency (ms)", drain.maxLatencySeen);
+    stat.add("FIFO overflows", total.overflows);
+    stat.add("FIFO resyncs", total.resyncs);
+    stat.add("FIFO resets", total.resets);
+    stat.add("FIFO bytes discarded", total.bytes_discarded);
+}
+
+/*Time spent in low power idle and how long the wake ups took, from motion seen to the first sample published*/
+static void idle_diagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    double seconds = idle.seconds;
+    if (idle.active)
+        seconds += (ros::Time::now() - idle.since).toSec();
+
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, idle.active ? "idle" : "awake");
+    if (idle.slow_wakes > idle.last_slow_wakes)
+        stat.mergeSummary(diagnostic_msgs::DiagnosticStatus::WARN, "slow wake up");
+    stat.add("idle periods", idle.entries);
+    stat.add("time idle (s)", seconds);
+    stat.add("enter time (ms)", idle.enter_ms);
+    stat.add("restore time (ms)", idle.restore_ms);
+    stat.add("wake up time (ms)", idle.wake_ms);
+    stat.add("max wake up time (ms)", idle.max_wake_ms);
+    stat.add("wake up limit (ms)", idle.wake_limit_ms);
+    stat.add("slow wake ups", idle.slow_wakes);
+    idle.last_slow_wakes = idle.slow_wakes;
+}
+
+/*Takes every device into wake on motion, all or none*/
+static bool enter_idle(int thresh_mg, int duration_ms, int wake_hz)
+{
+    uint64_t start = latency_now_ns();
+    for (int i = 0; i < idle.devices; i++) {
+        mpu9150_select_device(i);
+        if (mpu9150_enter_idle(thresh_mg, duration_ms, wake_hz) == 0)
+            continue;
+        while (--i >= 0) {
+            mpu9150_select_device(i);
+            mpu9150_exit_idle();
+        }
+        mpu9150_select_device(0);
+        return false;
+    }
+    mpu9150_select_device(0);
+
+    idle.active = true;
+    idle.since = ros::Time::now();
+    idle.entries++;
+    idle.enter_ms = (latency_now_ns() - start) / 1e6;
+    stream.idled = true;
+    return true;
+}
+
+/*1 once any device saw motion or could not be asked*/
+static bool idle_motion()
+{
+    bool motion = false;
+    for (int i = 0; i < idle.devices; i++) {
+        if (mpu9150_select_device(i) || mpu9150_idle_motion() != 0)
+            motion = true;
+    }
+    mpu9150_select_device(0);
+    return motion;
+}
+
+static void exit_idle()
+{
+    uint64_t start = latency_now_ns();
+    for (int i = 0; i < idle.devices; i++) {
+        if (mpu9150_select_device(i) || mpu9150_exit_idle())
+            ROS_WARN("MPU6050 - %s - device %d did not leave wake on motion",__FUNCTION__,i);
+    }
+    mpu9150_select_device(0);
+
+    idle.active = false;
+    idle.seconds += (ros::Time::now() - idle.since).toSec();
+    idle.wake_start_ns = start;
+    idle.restore_ms = (latency_now_ns() - start) / 1e6;
+    /*The gap is not a sample interval*/
+    stream.last_stamp = ros::Time();
+}
+
+/*Per stage latency percentiles from data ready to publish, in microseconds*/
+static void latency_diagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+    stat.add("samples", latency.stage[LATENCY_TOTAL].count);
+
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        const latency_hist_t *hist = &latency.stage[i];
+        std::string name = latency_stage_name(i);
+        stat.add(name + " p50 (us)", latency_hist_percentile(hist, 50.0) / 1000.0);
+        stat.add(name + " p99 (us)", latency_hist_percentile(hist, 99.0) / 1000.0);
+        stat.add(name + " p999 (us)", latency_hist_percentile(hist, 99.9) / 1000.0);
+        stat.add(name + " max (us)", hist->max / 1000.0);
+    }
+}
+
+/*Bus time per device and the registers that use most of it*/
+static void i2c_trace_diagnostics(diagnostic_updater::DiagnosticStatusWrapper &stat)
+{
+    char key[64];
+
+    i2ctrace_snapshot(&i2c_trace);
+    stat.summary(diagnostic_msgs::DiagnosticStatus::OK, "OK");
+
+    for (int i = 0; i < i2c_trace.numSlaves; i++) {
+        const i2ctrace_slave_t *s = &i2c_trace.slaves[i];
+        snprintf(key, sizeof(key), "bus %d 0x%02X", s->bus, s->slave & 0xff);
+        std::string prefix = key;
+        stat.add(prefix + " transfers", s->transfers);
+        stat.add(prefix + " bytes", s->bytes);
+        stat.add(prefix + " retries", s->retries);
+        stat.add(prefix + " errors", s->errors);
+        stat.add(prefix + " time (ms)", s->ns / 1e6);
+        stat.add(prefix + " p50 (us)", i2ctrace_percentile(s, 50.0) / 1e3);
+        stat.add(prefix + " p99 (us)", i2ctrace_percentile(s, 99.0) / 1e3);
+        stat.add(prefix + " max (us)", s->maxNs / 1e3);
+
+        if (s->errors > 0)
+            stat.summary(diagnostic_msgs::DiagnosticStatus::WARN, "I2C errors");
+
+        int top = -1;
+        for (int reg = 0; reg < I2CTRACE_REGS; reg++) {
+            if (s->regs[reg].ns > 0 && (top < 0 || s->regs[reg].ns > s->regs[top].ns))
+                top = reg;
+        }
+        if (top >= 0) {
+            const char *name = i2ctrace_reg_name(s->slave, top);
+            snprintf(key, sizeof(key), "0x%02X %s", top, name ? name : "");
+            stat.add(prefix + " busiest register", key);
+        }
+    }
+}
+
+static void dump_i2c_trace(int sig)
+{
+    i2c_trace_dump = 1;
+}
+
+/*Reads every device of the array, valid marks the ones that answered*/
+static void read_imu_array(imuarray_t *array, mpudata_t *devices, int *valid)
+{
+    for (int i = 0; i < array->numDevices; i++) {
+        valid[i] = mpu9150_select_device(i) == 0
+                && mpu9150_read_dmp(&devices[i]) == 0
+                && mpu9150_read_mag(&devices[i]) == 0;
+    }
+    mpu9150_select_device(0);
+}
+
+/*Gyro biases last loaded or saved, a new one is saved once the DMP has converged on it*/
+float saved_gyro_bias[IMUARRAY_MAX_DEVICES][3];
+
+static void save_gyro_biases(const std::string &path)
+{
+    for (int i = 0; i < num_devices; i++) {
+        float bias[3];
+        if (mpu9150_select_device(i) || mpu9150_get_gyro_bias(bias))
+            continue;
+        /*Zero until the first estimate*/
+        if (bias[0] == 0.0f && bias[1] == 0.0f && bias[2] == 0.0f)
+            continue;
+        if (fabsf(bias[0] - saved_gyro_bias[i][0]) < 0.001f && fabsf(bias[1] - saved_gyro_bias[i][1]) < 0.001f
+            && fabsf(bias[2] - saved_gyro_bias[i][2]) < 0.001f)
+            continue;
+        if (mpu9150_save_bias_state(path.c_str(), bias)) {
+            ROS_WARN("MPU6050 - %s - cannot save the gyro bias of device %d to %s",__FUNCTION__,i,path.c_str());
+            continue;
+        }
+        memcpy(saved_gyro_bias[i], bias, sizeof(bias));
+    }
+    mpu9150_select_device(0);
+}
+
+static void save_tempcomp_models(const std::string &path)
+{
+    for (int i = 0; i < num_devices; i++) {
+        if (mpu9150_select_device(i) || mpu9150_save_tempcomp(path.c_str()))
+            ROS_WARN("MPU6050 - %s - cannot save the bias model of device %d to %s",__FUNCTION__,i,path.c_str());
+    }
+    mpu9150_select_device(0);
+}
+
+static void reconfigure_callback(mpu_6050::MPU6050Config &config, uint32_t level)
+{
+    reconfig = config;
+    reconfig_pending = true;
+}
+
+/*Applies value to every device, false and a warning if any refused it*/
+static bool set_on_devices(int (*set)(int), int value, const char *name)
+{
+    bool ok = true;
+    for (int i = 0; i < num_devices && ok; i++) {
+        if (mpu9150_select_device(i) || set(value)) {
+            ROS_WARN("MPU6050 - %s - cannot set %s %d on device %d",__FUNCTION__,name,value,i);
+            ok = false;
+        }
+    }
+    mpu9150_select_device(0);
+    return ok;
+}
+
+static tf::Quaternion fused_orientation(const mpudata_t &mpu)
+{
+    return tf::createQuaternionFromRPY(mpu.fusedEuler[VEC3_X],-mpu.fusedEuler[VEC3_Y],-mpu.fusedEuler[VEC3_Z]);
+}
+
+static void set_orientation(sensor_msgs::Imu &msg, const tf::Quaternion &quat2)
+{
+    msg.orientation.x=quat2.getX();
+    msg.orientation.y=quat2.getY();
+    msg.orientation.z=quat2.getZ();
+    msg.orientation.w=quat2.getW();
+}
+
+/*Fuses the combined sample of the array into mpu*/
+static int fuse_imu_array(imuarray_t *array, mpudata_t *devices, const int *valid, mpudata_t *mpu)
+{
+    if (imuarray_combine(array, devices, valid, mpu))
+        return -1;
+
+    return mpu9150_process(mpu);
+}
+
 int main(int argc, char **argv){
 
     ros::init(argc, argv, "mpu_6050");
@@ -41,6 +468,128 @@ int main(int argc, char **argv){
     pn.param<int>("yaw_mix_factor",yaw_mix_factor,DEFAULT_YAW_MIX_FACTOR);
     std::string frame_id;
     pn.param<std::string>("frame_id",frame_id,MPU_FRAMEID);
+
+    /*Redundant IMUs: one device per bus, combined into a single stream*/
+    std::vector<int> i2c_buses;
+    pn.param< std::vector<int> >("i2c_buses", i2c_buses, std::vector<int>(1, i2c_bus));
+    std::vector<int> mounting_matrices;
+    pn.param< std::vector<int> >("mounting_matrices", mounting_matrices, std::vector<int>());
+    double outlier_sigma;
+    pn.param("outlier_sigma", outlier_sigma, (double)DEFAULT_OUTLIER_SIGMA);
+    /*Samples read this much before the newest one are left out, a bound on the read spread and not
+      a time alignment, the DMP packets carry no sensor time*/
+    int max_skew_ms;
+    pn.param<int>("max_skew_ms", max_skew_ms, DEFAULT_MAX_SKEW_MS);
+
+    /*Acquisition: dmp (fused on the chip, up to 100 Hz) or raw (gyro and accel up to 1 kHz, fused on the host)*/
+    std::string mode;
+    pn.param<std::string>("mode", mode, "dmp");
+    int lpf;
+    pn.param<int>("lpf", lpf, 0);
+    /*Full scale ranges in deg/s and g, the DMP needs 2000 deg/s and 2 g. These, frequency, lpf, yaw_mix_factor
+      and the stdevs below can be changed while running with dynamic_reconfigure*/
+    int gyro_fsr;
+    pn.param<int>("gyro_fsr", gyro_fsr, 2000);
+    int accel_fsr;
+    pn.param<int>("accel_fsr", accel_fsr, 2);
+
+    /*Transport: i2c (the hardware) or sim (simulated MPU6050 and HMC5883L, optionally replaying a recorded motion file)*/
+    std::string transport;
+    pn.param<std::string>("transport", transport, "i2c");
+    std::string sim_motion_file;
+    pn.param<std::string>("sim_motion_file", sim_motion_file, "");
+    int sim_seed;
+    pn.param<int>("sim_seed", sim_seed, 1);
+
+    /*Raw sample log for replaying the fusion offline: file prefix (empty disables), rotation size, O_DIRECT*/
+    std::string rawlog_path;
+    pn.param<std::string>("rawlog_path", rawlog_path, "");
+    int rawlog_max_mb;
+    pn.param<int>("rawlog_max_mb", rawlog_max_mb, 64);
+    bool rawlog_direct;
+    pn.param("rawlog_direct", rawlog_direct, false);
+
+    /*File keeping the HMC5883L self test result, empty runs the self test on every start*/
+    std::string compass_cache;
+    pn.param<std::string>("compass_cache", compass_cache, "");
+
+    /*DMP gyro biases kept across restarts: file (empty disables) and how often to save in s*/
+    std::string bias_state;
+    pn.param<std::string>("bias_state", bias_state, "");
+    double bias_save_period;
+    pn.param("bias_save_period", bias_save_period, 60.0);
+
+    /*Gyro bias against die temperature: on/off and the file keeping the model (empty starts from scratch),
+      saved along with bias_state*/
+    bool tempcomp;
+    pn.param("tempcomp", tempcomp, false);
+    std::string tempcomp_state;
+    pn.param<std::string>("tempcomp_state", tempcomp_state, "");
+
+    /*Per register bus counters, on the diagnostics and printed on SIGUSR1 and at exit*/
+    bool i2c_trace_on;
+    pn.param("i2c_trace", i2c_trace_on, false);
+
+    /*Vibration spectrum: publish rate in Hz (0 disables) and band edges in Hz*/
+    double vibration_rate;
+    pn.param("vibration_rate", vibration_rate, 0.0);
+    std::vector<double> vibration_bands;
+    double default_bands[] = { 0.0, 10.0, 30.0, 60.0, 120.0, 250.0, 500.0 };
+    pn.param< std::vector<double> >("vibration_bands", vibration_bands,
+        std::vector<double>(default_bands, default_bands + sizeof(default_bands) / sizeof(double)));
+
+    /*Extra Imu streams at a fraction of the sample rate, all fed from the same reads: a topic, a
+      decimation factor and a filter (none, cic or fir up to a factor of 16) each. Filtered accel and gyro lag the
+      orientation and the stamp by the filter delay, about one output period for cic and up to four for fir*/
+    std::vector<std::string> output_topics;
+    pn.param< std::vector<std::string> >("output_topics", output_topics, std::vector<std::string>());
+    std::vector<int> output_decimation;
+    pn.param< std::vector<int> >("output_decimation", output_decimation, std::vector<int>());
+    std::vector<std::string> output_filters;
+    pn.param< std::vector<std::string> >("output_filters", output_filters, std::vector<std::string>());
+
+    /*Orientation as a transform from tf_parent_frame to frame_id: broadcast rate in Hz (0 disables).
+      The parent is a level frame at the IMU, it must not already have frame_id as a child*/
+    double tf_rate;
+    pn.param("tf_rate", tf_rate, 0.0);
+    std::string tf_parent_frame;
+    pn.param<std::string>("tf_parent_frame", tf_parent_frame, "imu_link");
+
+    /*Rest detection on the gyro and accel spread: window in samples (0 disables), limits in deg/s and g.
+      While at rest: publish rate in Hz (0 keeps the full rate), yaw held off the magnetometer and
+      the published gyro bias refined from the rest windows*/
+    int stationary_window;
+    pn.param<int>("stationary_window", stationary_window, sample_rate);
+    double stationary_gyro_std;
+    pn.param("stationary_gyro_std", stationary_gyro_std, (double)DEFAULT_STATIONARY_GYRO_STD);
+    double stationary_accel_std;
+    pn.param("stationary_accel_std", stationary_accel_std, (double)DEFAULT_STATIONARY_ACCEL_STD);
+    double stationary_publish_rate;
+    pn.param("stationary_publish_rate", stationary_publish_rate, 0.0);
+    bool stationary_mag_hold;
+    pn.param("stationary_mag_hold", stationary_mag_hold, false);
+    bool stationary_bias;
+    pn.param("stationary_bias", stationary_bias, false);
+
+    /*Low power wake on motion after idle_after s at rest (0 disables, needs stationary_window): motion threshold
+      in mg, how long in ms, accel wake rate in Hz (1, 5, 20 or 40) and the wake up time in ms diagnostics warn above*/
+    double idle_after;
+    pn.param("idle_after", idle_after, 0.0);
+    int idle_motion_mg;
+    pn.param<int>("idle_motion_mg", idle_motion_mg, 64);
+    int idle_motion_ms;
+    pn.param<int>("idle_motion_ms", idle_motion_ms, 5);
+    int idle_wake_hz;
+    pn.param<int>("idle_wake_hz", idle_wake_hz, 20);
+    pn.param("idle_wake_limit_ms", idle.wake_limit_ms, 250.0);
+
+    /*FIFO draining: fixed, latency or wakeups*/
+    std::string drain_policy_param;
+    pn.param<std::string>("drain_policy", drain_policy_param, "fixed");
+    int drain_latency_ms;
+    pn.param<int>("drain_latency_ms", drain_latency_ms, DEFAULT_DRAIN_LATENCY_MS);
+    double drain_fill_target;
+    pn.param("drain_fill_target", drain_fill_target, (double)DEFAULT_DRAIN_FILL_TARGET);
     
     /*Covariance*/
     double angular_velocity_covariance,pitch_roll_covariance,yaw_covariance,linear_acceleration_covariance,linear_acceleration_stdev_,angular_velocity_stdev_,yaw_stdev_,pitch_roll_stdev_;
@@ -59,118 +608,657 @@ int main(int argc, char **argv){
 
     mpudata_t mpu;
 
+    num_devices = i2c_buses.size();
+    if (num_devices < 1 || num_devices > IMUARRAY_MAX_DEVICES) {
+        ROS_FATAL("MPU6050 - %s - between 1 and %d i2c_buses supported",__FUNCTION__,IMUARRAY_MAX_DEVICES);
+        ROS_BREAK();
+    }
+
+    bool raw = (mode == "raw");
+    if (!raw && mode != "dmp") {
+        ROS_FATAL("MPU6050 - %s - unknown mode %s",__FUNCTION__,mode.c_str());
+        ROS_BREAK();
+    }
+    if (raw && num_devices > 1) {
+        ROS_FATAL("MPU6050 - %s - raw mode supports a single device",__FUNCTION__);
+        ROS_BREAK();
+    }
+
+    if (transport == "sim") {
+        mpu_sim_config_t sim_config;
+        mpu_sim_default_config(&sim_config);
+        sim_config.seed = sim_seed;
+        sim_config.realtime = 1;
+        mpu_sim_init(&sim_config);
+        if (!sim_motion_file.empty() && mpu_sim_load_motion(sim_motion_file.c_str())) {
+            ROS_FATAL("MPU6050 - %s - cannot load motion file %s",__FUNCTION__,sim_motion_file.c_str());
+            ROS_BREAK();
+        }
+        linux_set_transport(mpu_sim_transport());
+        ROS_WARN("MPU6050 - %s - using the simulated IMU",__FUNCTION__);
+    } else if (transport != "i2c") {
+        ROS_FATAL("MPU6050 - %s - unknown transport %s",__FUNCTION__,transport.c_str());
+        ROS_BREAK();
+    }
+
     //mpu9150_set_debug(1);
+    mpu9150_set_compass_cache(compass_cache.c_str());
     ROS_INFO("Initialize MPU_6050...");
-    if (mpu9150_init(i2c_bus,sample_rate, yaw_mix_factor)){
-        ROS_FATAL("MPU6050 - %s - MPU6050 connection failed",__FUNCTION__);
-        ROS_BREAK();
+    if (raw) {
+        if (mpu9150_init_raw(i2c_buses[0], sample_rate, lpf, yaw_mix_factor)){
+            ROS_FATAL("MPU6050 - %s - MPU6050 connection failed on bus %d",__FUNCTION__,i2c_buses[0]);
+            ROS_BREAK();
+        }
+    } else {
+        int init_results[IMUARRAY_MAX_DEVICES];
+        if (mpu9150_init_devices(num_devices, &i2c_buses[0], sample_rate, yaw_mix_factor, init_results)){
+            for (int i = 0; i < num_devices; i++) {
+                if (init_results[i])
+                    ROS_FATAL("MPU6050 - %s - MPU6050 connection failed on bus %d",__FUNCTION__,i2c_buses[i]);
+            }
+            ROS_BREAK();
+        }
+    }
+    for (int i = 0; i < (raw ? 1 : num_devices); i++) {
+        char init_times[256];
+        mpu9150_format_init_times(i, init_times, sizeof(init_times));
+        ROS_INFO("MPU6050 on bus %d up in %s", i2c_buses[i], init_times);
     }
     memset(&mpu, 0, sizeof(mpudata_t));
+
+    memset(saved_gyro_bias, 0, sizeof(saved_gyro_bias));
+    if (!bias_state.empty() && raw) {
+        ROS_WARN("MPU6050 - %s - bias_state needs the DMP, ignored in raw mode",__FUNCTION__);
+        bias_state.clear();
+    }
+    for (int i = 0; i < num_devices && !bias_state.empty(); i++) {
+        float *bias = saved_gyro_bias[i];
+        mpu9150_select_device(i);
+        if (mpu9150_load_bias_state(bias_state.c_str(), bias) == 0)
+            ROS_INFO("MPU6050 on bus %d seeded with gyro bias %.3f %.3f %.3f deg/s",i2c_buses[i],bias[0],bias[1],bias[2]);
+        else
+            ROS_INFO("MPU6050 on bus %d has no saved gyro bias, the DMP needs about 8 s still to find it",i2c_buses[i]);
+    }
+    mpu9150_select_device(0);
+
+    if (!tempcomp)
+        tempcomp_state.clear();
+    for (int i = 0; i < (raw ? 1 : num_devices) && tempcomp; i++) {
+        mpu9150_select_device(i);
+        mpu9150_enable_tempcomp(1);
+        /*The model learns from the same rest windows as the node*/
+        if (stationary_window > 0)
+            mpu9150_set_tempcomp_stationary(stationary_window, stationary_gyro_std, stationary_accel_std);
+        if (!tempcomp_state.empty() && mpu9150_load_tempcomp(tempcomp_state.c_str()) == 0)
+            ROS_INFO("MPU6050 on bus %d loaded a bias model of %d temperatures",i2c_buses[i],
+                     tempcomp_learned_bins(mpu9150_get_tempcomp()));
+    }
+    mpu9150_select_device(0);
+
+    imuarray_t imu_array;
+    mpudata_t array_devices[IMUARRAY_MAX_DEVICES];
+    imuarray_init(&imu_array, num_devices, outlier_sigma, max_skew_ms);
+    memset(array_devices, 0, sizeof(array_devices));
+
+    if (!mounting_matrices.empty()) {
+        if ((int)mounting_matrices.size() != 9 * num_devices) {
+            ROS_FATAL("MPU6050 - %s - mounting_matrices needs 9 entries per device",__FUNCTION__);
+            ROS_BREAK();
+        }
+        for (int i = 0; i < num_devices; i++) {
+            signed char mtx[9];
+            for (int j = 0; j < 9; j++)
+                mtx[j] = mounting_matrices[9 * i + j];
+            if (imuarray_set_orientation(&imu_array, i, mtx)) {
+                ROS_FATAL("MPU6050 - %s - mounting matrix %d is not a rotation",__FUNCTION__,i);
+                ROS_BREAK();
+            }
+        }
+    }
+
+    if (num_devices > 1)
+        ROS_INFO("Combining %d MPU6050s into one IMU", num_devices);
     if (sample_rate == 0)
         ROS_BREAK();
 
+    int drain_policy = drain_policy_from_name(drain_policy_param.c_str());
+    if (drain_policy < 0) {
+        ROS_FATAL("MPU6050 - %s - unknown drain_policy %s",__FUNCTION__,drain_policy_param.c_str());
+        ROS_BREAK();
+    }
+    if (drain_policy != DRAIN_FIXED && num_devices > 1) {
+        ROS_WARN("MPU6050 - %s - drain_policy %s needs a single device, using fixed",__FUNCTION__,drain_policy_param.c_str());
+        drain_policy = DRAIN_FIXED;
+    }
+    if (raw && drain_policy == DRAIN_FIXED) {
+        /*Waking up for every sample at up to 1 kHz is what the FIFO is there to avoid*/
+        ROS_INFO("Raw mode drains the FIFO in bursts, using drain_policy latency");
+        drain_policy = DRAIN_LATENCY;
+    }
+    drain_init(&drain, drain_policy, sample_rate, raw ? RAW_FIFO_PACKETS : DMP_FIFO_PACKETS,
+               drain_latency_ms, drain_fill_target);
+
+    if (stationary_window > STATIONARY_MAX_WINDOW) {
+        ROS_WARN("MPU6050 - %s - stationary_window limited to %d samples",__FUNCTION__,STATIONARY_MAX_WINDOW);
+        stationary_window = STATIONARY_MAX_WINDOW;
+    }
+    stationary_init(&stationary, stationary_window, stationary_gyro_std, stationary_accel_std);
+    if (idle_after > 0.0 && stationary_window <= 0) {
+        ROS_WARN("MPU6050 - %s - idle_after needs stationary_window, ignored",__FUNCTION__);
+        idle_after = 0.0;
+    }
+    if (idle_after > 0.0 && (idle_wake_hz < 1 || idle_wake_hz > 40)) {
+        ROS_FATAL("MPU6050 - %s - idle_wake_hz must be 1 to 40",__FUNCTION__);
+        ROS_BREAK();
+    }
+
+    int num_bands = vibration_bands.size() - 1;
+    if (vibration_rate > 0.0) {
+        float edges[SPECTRUM_MAX_BANDS + 1];
+        if (num_bands < 1 || num_bands > SPECTRUM_MAX_BANDS) {
+            ROS_FATAL("MPU6050 - %s - vibration_bands needs 2 to %d edges",__FUNCTION__,SPECTRUM_MAX_BANDS + 1);
+            ROS_BREAK();
+        }
+        for (int i = 0; i <= num_bands; i++)
+            edges[i] = vibration_bands[i];
+        if (spectrum_init(&spectrum, mpu9150_sample_rate(), edges, num_bands)) {
+            ROS_FATAL("MPU6050 - %s - invalid vibration_bands",__FUNCTION__);
+            ROS_BREAK();
+        }
+        if (!raw)
+            ROS_WARN("MPU6050 - %s - vibration analysis at the DMP rate only covers up to %d Hz, consider mode raw",__FUNCTION__,sample_rate / 2);
+    }
+
+    if (output_decimation.size() != output_topics.size()
+        || (!output_filters.empty() && output_filters.size() != output_topics.size())) {
+        ROS_FATAL("MPU6050 - %s - output_decimation and output_filters need one entry per output topic",__FUNCTION__);
+        ROS_BREAK();
+    }
+    std::vector<decimator_t> outputs(output_topics.size());
+    for (size_t i = 0; i < outputs.size(); i++) {
+        int filter = output_filters.empty() ? DECIMATE_NONE : decimate_filter_from_name(output_filters[i].c_str());
+        if (filter < 0 || decimate_init(&outputs[i], output_decimation[i], filter, 0)) {
+            ROS_FATAL("MPU6050 - %s - invalid output stream %s",__FUNCTION__,output_topics[i].c_str());
+            ROS_BREAK();
+        }
+    }
+
+    rawlog_t rawlog;
+    if (!rawlog_path.empty()) {
+        if (rawlog_open(&rawlog, rawlog_path.c_str(), (uint64_t)rawlog_max_mb << 20, rawlog_direct, mpu9150_sample_rate())) {
+            ROS_FATAL("MPU6050 - %s - cannot open raw log %s",__FUNCTION__,rawlog_path.c_str());
+            ROS_BREAK();
+        }
+        mpu9150_set_rawlog(&rawlog);
+    }
+
+    diagnostic_updater::Updater updater;
+    updater.setHardwareID("mpu6050");
+    updater.add("FIFO drain", drain_diagnostics);
+    updater.add("Latency", latency_diagnostics);
+    if (idle_after > 0.0)
+        updater.add("Idle", idle_diagnostics);
+    idle.devices = raw ? 1 : num_devices;
+    updater.add("Sample stream", stream_diagnostics);
+    memset(&stream.last_totals, 0, sizeof(stream.last_totals));
+    stream.configured_rate = mpu9150_sample_rate();
+    stream.window_start = ros::Time::now();
+    if (i2c_trace_on) {
+        /*Initialization is mostly the DMP firmware load, count from here*/
+        updater.add("I2C trace", i2c_trace_diagnostics);
+        signal(SIGUSR1, dump_i2c_trace);
+        i2ctrace_enable(1);
+    }
+    latency_init(&latency);
+
 
     ros::Publisher imu_pub = n.advertise<sensor_msgs::Imu>("imu/data", 10);
     ros::Publisher imu_euler_pub = n.advertise<geometry_msgs::Vector3Stamped>("imu/euler", 10);
     ros::Publisher mag_pub = n.advertise<geometry_msgs::Vector3Stamped>("imu/mag", 10);
+    ros::Publisher vibration_pub;
+    if (vibration_rate > 0.0)
+        vibration_pub = n.advertise<std_msgs::Float32MultiArray>("imu/vibration", 10);
+    ros::Time last_vibration = ros::Time::now();
+    tf::TransformBroadcaster tf_broadcaster;
+    ros::Time last_tf;
+    std::vector<ros::Publisher> output_pubs;
+    for (size_t i = 0; i < output_topics.size(); i++)
+        output_pubs.push_back(n.advertise<sensor_msgs::Imu>(output_topics[i], 10));
+    ros::Publisher stationary_pub;
+    if (stationary_window > 0) {
+        /*Latched, the state is published when it changes*/
+        stationary_pub = n.advertise<std_msgs::Bool>("imu/stationary", 1, true);
+        std_msgs::Bool stationary_msg;
+        stationary_msg.data = false;
+        stationary_pub.publish(stationary_msg);
+    }
+    bool at_rest = false;
+    ros::Time rest_since;
+    ros::Rate idle_rate(idle_wake_hz > 0 ? idle_wake_hz : 1);
+    float gyro_offset[3] = { 0.0f, 0.0f, 0.0f };
+    ros::Time last_publish;
+    ros::Time last_bias_save = ros::Time::now();
+    ros::Time last_tempcomp_save = ros::Time::now();
     ros::Rate r(sample_rate);
 
+    /*What the devices run with, the server starts from the values read above and its first
+      callback applies the ranges*/
+    mpu_6050::MPU6050Config applied;
+    applied.frequency = sample_rate;
+    applied.lpf = raw ? lpf : 0;
+    applied.gyro_fsr = 2000;
+    applied.accel_fsr = 2;
+    applied.yaw_mix_factor = yaw_mix_factor;
+    applied.linear_acceleration_stdev = linear_acceleration_stdev_;
+    applied.angular_velocity_stdev = angular_velocity_stdev_;
+    applied.pitch_roll_stdev = pitch_roll_stdev_;
+    applied.yaw_stdev = yaw_stdev_;
+    pn.setParam("frequency", sample_rate);
+    pn.setParam("lpf", lpf);
+    pn.setParam("gyro_fsr", gyro_fsr);
+    pn.setParam("accel_fsr", accel_fsr);
+    pn.setParam("yaw_mix_factor", yaw_mix_factor);
+    pn.setParam("linear_acceleration_stdev", linear_acceleration_stdev_);
+    pn.setParam("angular_velocity_stdev", angular_velocity_stdev_);
+    pn.setParam("pitch_roll_stdev", pitch_roll_stdev_);
+    pn.setParam("yaw_stdev", yaw_stdev_);
+    dynamic_reconfigure::Server<mpu_6050::MPU6050Config> reconfig_server(pn);
+    reconfig_server.setCallback(reconfigure_callback);
+
     while(ros::ok())
     {
-        ros::Time now = ros::Time::now();
-
-        sensor_msgs::Imu imu_msg;
-        geometry_msgs::Vector3Stamped imu_euler_msg;
-        imu_msg.header.stamp = now;
-        imu_msg.header.frame_id = frame_id;
-        imu_euler_msg.header.stamp = now;
-        imu_euler_msg.header.frame_id = frame_id;
-        geometry_msgs::Vector3Stamped mag_msg;
-        mag_msg.header.stamp = now;
-        mag_msg.header.frame_id = frame_id;
-
-        if (mpu9150_read(&mpu) == 0) {
-
-            /*imu_msg.orientation.x=mpu.fusedQuat[QUAT_X];
-             imu_msg.orientation.y=mpu.fusedQuat[QUAT_Y];
-             imu_msg.orientation.z=mpu.fusedQuat[QUAT_Z];
-             imu_msg.orientation.w=mpu.fusedQuat[QUAT_W];*/
-
-            tf::Quaternion quat2 =tf::createQuaternionFromRPY(mpu.fusedEuler[VEC3_X],-mpu.fusedEuler[VEC3_Y],-mpu.fusedEuler[VEC3_Z]);
-            imu_euler_msg.vector.y=-mpu.fusedEuler[VEC3_Y]*RAD_TO_DEGREE;
-            imu_euler_msg.vector.x=mpu.fusedEuler[VEC3_X]*RAD_TO_DEGREE;
-            imu_euler_msg.vector.z=-mpu.fusedEuler[VEC3_Z]*RAD_TO_DEGREE;
-
-            imu_msg.orientation.x=quat2.getX();
-            imu_msg.orientation.y=quat2.getY();
-            imu_msg.orientation.z=quat2.getZ();
-            imu_msg.orientation.w=quat2.getW();
+        /*Only the motion interrupt is read while idle*/
+        if (idle.active) {
+            if (idle_motion()) {
+                exit_idle();
+                stationary_init(&stationary, stationary_window, stationary_gyro_std, stationary_accel_std);
+                mpu9150_set_mag_yaw_hold(0);
+                at_rest = false;
+                std_msgs::Bool stationary_msg;
+                stationary_msg.data = false;
+                stationary_pub.publish(stationary_msg);
+            } else {
+                updater.update();
+                ros::spinOnce();
+                idle_rate.sleep();
+                continue;
+            }
+        }
+
+        if (reconfig_pending) {
+            reconfig_pending = false;
+            bool rate_changed = false;
+
+            if (reconfig.frequency != applied.frequency
+                && set_on_devices(mpu9150_set_sample_rate, reconfig.frequency, "frequency")) {
+                applied.frequency = reconfig.frequency;
+                rate_changed = true;
+            }
+            /*In raw mode a new rate also resets the filter to half of it*/
+            if (reconfig.lpf != applied.lpf || (raw && rate_changed && reconfig.lpf > 0)) {
+                int hz = reconfig.lpf > 0 ? reconfig.lpf : (raw ? mpu9150_sample_rate() : 200) / 2;
+                if (set_on_devices(mpu9150_set_lpf, std::max(hz, 5), "lpf"))
+                    applied.lpf = reconfig.lpf;
+            }
+            bool range_changed = false;
+            if (reconfig.gyro_fsr != applied.gyro_fsr
+                && set_on_devices(mpu9150_set_gyro_fsr, reconfig.gyro_fsr, "gyro_fsr")) {
+                applied.gyro_fsr = reconfig.gyro_fsr;
+                range_changed = true;
+            }
+            if (reconfig.accel_fsr != applied.accel_fsr
+                && set_on_devices(mpu9150_set_accel_fsr, reconfig.accel_fsr, "accel_fsr")) {
+                applied.accel_fsr = reconfig.accel_fsr;
+                range_changed = true;
+            }
+            mpu9150_get_sens(&gyro_sens, &accel_sens);
+
+            if (reconfig.yaw_mix_factor != applied.yaw_mix_factor
+                && mpu9150_set_mix_factor(reconfig.yaw_mix_factor) == 0) {
+                applied.yaw_mix_factor = reconfig.yaw_mix_factor;
+                yaw_mix_factor = reconfig.yaw_mix_factor;
+            }
+
+            applied.linear_acceleration_stdev = reconfig.linear_acceleration_stdev;
+            applied.angular_velocity_stdev = reconfig.angular_velocity_stdev;
+            applied.pitch_roll_stdev = reconfig.pitch_roll_stdev;
+            applied.yaw_stdev = reconfig.yaw_stdev;
+            linear_acceleration_covariance = applied.linear_acceleration_stdev * applied.linear_acceleration_stdev;
+            angular_velocity_covariance = applied.angular_velocity_stdev * applied.angular_velocity_stdev;
+            pitch_roll_covariance = applied.pitch_roll_stdev * applied.pitch_roll_stdev;
+            yaw_covariance = applied.yaw_stdev * applied.yaw_stdev;
+
+            if (rate_changed) {
+                sample_rate = applied.frequency;
+                r = ros::Rate(sample_rate);
+                drain_init(&drain, drain.policy, sample_rate, raw ? RAW_FIFO_PACKETS : DMP_FIFO_PACKETS,
+                           drain_latency_ms, drain_fill_target);
+                stream.configured_rate = mpu9150_sample_rate();
+                if (vibration_rate > 0.0) {
+                    float edges[SPECTRUM_MAX_BANDS + 1];
+                    for (int i = 0; i <= num_bands; i++)
+                        edges[i] = vibration_bands[i];
+                    if (spectrum_init(&spectrum, mpu9150_sample_rate(), edges, num_bands)) {
+                        ROS_WARN("MPU6050 - %s - vibration_bands do not fit %d Hz, vibration analysis off",__FUNCTION__,sample_rate);
+                        vibration_rate = 0.0;
+                    }
+                }
+            }
+
+            /*A log file's header holds the rate and the gyro scale of all its records*/
+            if (!rawlog_path.empty() && (rate_changed || range_changed)
+                && rawlog_rotate(&rawlog, mpu9150_sample_rate()))
+                ROS_WARN("MPU6050 - %s - cannot start a new raw log file",__FUNCTION__);
+
+            /*Reports what actually took effect*/
+            reconfig_server.updateConfig(applied);
+            ROS_INFO("MPU6050 at %d Hz, lpf %d, gyro %d deg/s, accel %d g, yaw_mix_factor %d",mpu9150_sample_rate(),
+                     applied.lpf,applied.gyro_fsr,applied.accel_fsr,applied.yaw_mix_factor);
+        }
+
+        ros::Time wake = ros::Time::now();
+        uint64_t wake_ns = latency_now_ns();
+
+        /*Output stages only run for topics someone listens to. The compass feeds imu/mag and the yaw
+          of the orientation, it is not read when neither is wanted*/
+        bool want_imu = imu_pub.getNumSubscribers() > 0;
+        bool want_euler = imu_euler_pub.getNumSubscribers() > 0;
+        bool want_mag = mag_pub.getNumSubscribers() > 0;
+        bool read_mag = want_mag || (yaw_mix_factor > 0 && (want_imu || want_euler));
+        mpu9150_set_mag_reads(read_mag);
+        mpu9150_set_mag_yaw_hold(!read_mag || (at_rest && stationary_mag_hold));
+
+        /*Burst policies drain every queued packet, fixed reads the newest one*/
+        int queued = 1;
+        if (drain.policy != DRAIN_FIXED) {
+            if (mpu9150_fifo_queued(&queued) || (queued > 0 && mpu9150_read_mag(&mpu)))
+                queued = 0;
+        }
+
+        int packets = 0;
+        /*A queued packet is ready once the previous one is published*/
+        uint64_t ready_ns = wake_ns;
+        for (int k = 0; k < queued; k++) {
+            /*Packets arrive one DMP period apart, the newest one just now*/
+            ros::Time now = wake - ros::Duration((queued - 1 - k) / (drain.rate * 1000.0));
+            uint64_t sample_ns = wake_ns - (uint64_t)((queued - 1 - k) * 1000000.0 / drain.rate);
+
+            sensor_msgs::Imu imu_msg;
+            geometry_msgs::Vector3Stamped imu_euler_msg;
+            imu_msg.header.stamp = now;
+            imu_msg.header.frame_id = frame_id;
+            imu_euler_msg.header.stamp = now;
+            imu_euler_msg.header.frame_id = frame_id;
+            geometry_msgs::Vector3Stamped mag_msg;
+            mag_msg.header.stamp = now;
+            mag_msg.header.frame_id = frame_id;
+
+            int result = 0;
+            int valid[IMUARRAY_MAX_DEVICES];
+            if (num_devices > 1)
+                read_imu_array(&imu_array, array_devices, valid);
+            else if (drain.policy != DRAIN_FIXED)
+                result = mpu9150_read_fifo_packet(&mpu);
+            else
+                result = mpu9150_read_sample(&mpu);
+            uint64_t bus_ns = latency_now_ns();
+
+            if (result == 0)
+                result = num_devices > 1 ? fuse_imu_array(&imu_array, array_devices, valid, &mpu) : mpu9150_process(&mpu);
+            uint64_t fusion_ns = latency_now_ns();
+
+            if (result == 0) {
+
+                if (stationary_window > 0) {
+                    float gyro[3], accel[3];
+                    for (int i = 0; i < 3; i++) {
+                        gyro[i] = mpu.rawGyro[i] / gyro_sens;
+                        accel[i] = mpu.rawAccel[i] / accel_sens;
+                    }
+                    bool rest = stationary_add(&stationary, gyro, accel);
+                    if (rest != at_rest) {
+                        rest_since = now;
+                        std_msgs::Bool stationary_msg;
+                        stationary_msg.data = rest;
+                        stationary_pub.publish(stationary_msg);
+                        /*From the next sample on*/
+                        mpu9150_set_mag_yaw_hold(!read_mag || (rest && stationary_mag_hold));
+                        at_rest = rest;
+                    }
+                    if (stationary_bias && stationary_window_done(&stationary)) {
+                        float mean[3];
+                        stationary_gyro_mean(&stationary, mean);
+                        for (int i = 0; i < 3; i++)
+                            gyro_offset[i] += (mean[i] - gyro_offset[i]) * STATIONARY_BIAS_GAIN;
+                    }
+                }
+                bool publish = !at_rest || stationary_publish_rate <= 0.0
+                               || (now - last_publish).toSec() >= 1.0 / stationary_publish_rate;
+
+                /*imu_msg.orientation.x=mpu.fusedQuat[QUAT_X];
+                 imu_msg.orientation.y=mpu.fusedQuat[QUAT_Y];
+                 imu_msg.orientation.z=mpu.fusedQuat[QUAT_Z];
+                 imu_msg.orientation.w=mpu.fusedQuat[QUAT_W];*/
+
+                /*One quaternion for the Imu message, the transform and the extra streams*/
+                bool send_tf = tf_rate > 0.0 && (now - last_tf).toSec() >= 1.0 / tf_rate;
+                bool have_quat = (publish && want_imu) || send_tf;
+                tf::Quaternion quat2;
+                if (have_quat)
+                    quat2 = fused_orientation(mpu);
+                if (publish && want_imu)
+                    set_orientation(imu_msg, quat2);
+                if (send_tf) {
+                    tf_broadcaster.sendTransform(tf::StampedTransform(tf::Transform(quat2, tf::Vector3(0.0, 0.0, 0.0)),
+                                                                      now, tf_parent_frame, frame_id));
+                    last_tf = now;
+                }
+
+                if (publish && want_euler) {
+                    imu_euler_msg.vector.y=-mpu.fusedEuler[VEC3_Y]*RAD_TO_DEGREE;
+                    imu_euler_msg.vector.x=mpu.fusedEuler[VEC3_X]*RAD_TO_DEGREE;
+                    imu_euler_msg.vector.z=-mpu.fusedEuler[VEC3_Z]*RAD_TO_DEGREE;
+                }
 	    
-	    imu_msg.linear_acceleration_covariance[0] = linear_acceleration_covariance;
-	    imu_msg.linear_acceleration_covariance[4] = linear_acceleration_covariance;
-	    imu_msg.linear_acceleration_covariance[8] = linear_acceleration_covariance;
+                imu_msg.linear_acceleration_covariance[0] = linear_acceleration_covariance;
+                imu_msg.linear_acceleration_covariance[4] = linear_acceleration_covariance;
+                imu_msg.linear_acceleration_covariance[8] = linear_acceleration_covariance;
 
-	    imu_msg.angular_velocity_covariance[0] = angular_velocity_covariance;
-	    imu_msg.angular_velocity_covariance[4] = angular_velocity_covariance;
-	    imu_msg.angular_velocity_covariance[8] = angular_velocity_covariance;
+                imu_msg.angular_velocity_covariance[0] = angular_velocity_covariance;
+                imu_msg.angular_velocity_covariance[4] = angular_velocity_covariance;
+                imu_msg.angular_velocity_covariance[8] = angular_velocity_covariance;
     
-	    imu_msg.orientation_covariance[0] = pitch_roll_covariance;
-	    imu_msg.orientation_covariance[4] = pitch_roll_covariance;
-	    imu_msg.orientation_covariance[8] = yaw_covariance;
+                imu_msg.orientation_covariance[0] = pitch_roll_covariance;
+                imu_msg.orientation_covariance[4] = pitch_roll_covariance;
+                imu_msg.orientation_covariance[8] = yaw_covariance;
+
+                //TODO: check if needed
+                /*double roll, pitch , yaw;
+            tf::Quaternion q(msg->orientation.x,msg->orientation.y,msg->orientation.z,msg->orientation.w);
+            tf::Matrix3x3 m(q);
+            m.getRPY(roll, pitch, yaw);
+            yaw +=yaw_offset;
+            tf::Quaternion q_new;
+            q_new.setRPY(roll,pitch,yaw);
+            imu_corrected.orientation.x=q_new.getX();
+            imu_corrected.orientation.y=q_new.getY();
+            imu_corrected.orientation.z=q_new.getZ();
+            imu_corrected.orientation.w=q_new.getW();*/
+
+
+                //TODO: verify conversion
+
+                float ax_f, ay_f, az_f;
+                float gx_f, gy_f, gz_f;
+
+                ax_f =((float) mpu.calibratedAccel[0]) / (accel_sens / 9.807); // in m/s^2
+                ay_f =((float) mpu.calibratedAccel[1]) / (accel_sens / 9.807); // in m/s^2
+                az_f =((float) mpu.calibratedAccel[2]) / (accel_sens / 9.807); // in m/s^2
 
-            //TODO: check if needed
-            /*double roll, pitch , yaw;
-        tf::Quaternion q(msg->orientation.x,msg->orientation.y,msg->orientation.z,msg->orientation.w);
-        tf::Matrix3x3 m(q);
-        m.getRPY(roll, pitch, yaw);
-        yaw +=yaw_offset;
-        tf::Quaternion q_new;
-        q_new.setRPY(roll,pitch,yaw);
-        imu_corrected.orientation.x=q_new.getX();
-        imu_corrected.orientation.y=q_new.getY();
-        imu_corrected.orientation.z=q_new.getZ();
-        imu_corrected.orientation.w=q_new.getW();*/
+                gx_f=((float) mpu.rawGyro[0]) / gyro_sens - gyro_offset[0]; // in degrees/s
+                gy_f=((float) mpu.rawGyro[1]) / gyro_sens - gyro_offset[1]; // in degrees/s
+                gz_f=((float) mpu.rawGyro[2]) / gyro_sens - gyro_offset[2]; // in degrees/s
 
+                imu_msg.linear_acceleration.x=-ax_f;
+                imu_msg.linear_acceleration.y=ay_f;
+                imu_msg.linear_acceleration.z=az_f;
 
-            //TODO: verify conversion
+                imu_msg.angular_velocity.x=gx_f;
+                imu_msg.angular_velocity.y=gy_f;
+                imu_msg.angular_velocity.z=gz_f;
 
-            float ax_f, ay_f, az_f;
-            float gx_f, gy_f, gz_f;
+                if (publish && want_mag) {
+                    mag_msg.vector.x=mpu.calibratedMag[VEC3_X];
+                    mag_msg.vector.y=mpu.calibratedMag[VEC3_Y];
+                    mag_msg.vector.z=mpu.calibratedMag[VEC3_Z];
+                }
 
-            ax_f =((float) mpu.calibratedAccel[0]) / (16384 / 9.807); // 2g scale in m/s^2
-            ay_f =((float) mpu.calibratedAccel[1]) / (16384 / 9.807); // 2g scale in m/s^2
-            az_f =((float) mpu.calibratedAccel[2]) / (16384 / 9.807); // 2g scale in m/s^2
+                if (vibration_rate > 0.0) {
+                    float sample[SPECTRUM_AXES] = { -ax_f, ay_f, az_f, gx_f, gy_f, gz_f };
+                    spectrum_add(&spectrum, sample);
+                }
 
-            gx_f=((float) mpu.rawGyro[0]) / 16.4f; // for degrees/s 2000 scale
-            gy_f=((float) mpu.rawGyro[1]) / 16.4f; // for degrees/s 2000 scale
-            gz_f=((float) mpu.rawGyro[2]) / 16.4f; // for degrees/s 2000 scale
+                for (size_t i = 0; i < outputs.size(); i++) {
+                    float sample[DECIMATE_CHANNELS] = { -ax_f, ay_f, az_f, gx_f, gy_f, gz_f };
+                    if (!decimate_add(&outputs[i], sample) || output_pubs[i].getNumSubscribers() == 0)
+                        continue;
+                    sensor_msgs::Imu output_msg = imu_msg;
+                    decimate_output(&outputs[i], sample);
+                    if (!have_quat) {
+                        quat2 = fused_orientation(mpu);
+                        have_quat = true;
+                    }
+                    set_orientation(output_msg, quat2);
+                    output_msg.linear_acceleration.x = sample[0];
+                    output_msg.linear_acceleration.y = sample[1];
+                    output_msg.linear_acceleration.z = sample[2];
+                    output_msg.angular_velocity.x = sample[3];
+                    output_msg.angular_velocity.y = sample[4];
+                    output_msg.angular_velocity.z = sample[5];
+                    output_pubs[i].publish(output_msg);
+                }
 
-            imu_msg.linear_acceleration.x=-ax_f;
-            imu_msg.linear_acceleration.y=ay_f;
-            imu_msg.linear_acceleration.z=az_f;
+                if (publish) {
+                    if (want_imu)
+                        imu_pub.publish(imu_msg);
+                    if (want_euler)
+                        imu_euler_pub.publish(imu_euler_msg);
+                    if (want_mag)
+                        mag_pub.publish(mag_msg);
+                    last_publish = now;
+                }
+                if (idle.wake_start_ns) {
+                    idle.wake_ms = (latency_now_ns() - idle.wake_start_ns) / 1e6;
+                    if (idle.wake_ms > idle.max_wake_ms)
+                        idle.max_wake_ms = idle.wake_ms;
+                    if (idle.wake_ms > idle.wake_limit_ms)
+                        idle.slow_wakes++;
+                    idle.wake_start_ns = 0;
+                }
+                packets++;
+                stream_add(now);
 
-            imu_msg.angular_velocity.x=gx_f;
-            imu_msg.angular_velocity.y=gy_f;
-            imu_msg.angular_velocity.z=gz_f;
+                uint64_t published_ns = latency_now_ns();
+                latency_add_sample(&latency, sample_ns, ready_ns, bus_ns, fusion_ns, published_ns);
+                ready_ns = published_ns;
 
-            mag_msg.vector.x=mpu.calibratedMag[VEC3_X];
-            mag_msg.vector.y=mpu.calibratedMag[VEC3_Y];
-            mag_msg.vector.z=mpu.calibratedMag[VEC3_Z];
 
-            imu_pub.publish(imu_msg);
-            imu_euler_pub.publish(imu_euler_msg);
-            mag_pub.publish(mag_msg);
+            }else{
+                /*Fixed draining polls faster than the sample rate, an empty FIFO is not worth a warning*/
+                mpu9150_stats_t dev;
+                mpu9150_get_stats(&dev);
+                if (dev.noData == stream.last_no_data) {
+                    stream.read_failures++;
+                    ROS_WARN_THROTTLE(5.0, "MPU6050 - %s - MPU6050 read failed (%lu failures)",__FUNCTION__,stream.read_failures);
+                }
+                stream.last_no_data = dev.noData;
+            }
+        }
+
+        if (idle_after > 0.0 && at_rest && (wake - rest_since).toSec() >= idle_after) {
+            if (!enter_idle(idle_motion_mg, idle_motion_ms, idle_wake_hz)) {
+                ROS_WARN("MPU6050 - %s - cannot enter wake on motion, staying awake",__FUNCTION__);
+                idle_after = 0.0;
+            }
+        }
 
+        /*Rows are the published accel (m/s^2) and gyro axes, columns the band mean squares, peak frequency and peak amplitude*/
+        if (vibration_rate > 0.0 && (wake - last_vibration).toSec() >= 1.0 / vibration_rate
+            && spectrum_compute(&spectrum) == 0) {
+            std_msgs::Float32MultiArray vibration_msg;
+            int columns = num_bands + 2;
+            vibration_msg.layout.dim.resize(2);
+            vibration_msg.layout.dim[0].label = "ax_ay_az_gx_gy_gz";
+            vibration_msg.layout.dim[0].size = SPECTRUM_AXES;
+            vibration_msg.layout.dim[0].stride = SPECTRUM_AXES * columns;
+            vibration_msg.layout.dim[1].label = "band_power_peak_hz_peak_amplitude";
+            vibration_msg.layout.dim[1].size = columns;
+            vibration_msg.layout.dim[1].stride = columns;
+            vibration_msg.layout.data_offset = 0;
+            for (int axis = 0; axis < SPECTRUM_AXES; axis++) {
+                for (int band = 0; band < num_bands; band++)
+                    vibration_msg.data.push_back(spectrum.bandPower[axis][band]);
+                vibration_msg.data.push_back(spectrum.peakFreq[axis]);
+                vibration_msg.data.push_back(spectrum.peakAmplitude[axis]);
+            }
+            vibration_pub.publish(vibration_msg);
+            last_vibration = wake;
+        }
+
+        if (!bias_state.empty() && (wake - last_bias_save).toSec() >= bias_save_period) {
+            save_gyro_biases(bias_state);
+            last_bias_save = wake;
+        }
 
-        }else{
-            ROS_WARN("MPU6050 - %s - MPU6050 read failed",__FUNCTION__);
+        if (!tempcomp_state.empty() && (wake - last_tempcomp_save).toSec() >= bias_save_period) {
+            save_tempcomp_models(tempcomp_state);
+            last_tempcomp_save = wake;
         }
 
+        if (i2c_trace_dump) {
+            i2c_trace_dump = 0;
+            i2ctrace_snapshot(&i2c_trace);
+            i2ctrace_print(stdout, &i2c_trace, 10);
+            fflush(stdout);
+        }
+
+        uint32_t wait_ms = drain_update(&drain, wake.toNSec() / 1000000ULL,
+                                        drain.policy == DRAIN_FIXED ? packets : queued);
+        updater.update();
+
         ros::spinOnce();
-        r.sleep();
+        if (drain.policy == DRAIN_FIXED)
+            r.sleep();
+        else
+            ros::Time::sleepUntil(wake + ros::Duration(wait_ms / 1000.0));
+    }
+
+
+
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        const latency_hist_t *hist = &latency.stage[i];
+        ROS_INFO("Latency %-8s p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  max %8.1f us",
+                 latency_stage_name(i), latency_hist_percentile(hist, 50.0) / 1000.0,
+                 latency_hist_percentile(hist, 99.0) / 1000.0, latency_hist_percentile(hist, 99.9) / 1000.0,
+                 hist->max / 1000.0);
+    }
+
+    if (i2c_trace_on) {
+        i2ctrace_enable(0);
+        i2ctrace_snapshot(&i2c_trace);
+        i2ctrace_print(stdout, &i2c_trace, 10);
+    }
+
+    if (!rawlog_path.empty()) {
+        mpu9150_set_rawlog(NULL);
+        rawlog_close(&rawlog);
     }
 
+    if (!bias_state.empty())
+        save_gyro_biases(bias_state);
 
+    if (!tempcomp_state.empty())
+        save_tempcomp_models(tempcomp_state);
 
     mpu9150_exit();
 